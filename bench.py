@@ -0,0 +1,559 @@
+#!/usr/bin/env python3
+
+"""Benchmark suite for the labs, with a regression check against a baseline.
+
+The suite builds each lab with its own Makefile and runs a fixed set of
+benchmarks on it, each measured the way the lab's own tools measure it:
+
+* malloc: every trace of mdriver, for utilization and throughput.
+* csim: the long trace of the cache lab on two caches, timed.
+* trans: the transpose submission at 32x32 and 1024x1024, both in cycles
+  as test-trans simulates them and in ns per element on this machine.
+* queue: the bulk operations of qtest's bench command.
+* proxy: load from tests/loadgen on tiny directly and through the proxy.
+
+Every result is a metric with a unit and a direction. Metrics that do not
+depend on the machine, such as simulated cycles, miss counts and
+utilization, are exact: any change for the worse is a regression. Timed
+metrics regress when they get worse by more than the threshold.
+
+The results are written as JSON, together with a description of the
+machine, compiler and commit they were measured on. With a baseline, which
+is simply the results of an earlier run, the suite prints how every metric
+has changed and exits with status 1 if any has regressed. A lab that does
+not build here is skipped, and its metrics are left out of the comparison.
+
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Format of the results file
+RESULTS_VERSION = 1
+
+# Default files for the results and the baseline
+DEFAULT_OUTPUT = "bench-results.json"
+DEFAULT_BASELINE = "bench-baseline.json"
+
+# Default relative change beyond which a timed metric has regressed
+DEFAULT_THRESHOLD = 0.05
+
+# Directory of each lab, relative to this script
+LABS = {
+    'malloc': "lab5-malloclab5-qinlinj",
+    'csim': "lab4-cachelab4-qinlinj",
+    'trans': "lab4-cachelab4-qinlinj",
+    'queue': "lab0-cprogramminglab0-qinlinj",
+    'proxy': "lab7-proxylab7-qinlinj",
+}
+
+# Caches and traces csim is timed on, as (s, E, b, trace)
+CSIM_RUNS = [
+    (5, 1, 5, "traces/csim/long.trace"),
+    (8, 4, 6, "traces/csim/long.trace"),
+]
+
+# Matrices the transpose is measured on, as (M, N, large cache), as the
+# driver grades it
+TRANS_RUNS = [
+    (32, 32, False),
+    (1024, 1024, True),
+]
+
+# qtest bench operations, as (operation, calls), in the order they run on
+# one queue
+QUEUE_OPS = [
+    ('it', 200000),
+    ('size', 200000),
+    ('reverse', 20),
+    ('rh', 200000),
+    ('ih', 200000),
+]
+
+# Objects the proxy is loaded with: how many, their sizes, and how many of
+# them are hot
+PROXY_FILES = 400
+PROXY_SIZES = "pareto:2k:1.5"
+PROXY_HOT = 20
+PROXY_HIT_RATIO = 0.9
+PROXY_CLIENTS = 16
+
+# Seconds to wait for a server to start listening
+SERVER_START_TIMEOUT = 10
+
+
+class Skip(Exception):
+    """Raised when a benchmark cannot run on this machine."""
+
+
+class Failure(Exception):
+    """Raised when a benchmark ran but did not work."""
+
+
+def run(cmd, cwd, timeout=600, stdin=None):
+    """Runs a command, and returns its output, or raises Failure if it
+    failed."""
+
+    try:
+        p = subprocess.run(cmd, cwd=cwd, timeout=timeout, input=stdin,
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           encoding='utf-8', errors='replace')
+    except subprocess.TimeoutExpired:
+        raise Failure("%s timed out" % " ".join(cmd))
+    except OSError as e:
+        raise Failure("%s: %s" % (" ".join(cmd), e.strerror))
+    if p.returncode != 0:
+        raise Failure("%s failed (status %d): %s"
+                      % (" ".join(cmd), p.returncode, last_line(p.stdout)))
+    return p.stdout
+
+
+def last_line(output):
+    """Returns the last non-blank line of some output."""
+
+    lines = [line for line in output.splitlines() if line.strip()]
+    return lines[-1].strip() if lines else ""
+
+
+def build(labdir, targets, args):
+    """Builds targets with a lab's Makefile, or raises Skip if they do not
+    build here."""
+
+    cmd = ["make"] + targets
+    if args.cc:
+        cmd.append("CC=" + args.cc)
+    try:
+        run(cmd, labdir)
+    except Failure as e:
+        raise Skip("build failed: %s" % e)
+
+
+def metric(metrics, name, value, unit, better, exact=False):
+    """Records a metric. better is 'higher' or 'lower'."""
+
+    metrics[name] = {'value': value, 'unit': unit, 'better': better,
+                     'exact': exact}
+
+
+def timed(cmd, cwd, runs, stdin=None):
+    """Returns the output of a command and the fastest of runs wall clock
+    times, in seconds."""
+
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        output = run(cmd, cwd, stdin=stdin)
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return output, best
+
+
+def bench_malloc(labdir, args, metrics):
+    """Runs mdriver over every trace, in the tab-separated format of -T."""
+
+    build(labdir, ["mdriver"], args)
+    output = run(["./mdriver", "-T"], labdir)
+
+    # valid, thru?, util?, util, ops, msecs, Kops/s, trace
+    for line in output.splitlines():
+        fields = line.split('\t')
+        if len(fields) == 8 and fields[0] == '1':
+            trace = os.path.basename(fields[7])
+            if fields[2] == '1':
+                metric(metrics, "malloc/%s/util" % trace, float(fields[3]),
+                       "%", 'higher', exact=True)
+            if fields[1] == '1':
+                metric(metrics, "malloc/%s/kops" % trace, float(fields[6]),
+                       "Kops/s", 'higher')
+        elif len(fields) == 8 and fields[0] == 'no':
+            raise Failure("mm malloc is incorrect on %s" % fields[7])
+
+    result = re.search(r"Harmonic mean utilization = ([\d.]+)%", output)
+    if result:
+        metric(metrics, "malloc/mean_util", float(result.group(1)), "%",
+               'higher', exact=True)
+    result = re.search(r"Harmonic mean throughput \(Kops/sec\) = ([\d.]+)",
+                       output)
+    if result:
+        metric(metrics, "malloc/mean_kops", float(result.group(1)),
+               "Kops/s", 'higher')
+    result = re.search(r"Perf index = .* = ([\d.]+)/100", output)
+    if not result:
+        raise Failure("no perf index in the output of mdriver")
+    metric(metrics, "malloc/perf_index", float(result.group(1)), "/100",
+           'higher')
+
+
+def bench_csim(labdir, args, metrics):
+    """Times csim on CSIM_RUNS, and records its miss counts."""
+
+    build(labdir, ["csim"], args)
+    for s, E, b, trace in CSIM_RUNS:
+        cmd = ["./csim", "-s", str(s), "-E", str(E), "-b", str(b),
+               "-t", trace]
+        output, secs = timed(cmd, labdir, args.runs)
+        result = re.search(r"hits:(\d+) misses:(\d+) evictions:(\d+)",
+                           output)
+        if not result:
+            raise Failure("no summary in the output of %s" % " ".join(cmd))
+        name = "csim/%s-s%dE%db%d" % (os.path.splitext(
+            os.path.basename(trace))[0], s, E, b)
+        metric(metrics, name + "/ms", secs * 1000, "ms", 'lower')
+        metric(metrics, name + "/misses", int(result.group(2)), "misses",
+               'lower', exact=True)
+
+
+def bench_trans(labdir, args, metrics):
+    """Measures the transpose submission on TRANS_RUNS, simulated and
+    native."""
+
+    build(labdir, ["test-trans", "tracegen-ct"], args)
+    for M, N, large in TRANS_RUNS:
+        name = "trans/%dx%d" % (M, N)
+        cmd = ["./test-trans", "-s", "-M", str(M), "-N", str(N)]
+        if large:
+            cmd.append("-l")
+        result = re.search(r"TEST_TRANS_RESULTS=(\d+):(\d+)",
+                           run(cmd, labdir))
+        if not result or result.group(1) != '1':
+            raise Failure("the %dx%d transpose is incorrect" % (M, N))
+        metric(metrics, name + "/cycles", int(result.group(2)), "cycles",
+               'lower', exact=True)
+
+        # func, ns/elem, GB/s, misses, miss cycles, description
+        cmd = ["./test-trans", "-b", "-r", str(args.runs), "-M", str(M),
+               "-N", str(N)]
+        for line in run(cmd, labdir).splitlines():
+            result = re.match(r"\s*\d+\s+([\d.]+)\s+[\d.]+\s+\S+\s+\S+\s+"
+                              r"Transpose submission$", line)
+            if result:
+                metric(metrics, name + "/ns_per_elem",
+                       float(result.group(1)), "ns/elem", 'lower')
+
+
+def bench_queue(labdir, args, metrics):
+    """Times the bulk queue operations of QUEUE_OPS with qtest."""
+
+    build(labdir, ["qtest"], args)
+    commands = ["new"] + ["bench %s %d" % op for op in QUEUE_OPS] + \
+        ["free", "quit"]
+    best = {}
+    for _ in range(args.runs):
+        output = run(["./qtest", "-v", "1"], labdir,
+                     stdin='\n'.join(commands) + '\n')
+        for op, done, calls, ns in re.findall(
+                r"(\w+): (\d+) of (\d+) calls succeeded, ([\d.]+) ns/op",
+                output):
+            if done != calls:
+                raise Failure("only %s of %s calls of %s succeeded"
+                              % (done, calls, op))
+            if op not in best or float(ns) < best[op]:
+                best[op] = float(ns)
+    for op, _ in QUEUE_OPS:
+        if op not in best:
+            raise Failure("no time for %s in the output of qtest" % op)
+        metric(metrics, "queue/%s/ns_per_op" % op, best[op], "ns/op",
+               'lower')
+
+
+def free_port():
+    """Returns a TCP port that is free at the moment."""
+
+    with socket.socket() as s:
+        s.bind(('localhost', 0))
+        return s.getsockname()[1]
+
+
+def start_server(cmd, cwd, port):
+    """Starts a server and waits until it accepts connections on a port."""
+
+    server = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    deadline = time.monotonic() + SERVER_START_TIMEOUT
+    while time.monotonic() < deadline:
+        if server.poll() is not None:
+            raise Failure("%s exited with status %d"
+                          % (" ".join(cmd), server.returncode))
+        try:
+            socket.create_connection(('localhost', port), timeout=1).close()
+            return server
+        except OSError:
+            time.sleep(0.1)
+    server.kill()
+    raise Failure("%s did not start listening" % " ".join(cmd))
+
+
+def stop_server(server):
+    """Stops a server started by start_server()."""
+
+    if server and server.poll() is None:
+        server.terminate()
+        try:
+            server.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            server.wait()
+
+
+def load(labdir, name, target, proxy, args, metrics):
+    """Runs tests/loadgen against a server and records its results."""
+
+    cmd = ["tests/loadgen", "-t", target, "-u", "/lg", "-F", str(PROXY_FILES),
+           "-H", str(PROXY_HOT), "-r", str(PROXY_HIT_RATIO),
+           "-c", str(PROXY_CLIENTS), "-d", str(args.duration)]
+    if proxy:
+        cmd += ["-x", proxy]
+    output = run(cmd, labdir, timeout=args.duration + 60)
+
+    result = re.search(r"throughput ([\d.]+) req/s ([\d.]+) MiB/s", output)
+    if not result:
+        raise Failure("no throughput in the output of loadgen")
+    metric(metrics, name + "/req_per_s", float(result.group(1)), "req/s",
+           'higher')
+    metric(metrics, name + "/mib_per_s", float(result.group(2)), "MiB/s",
+           'higher')
+    result = re.search(r"latency_us mean \d+ p50 (\d+) p99 (\d+)", output)
+    if result:
+        metric(metrics, name + "/p50_us", int(result.group(1)), "us",
+               'lower')
+        metric(metrics, name + "/p99_us", int(result.group(2)), "us",
+               'lower')
+    result = re.search(r"hit ratio ([\d.]+)", output)
+    if result:
+        metric(metrics, name + "/hit_ratio", float(result.group(1)), "",
+               'higher')
+
+
+def bench_proxy(labdir, args, metrics):
+    """Loads tiny with tests/loadgen, directly and through the proxy."""
+
+    build(labdir, ["tests/loadgen", "tiny-code"], args)
+    tiny = proxy = None
+    docroot = tempfile.mkdtemp(prefix="bench-tiny-")
+    try:
+        run([os.path.join(labdir, "tests", "loadgen"), "-g",
+             os.path.join(docroot, "lg"), "-F", str(PROXY_FILES),
+             "-s", PROXY_SIZES], labdir)
+
+        tiny_port = free_port()
+        tiny = start_server([os.path.join(labdir, "tiny", "tiny"),
+                             str(tiny_port)], docroot, tiny_port)
+        target = "localhost:%d" % tiny_port
+        load(labdir, "proxy/tiny", target, None, args, metrics)
+
+        # Without the proxy, the results for tiny alone are still kept
+        build(labdir, ["proxy"], args)
+        proxy_port = free_port()
+        proxy = start_server([os.path.join(labdir, "proxy"),
+                              str(proxy_port)], labdir, proxy_port)
+        load(labdir, "proxy/cached", target, "localhost:%d" % proxy_port,
+             args, metrics)
+    finally:
+        stop_server(proxy)
+        stop_server(tiny)
+        shutil.rmtree(docroot, ignore_errors=True)
+
+
+# The benchmarks, in the order they run
+BENCHMARKS = [
+    ('malloc', bench_malloc),
+    ('csim', bench_csim),
+    ('trans', bench_trans),
+    ('queue', bench_queue),
+    ('proxy', bench_proxy),
+]
+
+
+def first_line(cmd):
+    """Returns the first line of the output of a command, or None."""
+
+    try:
+        p = subprocess.run(cmd, stdout=subprocess.PIPE,
+                           stderr=subprocess.DEVNULL, encoding='utf-8',
+                           errors='replace', timeout=30)
+    except (OSError, subprocess.TimeoutExpired):
+        return None
+    lines = p.stdout.splitlines()
+    return lines[0].strip() if p.returncode == 0 and lines else None
+
+
+def environment(here, args):
+    """Returns a description of the machine, compiler and commit the suite
+    runs on."""
+
+    cpu = platform.processor() or None
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    cpu = line.split(':', 1)[1].strip()
+                    break
+    except OSError:
+        pass
+
+    status = first_line(["git", "-C", here, "status", "--porcelain",
+                         "--untracked-files=no"])
+    return {
+        'timestamp': datetime.datetime.now(
+            datetime.timezone.utc).isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'os': platform.platform(),
+        'cpu': cpu,
+        'cpus': os.cpu_count(),
+        'cc': args.cc,
+        'cc_version': first_line([args.cc or "cc", "--version"]),
+        'python': platform.python_version(),
+        'commit': first_line(["git", "-C", here, "rev-parse", "HEAD"]),
+        'dirty': status is not None,
+        'runs': args.runs,
+        'duration': args.duration,
+    }
+
+
+def compare(baseline, results, threshold):
+    """Prints how every metric has changed since the baseline, and returns
+    the number of metrics that regressed."""
+
+    # Differences in where the results came from explain many changes
+    for key in ('host', 'cpu', 'cpus', 'cc_version', 'os'):
+        old = baseline['env'].get(key)
+        new = results['env'].get(key)
+        if old != new:
+            print("Warning: the baseline was measured with %s %s, not %s"
+                  % (key, old, new))
+
+    regressions = 0
+    print("%-36s %12s %12s %8s  %s" % ("Metric", "Baseline", "Current",
+                                       "Change", "Status"))
+    for name, old in sorted(baseline['metrics'].items()):
+        new = results['metrics'].get(name)
+        if new is None:
+            print("%-36s %12.6g %12s %8s  %s" % (name, old['value'], "-",
+                                                 "-", "missing"))
+            continue
+
+        if old['value']:
+            change = (new['value'] - old['value']) / abs(old['value'])
+        else:
+            change = 0.0 if new['value'] == old['value'] else float('inf')
+        worse = -change if new['better'] == 'higher' else change
+        allowed = 0.0 if new['exact'] else threshold
+        if worse > allowed:
+            status = "REGRESSED"
+            regressions += 1
+        elif worse < -allowed:
+            status = "improved"
+        else:
+            status = "ok"
+        print("%-36s %12.6g %12.6g %+7.1f%%  %s" % (
+            name, old['value'], new['value'], change * 100, status))
+    for name in sorted(set(results['metrics']) - set(baseline['metrics'])):
+        print("%-36s %12s %12.6g %8s  %s" % (
+            name, "-", results['metrics'][name]['value'], "-", "new"))
+    return regressions
+
+
+def main():
+
+    # Parse the command line arguments
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = argparse.ArgumentParser(
+        description="Run the benchmark suite and check for regressions")
+    p.add_argument("benchmarks", nargs="*",
+                   help="benchmarks to run (default: all of %s)"
+                        % ", ".join(name for name, _ in BENCHMARKS))
+    p.add_argument("-o", dest="output",
+                   default=os.path.join(here, DEFAULT_OUTPUT),
+                   help="file to write the results to (default: %s)"
+                        % DEFAULT_OUTPUT)
+    p.add_argument("-b", dest="baseline",
+                   default=os.path.join(here, DEFAULT_BASELINE),
+                   help="results to compare against, if the file exists "
+                        "(default: %s)" % DEFAULT_BASELINE)
+    p.add_argument("--save-baseline", action="store_true",
+                   help="also write the results to the baseline file, "
+                        "instead of comparing against it")
+    p.add_argument("-t", dest="threshold", type=float,
+                   default=DEFAULT_THRESHOLD * 100,
+                   help="percentage by which a timed metric may get worse "
+                        "(default: %g)" % (DEFAULT_THRESHOLD * 100))
+    p.add_argument("-r", dest="runs", type=int, default=3,
+                   help="timed runs of each benchmark, of which the fastest "
+                        "is kept (default: 3)")
+    p.add_argument("-d", dest="duration", type=int, default=5,
+                   help="seconds of each proxy load run (default: 5)")
+    p.add_argument("--cc", help="compiler to build the labs with "
+                                "(default: each Makefile's own)")
+    args = p.parse_args()
+
+    names = [name for name, _ in BENCHMARKS]
+    for name in args.benchmarks:
+        if name not in names:
+            p.error("unknown benchmark '%s'" % name)
+    if args.runs < 1 or args.duration < 1:
+        p.error("the number of runs and the duration must be positive")
+
+    results = {'version': RESULTS_VERSION, 'env': environment(here, args),
+               'benchmarks': {}, 'metrics': {}}
+    failed = False
+    for name, bench in BENCHMARKS:
+        if args.benchmarks and name not in args.benchmarks:
+            continue
+        print("Running %s..." % name)
+        sys.stdout.flush()
+        start = time.perf_counter()
+        metrics = {}
+        try:
+            bench(os.path.join(here, LABS[name]), args, metrics)
+            status, reason = 'ok', None
+        except Skip as e:
+            status, reason = 'skipped', str(e)
+        except Failure as e:
+            status, reason = 'failed', str(e)
+            failed = True
+        if reason:
+            print("  %s: %s" % (status, reason))
+        results['benchmarks'][name] = {
+            'status': status, 'reason': reason,
+            'seconds': round(time.perf_counter() - start, 3)}
+        results['metrics'].update(metrics)
+
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.write('\n')
+    print("Wrote %d metrics to %s" % (len(results['metrics']), args.output))
+
+    if args.save_baseline:
+        shutil.copyfile(args.output, args.baseline)
+        print("Saved the baseline to %s" % args.baseline)
+    elif os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline.get('version') != RESULTS_VERSION:
+            print("Error: %s is not a results file of this version"
+                  % args.baseline)
+            sys.exit(1)
+        print()
+        regressions = compare(baseline, results, args.threshold / 100)
+        if regressions:
+            print("\n%d metrics regressed." % regressions)
+            failed = True
+
+    if failed:
+        sys.exit(1)
+
+
+# execute main only if called as a script
+if __name__ == "__main__":
+    main()
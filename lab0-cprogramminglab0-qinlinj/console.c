@@ -8,6 +8,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -16,8 +17,13 @@
    arguments.  */
 #define UNUSED __attribute__((unused))
 
+/* Number of buckets in the command hash table, a power of 2 */
+#define CMD_HASH_SIZE 64
+
 /* Some global values */
 static cmd_ptr cmd_list = NULL;
+/* Hash table of the commands in cmd_list, chained through hash_next */
+static cmd_ptr cmd_hash[CMD_HASH_SIZE];
 static param_ptr param_list = NULL;
 static bool block_flag = false;
 static bool prompt_flag = true;
@@ -48,6 +54,15 @@ struct RIO_ELE {
 rio_ptr buf_stack;
 char linebuf[RIO_BUFSIZE];
 
+/*
+  Arena holding the words and argv of the line being interpreted.  It is
+  reused by every line, and only grows.
+*/
+static char *arg_buf = NULL;
+static size_t arg_buf_size = 0;
+static char **arg_vec = NULL;
+static size_t arg_vec_size = 0;
+
 /* Maximum file descriptor */
 int fd_max = 0;
 
@@ -85,6 +100,7 @@ static bool interpret_cmda(int argc, char *argv[]);
 /* Initialize interpreter */
 void init_cmd(void) {
     cmd_list = NULL;
+    memset(cmd_hash, 0, sizeof(cmd_hash));
     param_list = NULL;
     err_cnt = 0;
     quit_flag = false;
@@ -105,6 +121,14 @@ void init_cmd(void) {
     first_time = last_time;
 }
 
+/* Hash bucket of a command name (FNV-1a) */
+static size_t cmd_bucket(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h & (CMD_HASH_SIZE - 1);
+}
+
 /* Add a new command */
 void add_cmd(const char *name, cmd_function operation,
              const char *documentation) {
@@ -120,6 +144,9 @@ void add_cmd(const char *name, cmd_function operation,
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+    size_t bucket = cmd_bucket(name);
+    ele->hash_next = cmd_hash[bucket];
+    cmd_hash[bucket] = ele;
 }
 
 /* Add a new parameter */
@@ -140,17 +167,20 @@ void add_param(const char *name, int *valp, const char *documentation,
     *last_loc = ele;
 }
 
-/* Parse a string into a command line */
+/*
+  Parse a string into a command line.
+  The words and argv are kept in the arena, and are valid until the next
+  line is parsed.
+*/
 char **parse_args(char *line, int *argcp) {
-    /*
-      Must first determine how many arguments there are.
-      Replace all white space with null characters
-    */
     size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
+    if (len + 1 > arg_buf_size) {
+        arg_buf_size = 2 * arg_buf_size > len + 1 ? 2 * arg_buf_size : len + 1;
+        arg_buf = realloc_or_fail(arg_buf, arg_buf_size, "parse_args");
+    }
+    /* Copy into the arena with each word null-terminated */
     char *src = line;
-    char *dst = buf;
+    char *dst = arg_buf;
     bool skipping = true;
     char c = 0;
     int argc = 0;
@@ -164,22 +194,20 @@ char **parse_args(char *line, int *argcp) {
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                if ((size_t)argc == arg_vec_size) {
+                    arg_vec_size = arg_vec_size ? 2 * arg_vec_size : 16;
+                    arg_vec = realloc_or_fail(
+                        arg_vec, arg_vec_size * sizeof(char *), "parse_args");
+                }
+                arg_vec[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail((size_t)argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-    free(buf);
+    *dst = '\0';
     *argcp = argc;
-    return argv;
+    return arg_vec;
 }
 
 void record_error(void) {
@@ -196,10 +224,10 @@ static bool interpret_cmda(int argc, char *argv[]) {
         return true;
     }
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = cmd_hash[cmd_bucket(argv[0])];
     bool ok = true;
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0) {
-        next_cmd = next_cmd->next;
+        next_cmd = next_cmd->hash_next;
     }
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
@@ -224,12 +252,7 @@ bool interpret_cmd(char *cmdline) {
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++) {
-        free(argv[i]);
-    }
-    free(argv);
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -599,6 +622,12 @@ bool finish_cmd(void) {
     if (!quit_flag) {
         ok = ok && do_quit_cmd(0, NULL);
     }
+    free(arg_buf);
+    free(arg_vec);
+    arg_buf = NULL;
+    arg_buf_size = 0;
+    arg_vec = NULL;
+    arg_vec_size = 0;
     return ok && err_cnt == 0;
 }
 
@@ -16,13 +16,14 @@
 typedef bool (*cmd_function)(int argc, char *argv[]);
 
 /* Information about each command */
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, and in a hash table */
 typedef struct CELE cmd_ele, *cmd_ptr;
 struct CELE {
     const char *name;
     cmd_function operation;
     const char *documentation;
     cmd_ptr next;
+    cmd_ptr hash_next; /* Next command in same hash bucket */
 };
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -0,0 +1,201 @@
+/**
+ * @file cqueue.c
+ * @brief Implementation of a lock-free, multi-producer, multi-consumer queue.
+ *
+ * This queue is a bounded ring buffer in the style of Dmitry Vyukov's MPMC
+ * queue. Slot i of the ring starts with sequence number i. An inserter that
+ * claims position pos, by advancing the tail from pos to pos + 1, may fill
+ * slot pos % capacity once its sequence number is pos, and then sets it to
+ * pos + 1. A remover that claims position pos, by advancing the head, may
+ * empty the slot once its sequence number is pos + 1, and then sets it to
+ * pos + capacity, freeing it for the next lap.
+ *
+ * A full or empty queue is detected without blocking, and the operation
+ * fails, as queue_insert_tail and queue_remove_head do.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cqueue.h"
+#include "harness.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Atomic accesses to the positions and sequence numbers */
+#define load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define claim(p, expected, desired)                                           \
+    __atomic_compare_exchange_n((p), (expected), (desired), true,             \
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+/**
+ * @brief Allocates a new concurrent queue
+ * @param[in] capacity  Minimum number of strings the queue can hold; it is
+ *                      rounded up to a power of 2
+ * @param[in] slot_size Size of the longest string the queue can hold,
+ *                      including the null terminator
+ * @return The new queue, or NULL if capacity or slot_size is 0, or memory
+ *         allocation failed
+ */
+cqueue_t *cqueue_new(size_t capacity, size_t slot_size) {
+    if (capacity == 0 || slot_size == 0) {
+        return NULL;
+    }
+
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    cqueue_t *cq = malloc(sizeof(cqueue_t));
+    if (cq == NULL) {
+        return NULL;
+    }
+    cq->sequence = malloc(slots * sizeof(size_t));
+    cq->slots = malloc(slots * slot_size);
+    if (cq->sequence == NULL || cq->slots == NULL) {
+        free(cq->sequence);
+        free(cq->slots);
+        free(cq);
+        return NULL;
+    }
+
+    cq->tail = 0;
+    cq->head = 0;
+    cq->mask = slots - 1;
+    cq->slot_size = slot_size;
+    for (size_t i = 0; i < slots; i++) {
+        cq->sequence[i] = i;
+    }
+    return cq;
+}
+
+/**
+ * @brief Frees all memory used by a concurrent queue
+ *
+ * No other thread may be using the queue.
+ *
+ * @param[in] cq The queue to free
+ */
+void cqueue_free(cqueue_t *cq) {
+    if (cq == NULL) {
+        return;
+    }
+    free(cq->sequence);
+    free(cq->slots);
+    free(cq);
+}
+
+/**
+ * @brief Attempts to insert an element at tail of a concurrent queue
+ *
+ * The string is copied into a slot of the queue.
+ *
+ * @param[in] cq The queue to insert into
+ * @param[in] s  String to be copied and inserted into the queue
+ *
+ * @return true if insertion was successful
+ * @return false if cq is NULL, the queue is full, or s does not fit in a slot
+ */
+bool cqueue_insert_tail(cqueue_t *cq, const char *s) {
+    if (cq == NULL || s == NULL) {
+        return false;
+    }
+    size_t size = strlen(s) + 1;
+    if (size > cq->slot_size) {
+        return false;
+    }
+
+    size_t pos = load_relaxed(&cq->tail);
+    size_t i;
+    for (;;) {
+        i = pos & cq->mask;
+        size_t seq = load_acquire(&cq->sequence[i]);
+        long lap = (long)(seq - pos);
+        if (lap == 0) {
+            // The slot is free: claim the position, or retry with the
+            // position another inserter left
+            if (claim(&cq->tail, &pos, pos + 1)) {
+                break;
+            }
+        } else if (lap < 0) {
+            // The slot still holds the string from the last lap
+            return false;
+        } else {
+            pos = load_relaxed(&cq->tail);
+        }
+    }
+
+    memcpy(cq->slots + i * cq->slot_size, s, size);
+    store_release(&cq->sequence[i], pos + 1);
+    return true;
+}
+
+/**
+ * @brief Attempts to remove an element from head of a concurrent queue
+ *
+ * If removal succeeds and `buf` is non-NULL, this function copies up to
+ * `bufsize - 1` characters from the removed string into `buf`, and writes
+ * a null terminator '\0' after the copied string.
+ *
+ * @param[in]  cq      The queue to remove from
+ * @param[out] buf     Output buffer to write a string value into
+ * @param[in]  bufsize Size of the buffer `buf` points to
+ *
+ * @return true if removal succeeded
+ * @return false if cq is NULL or empty
+ */
+bool cqueue_remove_head(cqueue_t *cq, char *buf, size_t bufsize) {
+    if (cq == NULL) {
+        return false;
+    }
+
+    size_t pos = load_relaxed(&cq->head);
+    size_t i;
+    for (;;) {
+        i = pos & cq->mask;
+        size_t seq = load_acquire(&cq->sequence[i]);
+        long lap = (long)(seq - (pos + 1));
+        if (lap == 0) {
+            if (claim(&cq->head, &pos, pos + 1)) {
+                break;
+            }
+        } else if (lap < 0) {
+            // The slot has not been filled in for this lap yet
+            return false;
+        } else {
+            pos = load_relaxed(&cq->head);
+        }
+    }
+
+    if (buf && bufsize) {
+        const char *value = cq->slots + i * cq->slot_size;
+        size_t len = strnlen(value, bufsize - 1);
+        memcpy(buf, value, len);
+        buf[len] = '\0';
+    }
+    store_release(&cq->sequence[i], pos + cq->mask + 1);
+    return true;
+}
+
+/**
+ * @brief Returns the number of elements in a concurrent queue
+ *
+ * With other threads using the queue, the result may be out of date by
+ * the time it is returned.
+ *
+ * @param[in] cq The queue to examine
+ *
+ * @return the number of elements in the queue, or
+ *         0 if cq is NULL or empty
+ */
+size_t cqueue_size(cqueue_t *cq) {
+    if (cq == NULL) {
+        return 0;
+    }
+    size_t head = load_relaxed(&cq->head);
+    size_t tail = load_relaxed(&cq->tail);
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file cqueue.h
+ * @brief Header file for a concurrent queue of strings.
+ *
+ * The queue is a bounded ring buffer that any number of threads may insert
+ * into and remove from at once, without locks. It offers the insert-tail and
+ * remove-head operations of queue_t.
+ */
+
+#ifndef CQUEUE_H
+#define CQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/************** Data structure declarations ****************/
+
+/**
+ * @brief Assumed size of a cache line, used to keep the two ends of the
+ *        queue from sharing one.
+ */
+#define CQUEUE_LINE 64
+
+/**
+ * @brief Concurrent queue structure representing a ring of string slots
+ *
+ * Each slot has a sequence number, which tells an inserter whether the slot
+ * is free for the current lap of the ring, and a remover whether it has
+ * been filled in. Strings are stored inline in the slots, so inserting and
+ * removing never allocate memory.
+ */
+typedef struct {
+    /**
+     * @brief Position of the next insertion, only ever incremented.
+     */
+    size_t tail;
+    char pad_tail[CQUEUE_LINE - sizeof(size_t)];
+
+    /**
+     * @brief Position of the next removal, only ever incremented.
+     */
+    size_t head;
+    char pad_head[CQUEUE_LINE - sizeof(size_t)];
+
+    /**
+     * @brief Number of slots minus one; the number of slots is a power of 2.
+     */
+    size_t mask;
+
+    /**
+     * @brief Size of each slot, including the null terminator.
+     */
+    size_t slot_size;
+
+    /**
+     * @brief Sequence number of each slot.
+     */
+    size_t *sequence;
+
+    /**
+     * @brief The slots, each slot_size bytes.
+     */
+    char *slots;
+} cqueue_t;
+
+/************** Operations on queue ************************/
+
+/* Create empty queue of at least capacity slots, for strings of up to
+   slot_size - 1 characters. */
+cqueue_t *cqueue_new(size_t capacity, size_t slot_size);
+
+/* Free ALL storage used by queue. Not safe to call concurrently. */
+void cqueue_free(cqueue_t *cq);
+
+/* Attempt to insert element at tail of queue. */
+bool cqueue_insert_tail(cqueue_t *cq, const char *s);
+
+/* Attempt to remove element from head of queue. */
+bool cqueue_remove_head(cqueue_t *cq, char *sp, size_t bufsize);
+
+/* Return number of elements in queue, as of some recent moment. */
+size_t cqueue_size(cqueue_t *cq);
+
+#endif /* CQUEUE_H */
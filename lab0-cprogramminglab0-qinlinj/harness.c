@@ -7,6 +7,7 @@
 #include "harness.h"
 #include "report.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,12 +19,37 @@
 
 /** Special values **/
 
+/* Value at start of every allocated block */
+#define MAGICHEADER 0xdeadbeef
+/* Value used to mark the header and footer of a freed block */
+#define MAGICFREE 0xffffffff
+/* Value at end of every block */
+#define MAGICFOOTER 0xbeefdead
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
 /** Data structures used by our code **/
 
+/*
+  Header of an allocated block.  All allocated blocks are kept in a
+  doubly-linked list, so that a block is added and unlinked in O(1) time.
+  The payload is followed by a footer holding MAGICFOOTER, which may not be
+  aligned.
+*/
+typedef struct BELE {
+    struct BELE *next;
+    struct BELE *prev;
+    size_t payload_size;
+    size_t magic_header; /* Marker to see if block seems legitimate */
+    unsigned char payload[];
+} block_ele_t;
+
+static block_ele_t *allocated = NULL;
+
 static size_t allocated_count = 0;
+/* Payload bytes allocated now, and the most since the peak was reset */
+static size_t allocated_bytes = 0;
+static size_t peak_bytes = 0;
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 static bool cautious_mode = true;
@@ -40,6 +66,33 @@ static bool fail_allocation(void) {
     return (weight < 0.01 * fail_probability);
 }
 
+/* Header of the block whose payload is p */
+static block_ele_t *find_header(void *p) {
+    return (block_ele_t *)((unsigned char *)p - offsetof(block_ele_t, payload));
+}
+
+/* Is the block linked into the list of allocated blocks? */
+static bool is_linked(block_ele_t *b) {
+    if (b->prev ? b->prev->next != b : allocated != b)
+        return false;
+    return b->next == NULL || b->next->prev == b;
+}
+
+/* Footer of the block, just after its payload */
+static unsigned char *find_footer(block_ele_t *b) {
+    return b->payload + b->payload_size;
+}
+
+static size_t get_footer(block_ele_t *b) {
+    size_t magic;
+    memcpy(&magic, find_footer(b), sizeof(magic));
+    return magic;
+}
+
+static void set_footer(block_ele_t *b, size_t magic) {
+    memcpy(find_footer(b), &magic, sizeof(magic));
+}
+
 /*
   Implementation of application functions
  */
@@ -53,15 +106,28 @@ void *test_malloc(size_t size) {
         return NULL;
     }
 
-    void *p = malloc(size);
-    if (p == NULL) {
+    block_ele_t *b = NULL;
+    if (size <= SIZE_MAX - sizeof(block_ele_t) - sizeof(size_t))
+        b = malloc(sizeof(block_ele_t) + size + sizeof(size_t));
+    if (b == NULL) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
-        return p;
+        return NULL;
     }
-    memset(p, FILLCHAR, size);
+    b->payload_size = size;
+    b->magic_header = MAGICHEADER;
+    set_footer(b, MAGICFOOTER);
+    memset(b->payload, FILLCHAR, size);
+    b->next = allocated;
+    b->prev = NULL;
+    if (allocated)
+        allocated->prev = b;
+    allocated = b;
     allocated_count++;
-    return p;
+    allocated_bytes += size;
+    if (allocated_bytes > peak_bytes)
+        peak_bytes = allocated_bytes;
+    return b->payload;
 }
 
 void *test_calloc(size_t num, size_t size) {
@@ -89,7 +155,41 @@ void test_free(void *p) {
         return;
     }
 
-    free(p);
+    block_ele_t *b = find_header(p);
+    if (b->magic_header != MAGICHEADER) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated or corrupted block.  "
+                     "Address = %p",
+                     p);
+        error_occurred = true;
+        return;
+    }
+    /* In cautious mode, also check that the block is linked into the list */
+    if (cautious_mode && !is_linked(b)) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+    if (get_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+
+    b->magic_header = MAGICFREE;
+    set_footer(b, MAGICFREE);
+    memset(p, FILLCHAR, b->payload_size);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        allocated = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    allocated_bytes -= b->payload_size;
+    free(b);
     allocated_count--;
 }
 
@@ -97,13 +197,22 @@ size_t allocation_check(void) {
     return allocated_count;
 }
 
+size_t allocation_peak(void) {
+    return peak_bytes;
+}
+
+void reset_allocation_peak(void) {
+    peak_bytes = allocated_bytes;
+}
+
 /*
   Implementation of functions for testing
  */
 
 /*
   Set/unset cautious mode.
-  In this mode, makes extra sure any block to be freed is currently allocated.
+  In this mode, makes extra sure any block to be freed is currently allocated,
+  by checking that it is linked into the list of allocated blocks.
 */
 void set_cautious_mode(bool cautious) {
     cautious_mode = cautious;
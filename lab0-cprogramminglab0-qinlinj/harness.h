@@ -19,6 +19,12 @@ void test_free(void *p);
 /* Report number of allocated blocks */
 size_t allocation_check(void);
 
+/* Report most bytes allocated at once since peak was last reset */
+size_t allocation_peak(void);
+
+/* Reset peak to number of bytes allocated now */
+void reset_allocation_peak(void);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
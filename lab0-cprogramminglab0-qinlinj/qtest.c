@@ -5,14 +5,17 @@
 #define INTERNAL 1
 
 #include "console.h"
+#include "cqueue.h"
 #include "harness.h"
 #include "queue.h"
 #include "report.h"
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* A few functions in this file intentionally don't use their
    arguments.  */
@@ -32,12 +35,27 @@
 */
 #define BIG_QUEUE 30
 
+/* Most threads the stress command will run */
+#define MAX_STRESS_THREADS 64
+/* Slots, and slot size, of the concurrent queue the stress command uses */
+#define STRESS_CAPACITY 1024
+#define STRESS_SLOT 32
+
+/* Inserting this string inserts random strings instead */
+#define RAND_STRING "RAND"
+/* Longest random string */
+#define MAX_RAND_LENGTH 16
+
 size_t big_queue_size = BIG_QUEUE;
 
 /******* Global variables ******/
 
 /* Queue being tested */
 queue_t *q = NULL;
+/* Whether new queues use the unrolled layout */
+int unrolled_layout = 0;
+/* Whether the bench command checks each block it frees */
+int bench_check = 1;
 /* Number of elements in queue */
 size_t qcnt = 0;
 
@@ -60,6 +78,10 @@ bool do_remove_head_quiet(int argc, char *argv[]);
 bool do_reverse(int argc, char *argv[]);
 bool do_size(int argc, char *argv[]);
 bool do_show(int argc, char *argv[]);
+bool do_sort(int argc, char *argv[]);
+bool do_merge(int argc, char *argv[]);
+bool do_stress(int argc, char *argv[]);
+bool do_bench(int argc, char *argv[]);
 
 static void queue_init(void);
 
@@ -68,10 +90,10 @@ static void console_init(void) {
     add_cmd("free", do_free, "                | Delete queue");
     add_cmd("ih", do_insert_head,
             " str [n]        | Insert string str at head of queue n times "
-            "(default: n == 1)");
+            "(default: n == 1, str == RAND for random strings)");
     add_cmd("it", do_insert_tail,
             " str [n]        | Insert string str at tail of queue n times "
-            "(default: n == 1)");
+            "(default: n == 1, str == RAND for random strings)");
     add_cmd("rh", do_remove_head,
             " [str]          | Remove from head of queue.  Optionally compare "
             "to expected value str");
@@ -82,14 +104,43 @@ static void console_init(void) {
     add_cmd("size", do_size,
             " [n]            | Compute queue size n times (default: n == 1)");
     add_cmd("show", do_show, "                | Show queue contents");
+    add_cmd("sort", do_sort,
+            "                | Sort queue in ascending order");
+    add_cmd("merge", do_merge,
+            " str [n]        | Merge n copies of str, sorted, into sorted "
+            "queue (default: n == 1, str == RAND for random strings)");
+    add_cmd("stress", do_stress,
+            " [t] [n]        | Time the concurrent queue with 1, 2, 4, ... t "
+            "threads doing n inserts each (default: t == 4, n == 100000)");
+    add_cmd("bench", do_bench,
+            " op n [len]     | Time n calls of op (ih, it, rh, reverse or "
+            "size), inserting strings of len characters (default: len == 8)");
     add_param("length", &i_string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("unrolled", &unrolled_layout,
+              "Whether new queues use the unrolled layout", NULL);
+    add_param("benchcheck", &bench_check,
+              "Whether bench checks each block it frees", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
 }
 
+/*
+  Return the string to insert: str itself, or a new random string in buf
+  if str is RAND_STRING.
+*/
+static char *insert_string(char *str, char buf[MAX_RAND_LENGTH + 1]) {
+    if (strcmp(str, RAND_STRING) != 0)
+        return str;
+    size_t len = 1 + (size_t)rand() % MAX_RAND_LENGTH;
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)('a' + rand() % 26);
+    buf[len] = '\0';
+    return buf;
+}
+
 bool do_new(int argc, char *argv[]) {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
@@ -102,7 +153,7 @@ bool do_new(int argc, char *argv[]) {
     }
     error_check();
     arm_timeout();
-    q = queue_new();
+    q = unrolled_layout ? queue_new_unrolled() : queue_new();
     cancel_timeout();
     qcnt = 0;
     show_queue(3);
@@ -138,7 +189,8 @@ bool do_free(int argc, char *argv[]) {
 
 bool do_insert_head(int argc, char *argv[]) {
     char *inserts;
-    char *lasts = NULL;
+    char randstr[MAX_RAND_LENGTH + 1];
+    const char *lasts = NULL;
     int reps = 1;
     int r;
     bool ok = true;
@@ -158,24 +210,26 @@ bool do_insert_head(int argc, char *argv[]) {
     error_check();
     arm_timeout();
     for (r = 0; ok && r < reps; r++) {
+        inserts = insert_string(argv[1], randstr);
         bool rval = queue_insert_head(q, inserts);
         if (rval) {
             qcnt++;
-            if (!q->head->value) {
+            const char *head = queue_peek_head(q);
+            if (!head) {
                 report(1, "ERROR: Failed to save copy of string in list");
                 ok = false;
-            } else if (r == 0 && inserts == q->head->value) {
+            } else if (r == 0 && inserts == head) {
                 report(1, "ERROR: Need to allocate and copy string for new "
                           "list element");
                 ok = false;
                 break;
-            } else if (r == 1 && lasts == q->head->value) {
+            } else if (r == 1 && lasts == head) {
                 report(1, "ERROR: Need to allocate separate string for each "
                           "list element");
                 ok = false;
                 break;
             }
-            lasts = q->head->value;
+            lasts = head;
         } else {
             fail_count++;
             if (fail_count < fail_limit)
@@ -195,6 +249,7 @@ bool do_insert_head(int argc, char *argv[]) {
 
 bool do_insert_tail(int argc, char *argv[]) {
     char *inserts;
+    char randstr[MAX_RAND_LENGTH + 1];
     int reps = 1;
     int r;
     bool ok = true;
@@ -214,10 +269,11 @@ bool do_insert_tail(int argc, char *argv[]) {
     error_check();
     arm_timeout();
     for (r = 0; ok && r < reps; r++) {
+        inserts = insert_string(argv[1], randstr);
         bool rval = queue_insert_tail(q, inserts);
         if (rval) {
             qcnt++;
-            if (!q->head->value) {
+            if (!queue_peek_head(q)) {
                 report(1, "ERROR: Failed to save copy of string in list");
                 ok = false;
             }
@@ -269,7 +325,7 @@ bool do_remove_head(int argc, char *argv[]) {
 
     if (q == NULL)
         report(3, "Warning: Calling remove head on null queue");
-    else if (q->head == NULL)
+    else if (queue_size(q) == 0)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
     arm_timeout();
@@ -317,7 +373,7 @@ bool do_remove_head_quiet(int argc, char *argv[]) {
     bool ok = true;
     if (q == NULL)
         report(3, "Warning: Calling remove head on null queue");
-    else if (q->head == NULL)
+    else if (queue_size(q) == 0)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
     arm_timeout();
@@ -356,6 +412,121 @@ bool do_reverse(int argc, char *argv[]) {
     return !error_check();
 }
 
+/* Check that queue is in ascending order */
+static bool check_sorted(queue_t *sq) {
+    queue_iter_t it;
+    queue_iter_init(sq, &it);
+    const char *prev = queue_iter_next(&it);
+    const char *e;
+    while (prev && (e = queue_iter_next(&it)) != NULL) {
+        if (strcmp(prev, e) > 0) {
+            report(1, "ERROR: Queue not sorted, %s comes before %s", prev, e);
+            return false;
+        }
+        prev = e;
+    }
+    return true;
+}
+
+bool do_sort(int argc, char *argv[]) {
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    bool ok = true;
+    if (q == NULL)
+        report(3, "Warning: Calling sort on null queue");
+    error_check();
+    /* Only the unrolled layout may allocate while sorting */
+    set_noallocate_mode(q == NULL || !q->unrolled);
+    arm_timeout();
+    bool rval = queue_sort(q);
+    cancel_timeout();
+    set_noallocate_mode(false);
+    if (rval) {
+        if (queue_size(q) != qcnt) {
+            report(1, "ERROR: Queue has %lu elements after sort, expected %lu",
+                   queue_size(q), qcnt);
+            ok = false;
+        }
+        ok = ok && check_sorted(q);
+    } else {
+        fail_count++;
+        if (q != NULL && fail_count < fail_limit)
+            report(2, "Sort failed");
+        else if (q != NULL) {
+            report(1, "ERROR: Sort failed (%d failures total)", fail_count);
+            ok = false;
+        }
+    }
+    show_queue(3);
+    return ok && !error_check();
+}
+
+bool do_merge(int argc, char *argv[]) {
+    char randstr[MAX_RAND_LENGTH + 1];
+    int reps = 1;
+    bool ok = true;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3) {
+        if (!get_int(argv[2], &reps)) {
+            report(1, "Invalid number of insertions '%s'", argv[2]);
+            return false;
+        }
+    }
+    if (q == NULL)
+        report(3, "Warning: Calling merge on null queue");
+    error_check();
+
+    /* Build the other queue, in the same layout as the queue */
+    queue_t *other =
+        q != NULL && q->unrolled ? queue_new_unrolled() : queue_new();
+    size_t ocnt = 0;
+    for (int r = 0; other != NULL && r < reps; r++) {
+        if (queue_insert_tail(other, insert_string(argv[1], randstr)))
+            ocnt++;
+    }
+    if (other == NULL || ocnt != (size_t)reps || !queue_sort(other)) {
+        report(2, "Could not build queue to merge");
+        queue_free(other);
+        return !error_check();
+    }
+
+    arm_timeout();
+    bool rval = queue_merge(q, other);
+    cancel_timeout();
+    if (rval) {
+        qcnt += ocnt;
+        if (queue_size(other) != 0) {
+            report(1, "ERROR: Merged queue still has %lu elements",
+                   queue_size(other));
+            ok = false;
+        } else if (queue_size(q) != qcnt) {
+            report(1, "ERROR: Queue has %lu elements after merge, expected %lu",
+                   queue_size(q), qcnt);
+            ok = false;
+        }
+        ok = ok && check_sorted(q);
+    } else {
+        fail_count++;
+        if (q != NULL && fail_count < fail_limit)
+            report(2, "Merge failed");
+        else if (q != NULL) {
+            report(1, "ERROR: Merge failed (%d failures total)", fail_count);
+            ok = false;
+        }
+    }
+    if (ocnt > big_queue_size)
+        set_cautious_mode(false);
+    queue_free(other);
+    set_cautious_mode(true);
+    show_queue(3);
+    return ok && !error_check();
+}
+
 bool do_size(int argc, char *argv[]) {
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
@@ -409,11 +580,13 @@ static bool show_queue(int vlevel) {
     }
     report_noreturn(vlevel, "q = [");
     arm_timeout();
-    list_ele_t *e = q->head;
+    queue_iter_t it;
+    queue_iter_init(q, &it);
+    const char *e = queue_iter_next(&it);
     while (ok && e && cnt < qcnt) {
         if (cnt < big_queue_size)
-            report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-        e = e->next;
+            report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e);
+        e = queue_iter_next(&it);
         cnt++;
         ok = ok && !error_check();
     }
@@ -446,6 +619,249 @@ bool do_show(int argc, char *argv[]) {
     return show_queue(0);
 }
 
+/* State of one thread of the stress command */
+typedef struct {
+    pthread_t thread;
+    cqueue_t *cq;
+    long id;            /* Producer number of the thread */
+    long nthreads;      /* Number of threads in the run */
+    long ops;           /* Number of strings to insert */
+    long removed;       /* Number of strings removed */
+    long errors;        /* Number of strings removed out of order */
+    long last[MAX_STRESS_THREADS]; /* Last number seen from each producer */
+} stress_t;
+
+/*
+  Check a string removed by a stress thread, which must be the next one from
+  its producer that this thread has seen.
+*/
+static void stress_check(stress_t *st, const char *value) {
+    long producer, seq;
+    st->removed++;
+    if (sscanf(value, "%ld %ld", &producer, &seq) != 2 || producer < 0 ||
+        producer >= st->nthreads || seq <= st->last[producer]) {
+        st->errors++;
+        return;
+    }
+    st->last[producer] = seq;
+}
+
+/*
+  Body of a stress thread: insert "id seq" strings, removing one after each
+  attempt, until all ops strings are in.
+*/
+static void *stress_thread(void *arg) {
+    stress_t *st = arg;
+    char buf[STRESS_SLOT];
+    long seq = 0;
+    while (seq < st->ops) {
+        snprintf(buf, sizeof(buf), "%ld %ld", st->id, seq);
+        if (cqueue_insert_tail(st->cq, buf)) {
+            seq++;
+        }
+        if (cqueue_remove_head(st->cq, buf, sizeof(buf))) {
+            stress_check(st, buf);
+        }
+    }
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Run the stress threads once with nthreads threads */
+static bool stress_run(stress_t *st, long nthreads, long ops) {
+    cqueue_t *cq = cqueue_new(STRESS_CAPACITY, STRESS_SLOT);
+    if (cq == NULL) {
+        report(1, "ERROR: Could not allocate concurrent queue");
+        return false;
+    }
+
+    bool ok = true;
+    long started = 0;
+    double start = now_seconds();
+    for (long t = 0; t < nthreads; t++) {
+        st[t].cq = cq;
+        st[t].id = t;
+        st[t].nthreads = nthreads;
+        st[t].ops = ops;
+        st[t].removed = 0;
+        st[t].errors = 0;
+        for (long p = 0; p < nthreads; p++)
+            st[t].last[p] = -1;
+        if (pthread_create(&st[t].thread, NULL, stress_thread, &st[t]) != 0) {
+            report(1, "ERROR: Could not create thread %ld", t);
+            ok = false;
+            break;
+        }
+        started++;
+    }
+    for (long t = 0; t < started; t++)
+        pthread_join(st[t].thread, NULL);
+    double elapsed = now_seconds() - start;
+
+    /* Drain what is left, as one more consumer */
+    stress_t *rest = &st[nthreads];
+    char buf[STRESS_SLOT];
+    rest->nthreads = nthreads;
+    rest->removed = 0;
+    rest->errors = 0;
+    for (long p = 0; p < nthreads; p++)
+        rest->last[p] = -1;
+    while (cqueue_remove_head(cq, buf, sizeof(buf)))
+        stress_check(rest, buf);
+    cqueue_free(cq);
+
+    long removed = 0, errors = 0;
+    for (long t = 0; t <= nthreads; t++) {
+        removed += st[t].removed;
+        errors += st[t].errors;
+    }
+    if (!ok)
+        return false;
+    if (removed != nthreads * ops || errors != 0) {
+        report(1,
+               "ERROR: %ld threads inserted %ld strings, but %ld were "
+               "removed and %ld out of order",
+               nthreads, nthreads * ops, removed, errors);
+        return false;
+    }
+    report(1, "%3ld threads: %12.0f ops/sec", nthreads,
+           2.0 * (double)(nthreads * ops) / elapsed);
+    return true;
+}
+
+bool do_stress(int argc, char *argv[]) {
+    int max_threads = 4;
+    int ops = 100000;
+    if (argc > 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc > 1 && (!get_int(argv[1], &max_threads) || max_threads < 1 ||
+                     max_threads > MAX_STRESS_THREADS)) {
+        report(1, "Invalid number of threads '%s' (at most %d)", argv[1],
+               MAX_STRESS_THREADS);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &ops) || ops < 1)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    /* One state per thread, and one for draining the queue at the end */
+    stress_t *st = malloc((size_t)(max_threads + 1) * sizeof(stress_t));
+    if (st == NULL) {
+        report(1, "INTERNAL ERROR.  Could not allocate stress threads");
+        return false;
+    }
+    bool ok = true;
+    for (long n = 1; ok && n <= max_threads; n *= 2) {
+        ok = stress_run(st, n, ops);
+        if (ok && n < max_threads && n * 2 > max_threads)
+            ok = stress_run(st, max_threads, ops);
+    }
+    free(st);
+    return ok && !error_check();
+}
+
+/*
+  Run one bench operation n times, without checking results, and return how
+  many calls succeeded.
+*/
+static long bench_run(const char *op, long n, const char *s, char *buf,
+                      size_t bufsize) {
+    long done = 0;
+    if (strcmp(op, "ih") == 0) {
+        for (long i = 0; i < n; i++)
+            done += queue_insert_head(q, s);
+    } else if (strcmp(op, "it") == 0) {
+        for (long i = 0; i < n; i++)
+            done += queue_insert_tail(q, s);
+    } else if (strcmp(op, "rh") == 0) {
+        for (long i = 0; i < n; i++)
+            done += queue_remove_head(q, buf, bufsize);
+    } else if (strcmp(op, "reverse") == 0) {
+        for (long i = 0; i < n; i++)
+            queue_reverse(q);
+        done = n;
+    } else {
+        size_t total = 0;
+        for (long i = 0; i < n; i++)
+            total += queue_size(q);
+        /* Keep the calls from being optimized away */
+        done = total == (size_t)-1 ? 0 : n;
+    }
+    return done;
+}
+
+bool do_bench(int argc, char *argv[]) {
+    int reps;
+    int len = 8;
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
+        return false;
+    }
+    const char *op = argv[1];
+    if (strcmp(op, "ih") != 0 && strcmp(op, "it") != 0 &&
+        strcmp(op, "rh") != 0 && strcmp(op, "reverse") != 0 &&
+        strcmp(op, "size") != 0) {
+        report(1, "Unknown bench operation '%s'", op);
+        return false;
+    }
+    if (!get_int(argv[2], &reps) || reps < 1) {
+        report(1, "Invalid number of calls '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 4 && (!get_int(argv[3], &len) || len < 1)) {
+        report(1, "Invalid string length '%s'", argv[3]);
+        return false;
+    }
+    if (q == NULL) {
+        report(1, "ERROR: Calling bench on null queue");
+        return false;
+    }
+
+    char *s = malloc((size_t)len + 1);
+    char *buf = malloc(string_length + 1);
+    if (s == NULL || buf == NULL) {
+        report(1, "INTERNAL ERROR.  Could not allocate bench strings");
+        free(s);
+        free(buf);
+        return false;
+    }
+    memset(s, 'a', (size_t)len);
+    s[len] = '\0';
+
+    error_check();
+    bool is_insert = op[0] == 'i';
+    bool is_remove = strcmp(op, "rh") == 0;
+    size_t blocks = allocation_check();
+    reset_allocation_peak();
+    set_cautious_mode(bench_check != 0);
+    double start = now_seconds();
+    long done = bench_run(op, reps, s, buf, string_length + 1);
+    double elapsed = now_seconds() - start;
+    set_cautious_mode(true);
+    if (is_insert)
+        qcnt += (size_t)done;
+    else if (is_remove)
+        qcnt -= (size_t)done;
+
+    report(1, "%s: %ld of %d calls succeeded, %.1f ns/op", op, done, reps,
+           elapsed * 1e9 / reps);
+    report(1, "%lu blocks allocated, %+ld during bench, peak %lu bytes",
+           allocation_check(), (long)allocation_check() - (long)blocks,
+           allocation_peak());
+    free(s);
+    free(buf);
+    show_queue(3);
+    return !error_check();
+}
+
 static void queue_init() {
     fail_count = 0;
     q = NULL;
@@ -3,7 +3,14 @@
  * @brief Implementation of a queue that supports FIFO and LIFO operations.
  *
  * This queue implementation uses a singly-linked list to represent the
- * queue elements. Each queue element stores a string value.
+ * queue elements. Each queue element stores a string value, inline in the
+ * same allocation as the element itself. Removed elements are kept in a
+ * per-queue pool, by size class, and reused by later insertions.
+ *
+ * A queue made by queue_new_unrolled() instead keeps pointers to its strings
+ * in chunks of QUEUE_CHUNK_SLOTS, so walking it touches one node per chunk
+ * rather than one per element. Strings of up to QUEUE_CHUNK_INLINE bytes
+ * are stored in the chunk itself, so they cost no allocation of their own.
  *
  * Assignment for basic C skills diagnostic.
  * Developed for courses 15-213/18-213/15-513 by R. E. Bryant, 2017
@@ -19,6 +26,185 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * @brief Returns the size class of an element holding a string of `size`
+ *        bytes, including the null terminator
+ * @return The class, or QUEUE_POOL_CLASSES if the string is too large to
+ *         pool
+ */
+static size_t pool_class(size_t size) {
+    size_t c = 0;
+    while (c < QUEUE_POOL_CLASSES && ((size_t)16 << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+/**
+ * @brief Creates an element holding a copy of `s`
+ *
+ * The element is taken from the pool of `q` if the pool has one of the
+ * right size class, and allocated otherwise.
+ *
+ * @param[in] q The queue the element is for
+ * @param[in] s String to be copied into the element
+ *
+ * @return The new element, or NULL if memory allocation failed
+ */
+static list_ele_t *element_new(queue_t *q, const char *s) {
+    size_t size = strlen(s) + 1;
+    size_t c = pool_class(size);
+    list_ele_t *ele;
+
+    if (c < QUEUE_POOL_CLASSES && q->pool[c] != NULL) {
+        ele = q->pool[c];
+        q->pool[c] = ele->next;
+        q->pool_count[c]--;
+    } else {
+        // Round the string up to its class, so the element can be pooled
+        size_t room = c < QUEUE_POOL_CLASSES ? (size_t)16 << c : size;
+        ele = malloc(sizeof(list_ele_t) + room);
+        if (ele == NULL) {
+            return NULL;
+        }
+    }
+
+    ele->value = (char *)(ele + 1);
+    memcpy(ele->value, s, size);
+    return ele;
+}
+
+/**
+ * @brief Returns an element removed from `q` to its pool, or frees it if
+ *        the pool is full or the element too large to pool
+ * @param[in] q   The queue the element was removed from
+ * @param[in] ele The element
+ */
+static void element_release(queue_t *q, list_ele_t *ele) {
+    size_t c = pool_class(strlen(ele->value) + 1);
+
+    if (c < QUEUE_POOL_CLASSES && q->pool_count[c] < QUEUE_POOL_LIMIT) {
+        ele->next = q->pool[c];
+        q->pool[c] = ele;
+        q->pool_count[c]++;
+        return;
+    }
+    free(ele);
+}
+
+/**
+ * @brief Takes an empty chunk for an unrolled queue, reusing its spare
+ *        chunk if it has one
+ * @return The chunk, or NULL if memory allocation failed
+ */
+static queue_chunk_t *chunk_new(queue_t *q) {
+    queue_chunk_t *chunk = q->spare;
+    if (chunk != NULL) {
+        q->spare = NULL;
+        return chunk;
+    }
+    return malloc(sizeof(queue_chunk_t));
+}
+
+/**
+ * @brief Gives back a chunk emptied by a removal, keeping it as the spare
+ *        chunk if there is none
+ */
+static void chunk_release(queue_t *q, queue_chunk_t *chunk) {
+    if (q->spare == NULL) {
+        q->spare = chunk;
+    } else {
+        free(chunk);
+    }
+}
+
+/**
+ * @brief Returns the room a chunk has for the string of one of its slots
+ */
+static char *chunk_string(queue_chunk_t *chunk, size_t slot) {
+    return chunk->strings[chunk->mirrored ? QUEUE_CHUNK_SLOTS - 1 - slot
+                                          : slot];
+}
+
+/**
+ * @brief Gives back every chunk of a list, freeing the strings that they do
+ *        not hold in their slots only if `strings` is true
+ */
+static void chunks_release(queue_t *q, queue_chunk_t *chunk, bool strings) {
+    while (chunk) {
+        queue_chunk_t *next = chunk->next;
+        for (size_t i = chunk->begin; strings && i < chunk->end; i++) {
+            if (chunk->values[i] != chunk_string(chunk, i)) {
+                free(chunk->values[i]);
+            }
+        }
+        chunk_release(q, chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * @brief Inserts a copy of `s` at either end of an unrolled queue
+ *
+ * A new chunk is started when the chunk at that end is full, filled from
+ * its top down at the head and from its bottom up at the tail. The copy is
+ * stored in its slot if it fits, and allocated otherwise.
+ *
+ * @param[in] q       The queue to insert into
+ * @param[in] s       String to be copied and inserted into the queue
+ * @param[in] at_head Whether to insert at the head, rather than the tail
+ *
+ * @return true if insertion was successful
+ * @return false if memory allocation failed
+ */
+static bool unrolled_insert(queue_t *q, const char *s, bool at_head) {
+    size_t size = strlen(s) + 1;
+    char *value = NULL;
+    if (size > QUEUE_CHUNK_INLINE) {
+        value = malloc(size);
+        if (value == NULL) {
+            return false;
+        }
+        memcpy(value, s, size);
+    }
+
+    queue_chunk_t *chunk = at_head ? q->first : q->last;
+    if (chunk == NULL ||
+        (at_head ? chunk->begin == 0 : chunk->end == QUEUE_CHUNK_SLOTS)) {
+        chunk = chunk_new(q);
+        if (chunk == NULL) {
+            free(value);
+            return false;
+        }
+        chunk->begin = chunk->end = at_head ? QUEUE_CHUNK_SLOTS : 0;
+        chunk->mirrored = false;
+        if (at_head) {
+            chunk->next = q->first;
+            q->first = chunk;
+            if (q->last == NULL) {
+                q->last = chunk;
+            }
+        } else {
+            chunk->next = NULL;
+            if (q->last == NULL) {
+                q->first = chunk;
+            } else {
+                q->last->next = chunk;
+            }
+            q->last = chunk;
+        }
+    }
+
+    size_t slot = at_head ? --chunk->begin : chunk->end++;
+    if (value == NULL) {
+        value = chunk_string(chunk, slot);
+        memcpy(value, s, size);
+    }
+    chunk->values[slot] = value;
+    q->size++;
+    return true;
+}
+
 /**
  * @brief Allocates a new queue
  * @return The new queue, or NULL if memory allocation failed
@@ -33,6 +219,26 @@ queue_t *queue_new(void) {
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    for (size_t c = 0; c < QUEUE_POOL_CLASSES; c++) {
+        q->pool[c] = NULL;
+        q->pool_count[c] = 0;
+    }
+    q->unrolled = false;
+    q->first = NULL;
+    q->last = NULL;
+    q->spare = NULL;
+    return q;
+}
+
+/**
+ * @brief Allocates a new queue with the unrolled layout
+ * @return The new queue, or NULL if memory allocation failed
+ */
+queue_t *queue_new_unrolled(void) {
+    queue_t *q = queue_new();
+    if (q != NULL) {
+        q->unrolled = true;
+    }
     return q;
 }
 
@@ -49,17 +255,25 @@ void queue_free(queue_t *q) {
     while (q->head) {
         list_ele_t *temp = q->head;
         q->head = q->head->next;
-        free(temp->value);
         free(temp);
     }
+    for (size_t c = 0; c < QUEUE_POOL_CLASSES; c++) {
+        while (q->pool[c]) {
+            list_ele_t *temp = q->pool[c];
+            q->pool[c] = temp->next;
+            free(temp);
+        }
+    }
+    chunks_release(q, q->first, true);
+    free(q->spare);
     free(q);
 }
 
 /**
  * @brief Attempts to insert an element at head of a queue
  *
- * This function explicitly allocates space to create a copy of `s`.
- * The inserted element points to a copy of `s`, instead of `s` itself.
+ * The inserted element holds a copy of `s`, instead of `s` itself, in an
+ * element reused from the queue's pool or else freshly allocated.
  *
  * @param[in] q The queue to insert into
  * @param[in] s String to be copied and inserted into the queue
@@ -72,27 +286,16 @@ bool queue_insert_head(queue_t *q, const char *s) {
     if (q == NULL) {
         return false;
     }
-
-    list_ele_t *newh;
-    newh = malloc(sizeof(list_ele_t));
-
-    if (newh == NULL) {
-        return false;
+    if (q->unrolled) {
+        return unrolled_insert(q, s, true);
     }
 
-    // An extra byte is required to store the null character
-    newh->value = malloc(strlen(s) + 1);
+    list_ele_t *newh = element_new(q, s);
 
-    if (newh->value == NULL) {
-        free(newh);
-        newh = NULL;
+    if (newh == NULL) {
         return false;
     }
 
-    /* Don't forget to allocate space for the string and copy it */
-    /* What if either call to malloc returns NULL? */
-    strcpy(newh->value, s);
-
     if (q->head == NULL) {
         q->head = newh;
         q->tail = newh;
@@ -109,8 +312,8 @@ bool queue_insert_head(queue_t *q, const char *s) {
 /**
  * @brief Attempts to insert an element at tail of a queue
  *
- * This function explicitly allocates space to create a copy of `s`.
- * The inserted element points to a copy of `s`, instead of `s` itself.
+ * The inserted element holds a copy of `s`, instead of `s` itself, in an
+ * element reused from the queue's pool or else freshly allocated.
  *
  * @param[in] q The queue to insert into
  * @param[in] s String to be copied and inserted into the queue
@@ -124,23 +327,15 @@ bool queue_insert_tail(queue_t *q, const char *s) {
     if (!q || !s) {
         return false;
     }
+    if (q->unrolled) {
+        return unrolled_insert(q, s, false);
+    }
 
-    list_ele_t *newt;
-    newt = malloc(sizeof(list_ele_t));
+    list_ele_t *newt = element_new(q, s);
 
     if (!newt)
         return false;
 
-    newt->value = malloc(strlen(s) + 1);
-
-    if (newt->value == NULL) {
-        free(newt);
-        newt = NULL;
-        return false;
-    }
-
-    strcpy(newt->value, s);
-
     newt->next = NULL;
 
     if (q->tail == NULL) {
@@ -158,8 +353,8 @@ bool queue_insert_tail(queue_t *q, const char *s) {
 /**
  * @brief Attempts to remove an element from head of a queue
  *
- * If removal succeeds, this function frees all memory used by the
- * removed list element and its string value before returning.
+ * If removal succeeds, the removed list element, with its string value, is
+ * returned to the queue's pool, or freed if the pool has no room for it.
  *
  * If removal succeeds and `buf` is non-NULL, this function copies up to
  * `bufsize - 1` characters from the removed string into `buf`, and writes
@@ -175,9 +370,30 @@ bool queue_insert_tail(queue_t *q, const char *s) {
 bool queue_remove_head(queue_t *q, char *buf, size_t bufsize) {
     /* You need to fix up this code. */
 
-    if (q == NULL || q->head == NULL) {
+    if (q == NULL || q->size == 0) {
         return false;
     }
+    if (q->unrolled) {
+        queue_chunk_t *chunk = q->first;
+        size_t slot = chunk->begin++;
+        char *value = chunk->values[slot];
+        if (buf && bufsize) {
+            strncpy(buf, value, bufsize - 1);
+            buf[bufsize - 1] = '\0';
+        }
+        if (value != chunk_string(chunk, slot)) {
+            free(value);
+        }
+        if (chunk->begin == chunk->end) {
+            q->first = chunk->next;
+            if (q->first == NULL) {
+                q->last = NULL;
+            }
+            chunk_release(q, chunk);
+        }
+        q->size--;
+        return true;
+    }
     list_ele_t *removedhead = q->head;
     if (buf && bufsize) {
         strncpy(buf, removedhead->value, bufsize - 1);
@@ -188,8 +404,7 @@ bool queue_remove_head(queue_t *q, char *buf, size_t bufsize) {
     if (q->head == NULL) {
         q->tail = NULL;
     }
-    free(removedhead->value);
-    free(removedhead);
+    element_release(q, removedhead);
     q->size--;
 
     return true;
@@ -226,7 +441,32 @@ size_t queue_size(queue_t *q) {
  */
 void queue_reverse(queue_t *q) {
     /* You need to write the code for this function */
-    if (q == NULL || q->head == NULL) {
+    if (q == NULL || q->size == 0) {
+        return;
+    }
+
+    if (q->unrolled) {
+        // Reverse the order of the chunks, and mirror the slots of each,
+        // which leaves the strings stored in the slots where they are
+        queue_chunk_t *prev = NULL;
+        queue_chunk_t *curr = q->first;
+        while (curr) {
+            queue_chunk_t *next = curr->next;
+            for (size_t i = 0; i < QUEUE_CHUNK_SLOTS / 2; i++) {
+                char *temp = curr->values[i];
+                curr->values[i] = curr->values[QUEUE_CHUNK_SLOTS - 1 - i];
+                curr->values[QUEUE_CHUNK_SLOTS - 1 - i] = temp;
+            }
+            curr->mirrored = !curr->mirrored;
+            size_t begin = curr->begin;
+            curr->begin = QUEUE_CHUNK_SLOTS - curr->end;
+            curr->end = QUEUE_CHUNK_SLOTS - begin;
+            curr->next = prev;
+            prev = curr;
+            curr = next;
+        }
+        q->last = q->first;
+        q->first = prev;
         return;
     }
 
@@ -243,3 +483,311 @@ void queue_reverse(queue_t *q) {
     q->tail = q->head;
     q->head = prev;
 }
+
+/**
+ * @brief Merges two sorted lists of elements into one sorted list
+ *
+ * Of two equal strings, the one from `a` goes first, so the merge is stable.
+ *
+ * @param[in]  a    The first list, possibly empty
+ * @param[in]  b    The second list, possibly empty
+ * @param[out] tail If not NULL, set to the last element of the merged list
+ *
+ * @return The head of the merged list
+ */
+static list_ele_t *merge_lists(list_ele_t *a, list_ele_t *b,
+                               list_ele_t **tail) {
+    list_ele_t *head = NULL;
+    list_ele_t **link = &head;
+    list_ele_t *last = NULL;
+    while (a != NULL && b != NULL) {
+        if (strcmp(a->value, b->value) <= 0) {
+            last = a;
+            a = a->next;
+        } else {
+            last = b;
+            b = b->next;
+        }
+        *link = last;
+        link = &last->next;
+    }
+    *link = a != NULL ? a : b;
+    if (tail != NULL) {
+        while (*link != NULL) {
+            last = *link;
+            link = &last->next;
+        }
+        *tail = last;
+    }
+    return head;
+}
+
+/**
+ * @brief Merges the sorted runs src[lo, mid) and src[mid, hi) into
+ *        dst[lo, hi), stably
+ */
+static void merge_values(char **src, size_t lo, size_t mid, size_t hi,
+                         char **dst) {
+    size_t i = lo;
+    size_t j = mid;
+    for (size_t k = lo; k < hi; k++) {
+        if (j == hi || (i < mid && strcmp(src[i], src[j]) <= 0)) {
+            dst[k] = src[i++];
+        } else {
+            dst[k] = src[j++];
+        }
+    }
+}
+
+/**
+ * @brief Copies the string pointers of an unrolled queue into an array
+ * @return The number of pointers copied, which is the size of the queue
+ */
+static size_t unrolled_gather(queue_t *q, char **values) {
+    size_t n = 0;
+    for (queue_chunk_t *chunk = q->first; chunk; chunk = chunk->next) {
+        for (size_t i = chunk->begin; i < chunk->end; i++) {
+            values[n++] = chunk->values[i];
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Refills an unrolled queue with `n` strings, in order, gathered
+ *        from it and possibly from another queue
+ *
+ * The strings are packed into new chunks, copying those that fit into
+ * their slots and moving the pointers to the others, and the old chunks of
+ * `q` are then released. Strings of another queue stay in its chunks,
+ * which the caller must release afterwards.
+ *
+ * @return true if the queue was refilled
+ * @return false if memory allocation failed, leaving the queue unchanged
+ */
+static bool unrolled_pack(queue_t *q, char **values, size_t n) {
+    queue_chunk_t *first = NULL;
+    queue_chunk_t *last = NULL;
+    for (size_t done = 0; done < n; done += QUEUE_CHUNK_SLOTS) {
+        queue_chunk_t *chunk = chunk_new(q);
+        if (chunk == NULL) {
+            chunks_release(q, first, false);
+            return false;
+        }
+        chunk->begin = 0;
+        chunk->end = 0;
+        chunk->mirrored = false;
+        chunk->next = NULL;
+        if (last == NULL) {
+            first = chunk;
+        } else {
+            last->next = chunk;
+        }
+        last = chunk;
+    }
+
+    size_t done = 0;
+    for (queue_chunk_t *chunk = first; chunk; chunk = chunk->next) {
+        while (done < n && chunk->end < QUEUE_CHUNK_SLOTS) {
+            char *value = values[done++];
+            size_t size = strlen(value) + 1;
+            if (size <= QUEUE_CHUNK_INLINE) {
+                memcpy(chunk->strings[chunk->end], value, size);
+                value = chunk->strings[chunk->end];
+            }
+            chunk->values[chunk->end++] = value;
+        }
+    }
+
+    chunks_release(q, q->first, false);
+    q->first = first;
+    q->last = last;
+    q->size = n;
+    return true;
+}
+
+/**
+ * @brief Sorts the elements of a queue in ascending order, by strcmp
+ *
+ * The sort is a bottom-up merge sort, so it is stable and takes O(n log n)
+ * time. On a linked queue it relinks the existing elements, without
+ * recursion and without calling malloc or free: like a binary counter, it
+ * keeps one pending sorted run of 2^k elements for each bit k of the count
+ * so far, and merges runs of equal length as soon as they appear, while
+ * they are still in the cache. An unrolled queue is sorted through a
+ * temporary array of its string pointers, and packed into new chunks.
+ *
+ * @param[in] q The queue to sort
+ *
+ * @return true if the queue was sorted
+ * @return false if q is NULL, or memory allocation failed
+ */
+bool queue_sort(queue_t *q) {
+    if (q == NULL) {
+        return false;
+    }
+    if (q->size < 2) {
+        return true;
+    }
+
+    if (q->unrolled) {
+        char **values = malloc(2 * q->size * sizeof(char *));
+        if (values == NULL) {
+            return false;
+        }
+        size_t n = unrolled_gather(q, values);
+        char **src = values;
+        char **dst = values + n;
+        for (size_t width = 1; width < n; width *= 2) {
+            for (size_t lo = 0; lo < n; lo += 2 * width) {
+                size_t mid = lo + width < n ? lo + width : n;
+                size_t hi = mid + width < n ? mid + width : n;
+                merge_values(src, lo, mid, hi, dst);
+            }
+            char **temp = src;
+            src = dst;
+            dst = temp;
+        }
+        bool packed = unrolled_pack(q, src, n);
+        free(values);
+        return packed;
+    }
+
+    // pending[k] is NULL, or a sorted run of 2^k elements, which are all
+    // earlier in the queue than those of pending[k - 1]
+    list_ele_t *pending[sizeof(size_t) * 8] = {NULL};
+    list_ele_t *curr = q->head;
+    while (curr) {
+        list_ele_t *run = curr;
+        curr = curr->next;
+        run->next = NULL;
+        size_t k = 0;
+        while (pending[k] != NULL) {
+            run = merge_lists(pending[k], run, NULL);
+            pending[k] = NULL;
+            k++;
+        }
+        pending[k] = run;
+    }
+
+    // Merge the pending runs, finding the tail only in the last merge
+    size_t top = sizeof(size_t) * 8 - 1;
+    while (pending[top] == NULL) {
+        top--;
+    }
+    list_ele_t *head = NULL;
+    for (size_t k = 0; k < top; k++) {
+        if (pending[k] != NULL) {
+            head = merge_lists(pending[k], head, NULL);
+        }
+    }
+    q->head = merge_lists(pending[top], head, &q->tail);
+    return true;
+}
+
+/**
+ * @brief Merges the elements of a sorted queue into another sorted queue
+ *
+ * Afterwards `q` holds the elements of both queues in ascending order, and
+ * `other` is empty. Of two equal strings, the one from `q` goes first. Two
+ * linked queues are merged in O(n) time by relinking their elements, while
+ * two unrolled queues are merged through a temporary array of their string
+ * pointers.
+ *
+ * @param[in] q     The queue to merge into
+ * @param[in] other The queue to merge from, with the same layout as q
+ *
+ * @return true if the queues were merged
+ * @return false if either queue is NULL, they are the same queue or have
+ *         different layouts, or memory allocation failed
+ */
+bool queue_merge(queue_t *q, queue_t *other) {
+    if (q == NULL || other == NULL || q == other ||
+        q->unrolled != other->unrolled) {
+        return false;
+    }
+    if (other->size == 0) {
+        return true;
+    }
+
+    if (q->unrolled) {
+        size_t n = q->size + other->size;
+        char **values = malloc(2 * n * sizeof(char *));
+        if (values == NULL) {
+            return false;
+        }
+        size_t mid = unrolled_gather(q, values);
+        unrolled_gather(other, values + mid);
+        merge_values(values, 0, mid, n, values + n);
+        bool packed = unrolled_pack(q, values + n, n);
+        free(values);
+        if (!packed) {
+            return false;
+        }
+        chunks_release(q, other->first, false);
+        other->first = NULL;
+        other->last = NULL;
+    } else {
+        q->head = merge_lists(q->head, other->head, &q->tail);
+        q->size += other->size;
+        other->head = NULL;
+        other->tail = NULL;
+    }
+    other->size = 0;
+    return true;
+}
+
+/**
+ * @brief Returns the string at the head of a queue
+ *
+ * @param[in] q The queue to examine
+ *
+ * @return the string, or NULL if q is NULL or empty
+ */
+const char *queue_peek_head(queue_t *q) {
+    if (q == NULL || q->size == 0) {
+        return NULL;
+    }
+    if (q->unrolled) {
+        return q->first->values[q->first->begin];
+    }
+    return q->head->value;
+}
+
+/**
+ * @brief Starts an iteration over the strings of a queue, from head to tail
+ *
+ * The queue must not be changed until the iteration is over.
+ *
+ * @param[in]  q  The queue to iterate over, possibly NULL
+ * @param[out] it The iterator
+ */
+void queue_iter_init(queue_t *q, queue_iter_t *it) {
+    it->ele = q != NULL && !q->unrolled ? q->head : NULL;
+    it->chunk = q != NULL && q->unrolled ? q->first : NULL;
+    it->slot = it->chunk != NULL ? it->chunk->begin : 0;
+}
+
+/**
+ * @brief Returns the next string of an iteration over a queue
+ *
+ * @param[in,out] it The iterator
+ *
+ * @return the string, or NULL once every string has been returned
+ */
+const char *queue_iter_next(queue_iter_t *it) {
+    if (it->chunk != NULL) {
+        const char *value = it->chunk->values[it->slot++];
+        if (it->slot == it->chunk->end) {
+            it->chunk = it->chunk->next;
+            it->slot = it->chunk != NULL ? it->chunk->begin : 0;
+        }
+        return value;
+    }
+    if (it->ele != NULL) {
+        const char *value = it->ele->value;
+        it->ele = it->ele->next;
+        return value;
+    }
+    return NULL;
+}
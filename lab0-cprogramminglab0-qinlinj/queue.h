@@ -15,6 +15,30 @@
 
 /************** Data structure declarations ****************/
 
+/**
+ * @brief Number of size classes of removed elements a queue keeps for reuse.
+ *
+ * Class c holds elements with room for strings of up to 16 << c bytes,
+ * including the null terminator.
+ */
+#define QUEUE_POOL_CLASSES 8
+
+/**
+ * @brief Maximum number of removed elements a queue keeps in each class.
+ */
+#define QUEUE_POOL_LIMIT 1024
+
+/**
+ * @brief Number of strings held by each chunk of an unrolled queue.
+ */
+#define QUEUE_CHUNK_SLOTS 16
+
+/**
+ * @brief Size of the longest string, including the null terminator, that a
+ *        chunk stores in the slot itself rather than allocating it.
+ */
+#define QUEUE_CHUNK_INLINE 16
+
 /**
  * @brief Linked list element containing a string.
  *
@@ -24,8 +48,8 @@ typedef struct list_ele {
     /**
      * @brief Pointer to a char array containing a string value.
      *
-     * The memory for this string should be explicitly allocated and freed
-     * whenever an element is inserted and removed from the queue.
+     * The string is stored inline, right after the element, in the same
+     * allocation.
      */
     char *value;
 
@@ -35,8 +59,55 @@ typedef struct list_ele {
     struct list_ele *next;
 } list_ele_t;
 
+/**
+ * @brief Chunk of an unrolled queue, holding up to QUEUE_CHUNK_SLOTS strings.
+ *
+ * The strings of a chunk are in slots [begin, end), so that a chunk at the
+ * head of the queue can grow downwards and one at the tail upwards.
+ */
+typedef struct queue_chunk {
+    /**
+     * @brief Pointers to the strings. The string in a slot is stored in the
+     *        slot's entry of strings if it fits there, and separately
+     *        allocated if not.
+     */
+    char *values[QUEUE_CHUNK_SLOTS];
+
+    /**
+     * @brief Pointer to the next chunk, or NULL for the last one.
+     */
+    struct queue_chunk *next;
+
+    /**
+     * @brief First slot in use.
+     */
+    size_t begin;
+
+    /**
+     * @brief One past the last slot in use.
+     */
+    size_t end;
+
+    /**
+     * @brief Whether slot i uses entry QUEUE_CHUNK_SLOTS - 1 - i of strings
+     *        rather than entry i, which reversing the chunk toggles instead
+     *        of moving the strings.
+     */
+    bool mirrored;
+
+    /**
+     * @brief Room for the short strings of each slot, after the fields a
+     *        walk over the chunks reads.
+     */
+    char strings[QUEUE_CHUNK_SLOTS][QUEUE_CHUNK_INLINE];
+} queue_chunk_t;
+
 /**
  * @brief Queue structure representing a list of elements
+ *
+ * A queue made by queue_new_unrolled() keeps its strings in a list of
+ * chunks instead, and leaves head and tail NULL. Code outside queue.c
+ * should read either kind through queue_peek_head() and queue_iter_t.
  */
 typedef struct {
     /**
@@ -58,13 +129,53 @@ typedef struct {
      * @brief the queue size, or 0 if the queue is empty.
      */
     size_t size;
+
+    /**
+     * @brief Removed elements kept for reuse, one list per size class,
+     *        linked through their next pointers.
+     */
+    list_ele_t *pool[QUEUE_POOL_CLASSES];
+
+    /**
+     * @brief Number of elements in each list of the pool.
+     */
+    size_t pool_count[QUEUE_POOL_CLASSES];
+
+    /**
+     * @brief Whether the queue uses the unrolled layout.
+     */
+    bool unrolled;
+
+    /**
+     * @brief First and last chunks of an unrolled queue, or NULL if it is
+     *        empty.
+     */
+    queue_chunk_t *first;
+    queue_chunk_t *last;
+
+    /**
+     * @brief An empty chunk kept for reuse by an unrolled queue, or NULL.
+     */
+    queue_chunk_t *spare;
 } queue_t;
 
+/**
+ * @brief Iterator over the strings of a queue, from head to tail.
+ */
+typedef struct {
+    list_ele_t *ele;      /* Next element of a linked queue */
+    queue_chunk_t *chunk; /* Current chunk of an unrolled queue */
+    size_t slot;          /* Next slot of the current chunk */
+} queue_iter_t;
+
 /************** Operations on queue ************************/
 
 /* Create empty queue. */
 queue_t *queue_new(void);
 
+/* Create empty queue that stores its strings in chunks. */
+queue_t *queue_new_unrolled(void);
+
 /* Free ALL storage used by queue. */
 void queue_free(queue_t *q);
 
@@ -82,3 +193,18 @@ size_t queue_size(queue_t *q);
 
 /* Reverse elements in queue */
 void queue_reverse(queue_t *q);
+
+/* Sort elements of queue in ascending order. */
+bool queue_sort(queue_t *q);
+
+/* Merge sorted queue other into sorted queue q, leaving other empty. */
+bool queue_merge(queue_t *q, queue_t *other);
+
+/* Return string at head of queue, or NULL if it is empty. */
+const char *queue_peek_head(queue_t *q);
+
+/* Start iterating over queue. */
+void queue_iter_init(queue_t *q, queue_iter_t *it);
+
+/* Return next string of iteration, or NULL at its end. */
+const char *queue_iter_next(queue_iter_t *it);
@@ -0,0 +1,416 @@
+/*
+ * CS:APP Data Lab
+ *
+ * bench.c - Times the functions in bits.c against their references in
+ *           tests.c, and against equivalents written with compiler
+ *           builtins or plain C operators where there are any.
+ *
+ * Every version of a function is timed in two ways over the same array
+ * of random arguments, drawn from the argument ranges btest uses. For
+ * throughput, the calls are independent, so the processor may overlap
+ * them. For latency, the argument of each call depends on the result of
+ * the call before, so each call waits for the last one to finish. All
+ * versions are called through function pointers, as btest calls them,
+ * so the times include the cost of a call.
+ *
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "btest.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*************************
+ * Configuration Constants
+ *************************/
+
+/* Number of arguments each version is timed over (-n) */
+#define NUM_INPUTS (1 << 20)
+
+/* Number of timed runs of each version, of which the fastest is
+   reported (-r) */
+#define NUM_RUNS 5
+
+/**********************************
+ * Globals defined in other modules
+ **********************************/
+/* The set of puzzles, defined in decl.c */
+extern test_rec test_set[];
+
+/************************************************
+ * Write-once globals defined by command line args
+ ************************************************/
+
+/* Number of arguments and of runs */
+static long num_inputs = NUM_INPUTS;
+static int num_runs = NUM_RUNS;
+
+/* If non-NULL, time only one function (-f) */
+static char *bench_fname = NULL;
+
+/* Zero, but unknown to the compiler, so that the latency loops can make
+   each argument depend on the last result */
+static volatile long chain_zero = 0;
+
+/* Where the throughput loops leave their results */
+static volatile long sink;
+
+/**********************
+ * Builtin equivalents
+ **********************/
+
+static float u2f(unsigned u) {
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static unsigned f2u(float f) {
+    unsigned u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static long builtin_bitMatch(long x, long y) {
+    return ~(x ^ y);
+}
+
+static long builtin_anyOddBit(long x) {
+    return (x & (long)0xAAAAAAAAAAAAAAAAUL) != 0;
+}
+
+static long builtin_bitMask(long highbit, long lowbit) {
+    /* 2 << 63 is 0, so that the high mask is then all ones */
+    unsigned long high = (2UL << highbit) - 1;
+    unsigned long low = (1UL << lowbit) - 1;
+    return (long)(high & ~low);
+}
+
+static long builtin_howManyBits(long x) {
+    return 64 - __builtin_clrsbl(x);
+}
+
+static long builtin_isNegative(long x) {
+    return (long)((unsigned long)x >> 63);
+}
+
+static long builtin_integerLog2(long x) {
+    return 63 - __builtin_clzl((unsigned long)x);
+}
+
+static long builtin_floatFloat2Int(long x) {
+    float f = u2f((unsigned)x);
+    /* Out of range values and NaN give 0x80000000, as cvttss2si does */
+    if (!(f > -2147483649.0f && f < 2147483648.0f))
+        return INT_MIN;
+    return (int)f;
+}
+
+static long builtin_floatScale1d4(long x) {
+    float f = u2f((unsigned)x);
+    if (__builtin_isnan(f))
+        return (unsigned)x;
+    return f2u(f * 0.25f);
+}
+
+static long builtin_floatNegate(long x) {
+    if (__builtin_isnan(u2f((unsigned)x)))
+        return (unsigned)x;
+    return (unsigned)x ^ 0x80000000U;
+}
+
+/* The builtin equivalent of each function that has one */
+static const struct {
+    const char *name;
+    funct_t funct;
+} builtins[] = {
+    {"bitMatch", (funct_t)builtin_bitMatch},
+    {"anyOddBit", (funct_t)builtin_anyOddBit},
+    {"bitMask", (funct_t)builtin_bitMask},
+    {"howManyBits", (funct_t)builtin_howManyBits},
+    {"isNegative", (funct_t)builtin_isNegative},
+    {"integerLog2", (funct_t)builtin_integerLog2},
+    {"floatFloat2Int", (funct_t)builtin_floatFloat2Int},
+    {"floatScale1d4", (funct_t)builtin_floatScale1d4},
+    {"floatNegate", (funct_t)builtin_floatNegate},
+    {NULL, NULL},
+};
+
+/******************
+ * Helper functions
+ ******************/
+
+/*
+ * is_float - Return true if a function is a floating point puzzle, whose
+ *            argument is the bit-level representation of a float
+ */
+static int is_float(test_ptr t) {
+    return t->arg_ranges[0][0] == 1 && t->arg_ranges[0][1] == 1;
+}
+
+/*
+ * find_builtin - Return the builtin equivalent of a function, or NULL
+ */
+static funct_t find_builtin(const char *name) {
+    int i;
+    for (i = 0; builtins[i].name; i++)
+        if (strcmp(builtins[i].name, name) == 0)
+            return builtins[i].funct;
+    return NULL;
+}
+
+/*
+ * random_bits - Return 64 random bits
+ */
+static unsigned long random_bits(void) {
+    return ((unsigned long)rand() << 42) ^ ((unsigned long)rand() << 21) ^
+           (unsigned long)rand();
+}
+
+/*
+ * gen_inputs - Fill vals with random arguments between min and max, or
+ *              with random float bit patterns
+ */
+static void gen_inputs(long vals[], long min, long max, int is_float) {
+    unsigned long span = (unsigned long)max - (unsigned long)min + 1;
+    long i;
+
+    for (i = 0; i < num_inputs; i++) {
+        if (is_float)
+            vals[i] = (unsigned)random_bits();
+        else if (span == 0) /* the whole range of long */
+            vals[i] = (long)random_bits();
+        else
+            vals[i] = (long)((unsigned long)min + random_bits() % span);
+    }
+}
+
+/*
+ * now_ns - Return the time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * time_throughput - Return the ns per call of f over the arguments, with
+ *                   the calls independent of each other
+ */
+static double time_throughput(funct_t f, int args, long *vals[3]) {
+    double start = now_ns();
+    long sum = 0;
+    long i;
+
+    switch (args) {
+    case 0:
+        for (i = 0; i < num_inputs; i++)
+            sum += f();
+        break;
+    case 1:
+        for (i = 0; i < num_inputs; i++)
+            sum += ((funct1_t)f)(vals[0][i]);
+        break;
+    case 2:
+        for (i = 0; i < num_inputs; i++)
+            sum += ((funct2_t)f)(vals[0][i], vals[1][i]);
+        break;
+    default:
+        for (i = 0; i < num_inputs; i++)
+            sum += ((funct3_t)f)(vals[0][i], vals[1][i], vals[2][i]);
+        break;
+    }
+    sink = sum;
+    return (now_ns() - start) / num_inputs;
+}
+
+/*
+ * time_latency - Return the ns per call of f over the arguments, with
+ *                the first argument of each call depending on the result
+ *                of the call before
+ */
+static double time_latency(funct_t f, int args, long *vals[3]) {
+    long zero = chain_zero;
+    double start = now_ns();
+    long r = 0;
+    long i;
+
+    switch (args) {
+    case 0:
+        for (i = 0; i < num_inputs; i++)
+            r = f();
+        break;
+    case 1:
+        for (i = 0; i < num_inputs; i++)
+            r = ((funct1_t)f)(vals[0][i] ^ (r & zero));
+        break;
+    case 2:
+        for (i = 0; i < num_inputs; i++)
+            r = ((funct2_t)f)(vals[0][i] ^ (r & zero), vals[1][i]);
+        break;
+    default:
+        for (i = 0; i < num_inputs; i++)
+            r = ((funct3_t)f)(vals[0][i] ^ (r & zero), vals[1][i],
+                              vals[2][i]);
+        break;
+    }
+    sink = r;
+    return (now_ns() - start) / num_inputs;
+}
+
+/*
+ * count_mismatches - Return the number of arguments on which f and the
+ *                    reference ft disagree
+ */
+static long count_mismatches(funct_t f, funct_t ft, test_ptr t,
+                             long *vals[3]) {
+    long count = 0;
+    long i, r, rt;
+
+    for (i = 0; i < num_inputs; i++) {
+        switch (t->args) {
+        case 0:
+            r = f();
+            rt = ft();
+            break;
+        case 1:
+            r = ((funct1_t)f)(vals[0][i]);
+            rt = ((funct1_t)ft)(vals[0][i]);
+            break;
+        case 2:
+            r = ((funct2_t)f)(vals[0][i], vals[1][i]);
+            rt = ((funct2_t)ft)(vals[0][i], vals[1][i]);
+            break;
+        default:
+            r = ((funct3_t)f)(vals[0][i], vals[1][i], vals[2][i]);
+            rt = ((funct3_t)ft)(vals[0][i], vals[1][i], vals[2][i]);
+            break;
+        }
+        /* Floating point puzzles return only 32 bits */
+        if (is_float(t) ? (unsigned)r != (unsigned)rt : r != rt)
+            count++;
+    }
+    return count;
+}
+
+/*
+ * bench_version - Time one version of a function and print its line,
+ *                 headed by name
+ */
+static void bench_version(test_ptr t, const char *name, const char *version,
+                          funct_t f, long *vals[3]) {
+    double throughput = 0.0;
+    double latency = 0.0;
+    long mismatches;
+    int run;
+
+    for (run = 0; run < num_runs; run++) {
+        double tp = time_throughput(f, t->args, vals);
+        double lat = time_latency(f, t->args, vals);
+        if (run == 0 || tp < throughput)
+            throughput = tp;
+        if (run == 0 || lat < latency)
+            latency = lat;
+    }
+
+    printf("%-16s%-10s%10.2f%12.2f", name, version, throughput, latency);
+    if (f != t->test_funct &&
+        (mismatches = count_mismatches(f, t->test_funct, t, vals)) > 0)
+        printf("  (differs from tests.c on %ld of %ld)", mismatches,
+               num_inputs);
+    printf("\n");
+}
+
+/*
+ * run_benchmarks - Time every version of each function
+ */
+static void run_benchmarks(void) {
+    long *vals[3];
+    funct_t builtin;
+    int i, j;
+
+    for (j = 0; j < 3; j++) {
+        vals[j] = malloc(num_inputs * sizeof(long));
+        if (vals[j] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    printf("%-16s%-10s%10s%12s\n", "Function", "Version", "Throughput",
+           "Latency");
+    printf("%-16s%-10s%10s%12s\n", "", "", "(ns/call)", "(ns/call)");
+
+    for (i = 0; test_set[i].solution_funct; i++) {
+        test_ptr t = &test_set[i];
+        if (bench_fname && strcmp(t->name, bench_fname) != 0)
+            continue;
+
+        for (j = 0; j < t->args; j++)
+            gen_inputs(vals[j], t->arg_ranges[j][0], t->arg_ranges[j][1],
+                       is_float(t));
+
+        bench_version(t, t->name, "bits.c", t->solution_funct, vals);
+        bench_version(t, "", "tests.c", t->test_funct, vals);
+        if ((builtin = find_builtin(t->name)) != NULL)
+            bench_version(t, "", "builtin", builtin, vals);
+        fflush(stdout);
+    }
+
+    for (j = 0; j < 3; j++)
+        free(vals[j]);
+}
+
+/*
+ * usage - Display usage info
+ */
+static void usage(char *cmd) {
+    printf("Usage: %s [-h] [-f <name>] [-n <inputs>] [-r <runs>]\n", cmd);
+    printf("  -f <name>   Time only the named function\n");
+    printf("  -h          Print this message\n");
+    printf("  -n <inputs> Time each version over <inputs> arguments "
+           "(default %d)\n",
+           NUM_INPUTS);
+    printf("  -r <runs>   Report the fastest of <runs> runs (default %d)\n",
+           NUM_RUNS);
+    exit(1);
+}
+
+/**************
+ * Main routine
+ **************/
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    /* parse command line args */
+    while ((c = getopt(argc, argv, "hf:n:r:")) != -1)
+        switch (c) {
+        case 'f': /* time only one function */
+            bench_fname = strdup(optarg);
+            break;
+        case 'n': /* number of arguments */
+            num_inputs = atol(optarg);
+            if (num_inputs < 1)
+                usage(argv[0]);
+            break;
+        case 'r': /* number of runs */
+            num_runs = atoi(optarg);
+            if (num_runs < 1)
+                usage(argv[0]);
+            break;
+        case 'h': /* help */
+        default:
+            usage(argv[0]);
+        }
+
+    run_benchmarks();
+    return 0;
+}
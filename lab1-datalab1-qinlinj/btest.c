@@ -11,6 +11,9 @@
  * around zero and tmin and tmax for integer puzzles, and zero, norm,
  * and denorm boundaries for floating point puzzles.
  *
+ * With -x, floating point puzzles are instead checked on all 2^32
+ * inputs, in batches spread over one thread per processor.
+ *
  */
 
 #define _XOPEN_SOURCE 700
@@ -19,6 +22,7 @@
 
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -37,6 +41,10 @@ float strtof(const char *nptr, char **endptr);
    seconds */
 #define TIMEOUT_LIMIT 10
 
+/* The upper limit for a floating point puzzle checked on all its inputs
+   (-x), which takes a few minutes of CPU time */
+#define EXHAUSTIVE_TIMEOUT_LIMIT 300
+
 /* For functions with a single argument, generate TEST_RANGE values
    above and below the min and max test values, and above and below
    zero. Functions with two or three args will use square and cube
@@ -49,6 +57,14 @@ float strtof(const char *nptr, char **endptr);
    TEST_RANGE, thus MAX_TEST_VALS must be at least k*TEST_RANGE */
 #define MAX_TEST_VALS 13 * TEST_RANGE
 
+/* For exhaustive checks (-x), the number of inputs a thread takes at a
+   time, and the largest number of threads */
+#define EXHAUSTIVE_BATCH 4096
+#define MAX_THREADS 256
+
+/* One more than the largest input of a floating point puzzle */
+#define NUM_FLOAT_INPUTS (1UL << 32)
+
 /**********************************
  * Globals defined in other modules
  **********************************/
@@ -66,6 +82,7 @@ static int grade = 0;
 
 /* Time out after this number of seconds */
 static int timeout_limit = TIMEOUT_LIMIT; /* -T */
+static int has_timeout_limit = 0;
 
 /* If non-NULL, test only one function (-f) */
 static char *test_fname = NULL;
@@ -77,6 +94,26 @@ static unsigned long argval[3] = {0, 0, 0};
 /* Use fixed weight for rating, and if so, what should it  be? (-r) */
 static int global_rating = 0;
 
+/* Check floating point puzzles on every input (-x) */
+static int exhaustive = 0;
+
+/*****************************************************
+ * Globals shared by the threads of an exhaustive check
+ *****************************************************/
+
+/* Floating point puzzles take and return 32-bit values */
+typedef unsigned (*functf_t)(unsigned);
+
+/* The solution and the reference being compared */
+static functf_t exhaustive_funct;
+static functf_t exhaustive_test_funct;
+
+/* The first input of the next batch to hand out */
+static unsigned long next_input;
+
+/* The smallest input found to fail, or NUM_FLOAT_INPUTS if none */
+static unsigned long first_error;
+
 /******************
  * Helper functions
  ******************/
@@ -292,6 +329,114 @@ static int test_3_arg(funct_t f, funct_t ft, long arg1, long arg2, long arg3,
     return error;
 }
 
+/*
+ * record_error - Lower first_error to input, if that is smaller
+ */
+static void record_error(unsigned long input) {
+    unsigned long old = __atomic_load_n(&first_error, __ATOMIC_RELAXED);
+    while (input < old &&
+           !__atomic_compare_exchange_n(&first_error, &old, input, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * check_batches - Thread routine of an exhaustive check. Takes batches
+ *                 of inputs in increasing order and compares the solution
+ *                 with the reference on them, until the inputs run out or
+ *                 pass the smallest failing input found so far.
+ */
+static void *check_batches(void *arg) {
+    unsigned results[EXHAUSTIVE_BATCH];
+    unsigned expected[EXHAUSTIVE_BATCH];
+    unsigned long base, count, i;
+
+    /* Let a timeout stop the thread even in an infinite loop */
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+    for (;;) {
+        base = __atomic_fetch_add(&next_input, EXHAUSTIVE_BATCH,
+                                  __ATOMIC_RELAXED);
+        if (base >= __atomic_load_n(&first_error, __ATOMIC_RELAXED))
+            return NULL;
+        count = NUM_FLOAT_INPUTS - base;
+        if (count > EXHAUSTIVE_BATCH)
+            count = EXHAUSTIVE_BATCH;
+
+        for (i = 0; i < count; i++)
+            results[i] = exhaustive_funct((unsigned)(base + i));
+        for (i = 0; i < count; i++)
+            expected[i] = exhaustive_test_funct((unsigned)(base + i));
+        for (i = 0; i < count; i++) {
+            if (results[i] != expected[i]) {
+                record_error(base + i);
+                return NULL;
+            }
+        }
+    }
+}
+
+/*
+ * test_exhaustive - Test a floating point function on every input.
+ *                   Return number of errors
+ */
+static int test_exhaustive(test_ptr t) {
+    static pthread_t threads[MAX_THREADS];
+    static long num_threads;
+    sigset_t alarm_mask, prev_mask;
+    long i;
+    int rc;
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    exhaustive_funct = (functf_t)t->solution_funct;
+    exhaustive_test_funct = (functf_t)t->test_funct;
+    next_input = 0;
+    first_error = NUM_FLOAT_INPUTS;
+
+    /* Only this thread takes the timeout signal */
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm_mask, &prev_mask);
+    for (i = 0; i < num_threads; i++) {
+        if ((rc = pthread_create(&threads[i], NULL, check_batches, NULL))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+
+    /* Handle timeouts in the test code */
+    if (timeout_limit > 0) {
+        rc = sigsetjmp(envbuf, 1);
+        if (rc) {
+            /* control will reach here if there is a timeout */
+            for (i = 0; i < num_threads; i++)
+                pthread_cancel(threads[i]);
+            for (i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+            printf("ERROR: Test %s failed.\n"
+                   "  Timed out after %d secs (probably infinite loop)\n",
+                   t->name, timeout_limit);
+            return 1;
+        }
+        alarm(timeout_limit);
+    }
+
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    /* Report the smallest failing input as the other tests would */
+    if (first_error < NUM_FLOAT_INPUTS)
+        return test_1_arg(t->solution_funct, t->test_funct,
+                          (long)first_error, t->name);
+    return 0;
+}
+
 /*
  * test_function - Test a function.  Return number of errors
  */
@@ -319,6 +464,11 @@ static int test_function(test_ptr t) {
         exit(1);
     }
 
+    /* Check floating point puzzles exhaustively, if asked to */
+    if (exhaustive && args == 1 && !has_arg[0] && t->arg_ranges[0][0] == 1 &&
+        t->arg_ranges[0][1] == 1)
+        return test_exhaustive(t);
+
     /* Assign range of argument test vals so as to conserve the total
        number of tests, independent of the number of arguments */
     if (args == 1) {
@@ -503,7 +653,7 @@ static int get_num_val(char *sval, unsigned long *valp) {
  * usage - Display usage info
  */
 static void usage(char *cmd) {
-    printf("Usage: %s [-hg] [-r <n>] [-f <name> [-1|-2|-3 <val>]*] [-T <time "
+    printf("Usage: %s [-hgx] [-r <n>] [-f <name> [-1|-2|-3 <val>]*] [-T <time "
            "limit>]\n",
            cmd);
     printf("  -1 <val>  Specify first function argument\n");
@@ -514,6 +664,9 @@ static void usage(char *cmd) {
     printf("  -h        Print this message\n");
     printf("  -r <n>    Give uniform weight of n for all problems\n");
     printf("  -T <lim>  Set timeout limit to lim\n");
+    printf("  -x        Check floating point puzzles on all inputs "
+           "(default limit %ds)\n",
+           EXHAUSTIVE_TIMEOUT_LIMIT);
     exit(1);
 }
 
@@ -525,7 +678,7 @@ int main(int argc, char *argv[]) {
     char c;
 
     /* parse command line args */
-    while ((c = getopt(argc, argv, "hgf:r:T:1:2:3:")) != -1)
+    while ((c = getopt(argc, argv, "hgxf:r:T:1:2:3:")) != -1)
         switch (c) {
         case 'h': /* help */
             usage(argv[0]);
@@ -533,6 +686,9 @@ int main(int argc, char *argv[]) {
         case 'g': /* grading option for autograder */
             grade = 1;
             break;
+        case 'x': /* check floating point puzzles exhaustively */
+            exhaustive = 1;
+            break;
         case 'f': /* test only one function */
             test_fname = strdup(optarg);
             break;
@@ -564,11 +720,15 @@ int main(int argc, char *argv[]) {
             break;
         case 'T': /* Set timeout limit */
             timeout_limit = atoi(optarg);
+            has_timeout_limit = 1;
             break;
         default:
             usage(argv[0]);
         }
 
+    if (exhaustive && !has_timeout_limit) {
+        timeout_limit = EXHAUSTIVE_TIMEOUT_LIMIT;
+    }
     if (timeout_limit > 0) {
         Signal(SIGALRM, timeout_handler);
     }
@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+
+"""Gadget finder for the farm of rtarget.
+
+The finder reads the bytes of the gadget farm once, from start_farm to
+end_farm, and indexes every gadget in them.
+
+* A gadget is a run of bytes that decodes, from some address, as
+  instructions of the kinds the attack lab uses (movq, movl and popq
+  between registers, the lea of add_xy, and the functional nops), up to
+  a ret (c3).
+* The index maps each sequence of instructions, leaving out the nops, to
+  the addresses of the gadgets that perform it, so a query is a lookup.
+* The farm is read from the symbols and sections of rtarget itself, or
+  with -d from its disassembly, such as target173/rtarget.txt.
+
+Without arguments, it lists every gadget. Given instructions, such as
+"movq %rsp,%rax" or "popq %rax; movl %eax,%edx", it prints the gadgets
+that perform them. With -c, it turns a file of instructions and .quad
+values, like task2.s, into an exploit string for hex2raw.
+
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+# Registers in the order of their encoding
+REGS64 = ['%rax', '%rcx', '%rdx', '%rbx', '%rsp', '%rbp', '%rsi', '%rdi']
+REGS32 = ['%eax', '%ecx', '%edx', '%ebx', '%esp', '%ebp', '%esi', '%edi']
+REGS8 = ['%al', '%cl', '%dl', '%bl']
+
+# Opcodes of the two-byte functional nops, which operate on one 8-bit
+# register and leave the others unchanged
+NOP_OPS = {0x20: 'andb', 0x08: 'orb', 0x38: 'cmpb', 0x84: 'testb'}
+
+# The lea of add_xy
+LEA_XY = bytes([0x48, 0x8d, 0x04, 0x37])
+
+RET = 0xc3
+
+
+def decode(code, i):
+    """Returns (length, text, is_nop) for the instruction at code[i], or
+    None if it is not one the gadgets use."""
+
+    op = code[i]
+    arg = code[i + 1] if i + 1 < len(code) else None
+    if op == RET:
+        return 1, 'ret', False
+    if op == 0x90:
+        return 1, 'nop', True
+    if 0x58 <= op <= 0x5f:
+        return 1, 'popq ' + REGS64[op - 0x58], False
+    if op == 0x48 and arg == 0x89 and i + 2 < len(code) \
+            and code[i + 2] >= 0xc0:
+        modrm = code[i + 2]
+        return 3, 'movq %s,%s' % (REGS64[(modrm >> 3) & 7],
+                                  REGS64[modrm & 7]), False
+    if op == 0x89 and arg is not None and arg >= 0xc0:
+        return 2, 'movl %s,%s' % (REGS32[(arg >> 3) & 7],
+                                  REGS32[arg & 7]), False
+    if op in NOP_OPS and arg in (0xc0, 0xc9, 0xd2, 0xdb):
+        reg = REGS8[arg & 3]
+        return 2, '%s %s,%s' % (NOP_OPS[op], reg, reg), True
+    if code[i:i + len(LEA_XY)] == LEA_XY:
+        return len(LEA_XY), 'lea (%rdi,%rsi,1),%rax', False
+    return None
+
+
+def build_index(start, code):
+    """Returns a dict from each tuple of instructions to the list of
+    (address, bytes) of the gadgets that perform it, in address order."""
+
+    index = {}
+    for i in range(len(code)):
+        insns = []
+        j = i
+        while j < len(code):
+            decoded = decode(code, j)
+            if decoded is None:
+                break
+            length, text, is_nop = decoded
+            if text == 'ret':
+                if insns:
+                    index.setdefault(tuple(insns), []).append(
+                        (start + i, code[i:j + 1]))
+                break
+            if not is_nop:
+                insns.append(text)
+            j += length
+    return index
+
+
+def read_farm_elf(path):
+    """Returns the address and the bytes of the farm of an ELF binary."""
+
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF' or data[4] != 2:
+        raise ValueError("%s is not a 64-bit ELF file" % path)
+
+    # Section headers: name, type, flags, addr, offset, size, link, ...
+    shoff, = struct.unpack_from('<Q', data, 0x28)
+    shentsize, shnum = struct.unpack_from('<HH', data, 0x3a)
+    sections = [struct.unpack_from('<IIQQQQIIQQ', data, shoff + i * shentsize)
+                for i in range(shnum)]
+
+    # Look the farm up in the symbol table
+    symbols = {}
+    for symtab in (s for s in sections if s[1] == 2):  # SHT_SYMTAB
+        strtab = sections[symtab[6]][4]
+        for off in range(symtab[4], symtab[4] + symtab[5], 24):
+            name, = struct.unpack_from('<I', data, off)
+            value, = struct.unpack_from('<Q', data, off + 8)
+            end = data.index(b'\0', strtab + name)
+            symbols[data[strtab + name:end].decode()] = value
+    if 'start_farm' not in symbols or 'end_farm' not in symbols:
+        raise ValueError("%s has no start_farm and end_farm symbols" % path)
+    start, end = symbols['start_farm'], symbols['end_farm']
+
+    # Find the farm's bytes in the file
+    for s in sections:
+        if s[1] != 8 and s[3] <= start and end <= s[3] + s[5]:  # !NOBITS
+            offset = s[4] + start - s[3]
+            return start, data[offset:offset + end - start]
+    raise ValueError("%s has no section holding the farm" % path)
+
+
+def read_farm_disassembly(path):
+    """Returns the address and the bytes of the farm of an objdump -d
+    disassembly."""
+
+    code = {}
+    in_farm = False
+    with open(path) as f:
+        for line in f:
+            if line.rstrip().endswith('<start_farm>:'):
+                in_farm = True
+            elif line.rstrip().endswith('<end_farm>:'):
+                break
+            elif in_farm:
+                result = re.match(r'\s*([0-9a-f]+):\t([0-9a-f ]+)', line)
+                if result:
+                    address = int(result.group(1), 16)
+                    for k, byte in enumerate(result.group(2).split()):
+                        code[address + k] = int(byte, 16)
+    if not code:
+        raise ValueError("%s has no disassembly of start_farm" % path)
+    start = min(code)
+    return start, bytes(code.get(a, 0) for a in range(start, max(code) + 1))
+
+
+def normalize(text):
+    """Returns an instruction in the form the index uses."""
+
+    text = re.sub(r'\s*,\s*', ',', text.strip().lower())
+    return re.sub(r'\s+', ' ', text)
+
+
+def parse_query(query):
+    """Returns the tuple of instructions of a query, separated by ';'."""
+
+    return tuple(normalize(insn) for insn in query.split(';')
+                 if insn.strip() and normalize(insn) != 'ret')
+
+
+def format_gadget(address, code, insns):
+    """Returns a line describing a gadget."""
+
+    return "0x%x  %-24s %s" % (address, ' '.join('%02x' % b for b in code),
+                               '; '.join(insns))
+
+
+def quad_line(value, comment):
+    """Returns a line of hex2raw input for a 64-bit little-endian value."""
+
+    return "%s /* %s */" % (' '.join('%02x' % b
+                                     for b in struct.pack('<Q', value)),
+                            comment)
+
+
+def build_chain(path, index):
+    """Returns the hex2raw lines of the chain in a file, or None if an
+    instruction has no gadget."""
+
+    lines = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = re.sub(r'(#|//).*', '', line).strip()
+            if not line or line.endswith(':'):
+                continue
+            if line.startswith('.'):
+                result = re.match(r'\.quad\s+(\S+)$', line)
+                if result:
+                    value = int(result.group(1), 0) & (2 ** 64 - 1)
+                    lines.append(quad_line(value, result.group(1)))
+                continue
+            insns = parse_query(line)
+            if not insns:
+                continue
+            if insns not in index:
+                print("Error: %s:%d: no gadget for '%s'"
+                      % (path, number, '; '.join(insns)))
+                return None
+            address, code = index[insns][0]
+            lines.append(quad_line(address, "0x%x: %s"
+                                   % (address, '; '.join(insns))))
+    return lines
+
+
+def main():
+
+    # Parse the command line arguments
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = argparse.ArgumentParser(
+        description="Find the gadgets in the farm of rtarget")
+    p.add_argument("-t", dest="target",
+                   default=os.path.join(here, "target173", "rtarget"),
+                   help="rtarget binary to read the farm from "
+                        "(default: target173/rtarget)")
+    p.add_argument("-d", dest="disassembly",
+                   help="read the farm from an objdump -d disassembly "
+                        "instead, such as target173/rtarget.txt")
+    p.add_argument("-c", dest="chain",
+                   help="file of instructions and .quad values to turn "
+                        "into hex2raw input")
+    p.add_argument("queries", nargs="*",
+                   help="instructions to find, separated by ';' "
+                        "(default: list every gadget)")
+    args = p.parse_args()
+
+    try:
+        if args.disassembly:
+            start, code = read_farm_disassembly(args.disassembly)
+        else:
+            start, code = read_farm_elf(args.target)
+    except (OSError, ValueError) as e:
+        print("Error: %s" % e)
+        sys.exit(1)
+    index = build_index(start, code)
+
+    if args.chain:
+        lines = build_chain(args.chain, index)
+        if lines is None:
+            sys.exit(1)
+        print('\n'.join(lines))
+        return
+
+    if not args.queries:
+        gadgets = sorted((address, code, insns)
+                         for insns, found in index.items()
+                         for address, code in found)
+        for address, code, insns in gadgets:
+            print(format_gadget(address, code, insns))
+        return
+
+    missing = False
+    for query in args.queries:
+        insns = parse_query(query)
+        if insns not in index:
+            print("%s: not found" % '; '.join(insns))
+            missing = True
+        for address, code in index.get(insns, []):
+            print(format_gadget(address, code, insns))
+    if missing:
+        sys.exit(1)
+
+
+# execute main only if called as a script
+if __name__ == "__main__":
+    main()
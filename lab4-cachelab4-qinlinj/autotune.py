@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+
+"""Autotuner for the transpose functions.
+
+The tuner searches over blocked transpose kernels like transpose_32x32() and
+transpose_1024x1024(), varying the shape of the blocks and how they handle
+the diagonal, and prints the best one as a function to paste into trans.c.
+
+* It writes every candidate into one trans.c in a scratch copy of this
+  directory, and builds it there.
+* By default, it traces each candidate with ./tracegen-ct and simulates the
+  trace with ./csim-ref, for the cache the grader uses or any other, and
+  ranks the candidates by clock cycles as test-trans computes them.
+* With --native, it ranks them instead by the time ./test-trans -b measures
+  on this machine.
+
+"""
+
+import argparse
+import itertools
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import textwrap
+
+# Cost of hits and misses, as in cachelab.h
+HIT_CYCLES = 4
+MISS_CYCLES = 100
+
+# Size of the tmp array, as in cachelab.h
+TMPCOUNT = 256
+
+# Maximum number of functions test-trans and tracegen-ct can register
+MAX_TRANS_FUNCS = 100
+
+# Ways of handling the diagonal of a block, and the loop body for each row i
+# of a block. The body transposes columns [jj, col_end) of row i.
+strategies = {
+    'none': (
+        "moves each element directly",
+        """\
+            for (size_t j = jj; j < col_end; ++j) {
+                B[j][i] = A[i][j];
+            }
+"""),
+    'defer': (
+        "leaves the diagonal element of each row to the end of the row, "
+        "as transpose_32x32 does",
+        """\
+            bool diagonal = false;
+            for (size_t j = jj; j < col_end; ++j) {
+                if (i != j) {
+                    B[j][i] = A[i][j];
+                } else {
+                    diagonal = true;
+                }
+            }
+            if (diagonal) {
+                B[i][i] = A[i][i];
+            }
+"""),
+    'tmp': (
+        "holds the diagonal element of each row in tmp until the end of the "
+        "row, as transpose_1024x1024 does",
+        """\
+            bool diagonal = false;
+            for (size_t j = jj; j < col_end; ++j) {
+                if (i != j) {
+                    B[j][i] = A[i][j];
+                } else {
+                    tmp[0] = A[i][j];
+                    diagonal = true;
+                }
+            }
+            if (diagonal) {
+                B[i][i] = tmp[0];
+            }
+"""),
+    'row': (
+        "copies each row of a block into tmp before writing it to B",
+        """\
+            for (size_t j = jj; j < col_end; ++j) {
+                tmp[j - jj] = A[i][j];
+            }
+            for (size_t j = jj; j < col_end; ++j) {
+                B[j][i] = tmp[j - jj];
+            }
+"""),
+}
+
+# The parameters of the cache used by test-trans, with or without -l
+caches = {
+    'test': (5, 1, 6),
+    'haswell': (6, 8, 6),
+}
+
+
+def kernel_source(name, rows, cols, strategy, comment):
+    """Returns the C source of a blocked transpose function."""
+
+    comment = textwrap.fill(
+        "%s It transposes the matrix in blocks of %dx%d, and %s."
+        % (comment, rows, cols, strategies[strategy][0]),
+        width=80, initial_indent=' * ', subsequent_indent=' * ')
+    return """\
+/**
+{comment}
+ */
+static void {name}(size_t M, size_t N, double A[N][M], double B[M][N],
+{pad}double tmp[TMPCOUNT]) {{
+    const size_t BLOCK_ROWS = {rows};
+    const size_t BLOCK_COLS = {cols};
+
+    for (size_t ii = 0; ii < N; ii += BLOCK_ROWS) {{
+        size_t row_end = MIN(ii + BLOCK_ROWS, N);
+        for (size_t jj = 0; jj < M; jj += BLOCK_COLS) {{
+            size_t col_end = MIN(jj + BLOCK_COLS, M);
+            for (size_t i = ii; i < row_end; ++i) {{
+{body}\
+            }}
+        }}
+    }}
+}}
+""".format(comment=comment, rows=rows, cols=cols, name=name,
+           pad=' ' * (len(name) + 13),
+           body=''.join('    ' + line + '\n' if line else '\n'
+                        for line in strategies[strategy][1].splitlines()))
+
+
+def candidates_source(candidates):
+    """Returns a trans.c that registers one function per candidate."""
+
+    parts = ["""\
+/**
+ * @file trans.c
+ * @brief Candidate transpose functions generated by autotune.py
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#include "cachelab.h"
+"""]
+    for i, (rows, cols, strategy) in enumerate(candidates):
+        parts.append(kernel_source("candidate_%d" % i, rows, cols, strategy,
+                                   "Candidate %d." % i))
+    parts.append("void registerFunctions(void) {\n")
+    for i, (rows, cols, strategy) in enumerate(candidates):
+        parts.append('    registerTransFunction(candidate_%d, "%dx%d %s");\n'
+                     % (i, rows, cols, strategy))
+    parts.append("}\n")
+    return '\n'.join(parts)
+
+
+def run(cmd, cwd, env=None, timeout=600):
+    """Runs a command, and returns its output, or None if it failed."""
+
+    try:
+        p = subprocess.run(cmd, cwd=cwd, env=env, timeout=timeout,
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           encoding='utf-8')
+    except subprocess.TimeoutExpired:
+        print("Error: %s timed out." % " ".join(cmd))
+        return None
+    except OSError as e:
+        print("Error: " + e.strerror)
+        return None
+
+    if p.returncode != 0:
+        print("Error: %s failed (status %d):" % (" ".join(cmd), p.returncode))
+        print(p.stdout.rstrip())
+        return None
+    return p.stdout
+
+
+def simulate(workdir, args, count):
+    """Returns the clock cycles of each candidate, or None if it failed."""
+
+    if run(["make", "tracegen-ct"], workdir) is None:
+        return None
+
+    s, E, b = args.cache
+    env = dict(os.environ, CONTECH_TRACE="trace.tune")
+    costs = []
+    for i in range(count):
+        if run(["./tracegen-ct", "-M", str(args.M), "-N", str(args.N),
+                "-F", str(i)], workdir, env) is None:
+            costs.append(None)
+            continue
+        out = run(["./csim-ref", "-s", str(s), "-E", str(E), "-b", str(b),
+                   "-t", "trace.tune"], workdir)
+        result = out and re.search(r'hits:(\d+) misses:(\d+)', out)
+        if not result:
+            costs.append(None)
+            continue
+        hits, misses = int(result.group(1)), int(result.group(2))
+        costs.append(HIT_CYCLES * hits + MISS_CYCLES * misses)
+        print("  candidate %2d: %12d cycles" % (i, costs[-1]))
+    return costs
+
+
+def benchmark(workdir, args, count):
+    """Returns the ns per element of each candidate, or None if it failed."""
+
+    if run(["make", "test-trans"], workdir) is None:
+        return None
+
+    # Without tracegen-ct, test-trans skips the simulation of each candidate,
+    # and only times it.
+    out = run(["./test-trans", "-b", "-r", str(args.runs),
+               "-M", str(args.M), "-N", str(args.N)], workdir, timeout=None)
+    if out is None:
+        return None
+
+    costs = [None] * count
+    for line in out.splitlines():
+        result = re.match(r'\s*(\d+)\s+([\d.]+)\s', line)
+        if result and int(result.group(1)) < count:
+            costs[int(result.group(1))] = float(result.group(2))
+    for i, cost in enumerate(costs):
+        if cost is not None:
+            print("  candidate %2d: %12.3f ns/elem" % (i, cost))
+    return costs
+
+
+def main():
+
+    # Parse the command line arguments
+    p = argparse.ArgumentParser(
+        description="Search for the best blocked transpose function")
+    p.add_argument("-M", type=int, required=True,
+                   help="width of A, height of B")
+    p.add_argument("-N", type=int, required=True,
+                   help="height of A, width of B")
+    p.add_argument("-c", dest="cache", default="test",
+                   help="cache as s:E:b, or 'test' or 'haswell' for the "
+                        "caches of test-trans without and with -l "
+                        "(default: test)")
+    p.add_argument("--blocks", default="4,8,16,32",
+                   help="block sides to try for rows and columns "
+                        "(default: 4,8,16,32)")
+    p.add_argument("--strategies", default=",".join(strategies),
+                   help="diagonal strategies to try (default: all of %s)"
+                        % ", ".join(strategies))
+    p.add_argument("--native", action="store_true",
+                   help="rank by native time rather than simulated cycles")
+    p.add_argument("-r", dest="runs", type=int, default=5,
+                   help="timed runs of each candidate with --native")
+    p.add_argument("-o", dest="output",
+                   help="file to write the best function to "
+                        "(default: standard output)")
+    args = p.parse_args()
+
+    if args.cache in caches:
+        args.cache = caches[args.cache]
+    else:
+        try:
+            args.cache = tuple(int(x) for x in args.cache.split(':'))
+        except ValueError:
+            args.cache = ()
+        if len(args.cache) != 3:
+            p.error("the cache must be given as s:E:b")
+
+    blocks = [int(x) for x in args.blocks.split(',')]
+    chosen = args.strategies.split(',')
+    for strategy in chosen:
+        if strategy not in strategies:
+            p.error("unknown strategy '%s'" % strategy)
+    candidates = [(rows, cols, strategy)
+                  for rows, cols in itertools.product(blocks, blocks)
+                  for strategy in chosen
+                  if strategy != 'row' or cols <= TMPCOUNT]
+    if len(candidates) > MAX_TRANS_FUNCS:
+        p.error("%d candidates, but at most %d functions can be registered"
+                % (len(candidates), MAX_TRANS_FUNCS))
+
+    # Build the candidates in a scratch copy of this directory
+    here = os.path.dirname(os.path.abspath(__file__))
+    scratch = tempfile.mkdtemp(prefix="autotune.")
+    try:
+        workdir = os.path.join(scratch, "lab")
+        shutil.copytree(here, workdir, symlinks=True,
+                        ignore=shutil.ignore_patterns(
+                            "*.o", "*.bc", "*.ll", "trace.*"))
+        with open(os.path.join(workdir, "trans.c"), "w") as f:
+            f.write(candidates_source(candidates))
+
+        print("Evaluating %d candidates for M=%d, N=%d"
+              % (len(candidates), args.M, args.N))
+        if args.native:
+            costs = benchmark(workdir, args, len(candidates))
+            unit = "ns/elem"
+        else:
+            costs = simulate(workdir, args, len(candidates))
+            unit = "cycles with s=%d, E=%d, b=%d" % args.cache
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+
+    if not costs or all(cost is None for cost in costs):
+        print("Error: No candidate could be evaluated")
+        sys.exit(1)
+
+    best = min((cost, i) for i, cost in enumerate(costs) if cost is not None)
+    rows, cols, strategy = candidates[best[1]]
+    print("Best: %dx%d blocks, '%s' diagonal, %s %s"
+          % (rows, cols, strategy, best[0], unit))
+
+    comment = ("Transposes a %dx%d matrix, as tuned by autotune.py (%s %s)."
+               % (args.M, args.N, best[0], unit))
+    source = kernel_source("transpose_tuned", rows, cols, strategy, comment)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(source)
+    else:
+        print()
+        print(source, end='')
+
+
+# execute main only if called as a script
+if __name__ == "__main__":
+    main()
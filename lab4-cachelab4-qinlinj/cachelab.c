@@ -2,12 +2,18 @@
  * @file cachelab.c
  * @brief Cache Lab helper functions
  */
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "cachelab.h"
 
@@ -67,6 +73,154 @@ bool loadSummary(csim_stats_t *stats) {
     return true;
 }
 
+/**
+ * @brief Parse one line of a text trace, in the form " %c %lx,%d".
+ *
+ * @param[in]  p      The start of the line
+ * @param[in]  end    The end of the trace
+ * @param[out] access The access on the line
+ *
+ * @return The start of the next line, or NULL if the line can't be parsed
+ */
+static const char *parseTraceLine(const char *p, const char *end,
+                                  trace_access_t *access) {
+    const char *digits;
+    unsigned long value;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p == end || *p == '\n' || *p == '\r')
+        return NULL;
+    access->operation = *p++;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+    for (digits = p, value = 0; p < end; p++) {
+        unsigned int d = (unsigned int)(unsigned char)*p - '0';
+        if (d > 9) {
+            /* Setting bit 5 makes an upper case letter lower case */
+            d = ((unsigned int)(unsigned char)*p | 0x20) - 'a';
+            if (d > 5)
+                break;
+            d += 10;
+        }
+        value = value << 4 | d;
+    }
+    if (p == digits || p == end || *p != ',')
+        return NULL;
+    access->address = value;
+    p++;
+
+    for (digits = p, value = 0;
+         p < end && (unsigned int)(unsigned char)*p - '0' <= 9; p++)
+        value = value * 10 + ((unsigned long)(unsigned char)*p - '0');
+    if (p == digits)
+        return NULL;
+    access->size = value;
+
+    p = memchr(p, '\n', (size_t)(end - p));
+    return p ? p + 1 : end;
+}
+
+/**
+ * @brief Read a text or binary trace, calling fn on each access in turn.
+ *
+ * The trace is mapped into memory if it is a regular file, and read into a
+ * buffer otherwise. A binary trace is recognized by BINARY_TRACE_MAGIC.
+ *
+ * @param[in] trace The name of the trace file
+ * @param[in] fn    The function to call on each access
+ * @param[in] arg   Passed to fn
+ *
+ * @return True if the whole trace was read, false otherwise
+ */
+bool readTrace(const char *trace,
+               void (*fn)(const trace_access_t *access, void *arg), void *arg) {
+    int fd = open(trace, O_RDONLY);
+    struct stat st;
+    char *data = NULL;
+    size_t len = 0;
+    bool mapped = false;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error opening '%s': %s\n", trace, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        len = (size_t)st.st_size;
+        data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        else {
+            posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+            mapped = true;
+        }
+    }
+    if (!mapped) {
+        size_t cap = 1 << 16;
+        ssize_t n = 0;
+        len = 0;
+        data = malloc(cap);
+        while (data && (n = read(fd, data + len, cap - len)) > 0) {
+            len += (size_t)n;
+            if (len == cap) {
+                char *bigger = realloc(data, cap *= 2);
+                if (!bigger)
+                    free(data);
+                data = bigger;
+            }
+        }
+        if (!data || n < 0) {
+            fprintf(stderr, "Error reading '%s': %s\n", trace,
+                    data ? strerror(errno) : "Out of memory");
+            free(data);
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+
+    const char *p = data;
+    const char *end = data + len;
+    bool ok = true;
+    trace_access_t access;
+
+    if (len >= 8 && memcmp(p, BINARY_TRACE_MAGIC, 8) == 0) {
+        /* A whole number of records follows the magic number */
+        ok = (len - 8) % sizeof(uint64_t) == 0;
+        for (p += 8; ok && p < end; p += sizeof(uint64_t)) {
+            uint64_t record;
+            memcpy(&record, p, sizeof(record));
+            unsigned int op = (record >> BINARY_TRACE_OP_SHIFT) & 3;
+            if (op > 2) {
+                ok = false;
+                break;
+            }
+            access.address = (unsigned long)(record >> BINARY_TRACE_ADDR_SHIFT);
+            access.operation = BINARY_TRACE_OPS[op];
+            access.size = (unsigned long)(record & BINARY_TRACE_MAX_SIZE);
+            fn(&access, arg);
+        }
+    } else {
+        while (p < end && (p = parseTraceLine(p, end, &access)) != NULL)
+            fn(&access, arg);
+        ok = p != NULL;
+    }
+    if (!ok)
+        fprintf(stderr, "Error parsing trace file\n");
+
+    if (mapped)
+        munmap(data, len);
+    else
+        free(data);
+    return ok;
+}
+
 /**
  * @brief Initialize the given matrices
  */
@@ -114,5 +268,18 @@ void registerTransFunction(void (*trans)(size_t M, size_t N, double[N][M],
                            const char *desc) {
     func_list[func_counter].func_ptr = trans;
     func_list[func_counter].description = desc;
+    func_list[func_counter].native = false;
     func_counter++;
 }
+
+/*
+ * @brief Add the given trans function into the list, to be run natively
+ * rather than traced
+ */
+void registerNativeTransFunction(void (*trans)(size_t M, size_t N,
+                                               double[N][M], double[M][N],
+                                               double *T),
+                                 const char *desc) {
+    registerTransFunction(trans, desc);
+    func_list[func_counter - 1].native = true;
+}
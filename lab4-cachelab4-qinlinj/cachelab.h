@@ -7,6 +7,7 @@
 #define CACHELAB_TOOLS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /**
@@ -22,6 +23,43 @@ typedef struct {
                                       from dirty lines */
 } csim_stats_t;
 
+/*
+ * Binary traces
+ *
+ * A binary trace holds the same accesses as a text trace, without the cost of
+ * parsing them. It is BINARY_TRACE_MAGIC followed by one 64-bit record per
+ * access, in host byte order. The record holds the address in its upper 56
+ * bits, the operation in the 2 bits below, and the size in its lowest 6 bits.
+ */
+
+/** @brief The first 8 bytes of a binary trace */
+#define BINARY_TRACE_MAGIC "CSIMBIN1"
+
+/** @brief Shift of the address in a binary trace record */
+#define BINARY_TRACE_ADDR_SHIFT 8
+
+/** @brief Shift of the operation in a binary trace record */
+#define BINARY_TRACE_OP_SHIFT 6
+
+/** @brief The operations 0 to 2 in a binary trace record stand for */
+#define BINARY_TRACE_OPS "LSM"
+
+/** @brief Largest size a binary trace record can hold */
+#define BINARY_TRACE_MAX_SIZE 63
+
+/**
+ * @brief Struct representing one memory access read from a trace
+ */
+typedef struct {
+    unsigned long address; /* address accessed */
+    unsigned long size;    /* number of bytes accessed */
+    char operation;        /* 'L', 'S' or 'M' */
+} trace_access_t;
+
+/** @brief Read a text or binary trace, calling fn on each access in turn. */
+bool readTrace(const char *trace,
+               void (*fn)(const trace_access_t *access, void *arg), void *arg);
+
 /** @brief Store a summary of the cache simulation statistics. */
 void printSummary(const csim_stats_t *stats);
 
@@ -77,6 +115,7 @@ bool loadSummary(csim_stats_t *stats);
 typedef struct trans_func {
     void (*func_ptr)(size_t M, size_t N, double[N][M], double[M][N], double *);
     const char *description;
+    bool native; /* Run natively only, never traced */
 } trans_func_t;
 
 /* External variables defined in cachelab.c */
@@ -86,6 +125,10 @@ extern int func_counter;
 /* External function defined in trans.c */
 extern void registerFunctions(void);
 
+/* External functions defined in trans-native.c */
+extern void registerNativeFunctions(void);
+extern void firstTouchNative(size_t M, size_t N, double B[M][N]);
+
 /** @brief Fills a matrix with data */
 void initMatrix(size_t M, size_t N, double A[N][M], double B[M][N]);
 
@@ -100,4 +143,10 @@ void registerTransFunction(void (*trans)(size_t M, size_t N, double[N][M],
                                          double[M][N], double *),
                            const char *desc);
 
+/** @brief Adds a transpose function that is checked natively, not traced */
+void registerNativeTransFunction(void (*trans)(size_t M, size_t N,
+                                               double[N][M], double[M][N],
+                                               double *),
+                                 const char *desc);
+
 #endif /* CACHELAB_TOOLS_H */
@@ -0,0 +1,531 @@
+/*
+ * csim-hier.c - A simulator for a hierarchy of caches.
+ *
+ * Where csim models a single write-back LRU cache, this models up to
+ * MAX_LEVELS levels, from L1 down to the last level before memory, each with
+ * its own number of sets, associativity and replacement policy. All levels
+ * share one block size.
+ *
+ * The levels are kept in one of three ways:
+ *   nine       Non-inclusive: a block missed at L1 is brought into every
+ *              level, and a level evicts without regard to the others.
+ *   inclusive  As nine, but a block evicted from a lower level is also
+ *              invalidated in the levels above it.
+ *   exclusive  A block is held by at most one level. A block missed at L1
+ *              is taken from the level holding it, or from memory, and the
+ *              victims of each level move down to the next.
+ *
+ * Dirty blocks are written back to the next level, or to memory from the
+ * last one, and a block written back to a level that doesn't hold it is
+ * allocated there. Each level counts hits and misses of the accesses that
+ * reach it from above, its evictions, the bytes it evicted from dirty lines,
+ * and the bytes in dirty lines at the end.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cachelab.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LEVELS 4 // Maximum number of levels in the hierarchy.
+#define RRPV_MAX 3   // Largest re-reference prediction value, for RRIP.
+
+// The replacement policies.
+typedef enum {
+    POLICY_LRU,    // Least recently used.
+    POLICY_PLRU,   // Tree pseudo-LRU, for a power-of-two associativity.
+    POLICY_RRIP,   // Static re-reference interval prediction, with 2 bits.
+    POLICY_RANDOM, // A pseudo-random line.
+} policy_t;
+
+// How the blocks held by the levels relate.
+typedef enum { MODE_NINE, MODE_INCLUSIVE, MODE_EXCLUSIVE } hier_mode_t;
+
+static const char *const policy_names[] = {"lru", "plru", "rrip", "random"};
+static const char *const mode_names[] = {"nine", "inclusive", "exclusive"};
+
+// A line of a level. The tag is the whole block number, so that the address
+// of an evicted block is known.
+typedef struct {
+    unsigned long block; // The block held, if valid.
+    unsigned long meta;  // LRU stamp or RRIP prediction, by policy.
+    unsigned char valid; // Whether the line holds a block.
+    unsigned char dirty; // Whether the line has been written to.
+} line_t;
+
+// One level of the hierarchy.
+typedef struct {
+    long s;                   // Number of set index bits.
+    long E;                   // Number of lines per set.
+    policy_t policy;          // How a victim is chosen.
+    line_t *lines;            // Line j of set i is lines[i * E + j].
+    uint64_t *set_state;      // Per set: LRU clock, or PLRU tree bits.
+    uint64_t rng;             // State of the random policy.
+    csim_stats_t stats;       // What happened at this level.
+    unsigned long writebacks; // Number of dirty blocks written back into it.
+} level_t;
+
+// The whole hierarchy.
+typedef struct {
+    level_t levels[MAX_LEVELS]; // L1 first.
+    int n;                      // Number of levels.
+    long b;                     // Number of block offset bits.
+    hier_mode_t mode;           // How the levels relate.
+} hier_t;
+
+// A block pushed out of a level.
+typedef struct {
+    unsigned long block; // The block.
+    int valid;           // Whether a block was pushed out at all.
+    int dirty;           // Whether it was dirty.
+} victim_t;
+
+// Parse a level, given as s:E[:policy].
+void parse_level(hier_t *h, const char *spec);
+
+// Find the line holding a block in a level, or return NULL.
+line_t *find_block(level_t *L, unsigned long block);
+
+// Update a level's replacement state for an access to a line.
+void touch_line(level_t *L, line_t *line);
+
+// Put a block into a level, and return what it pushed out.
+victim_t insert_block(level_t *L, unsigned long block, int dirty);
+
+// Handle a block pushed out of a level.
+void evict_block(hier_t *h, int level, victim_t v);
+
+// Write a dirty block back into a level, or memory past the last.
+void write_back(hier_t *h, int level, unsigned long block);
+
+// Simulate one load or store at L1.
+void access_block(hier_t *h, unsigned long block, int write);
+
+// Simulate one access from the trace.
+void access_trace(const trace_access_t *access, void *arg);
+
+// Print the help message.
+void print_usage(void);
+
+int main(int argc, char **argv) {
+    int opt;        // Option character returned by getopt.
+    char *t = NULL; // Trace file name.
+    hier_t h = {0}; // The simulated hierarchy.
+    h.b = -1;
+
+    // Parse command line arguments using getopt.
+    while ((opt = getopt(argc, argv, "b:l:m:t:h")) != -1) {
+        switch (opt) {
+        case 'b': // Number of block size bits.
+            h.b = atoi(optarg);
+            break;
+        case 'l': // One more level, below those given so far.
+            parse_level(&h, optarg);
+            break;
+        case 'm': // How the levels relate.
+            for (h.mode = 0; h.mode < 3; h.mode++) {
+                if (strcmp(optarg, mode_names[h.mode]) == 0) {
+                    break;
+                }
+            }
+            if (h.mode == 3) {
+                fprintf(stderr, "Error: Unknown mode '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't': // Trace file name.
+            t = optarg;
+            break;
+        case 'h': // Display help message.
+        default:
+            print_usage();
+        }
+    }
+
+    // Check if all required command-line arguments have been provided.
+    if (h.b < 0 || h.n == 0 || t == NULL) {
+        fprintf(stderr, "Error: Missing required command line argument\n");
+        exit(1);
+    }
+
+    // Simulate each memory access in the trace file.
+    if (!readTrace(t, access_trace, &h)) {
+        exit(1);
+    }
+
+    // Count the dirty bytes left in each level, and print its statistics.
+    for (int i = 0; i < h.n; i++) {
+        level_t *L = &h.levels[i];
+        unsigned long lines = (1UL << L->s) * (unsigned long)L->E;
+        for (unsigned long j = 0; j < lines; j++) {
+            if (L->lines[j].valid && L->lines[j].dirty) {
+                L->stats.dirty_bytes += 1UL << h.b;
+            }
+        }
+        printf("L%d s:%ld E:%ld %s hits:%lu misses:%lu evictions:%lu "
+               "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu "
+               "writebacks_in:%lu\n",
+               i + 1, L->s, L->E, policy_names[L->policy], L->stats.hits,
+               L->stats.misses, L->stats.evictions, L->stats.dirty_bytes,
+               L->stats.dirty_evictions, L->writebacks);
+        free(L->lines);
+        free(L->set_state);
+    }
+
+    return 0;
+}
+
+// Print the help message.
+void print_usage(void) {
+    printf("Usage: csim-hier -b <block_bits> -l <level> [-l <level>...] "
+           "[-m <mode>] -t <tracefile>\n");
+    printf("Options:\n");
+    printf("  -h          : Print help message.\n");
+    printf("  -b <num>    : Number of block offset bits, for every level.\n");
+    printf("  -l <level>  : A level, as s:E[:policy], L1 first. The policy "
+           "is\n");
+    printf("                lru (the default), plru, rrip or random.\n");
+    printf("  -m <mode>   : nine (the default), inclusive or exclusive.\n");
+    printf("  -t <file>   : Name of the valgrind trace to replay.\n");
+    exit(0);
+}
+
+/**
+ * Parse a level, given as s:E[:policy], and add it below the others.
+ *
+ * @param h The hierarchy.
+ * @param spec The level.
+ */
+void parse_level(hier_t *h, const char *spec) {
+    char name[16] = "lru";
+    level_t *L = &h->levels[h->n];
+
+    if (h->n == MAX_LEVELS) {
+        fprintf(stderr, "Error: At most %d levels\n", MAX_LEVELS);
+        exit(1);
+    }
+    if (sscanf(spec, "%ld:%ld:%15s", &L->s, &L->E, name) < 2 || L->s < 0 ||
+        L->s > 30 || L->E < 1) {
+        fprintf(stderr, "Error: Bad level '%s', expected s:E[:policy]\n",
+                spec);
+        exit(1);
+    }
+    for (L->policy = 0; L->policy < 4; L->policy++) {
+        if (strcmp(name, policy_names[L->policy]) == 0) {
+            break;
+        }
+    }
+    if (L->policy == 4) {
+        fprintf(stderr, "Error: Unknown policy '%s'\n", name);
+        exit(1);
+    }
+    // The tree's nodes are bits 1 to E - 1 of a word.
+    if (L->policy == POLICY_PLRU && (L->E > 64 || (L->E & (L->E - 1)) != 0)) {
+        fprintf(stderr, "Error: plru needs E to be a power of 2, at most 64\n");
+        exit(1);
+    }
+
+    unsigned long S = 1UL << L->s;
+    L->lines = calloc(S * (unsigned long)L->E, sizeof(line_t));
+    L->set_state = calloc(S, sizeof(uint64_t));
+    if (!L->lines || !L->set_state) {
+        fprintf(stderr, "Error: Not enough memory for the cache\n");
+        exit(1);
+    }
+    L->rng = 0x9e3779b97f4a7c15ULL * ((uint64_t)(unsigned)h->n + 1);
+    h->n++;
+}
+
+// The lines of the set a block maps to in a level.
+static inline line_t *set_of(level_t *L, unsigned long block) {
+    return &L->lines[(block & ((1UL << L->s) - 1)) * (unsigned long)L->E];
+}
+
+/**
+ * Find the line holding a block in a level.
+ *
+ * @param L The level.
+ * @param block The block number.
+ * @return The line, or NULL if the level doesn't hold the block.
+ */
+line_t *find_block(level_t *L, unsigned long block) {
+    line_t *set = set_of(L, block);
+
+    for (long j = 0; j < L->E; j++) {
+        if (set[j].valid && set[j].block == block) {
+            return &set[j];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Update a level's replacement state for an access to a line.
+ *
+ * @param L The level.
+ * @param line The line accessed.
+ */
+void touch_line(level_t *L, line_t *line) {
+    unsigned long set = (line->block & ((1UL << L->s) - 1));
+    long way = line - &L->lines[set * (unsigned long)L->E];
+
+    switch (L->policy) {
+    case POLICY_LRU:
+        line->meta = ++L->set_state[set];
+        break;
+    case POLICY_PLRU: {
+        // Point each node on the way down at the half without this line.
+        unsigned int node = 1;
+        for (long lo = 0, n = L->E; n > 1; n /= 2) {
+            if (way < lo + n / 2) {
+                L->set_state[set] |= (uint64_t)1 << node;
+                node = 2 * node;
+            } else {
+                L->set_state[set] &= ~((uint64_t)1 << node);
+                node = 2 * node + 1;
+                lo += n / 2;
+            }
+        }
+        break;
+    }
+    case POLICY_RRIP:
+        // A hit predicts a near re-reference.
+        line->meta = 0;
+        break;
+    case POLICY_RANDOM:
+        break;
+    }
+}
+
+// Choose the line of a full set to replace.
+static line_t *choose_victim(level_t *L, line_t *set, unsigned long index) {
+    switch (L->policy) {
+    case POLICY_LRU: {
+        line_t *oldest = set;
+        for (long j = 1; j < L->E; j++) {
+            if (set[j].meta < oldest->meta) {
+                oldest = &set[j];
+            }
+        }
+        return oldest;
+    }
+    case POLICY_PLRU: {
+        // Follow the nodes to the half each points at.
+        unsigned int node = 1;
+        long lo = 0;
+        for (long n = L->E; n > 1; n /= 2) {
+            if ((L->set_state[index] >> node) & 1) {
+                node = 2 * node + 1;
+                lo += n / 2;
+            } else {
+                node = 2 * node;
+            }
+        }
+        return &set[lo];
+    }
+    case POLICY_RRIP:
+        // Age the set until some line is predicted to be re-referenced in
+        // the distant future.
+        for (;;) {
+            for (long j = 0; j < L->E; j++) {
+                if (set[j].meta == RRPV_MAX) {
+                    return &set[j];
+                }
+            }
+            for (long j = 0; j < L->E; j++) {
+                set[j].meta++;
+            }
+        }
+    case POLICY_RANDOM:
+        break;
+    }
+
+    // xorshift64
+    L->rng ^= L->rng << 13;
+    L->rng ^= L->rng >> 7;
+    L->rng ^= L->rng << 17;
+    return &set[L->rng % (uint64_t)L->E];
+}
+
+/**
+ * Put a block into a level, which must not hold it already.
+ *
+ * @param L The level.
+ * @param block The block number.
+ * @param dirty Whether the block is dirty.
+ * @return The block pushed out to make room, if any.
+ */
+victim_t insert_block(level_t *L, unsigned long block, int dirty) {
+    unsigned long index = block & ((1UL << L->s) - 1);
+    line_t *set = set_of(L, block);
+    line_t *line = NULL;
+    victim_t v = {0, 0, 0};
+
+    // An empty line is used before any is replaced.
+    for (long j = 0; j < L->E && !line; j++) {
+        if (!set[j].valid) {
+            line = &set[j];
+        }
+    }
+    if (!line) {
+        line = choose_victim(L, set, index);
+        v.block = line->block;
+        v.valid = 1;
+        v.dirty = line->dirty;
+    }
+
+    line->block = block;
+    line->valid = 1;
+    line->dirty = (unsigned char)dirty;
+    if (L->policy == POLICY_RRIP) {
+        // A new block is predicted to be re-referenced in the long interval.
+        line->meta = RRPV_MAX - 1;
+    } else {
+        touch_line(L, line);
+    }
+    return v;
+}
+
+/**
+ * Handle a block pushed out of a level.
+ *
+ * An inclusive hierarchy first invalidates the block in the levels above,
+ * which makes it dirty if any of them had written to it.
+ *
+ * @param h The hierarchy.
+ * @param level The level the block left.
+ * @param v The block.
+ */
+void evict_block(hier_t *h, int level, victim_t v) {
+    level_t *L = &h->levels[level];
+
+    if (!v.valid) {
+        return;
+    }
+    L->stats.evictions++;
+
+    if (h->mode == MODE_INCLUSIVE) {
+        for (int i = 0; i < level; i++) {
+            line_t *line = find_block(&h->levels[i], v.block);
+            if (line) {
+                v.dirty |= line->dirty;
+                line->valid = 0;
+            }
+        }
+    }
+    if (v.dirty) {
+        L->stats.dirty_evictions += 1UL << h->b;
+    }
+
+    if (h->mode == MODE_EXCLUSIVE) {
+        // Victims move down, clean or dirty, and leave the last level.
+        if (level + 1 < h->n) {
+            evict_block(h, level + 1,
+                        insert_block(&h->levels[level + 1], v.block, v.dirty));
+        }
+    } else if (v.dirty) {
+        write_back(h, level + 1, v.block);
+    }
+}
+
+/**
+ * Write a dirty block back into a level, allocating it there if need be.
+ *
+ * @param h The hierarchy.
+ * @param level The level, or h->n for memory.
+ * @param block The block number.
+ */
+void write_back(hier_t *h, int level, unsigned long block) {
+    if (level == h->n) {
+        return;
+    }
+
+    level_t *L = &h->levels[level];
+    line_t *line = find_block(L, block);
+    L->writebacks++;
+    if (line) {
+        line->dirty = 1;
+        touch_line(L, line);
+    } else {
+        evict_block(h, level, insert_block(L, block, 1));
+    }
+}
+
+/**
+ * Simulate one load or store of a block at L1.
+ *
+ * @param h The hierarchy.
+ * @param block The block number.
+ * @param write Whether the access is a store.
+ */
+void access_block(hier_t *h, unsigned long block, int write) {
+    level_t *L1 = &h->levels[0];
+    line_t *line = find_block(L1, block);
+
+    if (line) {
+        L1->stats.hits++;
+        touch_line(L1, line);
+        line->dirty |= (unsigned char)write;
+        return;
+    }
+    L1->stats.misses++;
+
+    // Find the first level below that holds the block.
+    int found = 1;
+    int dirty = write;
+    for (; found < h->n; found++) {
+        level_t *L = &h->levels[found];
+        line = find_block(L, block);
+        if (line) {
+            L->stats.hits++;
+            break;
+        }
+        L->stats.misses++;
+    }
+
+    if (h->mode == MODE_EXCLUSIVE) {
+        // Take the block from the level holding it.
+        if (found < h->n) {
+            dirty |= line->dirty;
+            line->valid = 0;
+        }
+    } else {
+        // Bring the block into the levels that missed, the lowest first, so
+        // that an inclusive hierarchy holds it below once it is in L1.
+        if (found < h->n) {
+            touch_line(&h->levels[found], line);
+        }
+        for (int i = found - 1; i > 0; i--) {
+            evict_block(h, i, insert_block(&h->levels[i], block, 0));
+        }
+    }
+    evict_block(h, 0, insert_block(L1, block, dirty));
+}
+
+/**
+ * Simulate one access from the trace. A modify is a load then a store.
+ *
+ * @param access The access.
+ * @param arg The hierarchy.
+ */
+void access_trace(const trace_access_t *access, void *arg) {
+    hier_t *h = arg;
+    unsigned long block = access->address >> h->b;
+
+    switch (access->operation) {
+    case 'M':
+        access_block(h, block, 0);
+        access_block(h, block, 1);
+        break;
+    case 'S':
+        access_block(h, block, 1);
+        break;
+    default:
+        access_block(h, block, 0);
+        break;
+    }
+}
@@ -5,48 +5,219 @@
  * This is a C program that simulates a cache.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "cachelab.h"
 #include "getopt.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define LINELEN 128 // Maximum length for each line read from the trace file.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The cache is kept as a structure of arrays in a single allocation, so the
+// tags of a set are contiguous and can be compared several at a time. Line j
+// of set i is at index i * E + j of each array.
+//
+// A set fills from its first line and lines are never invalidated, so the
+// valid lines of set i are exactly lines 0 to sets[i].fill - 1 and no valid
+// bits are needed.
+//
+// LRU is kept with timestamps: each access stamps the line it uses with the
+// value of a counter that counts the accesses to its set, so only that one
+// line changes, and a set's least recently used line is its line with the
+// smallest stamp. As nothing else is shared between sets, different sets can
+// be simulated on different threads.
+typedef struct {
+    unsigned long fill;  // Number of valid lines in the set.
+    unsigned long clock; // Number of accesses to the set so far.
+} set_info;
+
+#define STREAMS 16 // Number of streams the stride prefetcher tracks.
+#define STREAM_WINDOW 64 // Blocks an access may be from a stream to join it.
+
+// The prefetchers.
+enum { PREFETCH_NONE, PREFETCH_NEXT_LINE, PREFETCH_STRIDE };
 
-// This structure defines a single line in a cache set, detailing its metadata
-// and data.
+// A stream of accesses seen by the stride prefetcher.
 typedef struct {
-    unsigned long valid; // Valid bit to check if the block contains valid data.
-    unsigned long tag;   // The tag extracted from the address.
-    unsigned long
-        lru; // Counter to implement the Least Recently Used (LRU) policy.
-    unsigned long dirty; // Indicates if this block has been modified but not
-                         // written back to memory.
-} cache_line;
+    unsigned long last; // The block last accessed.
+    long stride;        // The distance between its last two blocks.
+    int confidence;     // How many times in a row the stride has repeated.
+    unsigned long used; // When the stream was last accessed, for replacement.
+} stream_t;
+
+// A prefetcher, and how many of its prefetches helped. A prefetch is useful
+// if the line it brought in is accessed before it is evicted.
+//
+// The prefetchers are driven by the stream of accesses alone, as if after
+// each one, and look at the cache only to skip blocks it already holds:
+//   next-line  On an access to a new block, prefetches the degree blocks
+//              starting distance blocks after it.
+//   stride     Tracks STREAMS streams of blocks. Once an access repeats the
+//              last stride of the nearest stream, prefetches degree strides
+//              starting distance strides ahead.
+typedef struct {
+    int kind;                  // Which prefetcher, or PREFETCH_NONE.
+    long degree;               // Number of blocks prefetched at a time.
+    long distance;             // How far ahead the first one is.
+    unsigned long last;        // The block last accessed, for next-line.
+    stream_t streams[STREAMS]; // The streams, for stride.
+    unsigned long clock;       // Number of accesses, for stride.
+    unsigned long issued;      // Number of blocks prefetched.
+    unsigned long useful;      // Number accessed before their eviction.
+    unsigned long useless;     // Number evicted, or left, unaccessed.
+} prefetcher_t;
+
+typedef struct {
+    long s;                    // Number of set index bits.
+    long E;                    // Number of lines per set.
+    long b;                    // Number of block offset bits.
+    unsigned long *tags;       // The tag of each line.
+    unsigned long *stamp;      // The clock of its set at the last access to
+                               // each line.
+    unsigned char *dirty;      // Whether each line has been written to.
+    unsigned char *prefetched; // Whether each line was prefetched and has not
+                               // been accessed since.
+    set_info *sets;            // The state of each set.
+    prefetcher_t pf;           // The prefetcher.
+} cache_t;
+
+// A cache is handled through a pointer to its arrays.
+typedef cache_t *cache;
 
-// A set in a cache is essentially an array of cache lines.
-typedef cache_line *cache_set;
+#define MAX_CONFIGS 64  // Maximum number of caches simulated in one pass.
+#define MAX_THREADS 64  // Maximum number of simulation threads.
+#define CHUNK (1 << 16) // Number of accesses decoded before they are simulated.
 
-// A cache consists of multiple cache sets.
-typedef cache_set *cache;
+// The outcomes of an access, as printed in verbose mode.
+enum { ACCESS_HIT, ACCESS_MISS, ACCESS_EVICTION };
+
+// One memory access, decoded from the trace.
+typedef struct {
+    unsigned long address; // Memory address.
+    char operation;        // Memory access type: 'L', 'S', or 'M'.
+} access_t;
+
+// A chunk of accesses, split up for the simulation threads. For cache k, the
+// accesses given to thread t are those at the indices in order[k * CHUNK + j]
+// for j from start[k * (threads + 1) + t] up to the next start, in trace
+// order.
+typedef struct {
+    access_t accesses[CHUNK];     // The accesses, in trace order.
+    size_t count;                 // The number of accesses.
+    unsigned int *order;          // Indices of the accesses, by thread.
+    size_t *start;                // Where each thread's indices start.
+    unsigned char result[CHUNK];  // The outcome of each access, if verbose.
+} batch_t;
+
+// The state shared by the simulation threads. Set i of a cache is simulated
+// by thread i % threads, so each thread sees all the accesses to its sets, in
+// order, and no other thread touches them.
+typedef struct {
+    cache *caches;             // The caches.
+    int n;                     // The number of caches.
+    int threads;               // The number of simulation threads.
+    int verbose;               // Whether to keep the outcome of each access.
+    csim_stats_t *stats;       // The statistics of each thread, for each cache.
+    pthread_barrier_t barrier; // Where the threads and the reader meet.
+    batch_t *job;              // The chunk being simulated, or NULL to stop.
+    int busy;                  // Whether the threads are simulating job.
+} parallel_t;
+
+// The argument of a simulation thread.
+typedef struct {
+    parallel_t *p; // The shared state.
+    int id;        // The number of the thread.
+} worker_arg;
 
 // Create a new cache given the s, E, and b parameters.
 cache create_cache(long s, long E, long b);
 
 // Deallocate the memory associated with the cache.
-void free_cache(cache c, long s, long E);
+void free_cache(cache c);
+
+// Count the bytes held in dirty lines of the cache.
+unsigned long count_dirty_bytes(cache c);
 
-// Process the given trace file, simulating each memory access against the
-// cache.
-int process_trace_file(const char *trace, cache cache_sim, csim_stats_t *stats,
-                       long s, long E, long b, int verbose);
+// Count the prefetched lines of the cache that were never accessed.
+unsigned long count_unused_prefetches(cache c);
+
+// The contents of a trace file, mapped into memory where possible.
+typedef struct {
+    const char *data; // The bytes of the file.
+    size_t len;       // The number of bytes.
+    int mapped;       // Whether data is mapped, rather than malloc'ed.
+} trace_data;
+
+// Read a whole trace file into memory.
+int load_trace(const char *trace, trace_data *td);
+
+// Release the memory holding a trace file.
+void unload_trace(trace_data *td);
+
+// Parse one line of a text trace.
+const char *parse_line(const char *p, const char *end, char *operation,
+                       unsigned long *address, unsigned long *size);
+
+// Append one access to a binary trace.
+int write_record(FILE *out, char operation, unsigned long address,
+                 unsigned long size);
+
+// Simulate a chunk of accesses against each of n caches.
+void simulate_chunk(cache *caches, csim_stats_t *stats, int n,
+                    const access_t *chunk, size_t count, int verbose);
+
+// Split a chunk of accesses up by set, for the simulation threads.
+void partition_batch(parallel_t *p, batch_t *batch);
+
+// The body of a simulation thread.
+void *simulate_worker(void *arg);
+
+// Hand a chunk to the simulation threads, or stop them if it is NULL, once
+// they are done with the last one.
+void submit_batch(parallel_t *p, batch_t *batch);
+
+// Simulate a full chunk of accesses, or the last one, and get the next chunk.
+batch_t *dispatch_batch(parallel_t *p, batch_t *batch, batch_t *batches,
+                        csim_stats_t *stats);
+
+// Process the given trace file, simulating each memory access against each of
+// n caches on the given number of threads, and copy the accesses to out in
+// binary form unless it is NULL.
+int process_trace_file(const char *trace, cache *caches, csim_stats_t *stats,
+                       int n, int threads, int verbose, FILE *out);
+
+// Find the line holding a tag among the first n lines of a set.
+long find_line(const unsigned long *tags, unsigned long n, unsigned long tag);
+
+// Choose the line of a set to bring a new block into, evicting if need be.
+unsigned long place_line(cache c, set_info *set, unsigned long base,
+                         csim_stats_t *stats, int *result);
 
 // Simulate a cache access for the given memory address and update the cache and
 // statistics accordingly.
-void access_data(cache c, unsigned long address, csim_stats_t *stats, long s,
-                 long E, long b, char operation, int verbose);
+int access_data(cache c, unsigned long address, csim_stats_t *stats,
+                char operation);
+
+// Bring a block into the cache ahead of any access to it.
+void prefetch_block(cache c, unsigned long block, csim_stats_t *stats);
+
+// Run the prefetcher after an access.
+void run_prefetcher(cache c, unsigned long address, csim_stats_t *stats);
+
+// Print the outcome of an access, in verbose mode.
+void print_access(cache c, unsigned long address, char operation, int result);
 
 // Print the help message.
 void print_usage(void);
@@ -57,13 +228,22 @@ int main(int argc, char **argv) {
     long s = -1, E = -1,
          b = -1; // Parameters for cache: s = # of set index bits, E = lines per
                  // set, b = block size bits.
-    char *t = NULL;                       // Trace file name.
-    int verbose = 0;                      // Verbose flag.
-    csim_stats_t stats = {0, 0, 0, 0, 0}; // Cache simulation statistics.
-    cache cache_sim;                      // The simulated cache.
+    long configs[MAX_CONFIGS][3]; // s, E and b of each cache to simulate.
+    int n = 0;                    // Number of caches to simulate.
+    char *t = NULL;               // Trace file name.
+    char *o = NULL;               // Binary trace file name.
+    FILE *out = NULL;             // The binary trace file.
+    int threads = 1;              // Number of simulation threads.
+    int verbose = 0;              // Verbose flag.
+    int prefetch = PREFETCH_NONE; // The prefetcher.
+    long degree = 1;              // Number of blocks prefetched at a time.
+    long distance = 1;            // How far ahead to prefetch.
+    cache caches[MAX_CONFIGS];    // The simulated caches.
+    csim_stats_t stats[MAX_CONFIGS] = {{0, 0, 0, 0, 0}}; // Cache simulation
+                                                          // statistics.
 
     // Parse command line arguments using getopt.
-    while ((opt = getopt(argc, argv, "s:E:b:t:vh")) != -1) {
+    while ((opt = getopt(argc, argv, "s:E:b:c:t:o:j:p:D:d:vh")) != -1) {
         switch (opt) {
         case 's': // Number of set index bits.
             s = atoi(optarg);
@@ -74,9 +254,50 @@ int main(int argc, char **argv) {
         case 'b': // Number of block size bits.
             b = atoi(optarg);
             break;
+        case 'c': // One more cache to simulate, as s:E:b.
+            if (n == MAX_CONFIGS) {
+                fprintf(stderr, "Error: At most %d caches can be simulated\n",
+                        MAX_CONFIGS);
+                exit(1);
+            }
+            if (sscanf(optarg, "%ld:%ld:%ld", &configs[n][0], &configs[n][1],
+                       &configs[n][2]) != 3) {
+                fprintf(stderr, "Error: Bad cache '%s', expected s:E:b\n",
+                        optarg);
+                exit(1);
+            }
+            n++;
+            break;
         case 't': // Trace file name.
             t = optarg;
             break;
+        case 'o': // Binary trace file name.
+            o = optarg;
+            break;
+        case 'j': // Number of simulation threads.
+            threads = atoi(optarg);
+            if (threads < 1 || threads > MAX_THREADS) {
+                fprintf(stderr, "Error: -j must be from 1 to %d\n",
+                        MAX_THREADS);
+                exit(1);
+            }
+            break;
+        case 'p': // The prefetcher.
+            if (strcmp(optarg, "next") == 0) {
+                prefetch = PREFETCH_NEXT_LINE;
+            } else if (strcmp(optarg, "stride") == 0) {
+                prefetch = PREFETCH_STRIDE;
+            } else {
+                fprintf(stderr, "Error: Unknown prefetcher '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'D': // Number of blocks prefetched at a time.
+            degree = atoi(optarg);
+            break;
+        case 'd': // How far ahead to prefetch.
+            distance = atoi(optarg);
+            break;
         case 'v': // Set verbose mode.
             verbose = 1;
             break;
@@ -88,35 +309,89 @@ int main(int argc, char **argv) {
         }
     }
 
+    // The cache given by -s, -E and -b, if any, is simulated first.
+    if (s != -1 || E != -1 || b != -1) {
+        if (s == -1 || E == -1 || b == -1 || n == MAX_CONFIGS) {
+            fprintf(stderr, "Error: Missing required command line argument\n");
+            exit(1);
+        }
+        memmove(configs[1], configs[0], sizeof(configs[0]) * (size_t)n);
+        configs[0][0] = s;
+        configs[0][1] = E;
+        configs[0][2] = b;
+        n++;
+    }
+
     // Check if all required command-line arguments have been provided.
-    if (s == -1 || E == -1 || b == -1 || t == NULL) {
+    if (n == 0 || t == NULL) {
         fprintf(stderr, "Error: Missing required command line argument\n");
         exit(1);
     }
+    if (verbose && n > 1) {
+        fprintf(stderr, "Error: Verbose mode needs a single cache\n");
+        exit(1);
+    }
+    // A prefetch may land in any set, so it can't be left to one thread.
+    if (prefetch != PREFETCH_NONE &&
+        (threads > 1 || degree < 1 || distance < 1)) {
+        fprintf(stderr, "Error: Prefetching needs -j 1, and -D and -d of at "
+                        "least 1\n");
+        exit(1);
+    }
 
-    // Initialize the cache.
-    cache_sim = create_cache(s, E, b);
+    // Open the binary trace file, if one was asked for, and write its magic
+    // number.
+    if (o != NULL) {
+        out = fopen(o, "wb");
+        if (!out || fwrite(BINARY_TRACE_MAGIC, 1, 8, out) != 8) {
+            fprintf(stderr, "Error opening '%s': %s\n", o, strerror(errno));
+            exit(1);
+        }
+    }
 
-    // Process each memory access in the trace file.
-    process_trace_file(t, cache_sim, &stats, s, E, b, verbose);
+    // Initialize the caches.
+    for (int i = 0; i < n; i++) {
+        caches[i] = create_cache(configs[i][0], configs[i][1], configs[i][2]);
+        caches[i]->pf.kind = prefetch;
+        caches[i]->pf.degree = degree;
+        caches[i]->pf.distance = distance;
+    }
 
-    // After processing the trace file, compute the number of dirty bytes in the
-    // cache.
-    for (int i = 0; i < (1 << s); i++) {
-        for (int j = 0; j < E; j++) {
-            // If a cache line is valid and dirty, add its size to the dirty
-            // bytes count.
-            if (cache_sim[i][j].valid && cache_sim[i][j].dirty) {
-                stats.dirty_bytes += (1 << b);
-            }
-        }
+    // Process each memory access in the trace file, once for all the caches.
+    process_trace_file(t, caches, stats, n, threads, verbose, out);
+
+    if (out && fclose(out) != 0) {
+        fprintf(stderr, "Error writing '%s': %s\n", o, strerror(errno));
+        exit(1);
     }
 
-    // Cleanup: free the memory used for the cache.
-    free_cache(cache_sim, s, E);
+    for (int i = 0; i < n; i++) {
+        // After processing the trace file, compute the number of dirty bytes
+        // in the cache, then free the memory used for the cache.
+        stats[i].dirty_bytes = count_dirty_bytes(caches[i]);
+        caches[i]->pf.useless += count_unused_prefetches(caches[i]);
+    }
 
-    // Display the final cache access statistics.
-    printSummary(&stats);
+    // Display the final cache access statistics. With several caches, a line
+    // is printed for each, and none is stored for the autograder.
+    for (int i = 0; i < n; i++) {
+        if (n == 1) {
+            printSummary(&stats[0]);
+        } else {
+            printf("s:%ld E:%ld b:%ld ", configs[i][0], configs[i][1],
+                   configs[i][2]);
+            printf("hits:%lu misses:%lu evictions:%lu dirty_bytes_in_cache:%lu "
+                   "dirty_bytes_evicted:%lu\n",
+                   stats[i].hits, stats[i].misses, stats[i].evictions,
+                   stats[i].dirty_bytes, stats[i].dirty_evictions);
+        }
+        if (prefetch != PREFETCH_NONE) {
+            printf("prefetches:%lu useful:%lu useless:%lu\n",
+                   caches[i]->pf.issued, caches[i]->pf.useful,
+                   caches[i]->pf.useless);
+        }
+        free_cache(caches[i]);
+    }
 
     return 0;
 }
@@ -132,7 +407,16 @@ void print_usage(void) {
     printf("  -E <num>    : Number of lines per set.\n");
     printf("  -b <num>    : Number of block offset bits (B = 2^num is the "
            "block size).\n");
+    printf("  -c <s:E:b>  : Also simulate this cache, in the same pass over "
+           "the trace.\n");
+    printf("  -j <num>    : Number of threads to simulate the sets on.\n");
+    printf("  -p <kind>   : Prefetch with a next-line or stride "
+           "prefetcher.\n");
+    printf("  -D <num>    : Number of blocks to prefetch at a time (1).\n");
+    printf("  -d <num>    : Number of blocks or strides to prefetch ahead "
+           "(1).\n");
     printf("  -t <file>   : Name of the valgrind trace to replay.\n");
+    printf("  -o <file>   : Also write the trace to <file> in binary form.\n");
     exit(0);
 }
 
@@ -145,190 +429,813 @@ void print_usage(void) {
  * @return A newly allocated cache structure.
  */
 cache create_cache(long s, long E, long b) {
-    // Calculate the total number of sets using the formula 2^s.
+    // Calculate the total number of sets using the formula 2^s, and of lines.
     unsigned long S = (1UL << s);
+    unsigned long lines = S * (unsigned long)E;
 
-    // Allocate memory for the cache sets.
-    cache new_cache = (cache_set *)malloc(sizeof(cache_set) * S);
+    // Allocate the arrays together, the word-sized ones first so that each is
+    // aligned. calloc leaves every set empty and every line clean.
+    cache new_cache = (cache)malloc(sizeof(cache_t));
+    unsigned long *words = (unsigned long *)calloc(
+        1,
+        2 * lines * sizeof(unsigned long) + S * sizeof(set_info) + 2 * lines);
+    if (!new_cache || !words) {
+        fprintf(stderr, "Error: Not enough memory for the cache\n");
+        exit(1);
+    }
 
-    for (unsigned long i = 0; i < S; i++) {
-        // For each set, allocate memory for 'E' cache lines.
-        new_cache[i] =
-            (cache_line *)malloc(sizeof(cache_line) * (unsigned long)E);
+    new_cache->s = s;
+    new_cache->E = E;
+    new_cache->b = b;
+    new_cache->tags = words;
+    new_cache->stamp = words + lines;
+    new_cache->sets = (set_info *)(words + 2 * lines);
+    new_cache->dirty = (unsigned char *)(new_cache->sets + S);
+    new_cache->prefetched = new_cache->dirty + lines;
+    memset(&new_cache->pf, 0, sizeof(new_cache->pf));
 
-        // Initialize each cache line in the set.
-        for (long j = 0; j < E; j++) {
-            new_cache[i][j].valid = 0;
-            new_cache[i][j].tag = 0;
-            new_cache[i][j].lru = 0;
-            new_cache[i][j].dirty = 0;
+    return new_cache;
+}
+
+/**
+ * Count the bytes held in dirty lines of the cache.
+ *
+ * @param c The cache.
+ * @return The number of dirty bytes.
+ */
+unsigned long count_dirty_bytes(cache c) {
+    unsigned long bytes = 0;
+
+    for (unsigned long i = 0; i < (1UL << c->s); i++) {
+        for (unsigned long j = 0; j < c->sets[i].fill; j++) {
+            // If a valid cache line is dirty, add its size to the dirty bytes
+            // count.
+            if (c->dirty[i * (unsigned long)c->E + j]) {
+                bytes += (1UL << c->b);
+            }
         }
     }
-
-    return new_cache;
+    return bytes;
 }
 
 /**
- * Deallocate memory used by the cache.
+ * Count the prefetched lines of the cache that were never accessed.
  *
- * @param c The cache to be deallocated.
- * @param s The number of set index bits.
- * @param E The number of lines per set.
+ * @param c The cache.
+ * @return The number of lines.
  */
-void free_cache(cache c, long s, long E) {
-    // Calculate the total number of sets using the formula 2^s.
-    long S = (1 << s);
+unsigned long count_unused_prefetches(cache c) {
+    unsigned long count = 0;
 
-    // For each set in the cache, free its memory.
-    for (long i = 0; i < S; i++) {
-        free(c[i]);
+    for (unsigned long i = 0; i < (1UL << c->s); i++) {
+        for (unsigned long j = 0; j < c->sets[i].fill; j++) {
+            count += c->prefetched[i * (unsigned long)c->E + j];
+        }
     }
+    return count;
+}
 
-    // Finally, free the cache memory.
+/**
+ * Deallocate memory used by the cache.
+ *
+ * @param c The cache to be deallocated.
+ */
+void free_cache(cache c) {
+    // The arrays share one allocation, which starts with the tags.
+    free(c->tags);
     free(c);
 }
 
-// Process the memory accesses in the trace file and simulate cache behavior.
-int process_trace_file(const char *trace, cache cache_sim, csim_stats_t *stats,
-                       long s, long E, long b, int verbose) {
-    // Open the trace file for reading.
-    FILE *tfp = fopen(trace, "r");
+/**
+ * Read a whole trace file into memory.
+ *
+ * A regular file is mapped, so its pages are read in as the parser reaches
+ * them without being copied. Anything else, such as a pipe, is read into a
+ * buffer.
+ *
+ * @param trace The name of the trace file.
+ * @param td Where to put the contents of the file.
+ * @return 0 on success, or 1 if the file can't be read.
+ */
+int load_trace(const char *trace, trace_data *td) {
+    int fd = open(trace, O_RDONLY);
+    struct stat st;
 
-    if (!tfp) {
-        // If the trace file can't be opened, display an error and exit.
+    if (fd < 0 || fstat(fd, &st) < 0) {
         fprintf(stderr, "Error opening '%s': %s\n", trace, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
         return 1;
     }
 
-    char linebuf[LINELEN];
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        td->len = (size_t)st.st_size;
+        void *map = mmap(NULL, td->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // The trace is read once from start to end.
+            posix_madvise(map, td->len, POSIX_MADV_SEQUENTIAL);
+            td->data = map;
+            td->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    // Otherwise read the file, doubling the buffer as it fills.
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    ssize_t n = 0;
+    td->len = 0;
+    while (buf && (n = read(fd, buf + td->len, cap - td->len)) > 0) {
+        td->len += (size_t)n;
+        if (td->len == cap) {
+            char *bigger = realloc(buf, cap *= 2);
+            if (!bigger) {
+                free(buf);
+            }
+            buf = bigger;
+        }
+    }
+    close(fd);
 
-    // For each line in the trace file...
-    while (fgets(linebuf, LINELEN, tfp)) {
-        char operation;        // Memory access type: 'L', 'S', or 'M'.
-        unsigned long address; // Memory address.
-        int size;              // Number of bytes accessed.
+    if (!buf || n < 0) {
+        fprintf(stderr, "Error reading '%s': %s\n", trace,
+                buf ? strerror(errno) : "Out of memory");
+        free(buf);
+        return 1;
+    }
+    td->data = buf;
+    td->mapped = 0;
+    return 0;
+}
 
-        // Parse the line to extract operation, address, and size.
-        if (sscanf(linebuf, " %c %lx,%d", &operation, &address, &size) != 3) {
-            fprintf(stderr, "Error parsing trace file\n");
-            fclose(tfp);
-            return 1;
+/**
+ * Release the memory holding a trace file.
+ *
+ * @param td The contents of the file, from load_trace.
+ */
+void unload_trace(trace_data *td) {
+    if (td->mapped) {
+        munmap((void *)td->data, td->len);
+    } else {
+        free((void *)td->data);
+    }
+}
+
+/**
+ * Parse one line of a text trace, in the form " %c %lx,%d".
+ *
+ * The digits are converted by hand, which is several times faster than
+ * sscanf. Anything after the size is ignored, up to the end of the line.
+ *
+ * @param p The start of the line.
+ * @param end The end of the trace.
+ * @param operation Where to put the operation.
+ * @param address Where to put the address.
+ * @param size Where to put the size.
+ * @return The start of the next line, or NULL if the line can't be parsed.
+ */
+const char *parse_line(const char *p, const char *end, char *operation,
+                       unsigned long *address, unsigned long *size) {
+    const char *digits;
+    unsigned long value;
+
+    // The operation, after any blanks.
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == end || *p == '\n' || *p == '\r') {
+        return NULL;
+    }
+    *operation = *p++;
+
+    // The address, in hex, after any blanks.
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+    }
+    for (digits = p, value = 0; p < end; p++) {
+        unsigned int d = (unsigned int)(unsigned char)*p - '0';
+        if (d > 9) {
+            // Setting bit 5 makes an upper case letter lower case.
+            d = ((unsigned int)(unsigned char)*p | 0x20) - 'a';
+            if (d > 5) {
+                break;
+            }
+            d += 10;
         }
+        value = value << 4 | d;
+    }
+    if (p == digits || p == end || *p != ',') {
+        return NULL;
+    }
+    *address = value;
+    p++;
 
-        // Simulate the cache access for the extracted memory address and
-        // operation.
-        access_data(cache_sim, address, stats, s, E, b, operation, verbose);
+    // The size, in decimal.
+    for (digits = p, value = 0;
+         p < end && (unsigned int)(unsigned char)*p - '0' <= 9; p++) {
+        value = value * 10 + ((unsigned long)(unsigned char)*p - '0');
+    }
+    if (p == digits) {
+        return NULL;
     }
+    *size = value;
 
-    // Close the trace file.
-    fclose(tfp);
+    // Skip the rest of the line.
+    p = memchr(p, '\n', (size_t)(end - p));
+    return p ? p + 1 : end;
+}
 
+/**
+ * Append one access to a binary trace.
+ *
+ * @param out The binary trace file.
+ * @param operation The operation, which must be 'L', 'S' or 'M'.
+ * @param address The address, which must fit in 56 bits.
+ * @param size The size, which must be at most BINARY_TRACE_MAX_SIZE.
+ * @return 0 on success, or 1 if the access doesn't fit in a record or can't be
+ * written.
+ */
+int write_record(FILE *out, char operation, unsigned long address,
+                 unsigned long size) {
+    const char *op = memchr(BINARY_TRACE_OPS, operation, 3);
+
+    if (!op || size > BINARY_TRACE_MAX_SIZE ||
+        address >> (64 - BINARY_TRACE_ADDR_SHIFT) != 0) {
+        fprintf(stderr, "Error: Can't write '%c %lx,%lu' to a binary trace\n",
+                operation, address, size);
+        return 1;
+    }
+
+    uint64_t record = (uint64_t)address << BINARY_TRACE_ADDR_SHIFT |
+                      (uint64_t)(op - BINARY_TRACE_OPS)
+                          << BINARY_TRACE_OP_SHIFT |
+                      size;
+    if (fwrite(&record, sizeof(record), 1, out) != 1) {
+        fprintf(stderr, "Error writing binary trace: %s\n", strerror(errno));
+        return 1;
+    }
     return 0;
 }
 
-// Simulate a cache access for a given memory address.
-void access_data(cache c, unsigned long address, csim_stats_t *stats, long s,
-                 long E, long b, char operation, int verbose) {
-    // Extract the set index and tag from the given address.
-    unsigned long tag =
-        address >> (s + b); // Extract the tag bits by discarding the set index
-                            // and block offset bits.
-    int set_index = (int)((address >> b) &
-                          ((1L << s) - 1)); // Extract set index bits by
-                                            // discarding the block offset bits.
-
-    int line_found = 0; // Flag to indicate if the line was found in the cache.
-    long empty_line = -1; // Keep track of the first empty line.
-
-    // Check each line in the set.
-    for (long i = 0; i < E; i++) {
-        // If the line is valid...
-        if (c[set_index][i].valid) {
-            // And the tag matches...
-            if (c[set_index][i].tag == tag) {
-                // It's a cache hit.
-                line_found = 1;
-                stats->hits++;
-
-                // If it's a modify operation, it's a double hit.
-                if (operation == 'M') {
-                    stats->hits++;
-                }
-                if (verbose) {
-                    printf("%c %lx,%d hit\n", operation, address, (1 << b));
-                }
+/**
+ * Simulate a chunk of accesses against each of n caches.
+ *
+ * Each cache runs through the whole chunk before the next one starts, so its
+ * lines stay in the host's caches while it does.
+ *
+ * @param caches The caches.
+ * @param stats The statistics of each cache.
+ * @param n The number of caches.
+ * @param chunk The accesses, in trace order.
+ * @param count The number of accesses.
+ * @param verbose Whether to print the result of each access.
+ */
+void simulate_chunk(cache *caches, csim_stats_t *stats, int n,
+                    const access_t *chunk, size_t count, int verbose) {
+    for (int k = 0; k < n; k++) {
+        for (size_t i = 0; i < count; i++) {
+            int result = access_data(caches[k], chunk[i].address, &stats[k],
+                                     chunk[i].operation);
+            if (verbose) {
+                print_access(caches[k], chunk[i].address, chunk[i].operation,
+                             result);
+            }
+            if (caches[k]->pf.kind != PREFETCH_NONE) {
+                run_prefetcher(caches[k], chunk[i].address, &stats[k]);
+            }
+        }
+    }
+}
+
+// The thread that simulates a set of a cache.
+static inline int thread_of(const parallel_t *p, cache c,
+                            unsigned long address) {
+    return (int)(((address >> c->b) & ((1UL << c->s) - 1)) %
+                 (unsigned long)p->threads);
+}
 
-                // Reset the LRU counter for this line.
-                c[set_index][i].lru = 0;
+/**
+ * Split a chunk of accesses up by set, for the simulation threads.
+ *
+ * @param p The state shared by the simulation threads.
+ * @param batch The chunk, whose order and start arrays are filled in.
+ */
+void partition_batch(parallel_t *p, batch_t *batch) {
+    size_t stride = (size_t)p->threads + 1;
+
+    for (int k = 0; k < p->n; k++) {
+        size_t *start = &batch->start[(size_t)k * stride];
+        unsigned int *order = &batch->order[(size_t)k * CHUNK];
+
+        // Count the accesses of each thread, then turn the counts into the
+        // end of each thread's indices, and fill them in from the back.
+        memset(start, 0, sizeof(*start) * stride);
+        for (size_t i = 0; i < batch->count; i++) {
+            start[thread_of(p, p->caches[k], batch->accesses[i].address) + 1]++;
+        }
+        for (int t = 1; t < (int)stride; t++) {
+            start[t] += start[t - 1];
+        }
+        for (size_t i = batch->count; i-- > 0;) {
+            int t = thread_of(p, p->caches[k], batch->accesses[i].address);
+            order[--start[t + 1]] = (unsigned int)i;
+        }
+        // The last fill left start[t + 1] at the start of thread t + 1.
+        memmove(&start[0], &start[1], sizeof(*start) * (stride - 1));
+        start[stride - 1] = batch->count;
+    }
+}
 
-                // If it's a modify or store operation, set the dirty bit.
-                if (operation == 'M' || operation == 'S') {
-                    c[set_index][i].dirty = 1;
+/**
+ * The body of a simulation thread.
+ *
+ * The thread waits at the barrier for a chunk, simulates its accesses to its
+ * sets of each cache, and waits at the barrier again to say it is done.
+ *
+ * @param arg The worker_arg of the thread.
+ * @return NULL, once the reader hands over no chunk.
+ */
+void *simulate_worker(void *arg) {
+    parallel_t *p = ((worker_arg *)arg)->p;
+    int id = ((worker_arg *)arg)->id;
+    size_t stride = (size_t)p->threads + 1;
+
+    for (;;) {
+        pthread_barrier_wait(&p->barrier);
+        batch_t *batch = p->job;
+        if (!batch) {
+            return NULL;
+        }
+
+        for (int k = 0; k < p->n; k++) {
+            const size_t *start = &batch->start[(size_t)k * stride];
+            const unsigned int *order = &batch->order[(size_t)k * CHUNK];
+            csim_stats_t *stats = &p->stats[id * p->n + k];
+
+            for (size_t j = start[id]; j < start[id + 1]; j++) {
+                const access_t *a = &batch->accesses[order[j]];
+                int result =
+                    access_data(p->caches[k], a->address, stats, a->operation);
+                if (p->verbose) {
+                    batch->result[order[j]] = (unsigned char)result;
                 }
+            }
+        }
 
-                break;
+        pthread_barrier_wait(&p->barrier);
+    }
+}
+
+/**
+ * Hand a chunk to the simulation threads, or stop them if it is NULL.
+ *
+ * This first waits for the threads to finish the last chunk, and in verbose
+ * mode prints its outcomes in trace order. The reader can then fill that
+ * chunk again while the threads simulate this one.
+ *
+ * @param p The state shared by the simulation threads.
+ * @param batch The chunk, already partitioned, or NULL.
+ */
+void submit_batch(parallel_t *p, batch_t *batch) {
+    if (p->busy) {
+        pthread_barrier_wait(&p->barrier);
+        if (p->verbose) {
+            for (size_t i = 0; i < p->job->count; i++) {
+                print_access(p->caches[0], p->job->accesses[i].address,
+                             p->job->accesses[i].operation,
+                             p->job->result[i]);
             }
-        } else if (empty_line == -1) {
-            // If the line is not valid, remember it as a potential place to
-            // bring in new data.
-            empty_line = i;
         }
     }
 
-    // If the line was not found in the cache...
-    if (!line_found) {
-        stats->misses++;
+    p->job = batch;
+    p->busy = batch != NULL;
+    pthread_barrier_wait(&p->barrier);
+}
 
-        // If it's a modify operation, it's a hit after the miss.
-        if (operation == 'M') {
-            stats->hits++;
-        }
+/**
+ * Simulate a full chunk of accesses, or the last one.
+ *
+ * On one thread the chunk is simulated at once. Otherwise it is handed to the
+ * simulation threads, and the other chunk is returned to be filled meanwhile.
+ *
+ * @param p The state shared by the simulation threads.
+ * @param batch The chunk.
+ * @param batches The two chunks.
+ * @param stats The statistics of each cache, when on one thread.
+ * @return The chunk to fill next, which is empty.
+ */
+batch_t *dispatch_batch(parallel_t *p, batch_t *batch, batch_t *batches,
+                        csim_stats_t *stats) {
+    if (p->threads == 1) {
+        simulate_chunk(p->caches, stats, p->n, batch->accesses, batch->count,
+                       p->verbose);
+    } else {
+        partition_batch(p, batch);
+        submit_batch(p, batch);
+        batch = batch == &batches[0] ? &batches[1] : &batches[0];
+    }
+    batch->count = 0;
+    return batch;
+}
 
-        if (empty_line != -1) {
-            // If there's an empty line, use it to bring in the new data.
-            c[set_index][empty_line].valid = 1;
-            c[set_index][empty_line].tag = tag;
-            c[set_index][empty_line].lru = 0; // Reset LRU.
-            if (operation == 'M' || operation == 'S') {
-                c[set_index][empty_line].dirty =
-                    1; // Set dirty bit if modify or store.
+// Process the memory accesses in the trace file and simulate cache behavior.
+int process_trace_file(const char *trace, cache *caches, csim_stats_t *stats,
+                       int n, int threads, int verbose, FILE *out) {
+    static batch_t batches[2]; // Chunks being decoded and simulated.
+    batch_t *batch = &batches[0];
+    parallel_t par = {.caches = caches,
+                      .n = n,
+                      .threads = threads,
+                      .verbose = verbose};
+    pthread_t tids[MAX_THREADS];
+    worker_arg args[MAX_THREADS];
+    trace_data td;
+
+    // Read the whole trace file.
+    if (load_trace(trace, &td)) {
+        return 1;
+    }
+
+    // Start the simulation threads, if there are to be any.
+    if (threads > 1) {
+        par.stats = calloc((size_t)(threads * n), sizeof(csim_stats_t));
+        for (int i = 0; i < 2; i++) {
+            batches[i].order = malloc(sizeof(unsigned int) * CHUNK * (size_t)n);
+            batches[i].start =
+                malloc(sizeof(size_t) * (size_t)((threads + 1) * n));
+            if (!batches[i].order || !batches[i].start) {
+                par.stats = NULL;
             }
-            if (verbose) {
-                printf("%c %lx,%d miss\n", operation, address, (1 << b));
+        }
+        if (!par.stats ||
+            pthread_barrier_init(&par.barrier, NULL, (unsigned)threads + 1)) {
+            fprintf(stderr, "Error: Can't set up the simulation threads\n");
+            exit(1);
+        }
+        for (int i = 0; i < threads; i++) {
+            args[i].p = &par;
+            args[i].id = i;
+            if (pthread_create(&tids[i], NULL, simulate_worker, &args[i])) {
+                fprintf(stderr, "Error: Can't start a simulation thread\n");
+                exit(1);
+            }
+        }
+    }
+
+    const char *p = td.data;
+    const char *end = td.data + td.len;
+    int binary = td.len >= 8 && memcmp(p, BINARY_TRACE_MAGIC, 8) == 0;
+    int status = 0;
+
+    // A binary trace is a whole number of records after its magic number.
+    if (binary) {
+        p += 8;
+        if ((td.len - 8) % sizeof(uint64_t) != 0) {
+            fprintf(stderr, "Error parsing trace file\n");
+            p = end;
+            status = 1;
+        }
+    }
+
+    // For each access in the trace file...
+    while (p < end) {
+        char operation;        // Memory access type: 'L', 'S', or 'M'.
+        unsigned long address; // Memory address.
+        unsigned long size;    // Number of bytes accessed.
+
+        if (binary) {
+            // Unpack the next record.
+            uint64_t record;
+            memcpy(&record, p, sizeof(record));
+            p += sizeof(record);
+            unsigned int op = (record >> BINARY_TRACE_OP_SHIFT) & 3;
+            if (op > 2) {
+                fprintf(stderr, "Error parsing trace file\n");
+                status = 1;
+                break;
             }
+            address = (unsigned long)(record >> BINARY_TRACE_ADDR_SHIFT);
+            operation = BINARY_TRACE_OPS[op];
+            size = (unsigned long)(record & BINARY_TRACE_MAX_SIZE);
         } else {
-            // Otherwise, evict the least recently used line.
-            stats->evictions++;
-            long max_lru_index = 0;
-            for (long i = 1; i < E; i++) {
-                if (c[set_index][i].lru > c[set_index][max_lru_index].lru) {
-                    max_lru_index = i;
-                }
+            // Parse the line to extract operation, address, and size.
+            p = parse_line(p, end, &operation, &address, &size);
+            if (!p) {
+                fprintf(stderr, "Error parsing trace file\n");
+                status = 1;
+                break;
             }
+        }
 
-            // If evicting a dirty line, update the dirty eviction stats.
-            if (c[set_index][max_lru_index].dirty) {
-                stats->dirty_evictions += (1 << b);
-                c[set_index][max_lru_index].dirty = 0; // Reset dirty flag.
-            }
+        if (out && write_record(out, operation, address, size)) {
+            status = 1;
+            break;
+        }
 
-            // Update the evicted line's metadata for the new data.
-            c[set_index][max_lru_index].valid = 1;
-            c[set_index][max_lru_index].tag = tag;
-            c[set_index][max_lru_index].lru = 0; // Reset LRU.
-            if (operation == 'M' || operation == 'S') {
-                c[set_index][max_lru_index].dirty =
-                    1; // Set dirty bit if modify or store.
-            }
-            if (verbose) {
-                printf("%c %lx,%d miss eviction\n", operation, address,
-                       (1 << b));
+        // Queue the cache access for the extracted memory address and
+        // operation, and simulate the queue once it is full.
+        batch->accesses[batch->count].address = address;
+        batch->accesses[batch->count].operation = operation;
+        if (++batch->count == CHUNK) {
+            batch = dispatch_batch(&par, batch, batches, stats);
+        }
+    }
+
+    // Simulate the accesses before any error, as they would have been.
+    dispatch_batch(&par, batch, batches, stats);
+
+    // Stop the threads, and add up what each counted.
+    if (threads > 1) {
+        submit_batch(&par, NULL);
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        for (int i = 0; i < threads * n; i++) {
+            csim_stats_t *sum = &stats[i % n];
+            sum->hits += par.stats[i].hits;
+            sum->misses += par.stats[i].misses;
+            sum->evictions += par.stats[i].evictions;
+            sum->dirty_evictions += par.stats[i].dirty_evictions;
+        }
+        pthread_barrier_destroy(&par.barrier);
+        free(par.stats);
+        for (int i = 0; i < 2; i++) {
+            free(batches[i].order);
+            free(batches[i].start);
+        }
+    }
+
+    unload_trace(&td);
+
+    return status;
+}
+
+/**
+ * Find the line holding a tag among the valid lines of a set.
+ *
+ * Where the target has vector instructions, several tags are compared at once
+ * and the lines left over are compared one at a time.
+ *
+ * @param tags The tags of the set.
+ * @param n The number of valid lines in the set.
+ * @param tag The tag to look for.
+ * @return The index of the line, or -1 if no valid line holds the tag.
+ */
+long find_line(const unsigned long *tags, unsigned long n, unsigned long tag) {
+    unsigned long i = 0;
+
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi64x((long long)tag);
+    for (; i + 4 <= n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *)&tags[i]), key);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask) {
+            return (long)i + __builtin_ctz((unsigned)mask);
+        }
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no 64-bit compare, so both halves of a tag must match
+    __m128i key = _mm_set1_epi64x((long long)tag);
+    for (; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)&tags[i]), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) {
+            return (long)i + __builtin_ctz((unsigned)mask);
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        if (tags[i] == tag) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Print the outcome of an access, in verbose mode.
+ *
+ * @param c The cache.
+ * @param address The address accessed.
+ * @param operation The memory access type.
+ * @param result The outcome, from access_data.
+ */
+void print_access(cache c, unsigned long address, char operation, int result) {
+    static const char *const outcomes[] = {"hit", "miss", "miss eviction"};
+
+    printf("%c %lx,%d %s\n", operation, address, 1 << c->b, outcomes[result]);
+}
+
+/**
+ * Choose the line of a set to bring a new block into.
+ *
+ * An empty line is used if there is one. Otherwise the least recently used
+ * line, the one with the oldest stamp, is evicted.
+ *
+ * @param c The cache.
+ * @param set The state of the set.
+ * @param base The index of the set's first line.
+ * @param stats The statistics, which count an eviction.
+ * @param result Set to ACCESS_EVICTION if a line was evicted.
+ * @return The index of the line.
+ */
+unsigned long place_line(cache c, set_info *set, unsigned long base,
+                         csim_stats_t *stats, int *result) {
+    if (set->fill < (unsigned long)c->E) {
+        // If there's an empty line, use it to bring in the new data.
+        return base + set->fill++;
+    }
+
+    // Otherwise, evict the least recently used line.
+    unsigned long i = base;
+    for (unsigned long j = base + 1; j < base + (unsigned long)c->E; j++) {
+        if (c->stamp[j] < c->stamp[i]) {
+            i = j;
+        }
+    }
+
+    // If evicting a dirty line, update the dirty eviction stats, and if
+    // evicting a prefetched line that was never accessed, count it as useless.
+    stats->evictions++;
+    if (c->dirty[i]) {
+        stats->dirty_evictions += 1UL << c->b;
+    }
+    c->pf.useless += c->prefetched[i];
+    *result = ACCESS_EVICTION;
+    return i;
+}
+
+// Simulate a cache access for a given memory address, and return its outcome.
+int access_data(cache c, unsigned long address, csim_stats_t *stats,
+                char operation) {
+    // Extract the set index and tag from the given address. A shift by the
+    // full width of the address is undefined, so a tag without bits is 0.
+    unsigned long tag = c->s + c->b < 64 ? address >> (c->s + c->b) : 0;
+    unsigned long set_index =
+        (address >> c->b) & ((1UL << c->s) - 1); // Extract set index bits by
+                                                 // discarding the block offset
+                                                 // bits.
+
+    // The lines of the set start at this index in each array.
+    unsigned long base = set_index * (unsigned long)c->E;
+    set_info *set = &c->sets[set_index];
+    int write = (operation == 'M' || operation == 'S');
+
+    set->clock++;
+
+    // Check the valid lines of the set for the tag.
+    long line = find_line(&c->tags[base], set->fill, tag);
+    if (line != -1) {
+        // It's a cache hit.
+        unsigned long i = base + (unsigned long)line;
+        stats->hits++;
+
+        // If it's a modify operation, it's a double hit.
+        if (operation == 'M') {
+            stats->hits++;
+        }
+
+        // Stamp the line as the most recently used, and if it's a modify or
+        // store operation, set the dirty bit. A prefetched line has now been
+        // of use.
+        c->stamp[i] = set->clock;
+        if (write) {
+            c->dirty[i] = 1;
+        }
+        if (c->prefetched[i]) {
+            c->prefetched[i] = 0;
+            c->pf.useful++;
+        }
+        return ACCESS_HIT;
+    }
+
+    // The line was not found in the cache.
+    stats->misses++;
+
+    // If it's a modify operation, it's a hit after the miss.
+    if (operation == 'M') {
+        stats->hits++;
+    }
+
+    int result = ACCESS_MISS;
+    unsigned long i = place_line(c, set, base, stats, &result);
+
+    // Update the line's metadata for the new data, setting the dirty bit if
+    // it's a modify or store operation.
+    c->tags[i] = tag;
+    c->stamp[i] = set->clock;
+    c->dirty[i] = (unsigned char)write;
+    c->prefetched[i] = 0;
+    return result;
+}
+
+/**
+ * Bring a block into the cache ahead of any access to it.
+ *
+ * Nothing happens if the cache holds the block already. The block is counted
+ * neither as a hit nor as a miss, but a line it evicts is counted as usual.
+ *
+ * @param c The cache.
+ * @param block The block number, that is, its address shifted right by b.
+ * @param stats The statistics.
+ */
+void prefetch_block(cache c, unsigned long block, csim_stats_t *stats) {
+    unsigned long tag = c->s < 64 ? block >> c->s : 0;
+    unsigned long set_index = block & ((1UL << c->s) - 1);
+    unsigned long base = set_index * (unsigned long)c->E;
+    set_info *set = &c->sets[set_index];
+    int result;
+
+    if (find_line(&c->tags[base], set->fill, tag) != -1) {
+        return;
+    }
+
+    unsigned long i = place_line(c, set, base, stats, &result);
+    c->tags[i] = tag;
+    c->stamp[i] = ++set->clock;
+    c->dirty[i] = 0;
+    c->prefetched[i] = 1;
+    c->pf.issued++;
+}
+
+/**
+ * Run the prefetcher after an access.
+ *
+ * @param c The cache.
+ * @param address The address accessed.
+ * @param stats The statistics.
+ */
+void run_prefetcher(cache c, unsigned long address, csim_stats_t *stats) {
+    prefetcher_t *pf = &c->pf;
+    unsigned long block = address >> c->b;
+
+    if (pf->kind == PREFETCH_NEXT_LINE) {
+        if (block != pf->last) {
+            for (long i = 0; i < pf->degree; i++) {
+                prefetch_block(c, block + (unsigned long)(pf->distance + i),
+                               stats);
             }
         }
+        pf->last = block;
+        return;
     }
 
-    // After the access, increment the LRU counter for each line in the set.
-    for (int i = 0; i < E; i++) {
-        c[set_index][i].lru++;
+    // Find the stream whose last block is nearest, or replace the one that
+    // has gone longest without an access.
+    stream_t *st = NULL;
+    stream_t *oldest = &pf->streams[0];
+    unsigned long nearest = STREAM_WINDOW + 1;
+    pf->clock++;
+    for (int i = 0; i < STREAMS; i++) {
+        stream_t *cand = &pf->streams[i];
+        unsigned long gap =
+            block > cand->last ? block - cand->last : cand->last - block;
+        if (cand->used != 0 && gap < nearest) {
+            nearest = gap;
+            st = cand;
+        }
+        if (cand->used < oldest->used) {
+            oldest = cand;
+        }
+    }
+    if (!st) {
+        oldest->last = block;
+        oldest->stride = 0;
+        oldest->confidence = 0;
+        oldest->used = pf->clock;
+        return;
+    }
+    st->used = pf->clock;
+    if (nearest == 0) {
+        return;
+    }
+
+    // A stride seen twice in a row is trusted.
+    long stride = (long)(block - st->last);
+    if (stride == st->stride) {
+        if (st->confidence < 3) {
+            st->confidence++;
+        }
+    } else {
+        st->stride = stride;
+        st->confidence = 0;
+    }
+    st->last = block;
+    if (st->confidence == 0) {
+        return;
+    }
+    for (long i = 0; i < pf->degree; i++) {
+        prefetch_block(c, block + (unsigned long)(stride * (pf->distance + i)),
+                       stats);
     }
 }
@@ -5,8 +5,14 @@
  * This program checks the correctness and performance of all of the
  * student's transpose functions and records the results for their
  * official submitted version as well.
+ *
+ * With -b, it also times every function natively, over a range of sizes,
+ * and reports the time per element and the bandwidth achieved next to the
+ * simulated results.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
@@ -18,6 +24,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h> // for WEXITSTATUS
+#include <time.h>
 #include <unistd.h>
 
 #include "cachelab.h"
@@ -36,6 +43,18 @@ static struct {
     csim_stats_t stats;
 } results = {-1, false, {LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX}};
 
+/** @brief Simulated results of each traced transpose function */
+static struct {
+    bool valid;
+    csim_stats_t stats;
+} simulated[MAX_TRANS_FUNCS];
+
+/** @brief Matrix sizes benchmarked by -b when no size is given, as M, N */
+static const size_t bench_sizes[][2] = {
+    {32, 32},     {64, 64},     {61, 67},     {256, 256},
+    {1000, 300},  {1024, 1024}, {2048, 2048}, {4096, 4096},
+};
+
 /**
  * @brief Calculates the number of clock cycles for the trace
  */
@@ -125,13 +144,114 @@ static bool compute_stats(const char *file_name, unsigned int s, unsigned int E,
     return true;
 }
 
+/** @brief Matrices for running transpose functions natively */
+typedef struct {
+    double *A;     /* Source matrix */
+    double *Acopy; /* Copy of A, to catch changes to it */
+    double *B;     /* Destination matrix, padded with a few extra rows */
+    double *Btarg; /* Expected contents of B */
+    double *T;     /* Temporary array */
+} native_mats_t;
+
+/**
+ * @brief Release the matrices allocated by alloc_native().
+ */
+static void free_native(native_mats_t *mats) {
+    free(mats->A);
+    free(mats->Acopy);
+    free(mats->B);
+    free(mats->Btarg);
+    free(mats->T);
+}
+
+/**
+ * @brief Allocate and fill matrices for running transpose functions on
+ * natively.
+ *
+ * B is padded with a few extra rows, as in tracegen-ct, and is given to
+ * firstTouchNative() before anything else writes it.
+ *
+ * @param[out] mats The matrices
+ *
+ * @return True if the function succeeded, and false otherwise
+ */
+static bool alloc_native(native_mats_t *mats) {
+    size_t rows = M + 10;
+    mats->A = malloc(N * M * sizeof(double));
+    mats->Acopy = malloc(N * M * sizeof(double));
+    mats->B = malloc(rows * N * sizeof(double));
+    mats->Btarg = calloc(rows * N, sizeof(double));
+    mats->T = calloc(TMPCOUNT, sizeof(double));
+    if (!mats->A || !mats->Acopy || !mats->B || !mats->Btarg || !mats->T) {
+        printf("Error: Not enough memory for %zux%zu matrices\n", M, N);
+        free_native(mats);
+        return false;
+    }
+
+    firstTouchNative(M, N, (double(*)[N])mats->B);
+    memset(mats->B + M * N, 0, (rows - M) * N * sizeof(double));
+    initMatrix(M, N, (double(*)[M])mats->A, (double(*)[N])mats->B);
+    memcpy(mats->Acopy, mats->A, N * M * sizeof(double));
+    correctTrans(M, N, (double(*)[M])mats->A, (double(*)[N])mats->Btarg);
+    return true;
+}
+
+/**
+ * @brief Run a transpose function natively once, and check it against
+ * correctTrans().
+ *
+ * @param[in] i    Index of the transpose function to use
+ * @param[in] mats The matrices to run it on
+ *
+ * @return True if the function transposed A into B, and false otherwise
+ */
+static bool run_native(int i, native_mats_t *mats) {
+    size_t rows = M + 10;
+
+    memset(mats->B, 0, M * N * sizeof(double));
+    (*func_list[i].func_ptr)(M, N, (double(*)[M])mats->A,
+                             (double(*)[N])mats->B, mats->T);
+
+    if (memcmp(mats->A, mats->Acopy, N * M * sizeof(double)) != 0) {
+        printf("Validation error at function %d! A corrupted\n", i);
+        return false;
+    }
+    if (memcmp(mats->B, mats->Btarg, rows * N * sizeof(double)) != 0) {
+        printf("Validation error at function %d! B is not the transpose "
+               "of A\n",
+               i);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks a native transpose function against correctTrans().
+ *
+ * Native functions are not traced, so they are run here directly.
+ *
+ * @param[in] i Index of the transpose function to use
+ *
+ * @return True if the function transposed A into B, and false otherwise
+ */
+static bool check_native(int i) {
+    native_mats_t mats;
+    if (!alloc_native(&mats)) {
+        return false;
+    }
+
+    bool correct = run_native(i, &mats);
+    free_native(&mats);
+    return correct;
+}
+
 /**
  * @brief Evaluate the performance of the registered transpose functions
  */
 static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
                       bool submission_only) {
 
-    registerFunctions();
+    memset(simulated, 0, sizeof(simulated));
 
     /* Evaluate the performance of each registered transpose function */
     for (int i = 0; i < func_counter; i++) {
@@ -151,6 +271,13 @@ static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
 
         printf("\nFunction %d out of %d (%s)\n", i, func_counter,
                func_list[i].description);
+
+        /* Native functions are checked here, but never traced */
+        if (func_list[i].native) {
+            printf("Native function: %s\n",
+                   check_native(i) ? "correct" : "incorrect");
+            continue;
+        }
         printf("Step 1: Validating and generating memory traces\n");
 
         if (!generate_trace(file_name, i)) {
@@ -173,6 +300,9 @@ static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
                i, func_list[i].description, stats.hits, stats.misses,
                stats.evictions, get_clock_cycles(stats.hits, stats.misses));
 
+        simulated[i].valid = true;
+        simulated[i].stats = stats;
+
         /* If it is transpose_submit(), record number of misses */
         if (results.funcid == i) {
             memcpy(&results.stats, &stats, sizeof(results.stats));
@@ -181,15 +311,88 @@ static void eval_perf(unsigned int s, unsigned int E, unsigned int b,
     }
 }
 
+/**
+ * @brief Returns the time on the monotonic clock, in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Time every registered transpose function natively, at the current
+ * size.
+ *
+ * Each function is run once to warm up and to be checked, and then timed
+ * over a number of runs, of which the fastest is reported. Bandwidth counts
+ * each element as read once and written once. The simulated columns are
+ * from the last eval_perf(), and are blank for native functions.
+ *
+ * @param[in] reps Number of timed runs of each function
+ *
+ * @return True if every function was correct, and false otherwise
+ */
+static bool eval_native(int reps) {
+    native_mats_t mats;
+    bool all_correct = true;
+
+    if (!alloc_native(&mats)) {
+        return false;
+    }
+
+    printf("\nBenchmark for M=%zu, N=%zu (fastest of %d runs)\n", M, N, reps);
+    printf("%4s %10s %8s %12s %14s  %s\n", "func", "ns/elem", "GB/s",
+           "misses", "clock_cycles", "description");
+    for (int i = 0; i < func_counter; i++) {
+        if (!run_native(i, &mats)) {
+            all_correct = false;
+            continue;
+        }
+
+        double best = -1;
+        for (int r = 0; r < reps; r++) {
+            double start = now();
+            (*func_list[i].func_ptr)(M, N, (double(*)[M])mats.A,
+                                     (double(*)[N])mats.B, mats.T);
+            double elapsed = now() - start;
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        double elems = (double)M * (double)N;
+        printf("%4d %10.3f %8.2f", i, best * 1e9 / elems,
+               2 * elems * sizeof(double) / best / 1e9);
+        if (simulated[i].valid) {
+            printf(" %12ld %14ld", simulated[i].stats.misses,
+                   get_clock_cycles(simulated[i].stats.hits,
+                                    simulated[i].stats.misses));
+        } else {
+            printf(" %12s %14s", "-", "-");
+        }
+        printf("  %s\n", func_list[i].description);
+    }
+
+    free_native(&mats);
+    return all_correct;
+}
+
 /**
  * @brief Print usage info
  */
 static void usage(char *argv[]) {
     printf("Usage: %s [-h] [-s] -M <rows> -N <cols>\n", argv[0]);
+    printf("       %s -b [-r <runs>] [-l] [-M <rows> -N <cols>]\n", argv[0]);
     printf("Options:\n");
     printf("  -h          Print this help message.\n");
     printf("  -s          Check official submission only.\n");
     printf("  -l          Simulate large (Haswell L1) cache\n");
+    printf("  -b          Also time each function natively, at the given "
+           "size or at a range\n"
+           "              of sizes.\n");
+    printf("  -r <runs>   Number of timed runs of each function (default "
+           "5)\n");
     printf("  -M <rows>   Number of destination matrix rows (max %d)\n", MAXN);
     printf("  -N <cols>   Number of destination matrix columns (max %d)\n",
            MAXN);
@@ -227,8 +430,10 @@ int main(int argc, char *argv[]) {
 
     bool submission_only = false;
     bool use_large_cache = false;
+    bool benchmark = false;
+    int reps = 5;
 
-    while ((c = getopt(argc, argv, "hcslM:N:")) != -1) {
+    while ((c = getopt(argc, argv, "hcslbr:M:N:")) != -1) {
         switch (c) {
         case 'M':
             M = (size_t)atoi(optarg);
@@ -242,6 +447,12 @@ int main(int argc, char *argv[]) {
         case 'l':
             use_large_cache = true;
             break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
         case 'h':
             usage(argv);
             exit(0);
@@ -251,7 +462,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (M == 0 || N == 0) {
+    if ((M == 0 || N == 0) && !(benchmark && M == 0 && N == 0)) {
         printf("Error: Missing required argument\n");
         usage(argv);
         exit(1);
@@ -263,6 +474,12 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (reps < 1) {
+        printf("Error: The number of runs must be positive\n");
+        usage(argv);
+        exit(1);
+    }
+
     /* Install SIGSEGV and SIGALRM handlers */
     if (signal(SIGSEGV, sigsegv_handler) == SIG_ERR) {
         fprintf(stderr, "Unable to install SIGALRM handler\n");
@@ -274,18 +491,42 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    /* Use Haswell L1 cache if asked, and the original cache otherwise */
+    unsigned int s = use_large_cache ? HASWELL_L1_SET : TEST_LOG_SET;
+    unsigned int E = use_large_cache ? HASWELL_L1_ASSOC : TEST_ASSOC;
+    unsigned int b = use_large_cache ? HASWELL_L1_BLOCK : TEST_LOG_BLOCK;
+
+    registerFunctions();
+    registerNativeFunctions();
+
+    /* Benchmarks run as long as they need to */
+    if (benchmark) {
+        size_t n = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+        bool fixed = M != 0;
+        status = 0;
+        for (size_t k = 0; k < (fixed ? 1 : n); k++) {
+            if (!fixed) {
+                M = bench_sizes[k][0];
+                N = bench_sizes[k][1];
+            }
+            eval_perf(s, E, b, submission_only);
+            if (!eval_native(reps)) {
+                status = 1;
+            }
+        }
+        for (int i = 0; i < func_counter; i++) {
+            char traceFile[FILENAME_BUFSIZE];
+            snprintf(traceFile, sizeof(traceFile), "trace.f%d", i);
+            remove(traceFile);
+        }
+        return status;
+    }
+
     /* Time out and give up after a while */
     alarm(360);
 
     /* Check the performance of the student's transpose function */
-    if (use_large_cache) {
-        /* Use Haswell L1 cache */
-        eval_perf(HASWELL_L1_SET, HASWELL_L1_ASSOC, HASWELL_L1_BLOCK,
-                  submission_only);
-    } else {
-        /* Use original cache otherwise */
-        eval_perf(TEST_LOG_SET, TEST_ASSOC, TEST_LOG_BLOCK, submission_only);
-    }
+    eval_perf(s, E, b, submission_only);
 
     /* Emit the results for this particular test */
     if (results.funcid == -1) {
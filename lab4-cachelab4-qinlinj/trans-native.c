@@ -0,0 +1,356 @@
+/**
+ * @file trans-native.c
+ * @brief Contains transpose functions for native runs only
+ *
+ * The functions here use vector registers and threads, which trans.c may
+ * not, and are not traced: test-trans checks their results natively instead
+ * of scoring them by simulated cache misses. They have the prototype of the
+ * functions in trans.c, leave tmp untouched, and are registered by
+ * registerNativeFunctions().
+ *
+ * Each function is built from a kernel that transposes a range of columns
+ * of A, that is, a range of rows of B, so that the threaded transpose can
+ * give each thread rows of B of its own.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
+
+#include "cachelab.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/** @brief Side of the square blocks each function works through in turn */
+#define BLOCK_SIZE 32
+
+/** @brief Maximum number of threads used by the threaded transpose */
+#define MAX_THREADS 64
+
+/** @brief Matrices with fewer elements are transposed on a single thread */
+#define PARALLEL_MIN (64 * 1024)
+
+/**
+ * @brief A kernel, which transposes columns [col, col_end) of A into B.
+ *
+ * The matrices are passed flat, as the kernels are called through pointers.
+ */
+typedef void (*cols_kernel_t)(size_t M, size_t N, const double *A, double *B,
+                              size_t col, size_t col_end);
+
+/**
+ * @brief Transposes rows [row, row_end) and columns [col, col_end) of A one
+ * element at a time.
+ */
+static void transpose_scalar_block(size_t M, size_t N, const double A[N][M],
+                                   double B[M][N], size_t row, size_t row_end,
+                                   size_t col, size_t col_end) {
+    for (size_t i = row; i < row_end; i++) {
+        for (size_t j = col; j < col_end; j++) {
+            B[j][i] = A[i][j];
+        }
+    }
+}
+
+/**
+ * @brief Transposes columns [col, col_end) of A in blocks, one element at a
+ * time.
+ *
+ * This is the fallback for processors without AVX2.
+ */
+static void transpose_scalar_cols(size_t M, size_t N, const double *A,
+                                  double *B, size_t col, size_t col_end) {
+    for (size_t i = 0; i < N; i += BLOCK_SIZE) {
+        for (size_t j = col; j < col_end; j += BLOCK_SIZE) {
+            transpose_scalar_block(M, N, (const double(*)[M])A,
+                                   (double(*)[N])B, i, MIN(i + BLOCK_SIZE, N),
+                                   j, MIN(j + BLOCK_SIZE, col_end));
+        }
+    }
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/**
+ * @brief Transposes the 4x4 tile of A at row i and column j into B.
+ *
+ * The four rows of the tile are loaded into registers. Unpacking pairs them
+ * up within each 128-bit lane, and permuting the lanes then completes the
+ * columns, which are stored as whole rows of B.
+ */
+__attribute__((target("avx2"))) static inline void
+transpose_tile_avx2(size_t M, size_t N, const double A[N][M], double B[M][N],
+                    size_t i, size_t j) {
+    __m256d r0 = _mm256_loadu_pd(&A[i][j]);
+    __m256d r1 = _mm256_loadu_pd(&A[i + 1][j]);
+    __m256d r2 = _mm256_loadu_pd(&A[i + 2][j]);
+    __m256d r3 = _mm256_loadu_pd(&A[i + 3][j]);
+
+    // a00 a10 a02 a12, a01 a11 a03 a13, a20 a30 a22 a32, a21 a31 a23 a33
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+    _mm256_storeu_pd(&B[j][i], _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(&B[j + 1][i], _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(&B[j + 2][i], _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(&B[j + 3][i], _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+/**
+ * @brief Transposes columns [col, col_end) of A in blocks of 4x4 tiles held
+ * in AVX2 registers.
+ *
+ * Rows and columns past the last whole tile are transposed one element at a
+ * time.
+ */
+__attribute__((target("avx2"))) static void
+transpose_avx2_cols(size_t M, size_t N, const double *A, double *B, size_t col,
+                    size_t col_end) {
+    const double(*a)[M] = (const double(*)[M])A;
+    double(*b)[N] = (double(*)[N])B;
+    size_t rows = N & ~(size_t)3;
+    size_t cols = col + ((col_end - col) & ~(size_t)3);
+
+    for (size_t ii = 0; ii < rows; ii += BLOCK_SIZE) {
+        size_t row_end = MIN(ii + BLOCK_SIZE, rows);
+        for (size_t jj = col; jj < cols; jj += BLOCK_SIZE) {
+            size_t block_end = MIN(jj + BLOCK_SIZE, cols);
+            for (size_t i = ii; i < row_end; i += 4) {
+                for (size_t j = jj; j < block_end; j += 4) {
+                    transpose_tile_avx2(M, N, a, b, i, j);
+                }
+            }
+        }
+    }
+
+    transpose_scalar_block(M, N, a, b, 0, rows, cols, col_end);
+    transpose_scalar_block(M, N, a, b, rows, N, col, col_end);
+}
+#endif
+
+/**
+ * @brief Picks the AVX2 kernel if the processor has AVX2, and the scalar
+ * kernel otherwise.
+ */
+static cols_kernel_t pick_kernel(void) {
+#ifdef HAVE_AVX2_KERNEL
+    static int has_avx2 = -1;
+    if (has_avx2 == -1) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (has_avx2) {
+        return transpose_avx2_cols;
+    }
+#endif
+    return transpose_scalar_cols;
+}
+
+/**
+ * @brief Transposes a matrix in blocks, one element at a time.
+ */
+static void transpose_scalar(size_t M, size_t N, double A[N][M],
+                             double B[M][N], double tmp[TMPCOUNT]) {
+    transpose_scalar_cols(M, N, &A[0][0], &B[0][0], 0, M);
+}
+
+/**
+ * @brief Transposes a matrix with the AVX2 kernel if the processor has AVX2,
+ * and in scalar code otherwise.
+ */
+static void transpose_simd(size_t M, size_t N, double A[N][M], double B[M][N],
+                           double tmp[TMPCOUNT]) {
+    assert(M > 0);
+    assert(N > 0);
+
+    pick_kernel()(M, N, &A[0][0], &B[0][0], 0, M);
+}
+
+/**
+ * @brief The pool of threads, and the job they are working on.
+ *
+ * The calling thread takes part as thread 0. It publishes a job by bumping
+ * the generation under the lock, and waits for the other threads to report
+ * it done.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;    // Signalled when a job is published.
+    pthread_cond_t finished; // Signalled when the last thread is done.
+    bool ready;              // Whether the threads have been started.
+    size_t threads;          // Number of threads, counting the caller.
+    unsigned long generation;
+    size_t pending;          // Number of threads still on the job.
+
+    cols_kernel_t kernel;    // The kernel to run, or NULL to zero B.
+    size_t M;
+    size_t N;
+    const double *A;
+    double *B;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .start = PTHREAD_COND_INITIALIZER,
+          .finished = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief Runs the share of the current job that belongs to a thread.
+ *
+ * Thread t gets the t-th of the threads ranges of rows of B, each a whole
+ * number of blocks, so each thread writes a contiguous part of B.
+ */
+static void run_share(size_t t) {
+    size_t blocks = (pool.M + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t first = blocks * t / pool.threads * BLOCK_SIZE;
+    size_t last = MIN(blocks * (t + 1) / pool.threads * BLOCK_SIZE, pool.M);
+
+    if (first >= last) {
+        return;
+    }
+    if (pool.kernel) {
+        pool.kernel(pool.M, pool.N, pool.A, pool.B, first, last);
+    } else {
+        memset(pool.B + first * pool.N, 0,
+               (last - first) * pool.N * sizeof(double));
+    }
+}
+
+/**
+ * @brief The loop run by each thread of the pool but the caller.
+ */
+static void *pool_thread(void *arg) {
+    size_t t = (size_t)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_share(t);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.finished);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the pool on first use, with a thread per online processor.
+ *
+ * If a thread can't be created, the pool makes do with those it has.
+ */
+static void start_pool(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pool.ready = true;
+    pool.threads = 1;
+    if (online > MAX_THREADS) {
+        online = MAX_THREADS;
+    }
+    for (long t = 1; t < online; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread,
+                           (void *)(size_t)pool.threads) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        pool.threads++;
+    }
+}
+
+/**
+ * @brief Runs a job on every thread of the pool, and waits for it.
+ *
+ * Small matrices are left to the calling thread alone.
+ */
+static void run_pool(cols_kernel_t kernel, size_t M, size_t N,
+                     const double *A, double *B) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.ready) {
+        start_pool();
+    }
+    if (pool.threads == 1 || M * N < PARALLEL_MIN) {
+        pthread_mutex_unlock(&pool.lock);
+        if (kernel) {
+            kernel(M, N, A, B, 0, M);
+        } else {
+            memset(B, 0, M * N * sizeof(double));
+        }
+        return;
+    }
+
+    pool.kernel = kernel;
+    pool.M = M;
+    pool.N = N;
+    pool.A = A;
+    pool.B = B;
+    pool.pending = pool.threads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_share(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending != 0) {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Transposes a matrix on a pool of threads.
+ *
+ * Each thread transposes whole blocks of rows of B, from the matching
+ * columns of A, with the kernel transpose_simd uses. The rows a thread
+ * writes are the ones firstTouchNative() zeroes on that thread, so on a
+ * NUMA machine they are in memory local to it.
+ */
+static void transpose_threads(size_t M, size_t N, double A[N][M],
+                              double B[M][N], double tmp[TMPCOUNT]) {
+    assert(M > 0);
+    assert(N > 0);
+
+    run_pool(pick_kernel(), M, N, &A[0][0], &B[0][0]);
+}
+
+/**
+ * @brief Zeroes the destination matrix of a transpose on the threads of the
+ * pool that transpose_threads() will write each part of it from.
+ *
+ * Operating systems that place a page on the node of the thread that first
+ * touches it will then keep each part of B near its writer. This has to be
+ * the first write to B.
+ *
+ * @param[in]  M Width of A, height of B
+ * @param[in]  N Height of A, width of B
+ * @param[out] B Matrix to zero
+ */
+void firstTouchNative(size_t M, size_t N, double B[M][N]) {
+    run_pool(NULL, M, N, NULL, &B[0][0]);
+}
+
+/**
+ * @brief Registers the native transpose functions with the driver.
+ */
+void registerNativeFunctions(void) {
+    registerNativeTransFunction(transpose_simd,
+                                "SIMD transpose (AVX2 if available)");
+    registerNativeTransFunction(transpose_scalar, "Scalar blocked transpose");
+    registerNativeTransFunction(transpose_threads,
+                                "Threaded transpose (one thread per CPU)");
+}
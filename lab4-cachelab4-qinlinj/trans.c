@@ -208,6 +208,94 @@ static void transpose_1024x1024(size_t M, size_t N, double A[N][M],
     }
 }
 
+/**
+ * Transposes the block of A made of rows [row, row_end) and columns
+ * [col, col_end), recursively.
+ * The larger side of the block is split in half until the block fits in 8x8,
+ * so that at some depth the rows of the block and of its transpose both fit
+ * in the cache, whatever its size. Splits are kept to multiples of 8, so that
+ * each base case covers whole cache lines where the rows allow it. In a base
+ * case on the diagonal, the diagonal element of each row is held in tmp until
+ * the rest of the row is written, as rows i of A and B may map to the same
+ * set.
+ *
+ * @param M: Width of the matrix A and height of matrix B.
+ * @param N: Height of the matrix A and width of matrix B.
+ * @param A: Source matrix (Input).
+ * @param B: Destination matrix where the transposed matrix will be stored
+ * (Output).
+ * @param tmp: Temporary storage for the diagonal elements.
+ * @param row: First row of the block.
+ * @param row_end: End of the rows of the block.
+ * @param col: First column of the block.
+ * @param col_end: End of the columns of the block.
+ */
+static void transpose_recursive(size_t M, size_t N, double A[N][M],
+                                double B[M][N], double tmp[TMPCOUNT],
+                                size_t row, size_t row_end, size_t col,
+                                size_t col_end) {
+    const size_t BLOCK_SIZE = 8;
+    size_t rows = row_end - row;
+    size_t cols = col_end - col;
+
+    if (rows > BLOCK_SIZE || cols > BLOCK_SIZE) {
+        // Split the longer side, at a multiple of the block size.
+        if (rows >= cols) {
+            size_t mid = row + (rows / 2 + BLOCK_SIZE - 1) / BLOCK_SIZE *
+                                   BLOCK_SIZE;
+            transpose_recursive(M, N, A, B, tmp, row, mid, col, col_end);
+            transpose_recursive(M, N, A, B, tmp, mid, row_end, col, col_end);
+        } else {
+            size_t mid = col + (cols / 2 + BLOCK_SIZE - 1) / BLOCK_SIZE *
+                                   BLOCK_SIZE;
+            transpose_recursive(M, N, A, B, tmp, row, row_end, col, mid);
+            transpose_recursive(M, N, A, B, tmp, row, row_end, mid, col_end);
+        }
+        return;
+    }
+
+    for (size_t i = row; i < row_end; ++i) {
+        bool diagonal = false;
+
+        for (size_t j = col; j < col_end; ++j) {
+            if (i != j) {
+                B[j][i] = A[i][j];
+            } else {
+                // diagonal element, store it temporarily in tmp to avoid
+                // cache conflict misses.
+                tmp[i - row] = A[i][j];
+                diagonal = true;
+            }
+        }
+
+        if (diagonal) {
+            B[i][i] = tmp[i - row];
+        }
+    }
+}
+
+/**
+ * Transposes a matrix of any size.
+ * This function divides the matrix recursively, so it does not depend on the
+ * size of the matrix or of the cache to keep the working set in the cache.
+ *
+ * @param M: Width of the matrix A and height of matrix B.
+ * @param N: Height of the matrix A and width of matrix B.
+ * @param A: Source matrix (Input).
+ * @param B: Destination matrix where the transposed matrix will be stored
+ * (Output).
+ * @param tmp: Temporary storage for the diagonal elements.
+ */
+static void transpose_oblivious(size_t M, size_t N, double A[N][M],
+                                double B[M][N], double tmp[TMPCOUNT]) {
+    assert(M > 0);
+    assert(N > 0);
+
+    transpose_recursive(M, N, A, B, tmp, 0, N, 0, M);
+
+    assert(is_transpose(M, N, A, B));
+}
+
 static void transpose_submit(size_t M, size_t N, double A[N][M], double B[M][N],
                              double tmp[TMPCOUNT]) {
     if (M == 32 && N == 32) {
@@ -216,14 +304,9 @@ static void transpose_submit(size_t M, size_t N, double A[N][M], double B[M][N],
         transpose_1024x1024(M, N, A, B, tmp);
     } else {
         // For other sizes.
-        for (size_t i = 0; i < N; i++) {
-            for (size_t j = 0; j < M; j++) {
-                B[j][i] = A[i][j];
-            }
-        }
+        transpose_oblivious(M, N, A, B, tmp);
     }
 }
-
 /**
  * @brief Registers all transpose functions with the driver.
  *
@@ -238,4 +321,6 @@ void registerFunctions(void) {
     // Register any additional transpose functions
     registerTransFunction(trans_basic, "Basic transpose");
     registerTransFunction(trans_tmp, "Transpose using the temporary array");
+    registerTransFunction(transpose_oblivious,
+                          "Cache-oblivious recursive transpose");
 }
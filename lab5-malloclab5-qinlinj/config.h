@@ -131,6 +131,11 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Size of a huge page, to which a heap backed by huge pages is aligned
+ */
+#define HUGE_PAGE_SIZE (1UL << 21) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -1,10 +1,19 @@
 /* Compute time used by function f */
 
+#define _GNU_SOURCE 1
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/times.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "clock.h"
 #include "fcyc.h"
 
@@ -32,6 +41,14 @@ static unsigned long int *cache_buf = NULL;
 static double *values = NULL;
 static unsigned long int samplecount = 0;
 
+/* Hardware event counters, one per fcyc_event_t, or -1 if not open */
+static bool count_events = false;
+static int event_fd[FCYC_NUM_EVENTS] = {-1, -1, -1, -1, -1};
+/* Events per call of the function in the fastest sample so far... */
+static double event_counts[FCYC_NUM_EVENTS];
+/* ...and its time or cycles per call, or -1 before the first sample */
+static double event_sample = -1;
+
 #define KEEP_VALS 0
 #define KEEP_SAMPLES 0
 
@@ -57,6 +74,9 @@ static void init_sampler(void) {
     samples = calloc(maxsamples + kbest, sizeof(double));
 #endif
     samplecount = 0;
+    event_sample = -1;
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++)
+        event_counts[e] = -1;
 }
 
 /* Add new sample.  */
@@ -88,6 +108,85 @@ static unsigned long int has_converged(void) {
            ((1 + epsilon) * values[0] >= values[kbest - 1]);
 }
 
+/* Code to count hardware events */
+
+#ifdef __linux__
+/* How to ask the kernel for each fcyc_event_t */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} event_attrs[FCYC_NUM_EVENTS] = {
+    [FCYC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [FCYC_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [FCYC_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [FCYC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [FCYC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/* Open a counter for one event in this process, in user mode only */
+static int open_event(fcyc_event_t e) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = event_attrs[e].type;
+    attr.config = event_attrs[e].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* The counters may have to share the PMU; these let us scale up */
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Reset and start the counters before a sample */
+static void start_events(void) {
+#ifdef __linux__
+    if (!count_events)
+        return;
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++) {
+        if (event_fd[e] >= 0) {
+            ioctl(event_fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(event_fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/* Stop the counters after a sample of reps calls, and keep their counts
+   if it was the fastest sample so far */
+static void stop_events(double sample, unsigned long reps) {
+#ifdef __linux__
+    if (!count_events)
+        return;
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++) {
+        if (event_fd[e] >= 0)
+            ioctl(event_fd[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    if (sample <= 0.0 || (event_sample >= 0 && sample >= event_sample))
+        return;
+    event_sample = sample;
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++) {
+        uint64_t v[3]; /* value, time enabled, time running */
+        event_counts[e] = -1;
+        if (event_fd[e] < 0 ||
+            read(event_fd[e], v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0)
+            continue;
+        event_counts[e] = (double)v[0] * ((double)v[1] / (double)v[2]) /
+                          (double)reps;
+    }
+#else
+    (void)sample;
+    (void)reps;
+#endif
+}
+
 /* Code to clear cache */
 
 static volatile unsigned long int sink = 0;
@@ -136,11 +235,13 @@ double fcyc(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
+        start_events();
         start_counter();
         for (r = 0; r < reps; r++) {
             f(args);
         }
         cyc = (double)get_counter() / (double)reps;
+        stop_events(cyc, reps);
         if (cyc > 0.0)
             add_sample(cyc);
     } while (!has_converged() && samplecount < maxsamples);
@@ -176,11 +277,13 @@ double fsec(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
+        start_events();
         start_timer();
         for (r = 0; r < reps; r++) {
             f(args);
         }
         sec = get_timer() / (double)reps;
+        stop_events(sec, reps);
         //        printf(" %.3f", sec * 1e6);
         if (sec > 0.0)
             add_sample(sec);
@@ -255,3 +358,33 @@ void set_fcyc_maxsamples(unsigned long int maxsamples_arg) {
 void set_fcyc_epsilon(double epsilon_arg) {
     epsilon = epsilon_arg;
 }
+
+/* When set, will count hardware events while the function runs.
+   Returns the number of events that can be counted.
+   Default = false
+*/
+int set_fcyc_counters(bool count) {
+    int n = 0;
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++) {
+#ifdef __linux__
+        if (count && event_fd[e] < 0)
+            event_fd[e] = open_event((fcyc_event_t)e);
+        else if (!count && event_fd[e] >= 0) {
+            close(event_fd[e]);
+            event_fd[e] = -1;
+        }
+#endif
+        if (event_fd[e] >= 0)
+            n++;
+    }
+    count_events = count;
+    return n;
+}
+
+/* Get the events counted by the last call of fcyc or fsec, per call of
+   the function.  Events that couldn't be counted are given as -1.
+*/
+void get_fcyc_counts(double counts[FCYC_NUM_EVENTS]) {
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++)
+        counts[e] = count_events ? event_counts[e] : -1;
+}
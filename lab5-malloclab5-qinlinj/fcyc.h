@@ -2,7 +2,8 @@
    is passed a list of integer parameters, which it may interpret
    in any way it chooses.
 
-   Time can be measured in seconds or clock cycles.
+   Time can be measured in seconds or clock cycles.  On Linux, hardware
+   events can also be counted while the function runs.
 */
 #ifndef FCYC_H__
 #define FCYC_H__ 1
@@ -11,6 +12,16 @@
 
 typedef void (*test_funct)(void *);
 
+/* Hardware events that can be counted by fcyc and fsec */
+typedef enum {
+    FCYC_INSTRUCTIONS,  /* instructions retired */
+    FCYC_L1D_MISSES,    /* L1 data cache read misses */
+    FCYC_LLC_MISSES,    /* last-level cache misses */
+    FCYC_BRANCH_MISSES, /* mispredicted branches */
+    FCYC_DTLB_MISSES,   /* data TLB read misses */
+    FCYC_NUM_EVENTS
+} fcyc_event_t;
+
 /* Compute number of cycles used by function f on given set of parameters */
 double fcyc(test_funct f, void *args);
 
@@ -62,4 +73,17 @@ void set_fcyc_maxsamples(unsigned long int maxsamples);
 */
 void set_fcyc_epsilon(double epsilon);
 
+/* When set, will count hardware events with perf_event_open(2) while the
+   function runs.  Returns the number of events that can be counted, which
+   may be 0 where the kernel doesn't allow it.
+   Default = false
+*/
+int set_fcyc_counters(bool count);
+
+/* Get the events counted by the last call of fcyc or fsec, per call of
+   the function, from the fastest sample.  Events that couldn't be counted
+   are given as -1.
+*/
+void get_fcyc_counts(double counts[FCYC_NUM_EVENTS]);
+
 #endif /* fcyc.h */
@@ -16,16 +16,25 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/wait.h>
+
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
 #ifdef USE_MSAN
 #include <sanitizer/msan_interface.h>
 #endif
@@ -64,7 +73,8 @@
 
 /*
  * Records the extent of each block's payload.
- * Organized as doubly linked list
+ * Organized as doubly linked list, sorted by address only with sparse
+ * emulation
  */
 typedef struct range_t {
     char *lo;           /* low payload address */
@@ -76,13 +86,27 @@ typedef struct range_t {
 
 /*
  * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * list of ranges, plus an index for finding overlaps. With sparse
+ * emulation, the index is a splay tree keyed by lo addresses. Otherwise it
+ * is an open-addressed hash table of the ranges by lo address, with a
+ * shadow bitmap of the dense heap holding a bit for each ALIGNMENT-byte
+ * granule, set where some payload lies. Payloads start on granule
+ * boundaries, so two overlap exactly when they share a granule, and a
+ * check costs one bit per granule rather than a search.
  */
 typedef struct {
     range_t *list;
-    tree_t *lo_tree;
+    tree_t *lo_tree; /* with sparse emulation */
+    range_t **table; /* by lo address; NULL where empty */
+    size_t table_mask; /* number of entries less one, a power of two */
+    size_t count;      /* ranges in the table */
+    uint64_t *shadow;  /* a bit for each granule of the dense heap */
+    size_t probes;     /* table entries looked at, for -v 3 */
 } range_set_t;
 
+/* Granules of the dense heap, each of which has a bit in a shadow bitmap */
+#define SHADOW_GRANULES (MAX_DENSE_HEAP / ALIGNMENT)
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -98,7 +122,7 @@ typedef struct {
     /* set from the trace parameters */
     const char *filename;
     weight_t weight;
-    unsigned int ops; /* number of ops (malloc/free/realloc) in the trace */
+    size_t ops; /* number of ops (malloc/free/realloc) in the trace */
 
     /* run-time stats defined for both libc and student */
     bool valid;  /* was the trace processed correctly by the allocator? */
@@ -108,6 +132,9 @@ typedef struct {
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
 
+    /* hardware events per op while timing the trace, or -1 (set by -H) */
+    double events[FCYC_NUM_EVENTS];
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -145,6 +172,19 @@ static unsigned int verbose = REF_ONLY ? 0 : 1; /* verbosity level */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool stats_mode = false; /* Print allocator statistics per trace */
+static bool events_mode = false; /* Count hardware events per trace */
+static unsigned int jobs = 1;   /* Traces to check at once (set by -j) */
+static unsigned int window = 0; /* If set, stream traces this many ops at a
+                                   time (set by -w) */
+/* If set, write a utilization timeline here (set by -U)... */
+static FILE *timeline = NULL;
+/* ...sampled every this many ops (set by -u) */
+static unsigned int timeline_interval = 1000;
+#ifdef MM_THREADS
+static unsigned int max_threads = 0; /* If set, measure scaling up to this
+                                        many threads (set by -P) */
+#endif
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -201,11 +241,13 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, size_t tracenum);
+static void timeline_header(void);
 static void eval_mm_speed(void *ptr);
 static double compute_scaled_score(double value, double min, double max);
 
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void printevents(size_t n, const stats_t *stats);
 static void usage(const char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -226,16 +268,220 @@ static void timeout_handler(int sig __attribute__((unused))) {
     longjmp(timeout_jmpbuf, 1);
 }
 
+/* Time spent running the ops of streamed traces, kept by the xxx_speed
+ * functions */
+static double stream_secs;
+
+/* stream_clock - Read a clock for timing the windows of a streamed trace */
+static double stream_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * time_trace - Time a trace with one of the xxx_speed functions. A
+ *     streamed trace is run just once, and is timed window by window, so
+ *     the time spent reading it isn't counted.
+ */
+static double time_trace(test_funct f, speed_t *params) {
+    if (params->trace->stream == NULL)
+        return fsec(f, params);
+    stream_secs = 0;
+    f(params);
+    return stream_secs;
+}
+
+/*
+ * record_events - With -H, keep the hardware events per op counted while
+ *     a trace was timed. Streamed traces aren't timed by fsec, so their
+ *     events aren't counted.
+ */
+static void record_events(stats_t *stats, const trace_t *trace) {
+    get_fcyc_counts(stats->events);
+    for (int e = 0; e < FCYC_NUM_EVENTS; e++) {
+        if (trace->stream != NULL || sparse_mode || stats->ops == 0)
+            stats->events[e] = -1;
+        else if (stats->events[e] >= 0)
+            stats->events[e] /= (double)stats->ops;
+    }
+}
+
+/*
+ * load_trace - Read a trace, or with -w open it to be streamed
+ */
+static trace_t *load_trace(const char *filename) {
+    if (window > 0)
+        return open_trace_stream(filename, window, verbose);
+    return read_trace(filename, verbose);
+}
+
 /* Compute throughput from reference implementation */
 static double lookup_ref_throughput(bool checkpoint);
 static double measure_ref_throughput(bool checkpoint);
 
+/* What a checker process sends back about its trace */
+typedef struct {
+    bool valid;
+    double util;
+    size_t ops;
+    int errors;
+} check_result_t;
+
+/*
+ * check_trace - Check one trace for correctness twice, since the allocator
+ *     may fail to reinitialize properly, and then measure its utilization
+ */
+static void check_trace(trace_t *trace, size_t tracenum,
+                        check_result_t *result) {
+    range_set_t *ranges = new_range_set();
+    result->valid = eval_mm_valid(trace, ranges);
+    free_range_set(ranges);
+
+    ranges = new_range_set();
+    result->valid = result->valid && eval_mm_valid(trace, ranges);
+    free_range_set(ranges);
+    result->ops = trace_ops_read(trace);
+
+    result->util = 0;
+#if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
+    if (result->valid) {
+        result->util = eval_mm_util(trace, tracenum);
+        if (stats_mode) {
+            printf("Allocator statistics for %s:\n", trace->filename);
+            mm_stats_dump(stdout);
+        }
+    }
+#endif
+}
+
+/*
+ * check_tests - Check up to jobs traces at once, each in a process of its
+ *     own with its own simulated heap, which sends back its results through
+ *     a pipe. A process that dies, whether the allocator crashed or the
+ *     driver found an error it can't go on from, leaves its trace invalid.
+ */
+static void check_tests(size_t num_tracefiles, char **tracefiles,
+                        stats_t *mm_stats) {
+    pid_t *pids = calloc(num_tracefiles, sizeof(pid_t));
+    int *fds = calloc(num_tracefiles, sizeof(int));
+    if (pids == NULL || fds == NULL)
+        unix_error("calloc failed in check_tests");
+
+    volatile size_t next = 0;
+    volatile unsigned int running = 0;
+
+    /* On a timeout, give up on the traces still being checked */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        for (size_t i = 0; i < next; i++) {
+            if (pids[i] > 0) {
+                kill(pids[i], SIGKILL);
+                waitpid(pids[i], NULL, 0);
+                close(fds[i]);
+                mm_stats[i].valid = false;
+            }
+        }
+        for (size_t i = next; i < num_tracefiles; i++) {
+            mm_stats[i].valid = false;
+        }
+        free(pids);
+        free(fds);
+        return;
+    }
+
+    while (next < num_tracefiles || running > 0) {
+        if (next < num_tracefiles && running < jobs) {
+            size_t i = next;
+            int fd[2];
+            if (pipe(fd) < 0)
+                unix_error("pipe failed in check_tests");
+
+            /* Don't let the child print what's still buffered here */
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid < 0)
+                unix_error("fork failed in check_tests");
+
+            if (pid == 0) {
+                check_result_t result;
+                close(fd[0]);
+                mem_init(sparse_mode);
+                trace_t *trace = load_trace(tracefiles[i]);
+                check_trace(trace, i, &result);
+                result.errors = errors;
+                if (write(fd[1], &result, sizeof(result)) !=
+                    (ssize_t)sizeof(result))
+                    unix_error("write failed in check_tests");
+                exit(0);
+            }
+
+            close(fd[1]);
+            pids[i] = pid;
+            fds[i] = fd[0];
+            next = i + 1;
+            running++;
+            continue;
+        }
+
+        /* Collect whichever child finishes first */
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            unix_error("wait failed in check_tests");
+        size_t i = 0;
+        while (i < next && pids[i] != pid)
+            i++;
+        if (i == next)
+            continue;
+
+        check_result_t result;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            read(fds[i], &result, sizeof(result)) ==
+                (ssize_t)sizeof(result)) {
+            mm_stats[i].valid = result.valid;
+            mm_stats[i].util = result.util;
+            mm_stats[i].ops = result.ops;
+            errors += result.errors;
+        } else {
+            fprintf(stderr, "Checking %s failed in its child process\n",
+                    tracefiles[i]);
+            mm_stats[i].valid = false;
+            errors++;
+        }
+        close(fds[i]);
+        pids[i] = 0;
+        running--;
+    }
+
+    free(pids);
+    free(fds);
+}
+
+/*
+ * pin_to_cpu - Keep the driver on the processor it is running on, so
+ *     timings aren't disturbed by its moving between them
+ */
+static void pin_to_cpu(void) {
+    int cpu = sched_getcpu();
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0 && verbose > 1)
+        fprintf(stderr, "Couldn't pin the driver to processor %d\n", cpu);
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
- * num_tracefiles, if there's a timeout)
+ * num_tracefiles, if there's a timeout). With checked set, check_tests has
+ * already checked the traces, and only those it found valid are timed.
  */
 static void run_tests(size_t num_tracefiles, char **tracefiles,
-                      stats_t *mm_stats, speed_t *speed_params) {
+                      stats_t *mm_stats, speed_t *speed_params,
+                      bool checked) {
     volatile size_t i;
     range_set_t *volatile ranges = 0;
 
@@ -247,15 +493,15 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
 
         // NOTE: If times out, then it will reread the trace file
 
-        trace_t *trace = read_trace(tracefiles[i], verbose);
+        trace_t *trace = load_trace(tracefiles[i]);
         mm_stats[i].filename = tracefiles[i];
-        mm_stats[i].weight = trace->weight;
-        mm_stats[i].ops = trace->num_ops;
+        /* A trace read from a pipe can be run only once, so isn't scored */
+        mm_stats[i].weight = trace_can_rewind(trace) ? trace->weight : WNONE;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0) {
             mm_stats[i].valid = false;
-        } else {
+        } else if (!checked) {
             if (verbose > 1) {
                 fprintf(stderr, "[%zu/%zu] Checking mm malloc for correctness",
                         i, num_tracefiles);
@@ -265,10 +511,13 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 /* Do 2 tests, since may fail to reinitialize properly */
                 eval_mm_valid(trace, ranges);
 
-            free_range_set(ranges);
-            ranges = new_range_set();
-            mm_stats[i].valid =
-                mm_stats[i].valid && eval_mm_valid(trace, ranges);
+            if (trace_can_rewind(trace)) {
+                free_range_set(ranges);
+                ranges = new_range_set();
+                mm_stats[i].valid =
+                    mm_stats[i].valid && eval_mm_valid(trace, ranges);
+            }
+            mm_stats[i].ops = trace_ops_read(trace);
 
             if (onetime_flag) {
                 if (verbose > 1) {
@@ -281,12 +530,18 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
             }
         }
 #if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
-        if (mm_stats[i].valid) {
+        if (mm_stats[i].valid && trace_can_rewind(trace)) {
             if (verbose > 1) {
                 fputs(", efficiency", stderr);
                 fflush(stderr);
             }
-            mm_stats[i].util = eval_mm_util(trace, i);
+            if (!checked) {
+                mm_stats[i].util = eval_mm_util(trace, i);
+                if (stats_mode) {
+                    printf("Allocator statistics for %s:\n", tracefiles[i]);
+                    mm_stats_dump(stdout);
+                }
+            }
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1) {
@@ -294,17 +549,23 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fflush(stderr);
             }
             mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
-            mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+                sparse_mode ? 1.0 : time_trace(eval_mm_speed, speed_params);
+            mm_stats[i].tput =
+                (double)mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            record_events(&mm_stats[i], trace);
         }
 #endif
         if (verbose > 0) {
             putc('.', stderr);
-            if (verbose > 2)
-                fprintf(stderr, " %d operations.  %ld comparisons.  Avg = %.1f",
-                        trace->num_ops, ranges->lo_tree->comparison_count,
-                        (double)ranges->lo_tree->comparison_count /
-                            trace->num_ops);
+            if (verbose > 2) {
+                size_t comparisons = ranges->lo_tree != NULL
+                                       ? ranges->lo_tree->comparison_count
+                                       : ranges->probes;
+                fprintf(stderr,
+                        " %zu operations.  %zu comparisons.  Avg = %.1f",
+                        mm_stats[i].ops, comparisons,
+                        (double)comparisons / (double)mm_stats[i].ops);
+            }
             if (verbose > 1)
                 putc('\n', stderr);
             fflush(stderr);
@@ -318,6 +579,223 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
     }
 }
 
+#ifdef MM_THREADS
+/**********************************************************************
+ * The multithreaded benchmark. Each trace is replayed by 1 to
+ * max_threads threads at once, with its blocks dealt out among them:
+ * each block is allocated and resized by one thread, and for every other
+ * block, freed by the next, so that half the frees cross threads the way
+ * a producer hands work to a consumer. The ops on any one block still run
+ * in trace order, each waiting for the one before it, wherever it ran.
+ **********************************************************************/
+
+/* Times each thread count is run, keeping the fastest */
+#define MT_RUNS 3
+
+/* An op as one thread of the benchmark runs it */
+typedef struct {
+    traceop_t op;
+    unsigned int turn; /* Number of ops on the block before this one */
+} mt_op_t;
+
+/* What each thread of the benchmark is given */
+typedef struct {
+    trace_t *trace;
+    mt_op_t *ops;
+    size_t num_ops;
+    bool use_libc;
+    atomic_uint *turns; /* Ops done so far on each block */
+    pthread_barrier_t *start;
+    double begin; /* When the thread left the start barrier */
+    double end;   /* When it finished its ops */
+} mt_thread_t;
+
+/*
+ * mt_split - Deal out the ops of a trace among nthreads threads, setting
+ *     each thread's ops and num_ops
+ */
+static void mt_split(const trace_t *trace, unsigned int nthreads,
+                     mt_thread_t *threads) {
+    unsigned int *turns = calloc(trace->num_ids, sizeof(unsigned int));
+    if (turns == NULL)
+        unix_error("calloc failed in mt_split");
+
+    for (unsigned int t = 0; t < nthreads; t++) {
+        threads[t].ops = malloc(trace->num_ops * sizeof(mt_op_t));
+        if (threads[t].ops == NULL)
+            unix_error("malloc failed in mt_split");
+        threads[t].num_ops = 0;
+    }
+
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        unsigned int index = op->index, t = 0, turn = 0;
+        if (index != (unsigned int)-1) {
+            t = index % nthreads;
+            if (op->type == FREE && index / nthreads % 2 == 1)
+                t = (t + 1) % nthreads;
+            turn = turns[index]++;
+        }
+        mt_thread_t *thread = &threads[t];
+        thread->ops[thread->num_ops].op = *op;
+        thread->ops[thread->num_ops].turn = turn;
+        thread->num_ops++;
+    }
+    free(turns);
+}
+
+/*
+ * mt_replay - Run one thread's share of a trace, with the mm package or
+ *     libc's
+ */
+static void *mt_replay(void *arg) {
+    mt_thread_t *thread = arg;
+    trace_t *trace = thread->trace;
+    bool use_libc = thread->use_libc;
+
+    pthread_barrier_wait(thread->start);
+    thread->begin = stream_clock();
+    for (size_t i = 0; i < thread->num_ops; i++) {
+        const traceop_t *op = &thread->ops[i].op;
+        unsigned int index = op->index, turn = thread->ops[i].turn;
+        char *p;
+
+        if (index == (unsigned int)-1) {
+            if (use_libc)
+                free(NULL);
+            else
+                mm_free(NULL);
+            continue;
+        }
+        while (atomic_load_explicit(&thread->turns[index],
+                                    memory_order_acquire) != turn)
+            sched_yield();
+
+        switch (op->type) {
+        case ALLOC:
+            p = use_libc ? malloc(op->size) : mm_malloc(op->size);
+            if (p == NULL)
+                app_error("malloc failed in mt_replay");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            p = use_libc ? realloc(trace->blocks[index], op->size)
+                         : mm_realloc(trace->blocks[index], op->size);
+            if (p == NULL && op->size != 0)
+                app_error("realloc failed in mt_replay");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE:
+            if (use_libc)
+                free(trace->blocks[index]);
+            else
+                mm_free(trace->blocks[index]);
+            break;
+        }
+        atomic_store_explicit(&thread->turns[index], turn + 1,
+                              memory_order_release);
+    }
+    thread->end = stream_clock();
+    return NULL;
+}
+
+/*
+ * mt_run - Replay a trace once with nthreads threads, and return how many
+ *     seconds it took, from the first thread starting to the last one
+ *     finishing. Each thread times itself, since on a busy host the threads
+ *     can finish before the main thread even returns from the barrier
+ */
+static double mt_run(trace_t *trace, mt_thread_t *threads,
+                     unsigned int nthreads, bool use_libc) {
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    atomic_uint *turns = malloc(trace->num_ids * sizeof(atomic_uint));
+    pthread_barrier_t start;
+    if (tids == NULL || turns == NULL)
+        unix_error("malloc failed in mt_run");
+    for (unsigned int i = 0; i < trace->num_ids; i++)
+        atomic_init(&turns[i], 0);
+
+    reinit_trace(trace);
+    if (!use_libc) {
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in mt_run");
+    }
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (unsigned int t = 0; t < nthreads; t++) {
+        threads[t].trace = trace;
+        threads[t].use_libc = use_libc;
+        threads[t].turns = turns;
+        threads[t].start = &start;
+        if (pthread_create(&tids[t], NULL, mt_replay, &threads[t]) != 0)
+            app_error("pthread_create failed in mt_run");
+    }
+    pthread_barrier_wait(&start);
+    double begin = DBL_MAX, end = 0;
+    for (unsigned int t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        begin = threads[t].begin < begin ? threads[t].begin : begin;
+        end = threads[t].end > end ? threads[t].end : end;
+    }
+    double secs = end - begin;
+
+    pthread_barrier_destroy(&start);
+    free(turns);
+    free(tids);
+    return secs;
+}
+
+/*
+ * mt_tests - Measure how the throughput of the mm package and of libc's
+ *     scales from 1 to max_threads threads on each trace
+ */
+static void mt_tests(size_t num_tracefiles, char **tracefiles) {
+    mt_thread_t *threads = calloc(max_threads, sizeof(mt_thread_t));
+    if (threads == NULL)
+        unix_error("calloc failed in mt_tests");
+
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        mem_init(sparse_mode);
+        trace_t *trace = read_trace(tracefiles[i], verbose);
+        double mm_base = 0, libc_base = 0;
+
+        printf("\nThread scaling for %s (%u ops, half the frees cross "
+               "threads):\n",
+               tracefiles[i], trace->num_ops);
+        printf("%7s %11s %7s %11s %7s\n", "threads", "mm Kops/s", "speedup",
+               "libc Kops/s", "speedup");
+        for (unsigned int n = 1; n <= max_threads; n++) {
+            double mm_secs = DBL_MAX, libc_secs = DBL_MAX;
+            mt_split(trace, n, threads);
+            for (int run = 0; run < MT_RUNS; run++) {
+                double secs = mt_run(trace, threads, n, false);
+                mm_secs = secs < mm_secs ? secs : mm_secs;
+                secs = mt_run(trace, threads, n, true);
+                libc_secs = secs < libc_secs ? secs : libc_secs;
+            }
+            for (unsigned int t = 0; t < n; t++)
+                free(threads[t].ops);
+
+            double mm_kops = trace->num_ops / (mm_secs * 1000.0);
+            double libc_kops = trace->num_ops / (libc_secs * 1000.0);
+            if (n == 1) {
+                mm_base = mm_kops;
+                libc_base = libc_kops;
+            }
+            printf("%7u %11.0f %7.2f %11.0f %7.2f\n", n, mm_kops,
+                   mm_kops / mm_base, libc_kops, libc_kops / libc_base);
+        }
+
+        free_trace(trace);
+        mem_deinit();
+    }
+    free(threads);
+}
+#endif /* MM_THREADS */
+
 /**************
  * Main routine
  **************/
@@ -350,7 +828,8 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:j:s:t:u:v:w:L:P:U:hpCOVAlDSTH")) !=
+           EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -411,10 +890,54 @@ int main(int argc, char **argv) {
             set_timeout = atoui_or_usage(optarg, "-s", argv[0]);
             break;
 
+        case 'j':
+            jobs = atoui_or_usage(optarg, "-j", argv[0]);
+            break;
+
+        case 'w':
+            window = atoui_or_usage(optarg, "-w", argv[0]);
+            break;
+
+        case 'L':
+            if (strcmp(optarg, "thp") == 0)
+                mem_set_pages(MEM_PAGES_THP);
+            else if (strcmp(optarg, "hugetlb") == 0)
+                mem_set_pages(MEM_PAGES_HUGETLB);
+            else
+                app_error("'-L' needs thp or hugetlb");
+            break;
+
+        case 'U':
+            if ((timeline = fopen(optarg, "w")) == NULL)
+                unix_error("Could not create %s for '-U'", optarg);
+            break;
+
+        case 'u':
+            timeline_interval = atoui_or_usage(optarg, "-u", argv[0]);
+            if (timeline_interval == 0)
+                app_error("'-u' needs an interval of at least 1");
+            break;
+
+        case 'P':
+#ifdef MM_THREADS
+            max_threads = atoui_or_usage(optarg, "-P", argv[0]);
+#else
+            app_error("'-P' needs mdriver-threads");
+#endif
+            break;
+
         case 'T':
             tab_mode = true;
             break;
 
+        case 'S':
+            stats_mode = true;
+            break;
+
+        case 'H':
+            events_mode = true;
+            break;
+
         case 'h': /* Print usage message */
             usage(argv[0]);
             exit(0);
@@ -445,10 +968,39 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* Checker processes would write the timeline all at once */
+    if (timeline != NULL) {
+        if (jobs > 1)
+            app_error("'-U' can't be used with '-j'");
+        timeline_header();
+    }
+
+    /* Standard input can be read only once, by one process */
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        if (strcmp(tracefiles[i], "-") == 0 &&
+            (window == 0 || jobs > 1 || run_libc || num_tracefiles > 1)) {
+            app_error("a trace on standard input needs -w, and can't be used "
+                      "with -j, -l or another trace");
+        }
+    }
+
     if (debug_mode != DBG_NONE) {
         init_random_data();
     }
 
+#ifdef MM_THREADS
+    if (max_threads > 0) {
+        mt_tests(num_tracefiles, tracefiles);
+        exit(0);
+    }
+#endif
+
+    if (events_mode && set_fcyc_counters(true) == 0) {
+        fputs("Warning: hardware events can't be counted here; is "
+              "perf_event_paranoid too high?\n",
+              stderr);
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -469,10 +1021,9 @@ int main(int argc, char **argv) {
 
         /* Evaluate the libc malloc package using the K-best scheme */
         for (size_t i = 0; i < num_tracefiles; i++) {
-            trace_t *trace = read_trace(tracefiles[i], verbose);
+            trace_t *trace = load_trace(tracefiles[i]);
             libc_stats[i].filename = tracefiles[i];
             libc_stats[i].weight = trace->weight;
-            libc_stats[i].ops = trace->num_ops;
 
             if (verbose > 1) {
                 fprintf(stderr,
@@ -481,13 +1032,15 @@ int main(int argc, char **argv) {
                 fflush(stderr);
             }
             libc_stats[i].valid = eval_libc_valid(trace);
+            libc_stats[i].ops = trace_ops_read(trace);
             if (libc_stats[i].valid) {
                 speed_params.trace = trace;
                 if (verbose > 1) {
                     fputs(" and performance", stderr);
                     fflush(stderr);
                 }
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                libc_stats[i].secs = time_trace(eval_libc_speed, &speed_params);
+                record_events(&libc_stats[i], trace);
             }
             free_trace(trace);
             if (verbose > 1) {
@@ -535,7 +1088,12 @@ int main(int argc, char **argv) {
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracefiles, mm_stats, &speed_params);
+    bool checked = jobs > 1 && !onetime_flag;
+    if (checked) {
+        check_tests(num_tracefiles, tracefiles, mm_stats);
+        pin_to_cpu();
+    }
+    run_tests(num_tracefiles, tracefiles, mm_stats, &speed_params, checked);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -707,6 +1265,11 @@ static void add_tracefile(char ***tracefiles_p, size_t *num_tracefiles_p,
         unix_error("realloc in add_tracefile failed");
     }
 
+    /* Standard input, or a trace given by its full path, is used as is */
+    if (strcmp(trace, "-") == 0 || trace[0] == '/') {
+        tracedir = "";
+    }
+
     if (asprintf(&tracefiles[num_tracefiles++], "%s%s", tracedir, trace) ==
         -1) {
         unix_error("asprintf in add_tracefile failed");
@@ -726,12 +1289,133 @@ static void add_tracefile(char ***tracefiles_p, size_t *num_tracefiles_p,
  * new_range_set - Create an empty range set
  */
 static range_set_t *new_range_set(void) {
-    range_set_t *ranges = malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    range_set_t *ranges = calloc(1, sizeof(range_set_t));
+    if (ranges == NULL)
+        unix_error("calloc error in new_range_set");
+    if (sparse_mode) {
+        ranges->lo_tree = tree_new();
+        return ranges;
+    }
+
+    ranges->table_mask = 1023;
+    ranges->table = calloc(ranges->table_mask + 1, sizeof(range_t *));
+    ranges->shadow = calloc(SHADOW_GRANULES / 64, sizeof(uint64_t));
+    if (ranges->table == NULL || ranges->shadow == NULL)
+        unix_error("calloc error in new_range_set");
     return ranges;
 }
 
+/*
+ * range_slot - Find the table entry of the range starting at lo, or the
+ *     empty entry where it would go
+ */
+static size_t range_slot(range_set_t *ranges, const char *lo) {
+    size_t i = (size_t)((((uintptr_t)lo / ALIGNMENT) * 0x9E3779B97F4A7C15u) >>
+                        32) &
+               ranges->table_mask;
+    ranges->probes++;
+    while (ranges->table[i] != NULL && ranges->table[i]->lo != lo) {
+        i = (i + 1) & ranges->table_mask;
+        ranges->probes++;
+    }
+    return i;
+}
+
+/*
+ * range_table_add - Add a range to the table, growing it to keep it at
+ *     most half full
+ */
+static void range_table_add(range_set_t *ranges, range_t *p) {
+    if (2 * (ranges->count + 1) > ranges->table_mask + 1) {
+        range_t **old = ranges->table;
+        size_t entries = ranges->table_mask + 1;
+        ranges->table = calloc(2 * entries, sizeof(range_t *));
+        if (ranges->table == NULL)
+            unix_error("calloc error in range_table_add");
+        ranges->table_mask = 2 * entries - 1;
+        for (size_t i = 0; i < entries; i++) {
+            if (old[i] != NULL)
+                ranges->table[range_slot(ranges, old[i]->lo)] = old[i];
+        }
+        free(old);
+    }
+    ranges->table[range_slot(ranges, p->lo)] = p;
+    ranges->count++;
+}
+
+/*
+ * range_table_remove - Take the range starting at lo out of the table,
+ *     moving back the entries after it that would otherwise no longer be
+ *     found, and return it, or NULL if there is none
+ */
+static range_t *range_table_remove(range_set_t *ranges, const char *lo) {
+    size_t i = range_slot(ranges, lo);
+    range_t *p = ranges->table[i];
+    if (p == NULL)
+        return NULL;
+    ranges->count--;
+
+    for (size_t j = i;;) {
+        ranges->table[i] = NULL;
+        size_t home;
+        do {
+            j = (j + 1) & ranges->table_mask;
+            if (ranges->table[j] == NULL)
+                return p;
+            home = (size_t)((((uintptr_t)ranges->table[j]->lo / ALIGNMENT) *
+                             0x9E3779B97F4A7C15u) >>
+                            32) &
+                   ranges->table_mask;
+            /* The entry at j can move to i only if i lies in [home, j) */
+        } while (i <= j ? (home > i && home <= j) : (home > i || home <= j));
+        ranges->table[i] = ranges->table[j];
+        i = j;
+    }
+}
+
+/*
+ * shadow_mark - Set or clear the shadow bits of the granules from first to
+ *     last, or if test is set, just return whether any of them is set
+ */
+static bool shadow_mark(uint64_t *shadow, size_t first, size_t last,
+                        bool set, bool test) {
+    for (size_t w = first / 64; w <= last / 64; w++) {
+        uint64_t mask = ~(uint64_t)0;
+        if (w == first / 64)
+            mask &= ~(uint64_t)0 << (first % 64);
+        if (w == last / 64)
+            mask &= ~(uint64_t)0 >> (63 - last % 64);
+        if (test) {
+            if (shadow[w] & mask)
+                return true;
+        } else if (set) {
+            shadow[w] |= mask;
+        } else {
+            shadow[w] &= ~mask;
+        }
+    }
+    return false;
+}
+
+/*
+ * shadow_owner - Find the range covering the first set granule from
+ *     first to last, for reporting an overlap
+ */
+static range_t *shadow_owner(range_set_t *ranges, size_t first, size_t last) {
+    char *base = mem_heap_lo();
+    size_t g = first;
+    while (g < last && !(ranges->shadow[g / 64] >> (g % 64) & 1))
+        g++;
+
+    /* Payloads don't share granules, so the nearest start at or below g
+       is that of the payload covering it */
+    for (;; g--) {
+        range_t *p = ranges->table[range_slot(ranges, base + g * ALIGNMENT)];
+        if (p != NULL || g == 0)
+            return p;
+    }
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
@@ -767,22 +1451,45 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (tkey_t)lo);
-    range_t *next = prev ? prev->next : NULL;
-    /* See if it overlaps previous or next blocks */
-    if (prev && lo <= prev->hi) {
-        malloc_error(
-            trace, opnum, "Payload (%p:%p) overlaps another payload (%p:%p)",
-            (void *)lo, (void *)hi, (void *)prev->lo, (void *)prev->hi);
-        return false;
-    }
-    if (next && hi >= next->lo) {
-        malloc_error(
-            trace, opnum, "Payload (%p:%p) overlaps another payload (%p:%p)",
-            (void *)lo, (void *)hi, (void *)prev->lo, (void *)prev->hi);
-        return false;
+    range_t *prev = NULL, *next = NULL;
+    if (ranges->lo_tree != NULL) {
+        /* Look in the tree for the predecessor block */
+        prev = tree_find_nearest(ranges->lo_tree, (tkey_t)lo);
+        next = prev ? prev->next : NULL;
+        /* See if it overlaps previous or next blocks */
+        if (prev && lo <= prev->hi) {
+            malloc_error(trace, opnum,
+                         "Payload (%p:%p) overlaps another payload (%p:%p)",
+                         (void *)lo, (void *)hi, (void *)prev->lo,
+                         (void *)prev->hi);
+            return false;
+        }
+        if (next && hi >= next->lo) {
+            malloc_error(trace, opnum,
+                         "Payload (%p:%p) overlaps another payload (%p:%p)",
+                         (void *)lo, (void *)hi, (void *)next->lo,
+                         (void *)next->hi);
+            return false;
+        }
+    } else {
+        /* See if any granule of the payload is taken */
+        char *base = mem_heap_lo();
+        size_t first = (size_t)(lo - base) / ALIGNMENT;
+        size_t last = (size_t)(hi - base) / ALIGNMENT;
+        if (shadow_mark(ranges->shadow, first, last, false, true)) {
+            range_t *other = shadow_owner(ranges, first, last);
+            malloc_error(trace, opnum,
+                         "Payload (%p:%p) overlaps another payload (%p:%p)",
+                         (void *)lo, (void *)hi,
+                         other ? (void *)other->lo : NULL,
+                         other ? (void *)other->hi : NULL);
+            return false;
+        }
+        shadow_mark(ranges->shadow, first, last, true, false);
+        /* The list needn't be in order without the tree; prepend */
+        next = ranges->list;
     }
+
     /*
      * Everything looks OK, so remember the extent of this block
      * by creating a range struct and adding it the range list.
@@ -801,7 +1508,10 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     p->lo = lo;
     p->hi = hi;
     p->index = index;
-    tree_insert(ranges->lo_tree, (tkey_t)lo, (void *)p);
+    if (ranges->lo_tree != NULL)
+        tree_insert(ranges->lo_tree, (tkey_t)lo, (void *)p);
+    else
+        range_table_add(ranges, p);
     return true;
 }
 
@@ -809,7 +1519,14 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
  * remove_range - Free the range record of block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo) {
-    range_t *p = (range_t *)tree_remove(ranges->lo_tree, (tkey_t)lo);
+    range_t *p;
+    if (ranges->lo_tree != NULL) {
+        p = (range_t *)tree_remove(ranges->lo_tree, (tkey_t)lo);
+    } else if ((p = range_table_remove(ranges, lo)) != NULL) {
+        char *base = mem_heap_lo();
+        shadow_mark(ranges->shadow, (size_t)(p->lo - base) / ALIGNMENT,
+                    (size_t)(p->hi - base) / ALIGNMENT, false, false);
+    }
     if (!p)
         return;
     range_t *prev = p->prev;
@@ -827,7 +1544,16 @@ static void remove_range(range_set_t *ranges, char *lo) {
  * free_range_set - free all of the range records for a trace
  */
 static void free_range_set(range_set_t *ranges) {
-    tree_free(ranges->lo_tree, free);
+    if (ranges->lo_tree != NULL) {
+        tree_free(ranges->lo_tree, free);
+    } else {
+        for (range_t *p = ranges->list, *next; p != NULL; p = next) {
+            next = p->next;
+            free(p);
+        }
+        free(ranges->table);
+        free(ranges->shadow);
+    }
     free(ranges);
 }
 
@@ -965,126 +1691,175 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0; i < trace->num_ops; i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
-
-        if (debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-
-            /* Let the students check their own heap */
-            if (!mm_checkheap(0)) {
-                malloc_error(trace, i, "mm_checkheap returned false");
-                return false;
-            };
-
-            /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r) {
-                if (!check_index(trace, i, r->index)) {
-                    allCheck = false;
+    for (bool more = first_trace_window(trace); more;
+         more = next_trace_window(trace)) {
+        for (i = 0; i < trace->num_ops; i++) {
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if (debug_mode == DBG_EXPENSIVE) {
+                range_t *r;
+
+                /* Let the students check their own heap */
+                if (!mm_checkheap(0)) {
+                    malloc_error(trace, i, "mm_checkheap returned false");
+                    return false;
+                };
+
+                /* Now check that all our allocated blocks have the right
+                 * data */
+                r = ranges->list;
+                while (r) {
+                    if (!check_index(trace, i, r->index)) {
+                        allCheck = false;
+                    }
+                    r = r->next;
                 }
-                r = r->next;
             }
-        }
 
-        switch (trace->ops[i].type) {
+            switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
+            case ALLOC: /* mm_malloc */
 
-            /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed");
-                return false;
-            }
+                /* Call the student's malloc */
+                if ((p = mm_malloc(size)) == NULL) {
+                    malloc_error(trace, i, "mm_malloc failed");
+                    return false;
+                }
 
-            /*
-             * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
-             * and must not overlap any currently allocated block.
-             */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
-                return false;
+                /*
+                 * Test the range of the new block for correctness and add
+                 * it to the range list if OK. The block must be  be aligned
+                 * properly, and must not overlap any currently allocated
+                 * block.
+                 */
+                if (add_range(ranges, p, size, trace, i, index) == 0)
+                    return false;
 
-            /* Remember region */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
+                /* Remember region */
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
 
-            /* Set to random data, for debugging. */
-            randomize_block(trace, index);
-            break;
+                /* Set to random data, for debugging. */
+                randomize_block(trace, index);
+                break;
 
-        case REALLOC: /* mm_realloc */
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
+            case REALLOC: /* mm_realloc */
+                if (!check_index(trace, i, index)) {
+                    allCheck = false;
+                }
 
-            /* Call the student's realloc */
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            newp = mm_realloc(oldp, size);
-            setUBCheck(true);
-            if ((newp == NULL) && (size != 0)) {
-                malloc_error(trace, i, "mm_realloc failed");
-                return false;
-            }
-            if ((newp != NULL) && (size == 0)) {
-                malloc_error(trace, i,
-                             "mm_realloc with size 0 returned "
-                             "non-NULL");
-                return false;
-            }
+                /* Call the student's realloc */
+                oldp = trace->blocks[index];
+                setUBCheck(false);
+                newp = mm_realloc(oldp, size);
+                setUBCheck(true);
+                if ((newp == NULL) && (size != 0)) {
+                    malloc_error(trace, i, "mm_realloc failed");
+                    return false;
+                }
+                if ((newp != NULL) && (size == 0)) {
+                    malloc_error(trace, i,
+                                 "mm_realloc with size 0 returned "
+                                 "non-NULL");
+                    return false;
+                }
 
-            /* Remove the old region from the range list */
-            remove_range(ranges, oldp);
+                /* Remove the old region from the range list */
+                remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
-            if (size > 0) {
-                if (add_range(ranges, newp, size, trace, i, index) == 0)
-                    return false;
-            }
+                /* Check new block for correctness and add it to range list */
+                if (size > 0) {
+                    if (add_range(ranges, newp, size, trace, i, index) == 0)
+                        return false;
+                }
+
+                /* Move the region from where it was.
+                 * Check up to min(size, oldsize) for correct copying. */
+                trace->blocks[index] = newp;
+                if (size < trace->block_sizes[index]) {
+                    trace->block_sizes[index] = size;
+                }
+                // NOTE: Might help to pass old size here to check bytes at
+                // each end of allocation
 
-            /* Move the region from where it was.
-             * Check up to min(size, oldsize) for correct copying. */
-            trace->blocks[index] = newp;
-            if (size < trace->block_sizes[index]) {
+                if (!check_index(trace, i, index)) {
+                    allCheck = false;
+                }
                 trace->block_sizes[index] = size;
-            }
-            // NOTE: Might help to pass old size here to check bytes at each end
-            // of allocation
 
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
-            trace->block_sizes[index] = size;
+                /* Set to random data, for debugging. */
+                randomize_block(trace, index);
+                break;
 
-            /* Set to random data, for debugging. */
-            randomize_block(trace, index);
-            break;
+            case FREE: /* mm_free */
+                if (!check_index(trace, i, index)) {
+                    allCheck = false;
+                }
 
-        case FREE: /* mm_free */
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
+                /* Remove region from list and call student's free function */
+                if (index == (unsigned int)-1) {
+                    p = 0;
+                } else {
+                    p = trace->blocks[index];
+                    remove_range(ranges, p);
+                }
+                mm_free(p);
+                break;
 
-            /* Remove region from list and call student's free function */
-            if (index == (unsigned int)-1) {
-                p = 0;
-            } else {
-                p = trace->blocks[index];
-                remove_range(ranges, p);
+            default:
+                app_error("Invalid request type in eval_mm_valid");
             }
-            mm_free(p);
-            break;
-
-        default:
-            app_error("Invalid request type in eval_mm_valid");
         }
     }
     /* As far as we know, this is a valid malloc package */
     return allCheck;
 }
 
+/*
+ * timeline_header - Start the utilization timeline, naming its columns
+ */
+static void timeline_header(void) {
+    size_t nclasses = mm_size_classes(NULL, 0);
+    size_t *limits = malloc(nclasses * sizeof(size_t));
+    if (limits == NULL)
+        unix_error("malloc failed in timeline_header");
+    mm_size_classes(limits, nclasses);
+
+    fputs("trace,op,live_bytes,heap_bytes,largest_free", timeline);
+    for (size_t class = 0; class < nclasses; class++) {
+        if (limits[class] == SIZE_MAX)
+            fputs(",free_larger", timeline);
+        else
+            fprintf(timeline, ",free_le_%zu", limits[class]);
+    }
+    putc('\n', timeline);
+    free(limits);
+}
+
+/*
+ * timeline_sample - Add a line to the utilization timeline: the bytes the
+ *     trace has allocated after op opnum, the size of the heap, and the
+ *     free blocks the allocator has
+ */
+static void timeline_sample(const trace_t *trace, size_t opnum,
+                            size_t live_bytes) {
+    static size_t *counts = NULL;
+    static size_t nclasses = 0;
+    if (counts == NULL) {
+        nclasses = mm_size_classes(NULL, 0);
+        if ((counts = malloc(nclasses * sizeof(size_t))) == NULL)
+            unix_error("malloc failed in timeline_sample");
+    }
+
+    size_t largest = mm_free_blocks(counts, nclasses);
+    fprintf(timeline, "%s,%zu,%zu,%zu,%zu", trace->filename, opnum,
+            live_bytes, mem_heapsize(), largest);
+    for (size_t class = 0; class < nclasses; class++)
+        fprintf(timeline, ",%zu", counts[class]);
+    putc('\n', timeline);
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
@@ -1103,6 +1878,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    size_t opnum = 0; /* ops run so far, across windows */
     char *p;
     char *newp, *oldp;
 
@@ -1113,69 +1889,78 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     if (!mm_init())
         app_error("trace %zd: mm_init failed in eval_mm_util", tracenum);
 
-    for (i = 0; i < trace->num_ops; i++) {
-        switch (trace->ops[i].type) {
+    for (bool more = first_trace_window(trace); more;
+         more = next_trace_window(trace)) {
+        for (i = 0; i < trace->num_ops; i++) {
+            switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_alloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            case ALLOC: /* mm_alloc */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
-                app_error("trace %zd: mm_malloc failed in eval_mm_util",
-                          tracenum);
-            }
+                if ((p = mm_malloc(size)) == NULL) {
+                    app_error("trace %zd: mm_malloc failed in eval_mm_util",
+                              tracenum);
+                }
 
-            /* Remember region and size */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
+                /* Remember region and size */
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
 
-            total_size += size;
-            break;
+                total_size += size;
+                break;
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldsize = trace->block_sizes[index];
+            case REALLOC: /* mm_realloc */
+                index = trace->ops[i].index;
+                newsize = trace->ops[i].size;
+                oldsize = trace->block_sizes[index];
+
+                oldp = trace->blocks[index];
+                setUBCheck(false);
+                if ((newp = mm_realloc(oldp, newsize)) == NULL &&
+                    newsize != 0) {
+                    app_error("trace %zd: mm_realloc failed in eval_mm_util",
+                              tracenum);
+                }
+                setUBCheck(true);
 
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0) {
-                app_error("trace %zd: mm_realloc failed in eval_mm_util",
-                          tracenum);
-            }
-            setUBCheck(true);
+                /* Remember region and size */
+                trace->blocks[index] = newp;
+                trace->block_sizes[index] = newsize;
 
-            /* Remember region and size */
-            trace->blocks[index] = newp;
-            trace->block_sizes[index] = newsize;
+                total_size += (newsize - oldsize);
+                break;
 
-            total_size += (newsize - oldsize);
-            break;
+            case FREE: /* mm_free */
+                index = trace->ops[i].index;
+                if (index == (unsigned int)-1) {
+                    size = 0;
+                    p = 0;
+                } else {
+                    size = trace->block_sizes[index];
+                    p = trace->blocks[index];
+                }
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index == (unsigned int)-1) {
-                size = 0;
-                p = 0;
-            } else {
-                size = trace->block_sizes[index];
-                p = trace->blocks[index];
-            }
+                mm_free(p);
 
-            mm_free(p);
+                total_size -= size;
+                break;
 
-            total_size -= size;
-            break;
+            default:
+                app_error("trace %zd: Nonexistent request type in eval_mm_util",
+                          tracenum);
+            }
 
-        default:
-            app_error("trace %zd: Nonexistent request type in eval_mm_util",
-                      tracenum);
-        }
+            /* update the high-water mark */
+            max_total_size =
+                (total_size > max_total_size) ? total_size : max_total_size;
 
-        /* update the high-water mark */
-        max_total_size =
-            (total_size > max_total_size) ? total_size : max_total_size;
+            if (timeline != NULL && ++opnum % timeline_interval == 0)
+                timeline_sample(trace, opnum, total_size);
+        }
     }
+    if (timeline != NULL && opnum % timeline_interval != 0)
+        timeline_sample(trace, opnum, total_size);
 
     return ((double)max_total_size / (double)mem_heapsize());
 }
@@ -1196,42 +1981,48 @@ static void eval_mm_speed(void *ptr) {
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
-    for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type) {
+    /* Interpret each trace request, timing only the requests themselves
+       when the trace is streamed */
+    for (bool more = first_trace_window(trace); more;
+         more = next_trace_window(trace)) {
+        double start = stream_clock();
+        for (i = 0; i < trace->num_ops; i++)
+            switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+            case REALLOC: /* mm_realloc */
+                index = trace->ops[i].index;
+                newsize = trace->ops[i].size;
+                oldp = trace->blocks[index];
+                setUBCheck(false);
+                if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+                    app_error("mm_realloc error in eval_mm_speed");
+                setUBCheck(true);
+                trace->blocks[index] = newp;
+                break;
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
-            break;
+            case FREE: /* mm_free */
+                index = trace->ops[i].index;
+                if (index == (unsigned int)-1) {
+                    block = 0;
+                } else {
+                    block = trace->blocks[index];
+                }
+                mm_free(block);
+                break;
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index == (unsigned int)-1) {
-                block = 0;
-            } else {
-                block = trace->blocks[index];
+            default:
+                app_error("Nonexistent request type in eval_mm_speed");
             }
-            mm_free(block);
-            break;
-
-        default:
-            app_error("Nonexistent request type in eval_mm_speed");
-        }
+        stream_secs += stream_clock() - start;
+    }
 }
 
 /*
@@ -1247,37 +2038,40 @@ static bool eval_libc_valid(trace_t *trace) {
 
     reinit_trace(trace);
 
-    for (i = 0; i < trace->num_ops; i++) {
-        switch (trace->ops[i].type) {
+    for (bool more = first_trace_window(trace); more;
+         more = next_trace_window(trace)) {
+        for (i = 0; i < trace->num_ops; i++) {
+            switch (trace->ops[i].type) {
 
-        case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
-                malloc_error(trace, i, "libc malloc failed: %s",
-                             strerror(errno));
-            }
-            trace->blocks[trace->ops[i].index] = p;
-            break;
+            case ALLOC: /* malloc */
+                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                    malloc_error(trace, i, "libc malloc failed: %s",
+                                 strerror(errno));
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
 
-        case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
-                malloc_error(trace, i, "libc realloc failed: %s",
-                             strerror(errno));
-            }
-            trace->blocks[trace->ops[i].index] = newp;
-            break;
+            case REALLOC: /* realloc */
+                newsize = trace->ops[i].size;
+                oldp = trace->blocks[trace->ops[i].index];
+                if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
+                    malloc_error(trace, i, "libc realloc failed: %s",
+                                 strerror(errno));
+                }
+                trace->blocks[trace->ops[i].index] = newp;
+                break;
 
-        case FREE: /* free */
-            if (trace->ops[i].index != (unsigned int)-1) {
-                free(trace->blocks[trace->ops[i].index]);
-            } else {
-                free(0);
-            }
-            break;
+            case FREE: /* free */
+                if (trace->ops[i].index != (unsigned int)-1) {
+                    free(trace->blocks[trace->ops[i].index]);
+                } else {
+                    free(0);
+                }
+                break;
 
-        default:
-            app_error("invalid operation type  in eval_libc_valid");
+            default:
+                app_error("invalid operation type  in eval_libc_valid");
+            }
         }
     }
 
@@ -1298,36 +2092,41 @@ static void eval_libc_speed(void *ptr) {
 
     reinit_trace(trace);
 
-    for (i = 0; i < trace->num_ops; i++) {
-        switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
-                unix_error("malloc failed in eval_libc_speed");
-            trace->blocks[index] = p;
-            break;
+    for (bool more = first_trace_window(trace); more;
+         more = next_trace_window(trace)) {
+        double start = stream_clock();
+        for (i = 0; i < trace->num_ops; i++) {
+            switch (trace->ops[i].type) {
+            case ALLOC: /* malloc */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if ((p = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
 
-        case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-                unix_error("realloc failed in eval_libc_speed");
+            case REALLOC: /* realloc */
+                index = trace->ops[i].index;
+                newsize = trace->ops[i].size;
+                oldp = trace->blocks[index];
+                if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
+                    unix_error("realloc failed in eval_libc_speed");
 
-            trace->blocks[index] = newp;
-            break;
+                trace->blocks[index] = newp;
+                break;
 
-        case FREE: /* free */
-            index = trace->ops[i].index;
-            if (index != (unsigned int)-1) {
-                block = trace->blocks[index];
-                free(block);
-            } else {
-                free(0);
+            case FREE: /* free */
+                index = trace->ops[i].index;
+                if (index != (unsigned int)-1) {
+                    block = trace->blocks[index];
+                    free(block);
+                } else {
+                    free(0);
+                }
+                break;
             }
-            break;
         }
+        stream_secs += stream_clock() - start;
     }
 }
 
@@ -1409,12 +2208,12 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
             double msecs = sparse_mode ? 0.0 : stats[i].secs * 1000.0;
             double kops = sparse_mode ? 0.0 : stats[i].tput;
             if (tab_mode) {
-                printf("%u\t%.3f\t%.0f\t", stats[i].ops, msecs, kops);
+                printf("%zu\t%.3f\t%.0f\t", stats[i].ops, msecs, kops);
             } else {
                 /* print '--' if perf isn't weighted */
                 if (stats[i].weight == WNONE || stats[i].weight == WALL ||
                     stats[i].weight == WPERF)
-                    printf("%8u%10.3f%7.0f ", stats[i].ops, msecs, kops);
+                    printf("%8zu%10.3f%7.0f ", stats[i].ops, msecs, kops);
                 else
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
@@ -1424,7 +2223,7 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
             if (stats[i].weight == WALL || stats[i].weight == WPERF) {
                 sum_perf_weight += 1;
                 sumsecs += stats[i].secs;
-                sumops += stats[i].ops;
+                sumops += (double)stats[i].ops;
                 sumtput += stats[i].tput;
             }
             if (stats[i].weight == WALL || stats[i].weight == WUTIL) {
@@ -1482,6 +2281,38 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         sumstats->secs = sumsecs;
         sumstats->tput = tput;
     }
+
+    if (events_mode)
+        printevents(n, stats);
+}
+
+/*
+ * printevents - With -H, print the hardware events per op for each trace
+ */
+static void printevents(size_t n, const stats_t *stats) {
+    static const char *names[FCYC_NUM_EVENTS] = {
+        [FCYC_INSTRUCTIONS] = "insns",     [FCYC_L1D_MISSES] = "L1D-miss",
+        [FCYC_LLC_MISSES] = "LLC-miss",    [FCYC_BRANCH_MISSES] = "br-miss",
+        [FCYC_DTLB_MISSES] = "dTLB-miss",
+    };
+    int e;
+
+    if (!tab_mode)
+        puts("Hardware events per op:");
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+        printf(tab_mode ? "%s\t" : "%10s", names[e]);
+    printf(tab_mode ? "trace\n" : "  trace\n");
+
+    for (size_t i = 0; i < n; i++) {
+        for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+            double count = stats[i].valid ? stats[i].events[e] : -1;
+            if (count < 0)
+                printf(tab_mode ? "%s\t" : "%10s", "-");
+            else
+                printf(tab_mode ? "%.3f\t" : "%10.3f", count);
+        }
+        printf(tab_mode ? "%s\n" : "  %s\n", stats[i].filename);
+    }
 }
 
 /*
@@ -1707,7 +2538,8 @@ static unsigned int atoui_or_usage(const char *arg, const char *option,
  * usage - Explain the command line arguments
  */
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVCdDSTH] [-j <n>] [-w <n>] [-f <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -1720,6 +2552,22 @@ static void usage(const char *prog) {
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+    fprintf(stderr, "\t-j <n>     Check up to n traces at once, in separate "
+                    "processes.\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-S         Print allocator statistics for each "
+                    "trace (needs MM_STATS)\n");
+    fprintf(stderr, "\t-H         Count hardware events per op for each "
+                    "trace (Linux only).\n");
+    fprintf(stderr, "\t-w <n>     Stream traces, reading n ops at a time.\n");
+    fprintf(stderr, "\t-L <kind>  Back the heap with huge pages: thp "
+                    "(transparent) or hugetlb (reserved).\n");
+    fprintf(stderr, "\t-U <file>  Write a utilization timeline to <file>, "
+                    "as CSV.\n");
+    fprintf(stderr, "\t-u <n>     Sample the timeline every n ops "
+                    "(default 1000).\n");
+    fprintf(stderr, "\t-P <n>     Measure scaling from 1 to n threads "
+                    "(mdriver-threads only).\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, or with -w, "
+                    "- for standard input\n");
 }
@@ -73,6 +73,7 @@ static unsigned char
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static mem_pages_t pages = MEM_PAGES_SMALL; /* Pages backing the dense heap */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
@@ -143,6 +144,56 @@ static inline void *round_address_up(void *addr, size_t align) {
     return (void *)(((uintptr_t)addr + align - 1) & ~(align - 1));
 }
 
+/*
+ * mem_chunk - the unit in which mem_sbrk makes the heap accessible
+ */
+static size_t mem_chunk(void) {
+    return !sparse && pages != MEM_PAGES_SMALL ? HUGE_PAGE_SIZE
+                                               : mem_pagesize();
+}
+
+/*
+ * map_dense - map the dense heap PROT_NONE, backed by the pages chosen
+ *     with mem_set_pages.  The heap is put near start, or exactly there if
+ *     fixed.  Returns its address, or MAP_FAILED.
+ */
+static void *map_dense(void *start, bool fixed) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (fixed ? MAP_FIXED : 0);
+    size_t length = mmap_length;
+
+    /* The kernel aligns MAP_HUGETLB mappings itself, and reserves their
+       pages now, so running out fails here rather than with a SIGBUS */
+    if (pages == MEM_PAGES_HUGETLB)
+        flags |= MAP_HUGETLB;
+    /* Otherwise map a huge page more than needed and trim it to align */
+    else if (pages == MEM_PAGES_THP && !fixed)
+        length += HUGE_PAGE_SIZE;
+
+    unsigned char *addr = mmap(start, length, PROT_NONE, flags, -1, 0);
+    if (addr == MAP_FAILED || pages != MEM_PAGES_THP)
+        return addr;
+
+    unsigned char *lo = round_address_up(addr, HUGE_PAGE_SIZE);
+    unsigned char *hi = lo + mmap_length;
+    if (lo > addr)
+        munmap(addr, (size_t)(lo - addr));
+    if (addr + length > hi)
+        munmap(hi, (size_t)(addr + length - hi));
+    if (madvise(lo, mmap_length, MADV_HUGEPAGE) == -1) {
+        munmap(lo, mmap_length);
+        return MAP_FAILED;
+    }
+    return lo;
+}
+
+/*
+ * mem_set_pages - choose the pages backing the dense heap from the next
+ *     mem_init
+ */
+void mem_set_pages(mem_pages_t kind) {
+    pages = kind;
+}
+
 /*
  * mem_init - initialize the memory system model
  */
@@ -170,23 +221,29 @@ void mem_init(bool do_sparse) {
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     /* The sparse heap is used for internal bookkeeping and is not
        exposed to student code.  The dense heap is used directly by
        student code.  We manage a pseudo-break within the dense heap
        by mapping it PROT_NONE initially and then changing pages to
        PROT_READ|PROT_WRITE upon calls to mem_sbrk.  */
-    int prot = sparse ? PROT_READ | PROT_WRITE : PROT_NONE;
-    void *addr = mmap(start,                       /* suggested start*/
-                      mmap_length,                 /* length */
-                      prot,                        /* access control */
-                      MAP_PRIVATE | MAP_ANONYMOUS, /* private anonymous mem */
-                      -1,                          /* fd */
-                      0);                          /* offset */
+    void *addr;
+    if (sparse) {
+        addr = mmap(NULL,                        /* suggested start*/
+                    mmap_length,                 /* length */
+                    PROT_READ | PROT_WRITE,      /* access control */
+                    MAP_PRIVATE | MAP_ANONYMOUS, /* private anonymous mem */
+                    -1,                          /* fd */
+                    0);                          /* offset */
+    } else {
+        addr = map_dense(TRY_DENSE_HEAP_START, false);
+    }
     if (addr == MAP_FAILED) {
         fprintf(stderr,
                 "FAILURE.  mmap couldn't allocate space for heap (%s)\n",
                 strerror(errno));
+        if (!sparse && pages == MEM_PAGES_HUGETLB)
+            fprintf(stderr, "Are %lu huge pages reserved in vm.nr_hugepages?\n",
+                    MAX_DENSE_HEAP / HUGE_PAGE_SIZE);
         exit(1);
     }
     if (round_address_down(addr, mem_pagesize()) != addr) {
@@ -237,9 +294,7 @@ void mem_reset_brk(void) {
         /* In order to make subsequent calls to mem_sbrk cost
            approximately what they did on the first pass, overwrite
            the entire heap with a fresh PROT_NONE mapping.  */
-        if (mmap(heap, MAX_DENSE_HEAP, PROT_NONE,
-                 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
-                 0) == MAP_FAILED) {
+        if (map_dense(heap, true) == MAP_FAILED) {
             fprintf(stderr, "FAILURE.  deallocation of heap failed (%s)\n",
                     strerror(errno));
             exit(1);
@@ -280,11 +335,12 @@ void *mem_sbrk(intptr_t incr) {
     }
 
     unsigned char *new_brk = old_brk + incr;
-    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_pagesize());
+    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_chunk());
     if (!sparse) {
         /* Make the requested section of the heap be accessible.
          * sbrk accepts any 'incr' value, but mprotect only works on
-         * full pages.
+         * full pages, and huge pages are only used for whole aligned
+         * huge pages.
          */
         if (new_brk_chunk > mem_brk_chunk &&
             mprotect(mem_brk_chunk, (size_t)(new_brk_chunk - mem_brk_chunk),
@@ -445,8 +501,68 @@ void mem_write(void *addr, uint64_t val, size_t len) {
     }
 }
 
+/*
+ * Outside sparse emulation, mem_memcpy and mem_memset have nothing to
+ *  translate or check, so they copy directly.  Copies of up to 32 bytes,
+ *  the common case for small blocks, use a pair of loads and stores of
+ *  the largest power of two that fits, which may overlap, instead of a
+ *  loop or a call, and all their loads come before their stores.
+ */
+static inline void copy_small(unsigned char *dst, const unsigned char *src,
+                              size_t n) {
+    if (n >= 16) {
+        unsigned char lo[16], hi[16];
+        memcpy(lo, src, 16);
+        memcpy(hi, src + n - 16, 16);
+        memcpy(dst, lo, 16);
+        memcpy(dst + n - 16, hi, 16);
+    } else if (n >= 8) {
+        uint64_t lo, hi;
+        memcpy(&lo, src, 8);
+        memcpy(&hi, src + n - 8, 8);
+        memcpy(dst, &lo, 8);
+        memcpy(dst + n - 8, &hi, 8);
+    } else if (n >= 4) {
+        uint32_t lo, hi;
+        memcpy(&lo, src, 4);
+        memcpy(&hi, src + n - 4, 4);
+        memcpy(dst, &lo, 4);
+        memcpy(dst + n - 4, &hi, 4);
+    } else if (n > 0) {
+        unsigned char first = src[0], mid = src[n / 2], last = src[n - 1];
+        dst[0] = first;
+        dst[n / 2] = mid;
+        dst[n - 1] = last;
+    }
+}
+
+/* Fill up to 32 bytes with a byte repeated in data, as copy_small does */
+static inline void set_small(unsigned char *dst, uint64_t data, size_t n) {
+    if (n >= 16) {
+        memcpy(dst, &data, 8);
+        memcpy(dst + 8, &data, 8);
+        memcpy(dst + n - 16, &data, 8);
+        memcpy(dst + n - 8, &data, 8);
+    } else if (n >= 8) {
+        memcpy(dst, &data, 8);
+        memcpy(dst + n - 8, &data, 8);
+    } else if (n >= 4) {
+        memcpy(dst, &data, 4);
+        memcpy(dst + n - 4, &data, 4);
+    } else if (n > 0) {
+        dst[0] = dst[n / 2] = dst[n - 1] = (unsigned char)data;
+    }
+}
+
 /* Emulation of memcpy */
 void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
+    if (!sparse) {
+        if (num_bytes > 32)
+            return memcpy(dst, src, num_bytes);
+        copy_small(dst, src, num_bytes);
+        return dst;
+    }
+
     void *savedst = dst;
     size_t word_size = sizeof(uint64_t);
     while (num_bytes >= word_size) {
@@ -467,11 +583,14 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
 void *mem_memset(void *dst, int c, size_t num_bytes) {
     void *savedst = dst;
     uint64_t byte = c & 0xFF;
-    uint64_t data = 0;
+    uint64_t data = byte * 0x0101010101010101ULL;
     size_t word_size = sizeof(uint64_t);
-    size_t i;
-    for (i = 0; i < word_size; i++) {
-        data = data | (byte << (8 * i));
+
+    if (!sparse) {
+        if (num_bytes > 32)
+            return memset(dst, c, num_bytes);
+        set_small(dst, data, num_bytes);
+        return dst;
     }
     while (num_bytes >= word_size) {
         mem_write(dst, data, word_size);
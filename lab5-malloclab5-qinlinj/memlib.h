@@ -12,6 +12,25 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/**
+ * @brief The kinds of pages that can back the dense heap
+ */
+typedef enum {
+    MEM_PAGES_SMALL,  /**< The system's base pages */
+    MEM_PAGES_THP,    /**< Transparent huge pages, asked for by madvise */
+    MEM_PAGES_HUGETLB /**< Reserved huge pages, asked for by MAP_HUGETLB */
+} mem_pages_t;
+
+/**
+ * @brief Chooses the pages that back the dense heap from the next mem_init.
+ *
+ * With huge pages, the heap is aligned to `HUGE_PAGE_SIZE`, and `mem_sbrk`
+ * makes it accessible a huge page at a time. The sparse heap ignores this.
+ *
+ * @param[in] kind The kind of pages, `MEM_PAGES_SMALL` by default
+ */
+void mem_set_pages(mem_pages_t kind);
+
 /**
  * @brief
  * @param[in] sparse
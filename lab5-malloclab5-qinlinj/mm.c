@@ -10,6 +10,51 @@
  *insertion method into the free list follows a Last-In, First-Out (LIFO)
  *strategy, ensuring efficient utilization of available memory.
  *
+ * Free blocks of over 512 bytes, those from `tree_class` up, are kept in a splay
+ * tree ordered by size and then address instead, so a large request gets
+ * the best fit, and the lowest-addressed block among equals, in amortized
+ * logarithmic time however many large blocks are free.
+ *
+ * Small requests whose header would push them into a larger block, those of
+ * up to `slab_max` bytes just short of a multiple of dsize, are served from
+ * slabs instead: heap blocks aligned to `slab_span` and divided into equal
+ * slots, with a bitmap of the free ones, so their objects need no header and
+ * a slot is found with a count of trailing zeros. A bit for each `slab_span`
+ * of the heap says where the slabs are, which is how free tells a slot from
+ * a block.
+ *
+ * `mm_aligned_alloc` gives payloads a larger power-of-two alignment, such
+ * as a cache line or a page, by taking a block with room to spare and
+ * freeing the slack before the aligned payload as a block of its own.
+ *
+ * `mm_malloc_batch` carves many blocks of one size from a single free block,
+ * and `mm_free_batch` frees many blocks and then coalesces each run of
+ * neighbors among them just once.
+ *
+ * Requests of `mmap_threshold` bytes or more get a mapping of their own,
+ * which free unmaps, and free blocks of `release_threshold` bytes or more
+ * give the pages inside them back to the system. Both are off until set by
+ * `mm_set_mmap_threshold` and `mm_set_release_threshold`, since the driver
+ * expects every payload inside the heap `mem_sbrk` grows.
+ *
+ * Compiled with MM_DEFER, freed blocks of the exact classes are not
+ * coalesced at once. They wait, still marked allocated, in a quick list for
+ * their size, where the next request of that size finds them, and are all
+ * coalesced together only when no free block fits a request and the heap
+ * would otherwise grow.
+ *
+ * Compiled with MM_THREADS, the allocator is thread-safe. The heap is split
+ * into arenas, one per processor up to MAX_ARENAS, each with its own free
+ * lists and lock; the first grows with `mem_sbrk`, the others within regions
+ * of their own. Threads are assigned arenas round-robin, and a freed block
+ * goes back to the arena whose region holds it. Each thread also keeps a
+ * small cache of blocks for each exact size class. Those blocks stay marked
+ * allocated in the heap, so nothing but the owning thread touches them. A
+ * thread allocates from and frees to its own cache without locking, and
+ * takes a lock only to refill a cache or flush it, `tcache_batch` blocks at
+ * a time, or for larger blocks. The caches of a thread that exits go back to
+ * the heap.
+ *
  *************************************************************************
  *
  * ADVICE FOR STUDENTS.
@@ -23,6 +68,9 @@
  * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
  */
 
+/* For mmap's MAP_ANONYMOUS, madvise and mremap, which C11 alone leaves out */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -30,11 +78,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "memlib.h"
 #include "mm.h"
 
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
 /* Do not change the following! */
 
 #ifdef DRIVER
@@ -85,7 +138,31 @@
 #define dbg_printheap(...) ((void)((0) && print_heap(__VA_ARGS__)))
 #endif
 
-#define MAX_SEG_LIST_LENGTH 14
+#define MAX_SEG_LIST_LENGTH 26
+
+/* Number of size classes a thread cache keeps, one per exact class */
+#define TCACHE_CLASSES 16
+
+/* Most arenas the allocator uses, however many processors there are */
+#define MAX_ARENAS 8
+
+/* Number of slab classes, one for each multiple of dsize up to slab_max */
+#define SLAB_CLASSES 4
+
+/* With MM_THREADS, the thread caches serve small requests instead of slabs;
+ * MM_NO_SLABS leaves them out of the single-threaded build too */
+#if !defined(MM_THREADS) && !defined(MM_NO_SLABS)
+#define MM_SLABS
+#endif
+
+/* MM_DEFER puts off coalescing small blocks until the heap would otherwise
+ * grow; with MM_THREADS, the thread caches already do */
+#if defined(MM_DEFER) && !defined(MM_THREADS)
+#define MM_QUICK_LISTS
+#endif
+
+/* Number of quick lists, one per exact class */
+#define QUICK_CLASSES 16
 
 /* Basic constants */
 
@@ -103,6 +180,26 @@ static const size_t min_block_size = dsize;
 static const word_t pre_alloc_mark = 0x2;
 
 static const word_t pre_min_mark = 0x4;
+
+/** @brief Set in the header of a block with a mapping of its own */
+static const word_t mmap_mark = 0x8;
+
+/**
+ * @brief Largest block size with a segregated list of its own
+ *
+ * Every block size up to this one, in steps of dsize, has an exact class.
+ * Larger blocks share classes that each cover a power-of-two range.
+ */
+static const size_t exact_class_max = 256;
+
+/** @brief Number of exact size classes */
+static const int exact_classes = 16;
+
+/**
+ * @brief First size class kept in the free tree rather than a list, that of
+ * blocks just over 512 bytes
+ */
+static const int tree_class = 17;
 /**
  * TODO: explain what chunksize is
  * (Must be divisible by dsize)
@@ -119,6 +216,17 @@ static const word_t alloc_mask = 0x1;
  */
 static const word_t size_mask = ~(word_t)0xF;
 
+#ifdef MM_SLABS
+/** @brief Largest request served from a slab (bytes) */
+static const size_t slab_max = SLAB_CLASSES * 16;
+
+/** @brief log2 of `slab_span` */
+static const int slab_shift = 10;
+
+/** @brief Size of a slab, and the alignment of its start (bytes) */
+static const size_t slab_span = (size_t)1 << 10;
+#endif
+
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
     /** @brief Header contains size + allocation flag */
@@ -149,6 +257,10 @@ typedef struct block {
             struct block *next;
             struct block *prev;
         } free_list;
+        struct {
+            struct block *left;
+            struct block *right;
+        } tree;
         char payload[0];
     } data;
     /*
@@ -163,15 +275,175 @@ typedef struct block {
      */
 } block_t;
 
+#ifdef MM_SLABS
+/**
+ * @brief The header of a slab, at the start of its block's payload
+ *
+ * The rest of the slab is divided into slots of one size, which hold small
+ * objects without headers of their own.
+ */
+typedef struct slab {
+    /** @brief Neighbors in the list of its class's slabs with free slots */
+    struct slab *next;
+    struct slab *prev;
+
+    /** @brief Bit `i` is set exactly when slot `i` is free */
+    uint64_t free_slots;
+
+    /** @brief Size of each slot (bytes) */
+    uint32_t slot_size;
+
+    /** @brief Number of slots, at most 64 */
+    uint32_t nslots;
+
+    /** @brief The first slot */
+    char slots[0];
+} slab_t;
+#endif
+
+/** @brief A heap and the free lists of its blocks */
+typedef struct arena {
+    /** @brief Pointer to first block in the heap */
+    block_t *heap_start;
+
+    /** @brief An array that keeps pointers to each free list */
+    block_t *seg_list[MAX_SEG_LIST_LENGTH];
+
+    /** @brief Bit `class` is set exactly when `seg_list[class]` is non-empty */
+    uint64_t seg_list_bitmap;
+
+    /**
+     * @brief Root of the splay tree of free blocks from `tree_class` up,
+     * ordered by size and then address
+     */
+    block_t *free_tree;
+
+#ifdef MM_SLABS
+    /** @brief The slabs of each class that have a free slot */
+    slab_t *slabs[SLAB_CLASSES];
+
+    /**
+     * @brief Bit `i` is set exactly when a slab starts `i` spans past
+     * `slab_base`; kept in a block of the heap
+     */
+    uint64_t *slab_map;
+
+    /** @brief Number of bits in `slab_map` */
+    size_t slab_map_len;
+
+    /** @brief Number of slabs in the heap */
+    size_t slab_count;
+
+    /** @brief The number of the span that holds the heap's first byte */
+    uintptr_t slab_base;
+#endif
+
+#ifdef MM_QUICK_LISTS
+    /**
+     * @brief Freed blocks of each exact class, still marked allocated and
+     * linked through `data.free_list.next`, waiting to be coalesced
+     */
+    block_t *quick[QUICK_CLASSES];
+#endif
+
+#ifdef MM_THREADS
+    /** @brief Guards the heap and everything above */
+    pthread_mutex_t lock;
+
+    /**
+     * @brief The region this arena's heap grows in, and its break, or all
+     * NULL for the first arena, whose heap comes from `mem_sbrk`
+     */
+    char *lo;
+    char *brk;
+    char *max;
+#endif
+} arena_t;
+
 /* Global variables */
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
+/** @brief Smallest request given a mapping of its own, or 0 for none */
+static size_t mmap_threshold = 0;
+
+/** @brief Smallest free block whose pages are released, or 0 for none */
+static size_t release_threshold = 0;
+
+#ifdef MM_THREADS
+/** @brief Every arena; only the first `narenas` are used */
+static arena_t arenas[MAX_ARENAS];
+
+/** @brief Number of arenas in use, one per processor up to `MAX_ARENAS` */
+static int narenas = 1;
+
+/** @brief Number of threads assigned an arena so far */
+static unsigned int arenas_assigned = 0;
+
+/** @brief Sets up the arenas on first use */
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+/** @brief The arena whose lock the calling thread holds, if any */
+static _Thread_local arena_t *arena = NULL;
+
+/** @brief The arena the calling thread allocates from */
+static _Thread_local arena_t *thread_arena = NULL;
+
+/** @brief Bytes of address space reserved for each arena but the first */
+static const size_t arena_region_size = (size_t)1 << 32;
+#else
+/** @brief The one arena */
+static arena_t main_arena;
+
+/** @brief The arena operated on */
+static arena_t *const arena = &main_arena;
+#endif
+
+#ifdef MM_THREADS
+/** @brief Number of blocks moved between a thread cache and the heap at once */
+static const int tcache_batch = 16;
+
+/** @brief Most blocks a thread cache holds in one class before flushing */
+static const int tcache_max = 64;
 
 /**
- * @brief An array that keeps pointers to each free list
+ * @brief A thread's cache of small allocated blocks for each exact size
+ * class, linked through `data.free_list.next`
  */
-static block_t *seg_list[MAX_SEG_LIST_LENGTH];
+typedef struct {
+    block_t *head[TCACHE_CLASSES];
+    int count[TCACHE_CLASSES];
+    bool registered; // Flushed back to the heap when the thread exits
+} tcache_t;
+
+/** @brief The calling thread's cache */
+static _Thread_local tcache_t tcache;
+
+/** @brief Key whose destructor flushes a thread's cache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+/** @brief Whether the counters below are kept, as they are with MM_STATS */
+#ifdef MM_STATS
+static const bool stats_enabled = true;
+#else
+static const bool stats_enabled = false;
+#endif
+
+/** @brief Counts of what the allocator has done since `mm_init` */
+typedef struct {
+    size_t mallocs[MAX_SEG_LIST_LENGTH]; // By size class of the block
+    size_t frees[MAX_SEG_LIST_LENGTH];
+    size_t fit_searches;    // Calls to find_fit
+    size_t fit_visits;      // Free blocks looked at by find_fit
+    size_t splits;          // Blocks split to allocate part of them
+    size_t coalesces[4];    // By case, handle_case_1 to handle_case_4
+    size_t extends;         // Calls to extend_heap
+    size_t extend_bytes;    // Bytes extend_heap asked for
+    size_t bytes_requested; // Sum of the sizes passed to malloc
+    size_t bytes_reserved;  // Sum of the sizes of what malloc returned
+} stats_t;
+
+static stats_t stats;
 
 /*
  * ---------------------------------------------------------------------------
@@ -179,6 +451,127 @@ static block_t *seg_list[MAX_SEG_LIST_LENGTH];
  * ---------------------------------------------------------------------------
  */
 
+/**
+ * @brief Extends the current arena's heap, as `mem_sbrk` does.
+ * @param[in] size The number of bytes to add.
+ * @return The old end of the heap, or (void *)-1 if it cannot grow.
+ */
+static void *arena_sbrk(size_t size) {
+#ifdef MM_THREADS
+    if (arena->lo != NULL) {
+        if ((size_t)(arena->max - arena->brk) < size) {
+            return (void *)-1;
+        }
+        void *old_brk = arena->brk;
+        arena->brk += size;
+        return old_brk;
+    }
+#endif
+    return mem_sbrk((intptr_t)size);
+}
+
+/**
+ * @brief Returns the address of the first byte of the current arena's heap.
+ */
+static void *arena_lo(void) {
+#ifdef MM_THREADS
+    if (arena->lo != NULL) {
+        return arena->lo;
+    }
+#endif
+    return mem_heap_lo();
+}
+
+/**
+ * @brief Returns the address of the last byte of the current arena's heap.
+ */
+static void *arena_hi(void) {
+#ifdef MM_THREADS
+    if (arena->lo != NULL) {
+        return arena->brk - 1;
+    }
+#endif
+    return mem_heap_hi();
+}
+
+#ifdef MM_THREADS
+/**
+ * @brief Initializes the arena locks, decides how many arenas to use, and
+ * reserves the regions their heaps will grow into.
+ *
+ * The regions are reserved here, before any thread can use an arena, so that
+ * `arena_of` can read their bounds without a lock.
+ */
+static void arenas_setup(void) {
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted =
+        nprocs < 1 ? 1 : nprocs > MAX_ARENAS ? MAX_ARENAS : (int)nprocs;
+
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    for (narenas = 1; narenas < wanted; narenas++) {
+        void *region = mmap(NULL, arena_region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            break; // Make do with the arenas we have
+        }
+        arenas[narenas].lo = region;
+        arenas[narenas].brk = region;
+        arenas[narenas].max = arenas[narenas].lo + arena_region_size;
+    }
+}
+
+/**
+ * @brief Locks an arena and makes it the current one.
+ * @param[in] a The arena.
+ */
+static void arena_lock(arena_t *a) {
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+}
+
+/**
+ * @brief Unlocks the current arena.
+ */
+static void arena_unlock(void) {
+    pthread_mutex_unlock(&arena->lock);
+    arena = NULL;
+}
+
+/**
+ * @brief Returns the arena the calling thread allocates from, assigning
+ * threads to arenas round-robin on first use.
+ */
+static arena_t *get_thread_arena(void) {
+    if (thread_arena == NULL) {
+        pthread_once(&arenas_once, arenas_setup);
+        unsigned int n = __atomic_fetch_add(&arenas_assigned, 1,
+                                            __ATOMIC_RELAXED);
+        thread_arena = &arenas[n % (unsigned int)narenas];
+    }
+    return thread_arena;
+}
+
+/**
+ * @brief Finds the arena a block belongs to from its address.
+ *
+ * An arena's region never moves once reserved, so this needs no lock.
+ *
+ * @param[in] block The block.
+ * @return The arena whose heap holds the block.
+ */
+static arena_t *arena_of(block_t *block) {
+    for (int i = 1; i < narenas; i++) {
+        if ((char *)block >= arenas[i].lo && (char *)block < arenas[i].max) {
+            return &arenas[i];
+        }
+    }
+    return &arenas[0];
+}
+
+#endif
+
 /**
  * @brief Returns the maximum of two integers.
  * @param[in] x
@@ -199,6 +592,23 @@ static size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
+/**
+ * @brief Adds to a statistics counter, or does nothing at all, arguments
+ * included, once inlined without MM_STATS.
+ *
+ * @param[in] counter A member of `stats`.
+ * @param[in] n The amount to add.
+ */
+static void stat_add(size_t *counter, size_t n) {
+    if (stats_enabled) {
+#ifdef MM_THREADS
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+        *counter += n;
+#endif
+    }
+}
+
 /**
  * @brief Packs the `size` and `alloc` of a block into a word suitable for
  *        use as a packed value.
@@ -321,7 +731,9 @@ static block_t *footer_to_header(word_t *footer) {
  */
 static size_t get_payload_size(block_t *block) {
     size_t asize = get_size(block);
-    return asize - wsize;
+
+    // A mapped block's header is a word into its mapping
+    return asize - ((block->header & mmap_mark) ? dsize : wsize);
 }
 
 /**
@@ -357,7 +769,7 @@ static bool get_alloc(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == (char *)mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)arena_hi() - 7);
     block->header =
         pack(0, false, false, true); // Size is 0, block is marked as allocated.
 }
@@ -435,10 +847,12 @@ static block_t *find_prev(block_t *block) {
  * @brief Determines the appropriate segregated list class for a block based on
  * its size.
  *
- * This function finds the right class in the segregated free list for a block
- * of a given size. The classes are determined based on size thresholds, which
- * double at each step. The function returns an index (starting from 0)
- * indicating the appropriate class.
+ * Sizes up to `exact_class_max` each have a class of their own, so the first
+ * block in such a class always fits. Above that, class `exact_classes + k`
+ * holds the sizes in (2^(k+8), 2^(k+9)], found from the number of leading
+ * zeros of `size - 1`, and the last class holds everything larger. Either
+ * way the class is computed without a loop, and the compiler turns the
+ * choices into conditional moves.
  *
  * @param[in] size The size of the block for which to find the segregated list
  * class.
@@ -447,14 +861,14 @@ static block_t *find_prev(block_t *block) {
  *
  */
 static int find_seg_list_class(size_t size) {
-    if (size <= min_block_size) {
-        return 0;
-    }
+    dbg_requires(size >= min_block_size && size % dsize == 0);
 
-    int seg_list_class = 1;
-    while (size > (min_block_size << seg_list_class)) {
-        seg_list_class++;
-    }
+    // ceil(log2(size)), which is 9 for the first power-of-two class
+    int log2_size = (int)(8 * sizeof(unsigned long)) -
+                    __builtin_clzl((unsigned long)(size - 1));
+    int log_class = exact_classes + log2_size - 9;
+    int exact_class = (int)(size / dsize) - 1;
+    int seg_list_class = size <= exact_class_max ? exact_class : log_class;
 
     // Ensure the class doesn't exceed the maximum
     return (seg_list_class < MAX_SEG_LIST_LENGTH) ? seg_list_class
@@ -545,6 +959,162 @@ static block_t *find_min_prev(block_t *block) {
 
 /******** The remaining content below are helper and debug routines ********/
 
+/**
+ * @brief Orders blocks in the free tree, by size and then by address.
+ *
+ * @param[in] size The size of the first block.
+ * @param[in] block The first block, which need not be in the tree.
+ * @param[in] node The second block.
+ * @return True if the first block comes before the second.
+ */
+static bool tree_before(size_t size, block_t *block, block_t *node) {
+    size_t node_size = get_size(node);
+    return size < node_size || (size == node_size && block < node);
+}
+
+/**
+ * @brief Splays a free tree around a key.
+ *
+ * This is the top-down splay of Sleator and Tarjan, which needs no parent
+ * pointers, so a node fits in the two words of a free block's payload. The
+ * node with the key, or else the last node on the path to where it would
+ * be, becomes the root.
+ *
+ * @param[in] root The root of the tree, which must not be empty.
+ * @param[in] size The size of the key.
+ * @param[in] block The address of the key.
+ * @return The new root.
+ */
+static block_t *tree_splay(block_t *root, size_t size, block_t *block) {
+    // Nodes less than the key collect in the right spine of `left`, those
+    // greater in the left spine of `right`, both hung off `side`
+    block_t side;
+    block_t *left = &side;
+    block_t *right = &side;
+    side.data.tree.left = NULL;
+    side.data.tree.right = NULL;
+
+    while (root != block) {
+        if (tree_before(size, block, root)) {
+            block_t *child = root->data.tree.left;
+            if (child == NULL) {
+                break;
+            }
+            if (tree_before(size, block, child)) {
+                // Rotate right
+                root->data.tree.left = child->data.tree.right;
+                child->data.tree.right = root;
+                root = child;
+                if (root->data.tree.left == NULL) {
+                    break;
+                }
+            }
+            right->data.tree.left = root;
+            right = root;
+            root = root->data.tree.left;
+        } else {
+            block_t *child = root->data.tree.right;
+            if (child == NULL) {
+                break;
+            }
+            if (child != block && !tree_before(size, block, child)) {
+                // Rotate left
+                root->data.tree.right = child->data.tree.left;
+                child->data.tree.left = root;
+                root = child;
+                if (root->data.tree.right == NULL) {
+                    break;
+                }
+            }
+            left->data.tree.right = root;
+            left = root;
+            root = root->data.tree.right;
+        }
+    }
+
+    // Reassemble
+    left->data.tree.right = root->data.tree.left;
+    right->data.tree.left = root->data.tree.right;
+    root->data.tree.left = side.data.tree.right;
+    root->data.tree.right = side.data.tree.left;
+    return root;
+}
+
+/**
+ * @brief Adds a free block to the free tree.
+ *
+ * @param[in] block The block, of a size in `tree_class` or above.
+ */
+static void tree_insert(block_t *block) {
+    size_t size = get_size(block);
+    block_t *root = arena->free_tree;
+
+    if (root == NULL) {
+        block->data.tree.left = NULL;
+        block->data.tree.right = NULL;
+    } else {
+        // The block goes between the root and its neighbor on one side
+        root = tree_splay(root, size, block);
+        if (tree_before(size, block, root)) {
+            block->data.tree.left = root->data.tree.left;
+            block->data.tree.right = root;
+            root->data.tree.left = NULL;
+        } else {
+            block->data.tree.right = root->data.tree.right;
+            block->data.tree.left = root;
+            root->data.tree.right = NULL;
+        }
+    }
+    arena->free_tree = block;
+}
+
+/**
+ * @brief Removes a free block from the free tree.
+ *
+ * @param[in] block The block, which must be in the tree.
+ */
+static void tree_remove(block_t *block) {
+    size_t size = get_size(block);
+    block_t *root = tree_splay(arena->free_tree, size, block);
+    dbg_assert(root == block);
+
+    if (root->data.tree.left == NULL) {
+        arena->free_tree = root->data.tree.right;
+    } else {
+        // Splaying the left subtree for a key greater than all of it brings
+        // up its largest node, which has no right child
+        block_t *left = tree_splay(root->data.tree.left, size, block);
+        left->data.tree.right = root->data.tree.right;
+        arena->free_tree = left;
+    }
+}
+
+/**
+ * @brief Finds the smallest block in the free tree that fits a size, and
+ * splays it to the root, where removing it next is cheap.
+ *
+ * @param[in] asize The size needed.
+ * @return The block, of the lowest address among those of its size, or
+ * NULL if no block is large enough.
+ */
+static block_t *tree_best_fit(size_t asize) {
+    block_t *best = NULL;
+
+    for (block_t *node = arena->free_tree; node != NULL;) {
+        stat_add(&stats.fit_visits, 1);
+        if (get_size(node) >= asize) {
+            best = node;
+            node = node->data.tree.left;
+        } else {
+            node = node->data.tree.right;
+        }
+    }
+    if (best != NULL) {
+        arena->free_tree = tree_splay(arena->free_tree, get_size(best), best);
+    }
+    return best;
+}
+
 /**
  * @brief Inserts a new free block into the segregated free list using LIFO
  * policy.
@@ -561,8 +1131,13 @@ static void insert_block_LIFO(block_t *block) {
     size_t size = get_size(block);
     int class = find_seg_list_class(size);
 
+    if (class >= tree_class) {
+        tree_insert(block);
+        return;
+    }
+
     // Handle the insertion for both minimum and non-minimum size blocks
-    block_t *first_block = seg_list[class];
+    block_t *first_block = arena->seg_list[class];
 
     // Set the previous pointer of the existing first block if it's not a
     // minimum size block
@@ -579,7 +1154,8 @@ static void insert_block_LIFO(block_t *block) {
     }
 
     // Update the segregated list to point to the new first block
-    seg_list[class] = block;
+    arena->seg_list[class] = block;
+    arena->seg_list_bitmap |= (uint64_t)1 << class;
 }
 /**
  * @brief Coalesces a given block with adjacent free blocks if possible.
@@ -604,6 +1180,11 @@ static void fix_free_list(block_t *block) {
     size_t size = get_size(block);
     int class = find_seg_list_class(size);
 
+    if (class >= tree_class) {
+        tree_remove(block);
+        return;
+    }
+
     if (size != min_block_size) {
         // Handle non-minimum size blocks
         block_t *prev = block->data.free_list.prev;
@@ -614,7 +1195,7 @@ static void fix_free_list(block_t *block) {
             if (nextv != NULL) {
                 nextv->data.free_list.prev = NULL;
             }
-            seg_list[class] = nextv;
+            arena->seg_list[class] = nextv;
         } else {
             // Block is in the middle or end of the list
             if (nextv != NULL) {
@@ -630,8 +1211,8 @@ static void fix_free_list(block_t *block) {
         // Handle minimum size blocks
         block_t *nextv = block->data.free_list.next;
         block_t *prev = NULL;
-        block_t *temp = seg_list[class];
-        dbg_requires(seg_list[class] != NULL);
+        block_t *temp = arena->seg_list[class];
+        dbg_requires(arena->seg_list[class] != NULL);
 
         // Iterate to find the block in the list
         while (temp != NULL) {
@@ -646,9 +1227,14 @@ static void fix_free_list(block_t *block) {
         if (prev != NULL) {
             prev->data.free_list.next = nextv;
         } else {
-            seg_list[class] = nextv;
+            arena->seg_list[class] = nextv;
         }
     }
+
+    // Mark the class empty if this was its last block
+    if (arena->seg_list[class] == NULL) {
+        arena->seg_list_bitmap &= ~((uint64_t)1 << class);
+    }
 }
 
 static void handle_case_1(block_t *block, size_t size);
@@ -726,6 +1312,7 @@ static block_t *coalesce_block(block_t *block) {
 
 // Case 1: Both front and back blocks have been assigned
 static void handle_case_1(block_t *block, size_t size) {
+    stat_add(&stats.coalesces[0], 1);
     if (size == min_block_size) {
         set_next_block_pre_alloc_pre_min(block, true, false);
     } else if (size > min_block_size) {
@@ -736,6 +1323,7 @@ static void handle_case_1(block_t *block, size_t size) {
 // Case 2: Front block allocated, back block unallocated
 static void handle_case_2(block_t *block, block_t *next_block, size_t size,
                           bool pre_min, bool pre_flag) {
+    stat_add(&stats.coalesces[1], 1);
     fix_free_list(next_block);
     size += get_size(next_block);
     write_block(block, size, pre_min, pre_flag, false, true);
@@ -744,6 +1332,7 @@ static void handle_case_2(block_t *block, block_t *next_block, size_t size,
 
 // Case 3: Front block unallocated, back block allocated
 static void handle_case_3(block_t *pre_block, size_t size, bool pre_min) {
+    stat_add(&stats.coalesces[2], 1);
     fix_free_list(pre_block);
     size += get_size(pre_block);
     write_block(pre_block, size, pre_min, true, false, true);
@@ -753,6 +1342,7 @@ static void handle_case_3(block_t *pre_block, size_t size, bool pre_min) {
 // Case 4: Both front and back blocks unallocated
 static void handle_case_4(block_t *pre_block, block_t *next_block, size_t size,
                           bool pre_min) {
+    stat_add(&stats.coalesces[3], 1);
     fix_free_list(pre_block);
     fix_free_list(next_block);
     size += get_size(pre_block) + get_size(next_block);
@@ -760,6 +1350,111 @@ static void handle_case_4(block_t *pre_block, block_t *next_block, size_t size,
     set_next_block_pre_alloc_pre_min(pre_block, false, false);
 }
 
+/**
+ * @brief Gives the pages inside a large free block back to the system.
+ *
+ * The block's header, list pointers and footer stay put, and only the whole
+ * pages between them are released; they read as zeros when next touched.
+ * The heap `mem_sbrk` grows cannot shrink, but at the end of an arena with a
+ * region of its own, the block is also cut back to `chunksize` and the
+ * arena's break lowered.
+ *
+ * @param[in] block A free block in the free lists.
+ */
+static void release_block(block_t *block) {
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo, hi;
+
+#ifdef MM_THREADS
+    if (arena->lo != NULL && get_size(find_next(block)) == 0 &&
+        get_size(block) > chunksize) {
+        fix_free_list(block);
+        write_block(block, chunksize, get_pre_min(block), get_pre_alloc(block),
+                    false, true);
+        insert_block_LIFO(block);
+
+        hi = (uintptr_t)arena->brk;
+        arena->brk = (char *)find_next(block) + wsize;
+        write_epilogue(find_next(block));
+
+        lo = round_up((uintptr_t)arena->brk, page);
+        if (hi > lo) {
+            madvise((void *)lo, hi - lo, MADV_DONTNEED);
+        }
+        return;
+    }
+#endif
+
+    lo = round_up((uintptr_t)header_to_payload(block) + dsize, page);
+    hi = (uintptr_t)header_to_footer(block) / page * page;
+    if (hi > lo) {
+        madvise((void *)lo, hi - lo, MADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Allocates a block in a mapping of its own.
+ *
+ * The mapping holds nothing else: the header is its second word, so the
+ * payload is aligned, and records the mapping's length with `mmap_mark`.
+ *
+ * @param[in] size The requested payload size.
+ * @return The block, or NULL if there is no memory for the mapping.
+ */
+static block_t *map_block(size_t size) {
+    size_t length = round_up(size + dsize, mem_pagesize());
+    void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    block_t *block = (block_t *)((char *)mapping + wsize);
+    block->header = pack(length, false, true, true) | mmap_mark;
+    return block;
+}
+
+/**
+ * @brief Unmaps a block allocated by `map_block`.
+ * @param[in] block The block.
+ */
+static void unmap_block(block_t *block) {
+    dbg_requires(block->header & mmap_mark);
+    munmap((char *)block - wsize, get_size(block));
+}
+
+/**
+ * @brief Resizes a block allocated by `map_block`, which may move it.
+ *
+ * The mapping is resized with `mremap`, which moves pages rather than
+ * copying them. A block shrinking below `mmap_threshold` is left for the
+ * caller to move into the heap.
+ *
+ * @param[in] block The block.
+ * @param[in] size The new payload size.
+ * @return The block at its new address, or NULL if it was not resized.
+ */
+static block_t *remap_block(block_t *block, size_t size) {
+    size_t length = round_up(size + dsize, mem_pagesize());
+
+    if (length == get_size(block)) {
+        return block;
+    }
+    if (size < mmap_threshold) {
+        return NULL;
+    }
+
+    void *mapping = mremap((char *)block - wsize, get_size(block), length,
+                           MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    block = (block_t *)((char *)mapping + wsize);
+    block->header = pack(length, false, true, true) | mmap_mark;
+    return block;
+}
+
 /**
  * @brief Extends the heap with a new free block.
  *
@@ -784,9 +1479,11 @@ static void handle_case_4(block_t *pre_block, block_t *next_block, size_t size,
 static block_t *extend_heap(size_t size) {
     // Align size to meet memory alignment requirements
     size = round_up(size, dsize);
+    stat_add(&stats.extends, 1);
+    stat_add(&stats.extend_bytes, size);
 
     // Extend the heap by the aligned size and check for errors
-    void *bp = mem_sbrk((intptr_t)size);
+    void *bp = arena_sbrk(size);
     if (bp == (void *)(-1)) {
         return NULL;
     }
@@ -844,6 +1541,8 @@ static void split_block(block_t *block, size_t asize) {
 
     // Check if the block can be split
     if ((block_size - asize) >= min_block_size) {
+        stat_add(&stats.splits, 1);
+
         // Initialize the next block
         block_t *block_next;
 
@@ -881,10 +1580,12 @@ static void split_block(block_t *block, size_t asize) {
 /**
  * @brief Finds a free block of memory that fits the requested size.
  *
- * This function iterates through segregated free lists to find a free block
- * that is large enough to fit the requested size. It starts searching from
- * the list that best matches the requested size and moves to higher lists
- * if necessary.
+ * This function searches the list that best matches the requested size
+ * first. Failing that, every block in a higher class is larger than any
+ * size in this one, so it takes the first block of the next non-empty
+ * class, found with a single count of trailing zeros in `seg_list_bitmap`,
+ * rather than visiting the empty lists in between. Blocks from `tree_class`
+ * up are in the free tree instead, which gives the best fit among them.
  *
  * @param[in] asize The size of the memory block needed.
  * @return Pointer to a suitable free block if found, otherwise NULL.
@@ -902,66 +1603,336 @@ static block_t *find_fit(size_t asize) {
     // Start searching from the segregated list class that best fits the
     // requested size
     int class = find_seg_list_class(asize);
+    stat_add(&stats.fit_searches, 1);
+    if (class >= tree_class) {
+        return tree_best_fit(asize);
+    }
+    block_t *class_root = arena->seg_list[class];
 
-    while (class < MAX_SEG_LIST_LENGTH) {
-        block_t *class_root = seg_list[class];
-
-        // Iterate through the blocks in the current segregated list
-        while (class_root != NULL) {
-            size_t size = get_size(class_root);
-
-            // If a block is found that is large enough, return it
-            if (size >= asize) {
-                return class_root;
-            }
+    // Iterate through the blocks in the best-matching segregated list
+    while (class_root != NULL) {
+        size_t size = get_size(class_root);
+        stat_add(&stats.fit_visits, 1);
 
-            // Move to the next block in the current segregated list
-            class_root = class_root->data.free_list.next;
+        // If a block is found that is large enough, return it
+        if (size >= asize) {
+            return class_root;
         }
 
-        // If no suitable block was found in the current list, move to the next
-        // higher list
-        class ++;
+        // Move to the next block in the current segregated list
+        class_root = class_root->data.free_list.next;
     }
 
-    // Return NULL if no suitable block was found in any of the lists
-    return NULL;
+    // Otherwise take the first block of the next non-empty higher list, or
+    // failing that, the smallest block in the tree
+    uint64_t higher = arena->seg_list_bitmap & ~(((uint64_t)2 << class) - 1);
+    if (higher == 0) {
+        return tree_best_fit(asize);
+    }
+    return arena->seg_list[__builtin_ctzll(higher)];
 }
 
-bool check_header_footer(block_t *block);
-bool check_free_list(void);
-bool check_free_block_counts(void);
+#ifdef MM_QUICK_LISTS
+static void free_block(block_t *block);
 
 /**
- * @brief Check the consistency of the heap at the given line.
+ * @brief Coalesces every block waiting in the quick lists.
  *
- * This function checks various aspects of the heap for consistency, including
- * prologue and epilogue blocks, block alignments, header-footer matches, and
- * the consistency of free blocks.
- *
- * @param[in] line - The line number from which this function is called.
- * @return true if the heap is consistent, false otherwise.
+ * @return true if there were any.
  */
-bool mm_checkheap(int line) {
-    // Check prologue footer
-    word_t prologue_footer = *(find_prev_footer(heap_start));
+static bool quick_consolidate(void) {
+    bool any = false;
+
+    for (int class = 0; class < QUICK_CLASSES; class ++) {
+        while (arena->quick[class] != NULL) {
+            block_t *block = arena->quick[class];
+            arena->quick[class] = block->data.free_list.next;
+            free_block(block);
+            any = true;
+        }
+    }
+    return any;
+}
+#endif
+
+#ifdef MM_SLABS
+static block_t *alloc_block(size_t asize);
+static void free_block(block_t *block);
+
+/**
+ * @brief Finds the slab an allocation lies in, if any.
+ *
+ * Slabs start on a multiple of `slab_span`, so the slab is found by rounding
+ * the address down, once the bit for that span says there is one there.
+ *
+ * @param[in] bp A pointer returned by malloc.
+ * @return The slab, or NULL if `bp` is the payload of an ordinary block.
+ */
+static slab_t *slab_of(void *bp) {
+    uintptr_t span = ((uintptr_t)bp >> slab_shift) - arena->slab_base;
+
+    if (span >= arena->slab_map_len ||
+        ((arena->slab_map[span / 64] >> (span % 64)) & 1) == 0) {
+        return NULL;
+    }
+    return (slab_t *)((uintptr_t)bp & ~(uintptr_t)(slab_span - 1));
+}
+
+/**
+ * @brief Sets or clears the bit in `slab_map` for a slab.
+ * @param[in] slab The slab.
+ * @param[in] present Whether the slab is in use.
+ */
+static void slab_map_set(slab_t *slab, bool present) {
+    uintptr_t span = ((uintptr_t)slab >> slab_shift) - arena->slab_base;
+    uint64_t bit = (uint64_t)1 << (span % 64);
+
+    if (present) {
+        arena->slab_map[span / 64] |= bit;
+    } else {
+        arena->slab_map[span / 64] &= ~bit;
+    }
+}
+
+/**
+ * @brief Makes sure `slab_map` has a bit for a span of the heap.
+ *
+ * A map that is too short is replaced by one for twice the current heap, in
+ * a new block, so that it is replaced only as often as the heap doubles.
+ *
+ * @param[in] span The span's number, counted from `slab_base`.
+ * @return false if there is no room for a larger map.
+ */
+static bool slab_map_cover(uintptr_t span) {
+    if (span < arena->slab_map_len) {
+        return true;
+    }
+
+    uintptr_t heap_spans =
+        ((uintptr_t)arena_hi() >> slab_shift) - arena->slab_base + 1;
+    size_t len = round_up(2 * max(span + 1, heap_spans), 64);
+    block_t *block = alloc_block(round_up(len / 8 + wsize, dsize));
+    if (block == NULL) {
+        return false;
+    }
+
+    uint64_t *map = header_to_payload(block);
+    size_t old_words = arena->slab_map_len / 64;
+    if (arena->slab_map != NULL) {
+        memcpy(map, arena->slab_map, old_words * sizeof(uint64_t));
+        free_block(payload_to_header(arena->slab_map));
+    }
+    memset(map + old_words, 0, (len / 64 - old_words) * sizeof(uint64_t));
+
+    arena->slab_map = map;
+    arena->slab_map_len = len;
+    return true;
+}
+
+/**
+ * @brief Adds a slab to the front of its class's list.
+ * @param[in] slab The slab, which has a free slot.
+ * @param[in] class The slab's class.
+ */
+static void slab_push(slab_t *slab, int class) {
+    slab->prev = NULL;
+    slab->next = arena->slabs[class];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->slabs[class] = slab;
+}
+
+/**
+ * @brief Removes a slab from its class's list.
+ * @param[in] slab The slab.
+ * @param[in] class The slab's class.
+ */
+static void slab_unlink(slab_t *slab, int class) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[class] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Returns the bitmap of a slab with every slot free.
+ * @param[in] slab The slab.
+ */
+static uint64_t slab_all_free(slab_t *slab) {
+    return slab->nslots == 64 ? ~(uint64_t)0
+                              : ((uint64_t)1 << slab->nslots) - 1;
+}
+
+/**
+ * @brief Makes a new, empty slab and adds it to its class's list.
+ *
+ * A slab's block is `slab_span` bytes, with its payload aligned to
+ * `slab_span`, so its header is the last word of the span before. Slabs made
+ * one after another at the end of the heap therefore follow each other with
+ * no gap between them.
+ *
+ * The slab is carved from a free block large enough to hold an aligned one
+ * wherever the block starts, or else from just enough new space at the end
+ * of the heap. The bytes before the slab go back to the free lists as a
+ * block of their own, and `split_block` returns those after it.
+ *
+ * @param[in] class The class, whose slots are `(class + 1) * dsize` bytes.
+ * @return The slab, or NULL if the heap cannot be extended.
+ */
+static slab_t *slab_new(int class) {
+    block_t *block = find_fit(2 * slab_span - dsize);
+#ifdef MM_QUICK_LISTS
+    if (block == NULL && quick_consolidate()) {
+        block = find_fit(2 * slab_span - dsize);
+    }
+#endif
+    if (block == NULL) {
+        uintptr_t brk = (uintptr_t)arena_hi() + 1;
+        size_t pad = round_up(brk, slab_span) - brk;
+        if ((block = extend_heap(pad + slab_span)) == NULL) {
+            return NULL;
+        }
+    }
+
+    // Split off the bytes before the first payload aligned to slab_span
+    uintptr_t payload = (uintptr_t)header_to_payload(block);
+    size_t pad = round_up(payload, slab_span) - payload;
+    if (pad > 0) {
+        size_t size = get_size(block);
+        fix_free_list(block);
+        write_block(block, pad, get_pre_min(block), get_pre_alloc(block),
+                    false, true);
+        insert_block_LIFO(block);
+
+        block = (block_t *)((char *)block + pad);
+        write_block(block, size - pad, pad == min_block_size, false, false,
+                    true);
+        insert_block_LIFO(block);
+    }
+    split_block(block, slab_span);
+    if (pad > 0) {
+        // split_block expects the block before to be allocated
+        write_block(block, get_size(block), pad == min_block_size, false, true,
+                    false);
+    }
+
+    slab_t *slab = header_to_payload(block);
+    if (!slab_map_cover(((uintptr_t)slab >> slab_shift) - arena->slab_base)) {
+        free_block(block);
+        return NULL;
+    }
+    slab_map_set(slab, true);
+    arena->slab_count++;
+
+    slab->slot_size = (uint32_t)((size_t)(class + 1) * dsize);
+    slab->nslots = (uint32_t)((slab_span - wsize - sizeof(slab_t)) /
+                              slab->slot_size);
+    slab->free_slots = slab_all_free(slab);
+    slab_push(slab, class);
+    return slab;
+}
+
+/**
+ * @brief Allocates a slot from a slab.
+ *
+ * @param[in] size The requested size, at most `slab_max`.
+ * @return The slot, or NULL if a new slab was needed and none could be made.
+ */
+static void *slab_alloc(size_t size) {
+    int class = (int)((size - 1) / dsize);
+    slab_t *slab = arena->slabs[class];
+
+    if (slab == NULL && (slab = slab_new(class)) == NULL) {
+        return NULL;
+    }
+
+    int slot = __builtin_ctzll(slab->free_slots);
+    slab->free_slots &= slab->free_slots - 1;
+    if (slab->free_slots == 0) {
+        slab_unlink(slab, class);
+    }
+    return slab->slots + (size_t)slot * slab->slot_size;
+}
+
+/**
+ * @brief Frees a slot in a slab.
+ *
+ * A slab left empty goes back to the heap, and the map with the last one, so
+ * that neither stays behind to split the free space around it.
+ *
+ * @param[in] slab The slab.
+ * @param[in] bp The slot.
+ */
+static void slab_free(slab_t *slab, void *bp) {
+    size_t slot = (size_t)((char *)bp - slab->slots) / slab->slot_size;
+    int class = (int)(slab->slot_size / dsize) - 1;
+    bool was_full = slab->free_slots == 0;
+
+    dbg_requires(((slab->free_slots >> slot) & 1) == 0);
+    slab->free_slots |= (uint64_t)1 << slot;
+
+    if (was_full) {
+        slab_push(slab, class);
+    } else if (slab->free_slots == slab_all_free(slab)) {
+        slab_unlink(slab, class);
+        slab_map_set(slab, false);
+        free_block(payload_to_header(slab));
+
+        if (--arena->slab_count == 0) {
+            free_block(payload_to_header(arena->slab_map));
+            arena->slab_map = NULL;
+            arena->slab_map_len = 0;
+        }
+    }
+}
+#endif
+
+bool check_header_footer(block_t *block);
+bool check_free_list(void);
+bool check_free_block_counts(void);
+#ifdef MM_SLABS
+bool check_slab(slab_t *slab);
+#endif
+
+/**
+ * @brief Check the consistency of the current arena's heap at the given line.
+ *
+ * This function checks various aspects of the heap for consistency, including
+ * prologue and epilogue blocks, block alignments, header-footer matches, and
+ * the consistency of free blocks.
+ *
+ * @param[in] line - The line number from which this function is called.
+ * @return true if the heap is consistent, false otherwise.
+ */
+static bool check_arena(int line) {
+    // Check prologue footer
+    word_t prologue_footer = *(find_prev_footer(arena->heap_start));
     if (extract_size(prologue_footer) != 0 ||
         extract_alloc(prologue_footer) != 1) {
         printf("Error at line %d: Bad prologue footer\n", line);
         return false;
     }
 
-    block_t *block = heap_start;
+    block_t *block = arena->heap_start;
     bool pre_alloc_flag = true; // Tracks if the previous block was allocated
+#ifdef MM_SLABS
+    size_t slab_count = 0;
+#endif
 
     // Iterate through blocks in the heap
     for (; get_size(block) > 0; block = find_next(block)) {
         size_t size = get_size(block);
 
         // Check for doubleword alignment and header-footer match for
-        // non-minimum blocks
+        // non-minimum free blocks; allocated blocks have no footer
         if ((size % dsize) != 0 ||
-            (size != min_block_size && !check_header_footer(block))) {
+            (size != min_block_size && !get_alloc(block) &&
+             !check_header_footer(block))) {
             printf("Error at line %d: Block at %p has alignment or "
                    "header-footer mismatch\n",
                    line, (void *)block);
@@ -974,6 +1945,19 @@ bool mm_checkheap(int line) {
             return false;
         }
         pre_alloc_flag = get_alloc(block);
+
+#ifdef MM_SLABS
+        // Check the slab in the block, if there is one
+        slab_t *slab = header_to_payload(block);
+        if (get_alloc(block) && slab_of(slab) == slab) {
+            if (!check_slab(slab)) {
+                printf("Error at line %d: Bad slab at %p\n", line,
+                       (void *)slab);
+                return false;
+            }
+            slab_count++;
+        }
+#endif
     }
 
     // Check epilogue header
@@ -982,6 +1966,27 @@ bool mm_checkheap(int line) {
         return false;
     }
 
+#ifdef MM_QUICK_LISTS
+    // Check that the quick lists hold allocated blocks of their class; a
+    // list longer than the heap could hold has a cycle
+    size_t most = (size_t)((char *)arena_hi() - (char *)arena_lo()) /
+                  min_block_size;
+    for (int class = 0; class < QUICK_CLASSES; class ++) {
+        size_t count = 0;
+        for (block_t *quick = arena->quick[class]; quick != NULL;
+             quick = quick->data.free_list.next) {
+            if (quick > (block_t *)arena_hi() ||
+                quick < (block_t *)arena_lo() || !get_alloc(quick) ||
+                find_seg_list_class(get_size(quick)) != class ||
+                ++count > most) {
+                printf("Error at line %d: Bad quick list for class %d\n",
+                       line, class);
+                return false;
+            }
+        }
+    }
+#endif
+
     // Check free list pointers and bucket size consistency
     if (!check_free_list()) {
         printf("Error at line %d: Free list pointer or bucket size "
@@ -996,9 +2001,224 @@ bool mm_checkheap(int line) {
         return false;
     }
 
+#ifdef MM_SLABS
+    // Check that every bit in the slab map is for a slab in the heap, and
+    // that the class lists hold only slabs with free slots
+    size_t map_count = 0;
+    for (size_t i = 0; i < arena->slab_map_len / 64; i++) {
+        map_count += (size_t)__builtin_popcountll(arena->slab_map[i]);
+    }
+    if (map_count != slab_count || slab_count != arena->slab_count) {
+        printf("Error at line %d: Slab map marks %zu slabs, heap has %zu\n",
+               line, map_count, slab_count);
+        return false;
+    }
+    for (int class = 0; class < SLAB_CLASSES; class ++) {
+        slab_t *prev = NULL;
+        for (slab_t *slab = arena->slabs[class]; slab != NULL;
+             slab = slab->next) {
+            if (slab_of(slab->slots) != slab || slab->prev != prev ||
+                slab->free_slots == 0 ||
+                slab->slot_size != (size_t)(class + 1) * dsize) {
+                printf("Error at line %d: Bad slab %p in class %d\n", line,
+                       (void *)slab, class);
+                return false;
+            }
+            prev = slab;
+        }
+    }
+#endif
+
     return true;
 }
 
+/**
+ * @brief Check the consistency of the heap at the given line.
+ *
+ * Called from within the allocator, this checks the arena being operated on.
+ * With MM_THREADS, a call from outside checks every arena in turn.
+ *
+ * @param[in] line - The line number from which this function is called.
+ * @return true if the heap is consistent, false otherwise.
+ */
+bool mm_checkheap(int line) {
+#ifdef MM_THREADS
+    if (arena == NULL) {
+        bool ok = true;
+        pthread_once(&arenas_once, arenas_setup);
+        for (int i = 0; i < narenas && ok; i++) {
+            arena_lock(&arenas[i]);
+            ok = arena->heap_start == NULL || check_arena(line);
+            arena_unlock();
+        }
+        return ok;
+    }
+#endif
+    return check_arena(line);
+}
+
+/**
+ * @brief Sets the smallest request given a mapping of its own.
+ *
+ * With MM_THREADS, this should be called before other threads start using
+ * the allocator.
+ *
+ * @param[in] threshold The size in bytes, or 0 to map no requests.
+ */
+void mm_set_mmap_threshold(size_t threshold) {
+    mmap_threshold = threshold;
+}
+
+/**
+ * @brief Sets the smallest free block whose pages are given back.
+ *
+ * With MM_THREADS, this should be called before other threads start using
+ * the allocator.
+ *
+ * @param[in] threshold The size in bytes, or 0 to release none.
+ */
+void mm_set_release_threshold(size_t threshold) {
+    release_threshold = threshold;
+}
+
+/**
+ * @brief Returns the largest block size in a size class, as
+ * find_seg_list_class assigns them.
+ *
+ * @param[in] class The size class.
+ * @return The size, or SIZE_MAX for the last class.
+ */
+static size_t class_max_size(int class) {
+    if (class == MAX_SEG_LIST_LENGTH - 1) {
+        return SIZE_MAX;
+    }
+    if (class < exact_classes) {
+        return (size_t)(class + 1) * dsize;
+    }
+    return (size_t)1 << (class - exact_classes + 9);
+}
+
+/**
+ * @brief Reports the allocator's size classes.
+ *
+ * @param[out] limits If not NULL, set to the largest block size in each of
+ *                    the first `n` classes, and SIZE_MAX for the last.
+ * @param[in] n The length of `limits`.
+ * @return The number of size classes.
+ */
+size_t mm_size_classes(size_t *limits, size_t n) {
+    for (int class = 0; class < MAX_SEG_LIST_LENGTH && (size_t)class < n;
+         class ++) {
+        limits[class] = class_max_size(class);
+    }
+    return MAX_SEG_LIST_LENGTH;
+}
+
+/**
+ * @brief Adds up the free blocks in the arena being operated on.
+ *
+ * @param[in,out] counts The counts for each of the first `n` classes.
+ * @param[in] n The length of `counts`.
+ * @return The size of the arena's largest free block, or 0 if it has none.
+ */
+static size_t count_free_blocks(size_t *counts, size_t n) {
+    size_t largest = 0;
+    if (arena->heap_start == NULL) {
+        return 0;
+    }
+    for (block_t *block = arena->heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        if (get_alloc(block)) {
+            continue;
+        }
+        size_t size = get_size(block);
+        size_t class = (size_t)find_seg_list_class(size);
+        if (class < n) {
+            counts[class]++;
+        }
+        largest = size > largest ? size : largest;
+    }
+    return largest;
+}
+
+/**
+ * @brief Counts the free blocks in the heap in each size class, walking
+ * every block.
+ *
+ * Blocks waiting in quick lists or thread caches are allocated as far as
+ * the heap is concerned, and aren't counted. With MM_THREADS, a call from
+ * outside the allocator counts every arena.
+ *
+ * @param[out] counts Set to the number of free blocks in each of the first
+ *                    `n` classes.
+ * @param[in] n The length of `counts`.
+ * @return The size of the largest free block, or 0 if there is none.
+ */
+size_t mm_free_blocks(size_t *counts, size_t n) {
+    for (size_t class = 0; class < n; class ++) {
+        counts[class] = 0;
+    }
+#ifdef MM_THREADS
+    if (arena == NULL) {
+        size_t largest = 0;
+        pthread_once(&arenas_once, arenas_setup);
+        for (int i = 0; i < narenas; i++) {
+            arena_lock(&arenas[i]);
+            size_t size = count_free_blocks(counts, n);
+            arena_unlock();
+            largest = size > largest ? size : largest;
+        }
+        return largest;
+    }
+#endif
+    return count_free_blocks(counts, n);
+}
+
+/**
+ * @brief Prints the allocator's statistics since `mm_init`.
+ *
+ * Only builds with MM_STATS keep them; others say so and print nothing
+ * else. With MM_THREADS, the counts are exact only once other threads have
+ * stopped allocating.
+ *
+ * @param[in] stream Where to print them.
+ */
+void mm_stats_dump(FILE *stream) {
+    if (!stats_enabled) {
+        fprintf(stream, "Allocator statistics need a build with MM_STATS\n");
+        return;
+    }
+
+    fprintf(stream, "%12s %12s %12s\n", "block size", "mallocs", "frees");
+    for (int class = 0; class < MAX_SEG_LIST_LENGTH; class ++) {
+        if (stats.mallocs[class] == 0 && stats.frees[class] == 0) {
+            continue;
+        }
+
+        char label[32];
+        if (class == MAX_SEG_LIST_LENGTH - 1) {
+            snprintf(label, sizeof(label), "larger");
+        } else {
+            snprintf(label, sizeof(label), "<= %zu", class_max_size(class));
+        }
+        fprintf(stream, "%12s %12zu %12zu\n", label, stats.mallocs[class],
+                stats.frees[class]);
+    }
+
+    fprintf(stream, "find_fit: %zu searches, %zu free blocks visited\n",
+            stats.fit_searches, stats.fit_visits);
+    fprintf(stream, "splits: %zu\n", stats.splits);
+    fprintf(stream,
+            "coalesces: %zu with neither neighbor free, %zu next, "
+            "%zu previous, %zu both\n",
+            stats.coalesces[0], stats.coalesces[1], stats.coalesces[2],
+            stats.coalesces[3]);
+    fprintf(stream, "extend_heap: %zu calls, %zu bytes\n", stats.extends,
+            stats.extend_bytes);
+    fprintf(stream, "bytes: %zu requested, %zu reserved\n",
+            stats.bytes_requested, stats.bytes_reserved);
+}
+
 /**
  * @brief Check the consistency of the header and footer of a block.
  *
@@ -1017,112 +2237,632 @@ bool check_header_footer(block_t *block) {
            get_alloc(block) == extract_alloc(*(header_to_footer(block)));
 }
 
+#ifdef MM_SLABS
+/**
+ * @brief Check the consistency of a slab.
+ *
+ * @param[in] slab - The slab, which `slab_map` says is one.
+ * @return true if the slab fits in its block and its slots are consistent.
+ */
+bool check_slab(slab_t *slab) {
+    block_t *block = payload_to_header(slab);
+
+    return get_size(block) >= slab_span && slab->slot_size > 0 &&
+           slab->slot_size <= slab_max && slab->slot_size % dsize == 0 &&
+           slab->nslots ==
+               (slab_span - wsize - sizeof(slab_t)) / slab->slot_size &&
+           (slab->free_slots & ~slab_all_free(slab)) == 0;
+}
+#endif
+
+/**
+ * @brief Checks a subtree of the free tree.
+ *
+ * @param[in] node The root of the subtree.
+ * @param[in] lo The block every node must come after, or NULL.
+ * @param[in] hi The block every node must come before, or NULL.
+ * @return The number of blocks in the subtree, or -1 if it is inconsistent.
+ */
+static long check_tree(block_t *node, block_t *lo, block_t *hi) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (node > (block_t *)arena_hi() || node < (block_t *)arena_lo()) {
+        printf("Error: Free tree pointer out of heap bounds\n");
+        return -1;
+    }
+    if (get_alloc(node) || find_seg_list_class(get_size(node)) < tree_class) {
+        printf("Error: Block %p of size %zu in the free tree\n", (void *)node,
+               get_size(node));
+        return -1;
+    }
+    if ((lo != NULL && !tree_before(get_size(lo), lo, node)) ||
+        (hi != NULL && !tree_before(get_size(node), node, hi))) {
+        printf("Error: Free tree out of order at %p\n", (void *)node);
+        return -1;
+    }
+
+    long left = check_tree(node->data.tree.left, lo, node);
+    long right = check_tree(node->data.tree.right, node, hi);
+    if (left < 0 || right < 0) {
+        return -1;
+    }
+    return left + right + 1;
+}
+
+/**
+ * @brief Check the consistency of the free list.
+ *
+ * This function iterates through the free list and checks the pointers and
+ * size consistency of the free blocks. It also ensures that the pointers are
+ * within the bounds of the heap.
+ *
+ * @return true if the free list is consistent, false otherwise.
+ */
+bool check_free_list(void) {
+    // Iterate through the segmentation list and check pointers and size
+    // consistency
+    for (int class = 0; class < MAX_SEG_LIST_LENGTH; class ++) {
+        block_t *temp = arena->seg_list[class];
+        while (temp != NULL) {
+            // Check if pointers are within heap bounds; NULL ends the list
+            block_t *next = temp->data.free_list.next;
+            if (next != NULL && (next > (block_t *)arena_hi() ||
+                                 next < (block_t *)arena_lo())) {
+                printf("Error: Free list pointer out of heap bounds\n");
+                return false;
+            }
+            // Check that the block is in the list for its size
+            if (find_seg_list_class(get_size(temp)) != class) {
+                printf("Error: Free block of size %zu in wrong class %d\n",
+                       get_size(temp), class);
+                return false;
+            }
+            temp = next;
+        }
+
+        // Check that the bitmap agrees with the list
+        if (((arena->seg_list_bitmap >> class) & 1) != (arena->seg_list[class] != NULL)) {
+            printf("Error: Bitmap wrong for class %d\n", class);
+            return false;
+        }
+        if (class >= tree_class && arena->seg_list[class] != NULL) {
+            printf("Error: List for class %d kept in the free tree\n", class);
+            return false;
+        }
+    }
+    return check_tree(arena->free_tree, NULL, NULL) >= 0;
+}
+
+/**
+ * @brief Check if the counts of free blocks in the heap match the free list.
+ *
+ * This function compares the counts of free blocks in the heap with the counts
+ * in the free list to ensure they match.
+ *
+ * @return true if the counts match, false otherwise.
+ */
+bool check_free_block_counts(void) {
+    int free_block_count = 0;
+    for (block_t *block = arena->heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        if (!get_alloc(block)) {
+            free_block_count++;
+        }
+    }
+
+    int free_list_count = 0;
+    for (int class = 0; class < MAX_SEG_LIST_LENGTH; class ++) {
+        for (block_t *temp = arena->seg_list[class]; temp != NULL;
+             temp = temp->data.free_list.next) {
+            free_list_count++;
+        }
+    }
+    free_list_count += (int)check_tree(arena->free_tree, NULL, NULL);
+
+    // Compare the counts of free blocks in the heap and free list
+    if (free_block_count != free_list_count) {
+        printf("Error: Free block count does not match free list count\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Initializes the current arena's heap.
+ *
+ * This function initializes the memory allocator by creating the initial empty
+ * heap, setting up the heap prologue and epilogue, and extending the empty heap
+ * with a free block of `chunksize` bytes. It also reinitializes the
+ * segmentation list for free blocks.
+ *
+ * @return true if initialization is successful, false otherwise.
+ *
+ * Postconditions:
+ * - The initial empty heap is created.
+ * - The heap prologue and epilogue are set up.
+ * - The segmentation list for free blocks is reinitialized.
+ * - The empty heap is extended with a free block of at least `chunksize` bytes.
+ * - If initialization fails, false is returned.
+ */
+static bool heap_init(void) {
+    // Create the initial empty heap
+    word_t *start = (word_t *)(arena_sbrk(2 * wsize));
+
+    if (start == (void *)-1) {
+        return false;
+    }
+
+    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
+    start[1] = pack(0, false, true, true); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    arena->heap_start = (block_t *)&(start[1]);
+    // reinitialize seg list
+    for (int index = 0; index < MAX_SEG_LIST_LENGTH; index++) {
+        arena->seg_list[index] = NULL;
+    }
+    arena->seg_list_bitmap = 0;
+    arena->free_tree = NULL;
+#ifdef MM_QUICK_LISTS
+    for (int class = 0; class < QUICK_CLASSES; class ++) {
+        arena->quick[class] = NULL;
+    }
+#endif
+
+#ifdef MM_SLABS
+    for (int class = 0; class < SLAB_CLASSES; class ++) {
+        arena->slabs[class] = NULL;
+    }
+    arena->slab_map = NULL;
+    arena->slab_map_len = 0;
+    arena->slab_count = 0;
+    arena->slab_base = (uintptr_t)arena_lo() >> slab_shift;
+#endif
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Initialize the memory allocator.
+ *
+ * This resets the first arena's heap, the one `mem_sbrk` grows, as the
+ * driver does between traces. With MM_THREADS, it must not be called while
+ * other threads are using the allocator; arenas other than the first keep
+ * their heaps.
+ *
+ * @return true if initialization is successful, false otherwise.
+ */
+bool mm_init(void) {
+    stats = (stats_t){0};
+
+#ifdef MM_THREADS
+    pthread_once(&arenas_once, arenas_setup);
+
+    // Blocks cached from an earlier heap are gone
+    for (int class = 0; class < TCACHE_CLASSES; class ++) {
+        tcache.head[class] = NULL;
+        tcache.count[class] = 0;
+    }
+
+    arena_lock(&arenas[0]);
+    bool ok = heap_init();
+    arena_unlock();
+    return ok;
+#else
+    return heap_init();
+#endif
+}
+
+/**
+ * @brief Allocates a block of an adjusted size from the heap.
+ *
+ * The free lists are searched for a fit first. If there is none, the heap is
+ * extended by at least `chunksize`, and the block taken from the new space.
+ * In deferred mode, a block of the exact size waiting in a quick list is
+ * taken before anything else, and the quick lists are coalesced before the
+ * heap is extended.
+ *
+ * @param[in] asize The adjusted block size, including overhead.
+ * @return The allocated block, or NULL if the heap cannot be extended.
+ */
+static block_t *alloc_block(size_t asize) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+
+#ifdef MM_QUICK_LISTS
+    if (asize <= exact_class_max) {
+        int class = find_seg_list_class(asize);
+        if ((block = arena->quick[class]) != NULL) {
+            arena->quick[class] = block->data.free_list.next;
+            return block;
+        }
+    }
+#endif
+
+    // Search the free list for a fit
+    block = find_fit(asize);
+#ifdef MM_QUICK_LISTS
+    if (block == NULL && quick_consolidate()) {
+        block = find_fit(asize);
+    }
+#endif
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // Always request at least chunksize
+        extendsize = max(asize, chunksize);
+        block = extend_heap(extendsize);
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    split_block(block, asize);
+    return block;
+}
+
+/**
+ * @brief Marks an allocated block free and coalesces it with its neighbors.
+ *
+ * @param[in] block The allocated block.
+ */
+static void free_block(block_t *block) {
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    // Mark the block as free by updating its header (and footer if necessary)
+    bool pre_alloc = get_pre_alloc(block);
+    bool pre_min = get_pre_min(block);
+    write_block(block, size, pre_min, pre_alloc, false, size != min_block_size);
+
+    // Update the 'pre_alloc' status of the next block in the heap
+    // If the block size is not minimum, mark the next block as not
+    // pre-allocated
+    if (size != min_block_size) {
+        set_next_block_pre_alloc_pre_min(block, false, false);
+    } else {
+        // If the block is of minimum size, mark the next block as pre-allocated
+        set_next_block_pre_alloc_pre_min(block, true, false);
+    }
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+
+    if (release_threshold != 0 && get_size(block) >= release_threshold) {
+        release_block(block);
+    }
+}
+
+/**
+ * @brief Resizes an allocated block where it is.
+ *
+ * A block grows into a free block after it, and at the end of the heap by
+ * as much as it still lacks. Mid-heap, it grows only when no free block
+ * elsewhere could take it instead. A block that shrinks, or grows into more than
+ * it needs, has the excess split off and freed, which coalesces it with
+ * whatever follows.
+ *
+ * @param[in] block The allocated block.
+ * @param[in] asize The adjusted block size wanted.
+ * @return true if the block is now at least `asize` bytes, false if it
+ * cannot grow without moving and is unchanged.
+ */
+static bool resize_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+
+    if (asize > size) {
+        block_t *next = find_next(block);
+        size_t next_size = get_alloc(next) ? 0 : get_size(next);
+
+        // Taking in a free block mid-heap leaves the remainder where it
+        // fragments the heap, so only do so when moving would grow it
+        if (next_size > 0 && get_size(find_next(next)) != 0 &&
+            find_fit(asize) != NULL) {
+            next_size = 0;
+        }
+
+        if (size + next_size < asize) {
+            bool at_end = get_size(next) == 0 ||
+                          (next_size > 0 && get_size(find_next(next)) == 0);
+            if (!at_end || extend_heap(asize - size - next_size) == NULL) {
+                return false;
+            }
+            next = find_next(block);
+            next_size = get_size(next);
+        }
+
+        // Take in the free block after
+        fix_free_list(next);
+        size += next_size;
+        write_block(block, size, get_pre_min(block), get_pre_alloc(block),
+                    true, false);
+        set_next_block_pre_alloc_pre_min(block, false, true);
+    }
+
+    if (size - asize >= min_block_size) {
+        block_t *rest = (block_t *)((char *)block + asize);
+        write_block(block, asize, get_pre_min(block), get_pre_alloc(block),
+                    true, false);
+        write_block(rest, size - asize, asize == min_block_size, true, true,
+                    false);
+        free_block(rest);
+    }
+    return true;
+}
+
+/**
+ * @brief Moves the start of an allocated block up to an aligned payload.
+ *
+ * The bytes before the first payload aligned to `align` are a multiple of
+ * `dsize`, so when there are any they make a block of at least the minimum
+ * size, which is freed and coalesces with the block before. Whatever
+ * follows the first `asize` bytes of the rest is freed as well.
+ *
+ * @param[in] block The allocated block, of at least `asize + align - dsize`
+ * bytes.
+ * @param[in] align The alignment, a power of two larger than `dsize`.
+ * @param[in] asize The adjusted block size wanted.
+ * @return The block with the aligned payload.
+ */
+static block_t *align_block(block_t *block, size_t align, size_t asize) {
+    size_t payload = (size_t)header_to_payload(block);
+    size_t pad = round_up(payload, align) - payload;
+
+    if (pad > 0) {
+        size_t size = get_size(block);
+        block_t *aligned = (block_t *)((char *)block + pad);
+        write_block(block, pad, get_pre_min(block), get_pre_alloc(block), true,
+                    false);
+        write_block(aligned, size - pad, pad == min_block_size, true, true,
+                    false);
+        free_block(block);
+        block = aligned;
+    }
+    resize_block(block, asize);
+
+    dbg_ensures((size_t)header_to_payload(block) % align == 0);
+    return block;
+}
+
+/**
+ * @brief Finds a free block to carve a batch of blocks from.
+ *
+ * The heap is extended for the whole batch if no free block holds it.
+ * Failing that, any block that holds one of them will do.
+ *
+ * @param[in] asize The adjusted size of each block.
+ * @param[in] n The number of blocks wanted.
+ * @return The free block, or NULL if there is no room for even one.
+ */
+static block_t *find_batch_fit(size_t asize, size_t n) {
+    size_t want = asize * (n < SIZE_MAX / 2 / asize ? n : SIZE_MAX / 2 / asize);
+    block_t *block = find_fit(want);
+
+#ifdef MM_QUICK_LISTS
+    if (block == NULL && quick_consolidate()) {
+        block = find_fit(want);
+    }
+#endif
+    if (block == NULL) {
+        block = extend_heap(max(want, chunksize));
+    }
+    if (block == NULL) {
+        block = find_fit(asize);
+    }
+    return block;
+}
+
+/**
+ * @brief Carves consecutive allocated blocks from the front of a free block.
+ *
+ * The rest, if any, stays free. It needs no coalescing, since the block
+ * after a free block is always allocated.
+ *
+ * @param[in] block A free block of at least `asize` bytes.
+ * @param[in] asize The adjusted size of each block.
+ * @param[in] n The most blocks to carve.
+ * @param[out] ptrs Set to the payloads of the blocks.
+ * @return The number of blocks carved.
+ */
+static size_t carve_blocks(block_t *block, size_t asize, size_t n,
+                           void **ptrs) {
+    size_t size = get_size(block);
+    size_t count = size / asize < n ? size / asize : n;
+    bool pre_min = get_pre_min(block);
+    bool pre_alloc = get_pre_alloc(block);
+
+    fix_free_list(block);
+    stat_add(&stats.splits, 1);
+    for (size_t i = 0; i < count; i++) {
+        write_block(block, asize, pre_min, pre_alloc, true, false);
+        ptrs[i] = header_to_payload(block);
+        block = find_next(block);
+        pre_min = asize == min_block_size;
+        pre_alloc = true;
+    }
+
+    size_t rest = size - count * asize;
+    if (rest > 0) {
+        write_block(block, rest, pre_min, true, false, true);
+        set_next_block_pre_alloc_pre_min(block, rest == min_block_size, false);
+        insert_block_LIFO(block);
+    } else {
+        write_block(block, get_size(block), pre_min, true, get_alloc(block),
+                    false);
+    }
+    return count;
+}
+
+#ifndef MM_THREADS
+/**
+ * @brief Tells whether `mm_free_batch` frees an allocation itself.
+ *
+ * Slots in slabs and mapped blocks, which lie outside the heap, are left to
+ * free. Neither test reads the header, which may by then lie inside a free
+ * block, or inside a slab or mapping that has gone.
+ *
+ * @param[in] bp A pointer passed to `mm_free_batch`.
+ * @return true if `bp` is the payload of an ordinary block in the heap.
+ */
+static bool is_batch_block(void *bp) {
+    if (bp == NULL || (char *)bp < (char *)arena_lo() ||
+        (char *)bp > (char *)arena_hi()) {
+        return false;
+    }
+#ifdef MM_SLABS
+    return slab_of(bp) == NULL;
+#else
+    return true;
+#endif
+}
+
 /**
- * @brief Check the consistency of the free list.
- *
- * This function iterates through the free list and checks the pointers and
- * size consistency of the free blocks. It also ensures that the pointers are
- * within the bounds of the heap.
- *
- * @return true if the free list is consistent, false otherwise.
+ * @brief Coalesces the run of free blocks that a block freed by
+ * `mm_free_batch` lies in.
+ *
+ * Blocks freed by the batch carry `mmap_mark`, which no other free block
+ * does, until their run is coalesced; the others in the run are in the free
+ * lists. The run is found by walking back to its first block and then
+ * forward to the next allocated one, so each run is coalesced once, from
+ * whichever of its blocks comes first in the batch.
+ *
+ * The result is pushed onto `merged` through `data.free_list.next` instead
+ * of going in the free lists now: `data.free_list.prev` of a merged block
+ * of the minimum size would overwrite the header of the next block in its
+ * run, which a later pointer in the batch may still look at.
+ *
+ * @param[in] block A free block with `mmap_mark` set.
+ * @param[in,out] merged The blocks coalesced so far.
  */
-bool check_free_list(void) {
-    // Iterate through the segmentation list and check pointers and size
-    // consistency
-    for (int class = 0; class < MAX_SEG_LIST_LENGTH; class ++) {
-        block_t *temp = seg_list[class];
-        while (temp != NULL) {
-            // Check if pointers are within heap bounds
-            if (temp->data.free_list.next > (block_t *)mem_heap_hi() ||
-                temp->data.free_list.next < (block_t *)mem_heap_lo()) {
-                printf("Error: Free list pointer out of heap bounds\n");
-                return false;
-            }
-            // Further checks for consistency can be added here
-            temp = temp->data.free_list.next;
+static void coalesce_run(block_t *block, block_t **merged) {
+    while (!get_pre_alloc(block)) {
+        block = get_pre_min(block) ? find_min_prev(block) : find_prev(block);
+    }
+
+    bool pre_min = get_pre_min(block);
+    size_t size = 0;
+    block_t *next = block;
+    while (!get_alloc(next)) {
+        if (next->header & mmap_mark) {
+            next->header &= ~mmap_mark;
+        } else {
+            fix_free_list(next);
         }
+        size += get_size(next);
+        next = find_next(next);
     }
-    return true;
+
+    stat_add(&stats.coalesces[3], 1);
+    write_block(block, size, pre_min, true, false, true);
+    set_next_block_pre_alloc_pre_min(block, size == min_block_size, false);
+    block->data.free_list.next = *merged;
+    *merged = block;
 }
+#endif
 
+#ifdef MM_THREADS
 /**
- * @brief Check if the counts of free blocks in the heap match the free list.
- *
- * This function compares the counts of free blocks in the heap with the counts
- * in the free list to ensure they match.
+ * @brief Returns blocks from a thread cache to the heap.
  *
- * @return true if the counts match, false otherwise.
+ * @param[in] tc The cache.
+ * @param[in] class The size class to flush.
+ * @param[in] keep How many blocks to leave in the cache.
  */
-bool check_free_block_counts(void) {
-    int free_block_count = 0;
-    for (block_t *block = heap_start; get_size(block) > 0;
-         block = find_next(block)) {
-        if (!get_alloc(block)) {
-            free_block_count++;
+static void tcache_flush(tcache_t *tc, int class, int keep) {
+    while (tc->count[class] > keep) {
+        block_t *block = tc->head[class];
+        tc->head[class] = block->data.free_list.next;
+        tc->count[class]--;
+
+        // Blocks freed by other threads may belong to other arenas; keep
+        // the lock while consecutive blocks share one
+        arena_t *owner = arena_of(block);
+        if (owner != arena) {
+            if (arena != NULL) {
+                dbg_ensures(mm_checkheap(__LINE__));
+                arena_unlock();
+            }
+            arena_lock(owner);
+            dbg_requires(mm_checkheap(__LINE__));
         }
+        free_block(block);
     }
-
-    int free_list_count = 0;
-    for (int class = 0; class < MAX_SEG_LIST_LENGTH; class ++) {
-        for (block_t *temp = seg_list[class]; temp != NULL;
-             temp = temp->data.free_list.next) {
-            free_list_count++;
-        }
+    if (arena != NULL) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock();
     }
+}
 
-    // Compare the counts of free blocks in the heap and free list
-    if (free_block_count != free_list_count) {
-        printf("Error: Free block count does not match free list count\n");
-        return false;
+/**
+ * @brief Returns every block in an exiting thread's cache to the heap.
+ *
+ * @param[in] arg The thread's cache.
+ */
+static void tcache_destroy(void *arg) {
+    tcache_t *tc = arg;
+    for (int class = 0; class < TCACHE_CLASSES; class ++) {
+        tcache_flush(tc, class, 0);
     }
+}
 
-    return true;
+/**
+ * @brief Creates the key whose destructor flushes thread caches.
+ */
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
 }
 
 /**
- * @brief Initialize the memory allocator.
- *
- * This function initializes the memory allocator by creating the initial empty
- * heap, setting up the heap prologue and epilogue, and extending the empty heap
- * with a free block of `chunksize` bytes. It also reinitializes the
- * segmentation list for free blocks.
+ * @brief Adds a small allocated block to the calling thread's cache.
  *
- * @return true if initialization is successful, false otherwise.
- *
- * Postconditions:
- * - The initial empty heap is created.
- * - The heap prologue and epilogue are set up.
- * - The segmentation list for free blocks is reinitialized.
- * - The empty heap is extended with a free block of at least `chunksize` bytes.
- * - If initialization fails, false is returned.
+ * @param[in] block The block, no larger than `exact_class_max`.
+ * @return true if the class now holds more than `tcache_max` blocks.
  */
-bool mm_init(void) {
-    // printf("start");
-    // Create the initial empty heap
-    // printf("start\n");
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+static bool tcache_push(block_t *block) {
+    int class = find_seg_list_class(get_size(block));
 
-    if (start == (void *)-1) {
-        return false;
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
     }
 
-    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
-    start[1] = pack(0, false, true, true); // Heap epilogue (block header)
+    block->data.free_list.next = tcache.head[class];
+    tcache.head[class] = block;
+    return ++tcache.count[class] > tcache_max;
+}
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-    // reinitialize seg list
-    for (int index = 0; index < MAX_SEG_LIST_LENGTH; index++) {
-        seg_list[index] = NULL;
-    }
+/**
+ * @brief Takes a block from the calling thread's cache.
+ *
+ * @param[in] asize The adjusted block size, no larger than `exact_class_max`.
+ * @return The block, or NULL if the cache has none of that size.
+ */
+static block_t *tcache_pop(size_t asize) {
+    int class = find_seg_list_class(asize);
+    block_t *block = tcache.head[class];
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
+    if (block != NULL) {
+        tcache.head[class] = block->data.free_list.next;
+        tcache.count[class]--;
     }
-
-    return true;
+    return block;
 }
+#endif
 
 /**
  * @brief Allocate a block of memory with the requested size.
@@ -1150,53 +2890,192 @@ bool mm_init(void) {
  * remaining portion is marked as free.
  */
 void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
+    size_t asize; // Adjusted block size
     block_t *block;
     void *bp = NULL;
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
-        }
-    }
-
     // Ignore spurious request
     if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
         return bp;
     }
 
     // Adjust block size to include overhead and to meet alignment requirements
     asize = round_up(size + wsize, dsize);
+    stat_add(&stats.mallocs[find_seg_list_class(asize)], 1);
+    stat_add(&stats.bytes_requested, size);
+
+    // Large requests get a mapping of their own, or failing that a block
+    if (mmap_threshold != 0 && size >= mmap_threshold &&
+        asize > exact_class_max && (block = map_block(size)) != NULL) {
+        stat_add(&stats.bytes_reserved, get_size(block));
+        return header_to_payload(block);
+    }
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+#ifdef MM_THREADS
+    // Small blocks come from the thread's cache when it has one
+    if (asize <= exact_class_max && (block = tcache_pop(asize)) != NULL) {
+        stat_add(&stats.bytes_reserved, asize);
+        return header_to_payload(block);
+    }
+    arena_lock(get_thread_arena());
+#endif
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
+    // Initialize heap if it isn't initialized
+    if (arena->heap_start == NULL && !heap_init()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        block = NULL;
+    } else {
+        dbg_requires(mm_checkheap(__LINE__));
+
+#ifdef MM_SLABS
+        // Small requests go in a slab when leaving out the header makes them
+        // fit a smaller size; otherwise a slot saves nothing over a block
+        if (size <= slab_max && round_up(size, dsize) < asize &&
+            (bp = slab_alloc(size)) != NULL) {
+            stat_add(&stats.bytes_reserved, slab_of(bp)->slot_size);
+            dbg_ensures(mm_checkheap(__LINE__));
             return bp;
         }
+#endif
+        block = alloc_block(asize);
+
+#ifdef MM_THREADS
+        // Fill the cache for the thread's next few requests of this size,
+        // rather than come back to the lock for each of them
+        block_t *extra;
+        while (block != NULL && asize <= exact_class_max &&
+               tcache.count[find_seg_list_class(asize)] < tcache_batch &&
+               (extra = alloc_block(asize)) != NULL) {
+            tcache_push(extra);
+        }
+#endif
+        dbg_ensures(mm_checkheap(__LINE__));
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
+#ifdef MM_THREADS
+    arena_unlock();
+#endif
 
-    split_block(block, asize);
+    if (block != NULL) {
+        stat_add(&stats.bytes_reserved, get_size(block));
+        bp = header_to_payload(block);
+    }
+    return bp;
+}
+
+/**
+ * @brief Allocate a block of memory whose payload is aligned to `align`.
+ *
+ * The block always comes from the heap: slab slots, the thread caches and
+ * mappings of their own keep payloads only `dsize`-aligned. It is freed
+ * with free as usual, but realloc keeps the alignment only while the block
+ * resizes in place.
+ *
+ * @param[in] align The alignment, a power of two.
+ * @param[in] size Requested size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if `align` is not
+ * a power of two or allocation fails.
+ */
+void *mm_aligned_alloc(size_t align, size_t size) {
+    block_t *block = NULL;
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 2 - align) {
+        return NULL;
+    }
 
-    bp = header_to_payload(block);
+    size_t asize = round_up(size + wsize, dsize);
+    stat_add(&stats.mallocs[find_seg_list_class(asize)], 1);
+    stat_add(&stats.bytes_requested, size);
 
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+#ifdef MM_THREADS
+    arena_lock(get_thread_arena());
+#endif
+
+    if (arena->heap_start != NULL || heap_init()) {
+        dbg_requires(mm_checkheap(__LINE__));
+
+        // The first aligned payload is at most align - dsize bytes in
+        block = alloc_block(asize + align - dsize);
+        if (block != NULL) {
+            block = align_block(block, align, asize);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+    }
+
+#ifdef MM_THREADS
+    arena_unlock();
+#endif
+
+    if (block == NULL) {
+        return NULL;
+    }
+    stat_add(&stats.bytes_reserved, get_size(block));
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Allocate `n` blocks of memory of the same size.
+ *
+ * The blocks are carved one after another from as few free blocks as will
+ * hold them, extending the heap once for all of them if need be, so there
+ * is one search and one split for the batch rather than one per block.
+ * Requests that malloc would serve from a slab or a mapping of their own
+ * are allocated one at a time.
+ *
+ * @param[in] size Requested size of each memory block.
+ * @param[in] n The number of blocks.
+ * @param[out] ptrs Set to pointers to the first `n` allocated blocks.
+ * @return The number of blocks allocated, fewer than `n` only if memory ran
+ * out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t done = 0;
+
+    if (size == 0 || n == 0 || size > SIZE_MAX / 2) {
+        return 0;
+    }
+    size_t asize = round_up(size + wsize, dsize);
+
+    if ((mmap_threshold != 0 && size >= mmap_threshold &&
+         asize > exact_class_max)
+#ifdef MM_SLABS
+        || (size <= slab_max && round_up(size, dsize) < asize)
+#endif
+    ) {
+        while (done < n && (ptrs[done] = malloc(size)) != NULL) {
+            done++;
+        }
+        return done;
+    }
+
+#ifdef MM_THREADS
+    arena_lock(get_thread_arena());
+#endif
+
+    if (arena->heap_start != NULL || heap_init()) {
+        dbg_requires(mm_checkheap(__LINE__));
+
+        block_t *block;
+        while (done < n && (block = find_batch_fit(asize, n - done)) != NULL) {
+            done += carve_blocks(block, asize, n - done, ptrs + done);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+    }
+
+#ifdef MM_THREADS
+    arena_unlock();
+#endif
+
+    stat_add(&stats.mallocs[find_seg_list_class(asize)], done);
+    stat_add(&stats.bytes_requested, size * done);
+    stat_add(&stats.bytes_reserved, asize * done);
+    return done;
 }
 
 /**
@@ -1209,38 +3088,170 @@ void *malloc(size_t size) {
  * @param[in] bp Pointer to the block of memory to be deallocated.
  */
 void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-
     if (bp == NULL) {
         return;
     }
 
+#ifdef MM_SLABS
+    slab_t *slab = slab_of(bp);
+    if (slab != NULL) {
+        stat_add(&stats.frees[find_seg_list_class(slab->slot_size + dsize)],
+                 1);
+        dbg_requires(mm_checkheap(__LINE__));
+        slab_free(slab, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    stat_add(&stats.frees[find_seg_list_class(get_size(block))], 1);
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    if (block->header & mmap_mark) {
+        unmap_block(block);
+        return;
+    }
 
-    // Mark the block as free
-    // Mark the block as free by updating its header (and footer if necessary)
-    bool pre_alloc = get_pre_alloc(block);
-    bool pre_min = get_pre_min(block);
-    write_block(block, size, pre_min, pre_alloc, false, size != min_block_size);
+#ifdef MM_QUICK_LISTS
+    // Small blocks wait, still allocated, for the next request of their size
+    if (get_size(block) <= exact_class_max) {
+        int class = find_seg_list_class(get_size(block));
+        block->data.free_list.next = arena->quick[class];
+        arena->quick[class] = block;
+        return;
+    }
+#endif
 
-    // Update the 'pre_alloc' status of the next block in the heap
-    // If the block size is not minimum, mark the next block as not
-    // pre-allocated
-    if (size != min_block_size) {
-        set_next_block_pre_alloc_pre_min(block, false, false);
-    } else {
-        // If the block is of minimum size, mark the next block as pre-allocated
-        set_next_block_pre_alloc_pre_min(block, true, false);
+#ifdef MM_THREADS
+    // Small blocks go to the thread's cache, and a batch back to the heap
+    // when it fills up. Only the size is read from the header without the
+    // lock: other threads may rewrite its flag bits as its neighbors change,
+    // but never its size.
+    if (get_size(block) <= exact_class_max) {
+        if (tcache_push(block)) {
+            int class = find_seg_list_class(get_size(block));
+            tcache_flush(&tcache, class, tcache_max - tcache_batch);
+        }
+        return;
     }
+    arena_lock(arena_of(block));
+#endif
 
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    dbg_requires(mm_checkheap(__LINE__));
+    free_block(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+
+#ifdef MM_THREADS
+    arena_unlock();
+#endif
+}
+
+/**
+ * @brief Deallocate `n` blocks of memory, coalescing them once.
+ *
+ * All the blocks are marked free first, and only then is each run of
+ * adjacent free blocks among them coalesced, in a single step, so that
+ * neighbors freed together don't each coalesce and reinsert the growing
+ * block. Slots in slabs and mapped blocks are freed as free would.
+ * Compiled with MM_THREADS, where the blocks may belong to different
+ * arenas, each block is simply freed in turn.
+ *
+ * @param[in] ptrs Pointers to the blocks, any of which may be NULL.
+ * @param[in] n The number of pointers.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+#ifdef MM_THREADS
+    for (size_t i = 0; i < n; i++) {
+        free(ptrs[i]);
+    }
+#else
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Mark the heap blocks free, but leave them out of the free lists
+    for (size_t i = 0; i < n; i++) {
+        if (!is_batch_block(ptrs[i])) {
+            continue;
+        }
+        block_t *block = payload_to_header(ptrs[i]);
+        size_t size = get_size(block);
+        stat_add(&stats.frees[find_seg_list_class(size)], 1);
+        write_block(block, size, get_pre_min(block), get_pre_alloc(block),
+                    false, size != min_block_size);
+        block->header |= mmap_mark;
+
+        // Only the flags change, so a block after that is marked keeps it
+        block_t *next = find_next(block);
+        next->header &= ~(pre_alloc_mark | pre_min_mark);
+        if (size == min_block_size) {
+            next->header |= pre_min_mark;
+        }
+    }
+
+    // Coalesce them; a block whose run is done is no longer marked
+    block_t *merged = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (is_batch_block(ptrs[i]) &&
+            (payload_to_header(ptrs[i])->header & mmap_mark)) {
+            coalesce_run(payload_to_header(ptrs[i]), &merged);
+        }
+    }
+    while (merged != NULL) {
+        block_t *block = merged;
+        merged = block->data.free_list.next;
+        insert_block_LIFO(block);
+        if (release_threshold != 0 && get_size(block) >= release_threshold) {
+            release_block(block);
+        }
+    }
+
+    // Only now may free_block run, when no block is left out of the lists
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL && !is_batch_block(ptrs[i])) {
+            free(ptrs[i]);
+        }
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+#endif
+}
+
+/**
+ * @brief Tries to resize an allocation without copying it.
+ *
+ * A slot in a slab keeps any size that fits it, a mapped block is remapped,
+ * and any other block is resized in the heap by `resize_block`.
+ *
+ * @param[in] bp The allocation.
+ * @param[in] size The new size.
+ * @return The allocation, at a new address only if it was mapped, or NULL if
+ * it must be moved.
+ */
+static void *resize_in_place(void *bp, size_t size) {
+#ifdef MM_SLABS
+    slab_t *slab = slab_of(bp);
+    if (slab != NULL) {
+        return size <= slab->slot_size ? bp : NULL;
+    }
+#endif
+
+    block_t *block = payload_to_header(bp);
+    if (block->header & mmap_mark) {
+        block = remap_block(block, size);
+        return block != NULL ? header_to_payload(block) : NULL;
+    }
 
+#ifdef MM_THREADS
+    arena_lock(arena_of(block));
+#endif
+
+    dbg_requires(mm_checkheap(__LINE__));
+    bool resized = resize_block(block, round_up(size + wsize, dsize));
     dbg_ensures(mm_checkheap(__LINE__));
+
+#ifdef MM_THREADS
+    arena_unlock();
+#endif
+    return resized ? bp : NULL;
 }
 
 /**
@@ -1275,6 +3286,12 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    // Resize the block where it is if possible
+    newptr = resize_in_place(ptr, size);
+    if (newptr != NULL) {
+        return newptr;
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1285,6 +3302,12 @@ void *realloc(void *ptr, size_t size) {
 
     // Copy the old data
     copysize = get_payload_size(block); // gets size of old payload
+#ifdef MM_SLABS
+    slab_t *slab = slab_of(ptr);
+    if (slab != NULL) {
+        copysize = slab->slot_size;
+    }
+#endif
     if (size < copysize) {
         copysize = size;
     }
@@ -1293,8 +3316,6 @@ void *realloc(void *ptr, size_t size) {
     // Free the old block
     free(ptr);
 
-    dbg_ensures(mm_checkheap(__LINE__));
-
     return newptr;
 }
 
@@ -1331,8 +3352,12 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, which a new mapping already is; smaller
+    // requests may be slots in a slab, without a header to look at
+    if (asize <= exact_class_max ||
+        (payload_to_header(bp)->header & mmap_mark) == 0) {
+        memset(bp, 0, asize);
+    }
 
     return bp;
 }
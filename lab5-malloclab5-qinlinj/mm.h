@@ -61,6 +61,41 @@ extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
 #endif
 
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `align` bytes.
+ *
+ * @param[in] align  The alignment, a power of two, such as 64 for a cache
+ *                   line or 4096 for a page.
+ * @param[in] size   The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, to be freed as
+ *          usual, or NULL if `align` is not a power of two.
+ */
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks in the heap of at least `size` bytes each,
+ *         much faster than calling malloc `n` times.
+ *
+ * @param[in]  size  The minimum size of bytes of each block.
+ * @param[in]  n     The number of blocks.
+ * @param[out] ptrs  Set to pointers to the beginning of each block.
+ *
+ * @return  The number of blocks allocated, fewer than `n` only if memory
+ *          ran out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Mark `n` allocated blocks as free, coalescing them once.
+ *
+ * @param[in] ptrs  Pointers to the beginning of each block's payload, which
+ *                  may be NULL.
+ * @param[in] n     The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
 /**
  * @brief  Initialize the heap.
  *
@@ -78,4 +113,52 @@ extern bool mm_init(void);
  */
 extern bool mm_checkheap(int line);
 
+/**
+ * @brief  Give requests of at least `threshold` bytes mappings of their own,
+ *         which are unmapped when freed.
+ *
+ * @param[in] threshold  The size in bytes, or 0 to turn this off.
+ */
+extern void mm_set_mmap_threshold(size_t threshold);
+
+/**
+ * @brief  Give the pages inside free blocks of at least `threshold` bytes
+ *         back to the system.
+ *
+ * @param[in] threshold  The size in bytes, or 0 to turn this off.
+ */
+extern void mm_set_release_threshold(size_t threshold);
+
+/**
+ * @brief  Print counts of what the allocator has done since `mm_init`:
+ *         requests by size class, free blocks searched, splits, coalesces
+ *         and heap extensions. They are kept only when compiled with
+ *         MM_STATS.
+ *
+ * @param[in] stream  Where to print them.
+ */
+extern void mm_stats_dump(FILE *stream);
+
+/**
+ * @brief  Report the allocator's size classes.
+ *
+ * @param[out] limits  If not NULL, set to the largest block size in each of
+ *                     the first `n` classes, SIZE_MAX for the last one.
+ * @param[in]  n       The length of `limits`.
+ *
+ * @return  The number of size classes.
+ */
+extern size_t mm_size_classes(size_t *limits, size_t n);
+
+/**
+ * @brief  Count the free blocks in the heap in each size class.
+ *
+ * @param[out] counts  Set to the number of free blocks in each of the first
+ *                     `n` classes.
+ * @param[in]  n       The length of `counts`.
+ *
+ * @return  The size of the largest free block, or 0 if there is none.
+ */
+extern size_t mm_free_blocks(size_t *counts, size_t n);
+
 #endif /* mm.h */
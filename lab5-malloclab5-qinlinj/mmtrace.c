@@ -0,0 +1,653 @@
+/*
+ * mmtrace.c - Record the allocations a program makes as a trace for the
+ * CS:APP Malloc Lab Driver.
+ *
+ * Usage: LD_PRELOAD=./mmtrace.so [MMTRACE_FILE=<trace>]
+ *            [MMTRACE_FORMAT=binary] <program> [<args>...]
+ *
+ * The library stands in for malloc, calloc, realloc, free and the
+ * aligned allocators, passing each call on to the C library and noting
+ * what it did.  When the program exits, the notes are turned into a
+ * trace, which is written to <trace>, or by default to mmtrace.<pid>.rep,
+ * in the text format or, with MMTRACE_FORMAT=binary, the binary one.
+ * Only the process the library was loaded into is traced, not children
+ * it forks.
+ *
+ * Each thread notes calls in a buffer of its own, so recording takes no
+ * locks; a sequence number taken from one shared counter puts the calls
+ * of all threads in order.  A full buffer is appended to a spool file,
+ * which at exit is read back with what remains in the buffers, sorted by
+ * sequence number, and replayed to give each block an ID.  A realloc is
+ * noted twice, once before the call and once after, since the block it
+ * releases can be handed to another thread before it returns.
+ */
+
+#define _GNU_SOURCE 1 // for the __libc_ allocators and O_APPEND
+
+#include "tracefile.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The C library's own allocators, which those here pass calls on to */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+/** What an allocator call did, as noted when it was made.  */
+typedef enum record_type_t {
+    REC_ALLOC,   /* malloc and the like returned ptr */
+    REC_FREE,    /* free was called on ptr */
+    REC_RELEASE, /* realloc was called on ptr... */
+    REC_REALLOC, /* ...and returned ptr, for the release numbered pair... */
+    REC_KEPT,    /* ...or failed, leaving the block at ptr */
+} record_type_t;
+
+/** A note of one allocator call, or for realloc, of half of one.  */
+typedef struct record_t {
+    uint64_t seq;  /* place in the order of all calls */
+    uint64_t pair; /* for REC_REALLOC and REC_KEPT, the seq of the release */
+    uintptr_t ptr; /* the block */
+    size_t size;   /* for REC_ALLOC and REC_REALLOC, the size asked for */
+    record_type_t type;
+} record_t;
+
+/** Records a thread buffer holds before it is spooled.  */
+#define BUF_RECORDS 4096
+
+/** A thread's buffer of records, in memory of its own from mmap.  */
+typedef struct record_buf_t {
+    struct record_buf_t *next; /* in the list of all buffers */
+    _Atomic size_t count;      /* records filled in */
+    record_t records[BUF_RECORDS];
+} record_buf_t;
+
+/* Whether calls are being recorded */
+static atomic_bool recording = false;
+
+/* Source of sequence numbers */
+static _Atomic uint64_t next_seq = 0;
+
+/* Every thread's buffer, so the last records can be found at exit */
+static _Atomic(record_buf_t *) all_bufs = NULL;
+
+/* File full buffers are appended to, already unlinked */
+static int spool_fd = -1;
+
+/* The process being traced */
+static pid_t traced_pid;
+
+/* This thread's buffer, made when it first records a call */
+static _Thread_local record_buf_t *thread_buf
+    __attribute__((tls_model("initial-exec")));
+
+/** Make a buffer for this thread and add it to the list of all of them.
+ *
+ *  @return        The buffer, or NULL if there is no memory for it.
+ */
+static record_buf_t *new_buf(void) {
+    record_buf_t *buf = mmap(NULL, sizeof(record_buf_t),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+    buf->next = atomic_load_explicit(&all_bufs, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &all_bufs, &buf->next, buf, memory_order_release,
+        memory_order_relaxed)) {
+    }
+    return buf;
+}
+
+/** Append a full buffer to the spool file and empty it.
+ *
+ *  @param buf     The buffer.
+ */
+static void spool_buf(record_buf_t *buf) {
+    const char *p = (const char *)buf->records;
+    size_t left = sizeof(buf->records);
+    while (left > 0) {
+        ssize_t n = write(spool_fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            atomic_store(&recording, false); // The spool is incomplete
+            return;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    atomic_store_explicit(&buf->count, 0, memory_order_release);
+}
+
+/** Take the next sequence number, or report that calls aren't being
+ *  recorded.
+ *
+ *  @param seq     Set to the sequence number.
+ *  @return        Whether to record the call.
+ */
+static bool take_seq(uint64_t *seq) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed)) {
+        return false;
+    }
+    *seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+    return true;
+}
+
+/** Note a call in this thread's buffer.
+ *
+ *  @param type    What the call did.
+ *  @param seq     Its sequence number, from take_seq.
+ *  @param pair    For REC_REALLOC and REC_KEPT, that of the release.
+ *  @param ptr     The block.
+ *  @param size    The size asked for.
+ */
+static void record(record_type_t type, uint64_t seq, uint64_t pair,
+                   void *ptr, size_t size) {
+    record_buf_t *buf = thread_buf;
+    if (!buf && !(buf = thread_buf = new_buf())) {
+        return;
+    }
+
+    size_t count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    if (count == BUF_RECORDS) {
+        return; // Spooling failed
+    }
+    buf->records[count] = (record_t){.seq = seq,
+                                     .pair = pair,
+                                     .ptr = (uintptr_t)ptr,
+                                     .size = size,
+                                     .type = type};
+    atomic_store_explicit(&buf->count, count + 1, memory_order_release);
+    if (count + 1 == BUF_RECORDS) {
+        spool_buf(buf);
+    }
+}
+
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    uint64_t seq;
+    if (p && take_seq(&seq)) {
+        record(REC_ALLOC, seq, 0, p, size);
+    }
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *p = __libc_calloc(nmemb, size);
+    uint64_t seq;
+    if (p && take_seq(&seq)) {
+        record(REC_ALLOC, seq, 0, p, nmemb * size);
+    }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    uint64_t release, seq;
+    bool traced = ptr && take_seq(&release);
+    if (traced) {
+        record(REC_RELEASE, release, 0, ptr, 0);
+    }
+    void *p = __libc_realloc(ptr, size);
+    if (traced) {
+        // Always completed, even if recording has stopped meanwhile
+        seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+        if (!p && size > 0) {
+            record(REC_KEPT, seq, release, ptr, size);
+        } else {
+            record(REC_REALLOC, seq, release, p, size);
+        }
+    } else if (!ptr && p && take_seq(&seq)) {
+        record(REC_ALLOC, seq, 0, p, size);
+    }
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+void free(void *ptr) {
+    uint64_t seq;
+    if (ptr && take_seq(&seq)) {
+        record(REC_FREE, seq, 0, ptr, 0);
+    }
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    uint64_t seq;
+    if (p && take_seq(&seq)) {
+        record(REC_ALLOC, seq, 0, p, size);
+    }
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *p = memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+/** A child of the traced process isn't traced, and mustn't spool.  */
+static void stop_in_child(void) {
+    atomic_store(&recording, false);
+}
+
+__attribute__((constructor)) static void start_recording(void) {
+    char spool[] = "/tmp/mmtrace-XXXXXX";
+    spool_fd = mkstemp(spool);
+    if (spool_fd < 0) {
+        perror("mmtrace: can't create spool file");
+        return;
+    }
+    unlink(spool);
+    fcntl(spool_fd, F_SETFL, O_APPEND);
+    traced_pid = getpid();
+    pthread_atfork(NULL, NULL, stop_in_child);
+    atomic_store(&recording, true);
+}
+
+/** Map from block addresses, or release sequence numbers, to IDs.  */
+typedef struct id_map_t {
+    uint64_t *keys;
+    unsigned int *ids; /* NO_ID where the entry is empty */
+    size_t mask;       /* entries less one, a power of two */
+    size_t count;
+} id_map_t;
+
+#define NO_ID UINT_MAX
+
+/** Allocate (or reallocate) the entries of an ID map.
+ *
+ *  @param map      The map.
+ *  @param entries  The number of entries, a power of two.
+ */
+static void map_alloc(id_map_t *map, size_t entries) {
+    map->keys = malloc(entries * sizeof(uint64_t));
+    map->ids = malloc(entries * sizeof(unsigned int));
+    if (!map->keys || !map->ids) {
+        fputs("mmtrace: out of memory\n", stderr);
+        exit(1);
+    }
+    memset(map->ids, 0xff, entries * sizeof(unsigned int));
+    map->mask = entries - 1;
+}
+
+/** Find where a key is, or would go, in an ID map.
+ *
+ *  @param map     The map.
+ *  @param key     The key.
+ *  @return        The index of its entry, or of the empty one for it.
+ */
+static size_t map_find(const id_map_t *map, uint64_t key) {
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15u) >> 32) & map->mask;
+    while (map->ids[i] != NO_ID && map->keys[i] != key) {
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+/** Add a key to an ID map, growing it to keep it at most half full.
+ *
+ *  @param map     The map.
+ *  @param key     The key, which mustn't be in the map.
+ *  @param id      Its ID.
+ */
+static void map_put(id_map_t *map, uint64_t key, unsigned int id) {
+    if (2 * (map->count + 1) > map->mask + 1) {
+        uint64_t *keys = map->keys;
+        unsigned int *ids = map->ids;
+        size_t entries = map->mask + 1;
+        map_alloc(map, 2 * entries);
+        for (size_t i = 0; i < entries; i++) {
+            if (ids[i] != NO_ID) {
+                size_t j = map_find(map, keys[i]);
+                map->keys[j] = keys[i];
+                map->ids[j] = ids[i];
+            }
+        }
+        free(keys);
+        free(ids);
+    }
+    size_t i = map_find(map, key);
+    map->keys[i] = key;
+    map->ids[i] = id;
+    map->count++;
+}
+
+/** Remove a key from an ID map, moving back the entries after it that
+ *  would otherwise no longer be found.
+ *
+ *  @param map     The map.
+ *  @param key     The key.
+ *  @return        Its ID, or NO_ID if it wasn't in the map.
+ */
+static unsigned int map_take(id_map_t *map, uint64_t key) {
+    size_t i = map_find(map, key);
+    unsigned int id = map->ids[i];
+    if (id == NO_ID) {
+        return NO_ID;
+    }
+    map->count--;
+    for (size_t j = i;;) {
+        map->ids[i] = NO_ID;
+        size_t home;
+        do {
+            j = (j + 1) & map->mask;
+            if (map->ids[j] == NO_ID) {
+                return id;
+            }
+            home = (size_t)((map->keys[j] * 0x9E3779B97F4A7C15u) >> 32) &
+                   map->mask;
+            // The entry at j can move to i only if i lies in [home, j)
+        } while (i <= j ? (home > i && home <= j) : (home > i || home <= j));
+        map->keys[i] = map->keys[j];
+        map->ids[i] = map->ids[j];
+        i = j;
+    }
+}
+
+/** Order records by sequence number, for qsort.  */
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = ((const record_t *)a)->seq, y = ((const record_t *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+/** Block IDs, and the sizes of the blocks that have them, as the trace
+ *  is built.  IDs are reused once their blocks are freed, so that there
+ *  are about as many as the most blocks live at once.  */
+typedef struct id_pool_t {
+    unsigned int num_ids;
+    unsigned int *free_ids;
+    size_t nfree;
+    size_t *sizes;
+    size_t live_bytes;
+    size_t peak_bytes;
+} id_pool_t;
+
+/** Give a new block an ID.
+ *
+ *  @param pool    The IDs.
+ *  @param size    Its size.
+ *  @return        The ID.
+ */
+static unsigned int take_id(id_pool_t *pool, size_t size) {
+    unsigned int id;
+    if (pool->nfree > 0) {
+        id = pool->free_ids[--pool->nfree];
+    } else {
+        id = pool->num_ids++;
+        if ((id & (id - 1)) == 0) { // Grow the arrays at powers of two
+            size_t n = id ? 2 * (size_t)id : 1;
+            pool->free_ids = realloc(pool->free_ids, n * sizeof(unsigned int));
+            pool->sizes = realloc(pool->sizes, n * sizeof(size_t));
+            if (!pool->free_ids || !pool->sizes) {
+                fputs("mmtrace: out of memory\n", stderr);
+                exit(1);
+            }
+        }
+    }
+    pool->sizes[id] = size;
+    pool->live_bytes += size;
+    if (pool->live_bytes > pool->peak_bytes) {
+        pool->peak_bytes = pool->live_bytes;
+    }
+    return id;
+}
+
+/** Change the size of a block that has an ID.
+ *
+ *  @param pool    The IDs.
+ *  @param id      Its ID.
+ *  @param size    Its new size.
+ */
+static void resize_id(id_pool_t *pool, unsigned int id, size_t size) {
+    pool->live_bytes = pool->live_bytes - pool->sizes[id] + size;
+    pool->sizes[id] = size;
+    if (pool->live_bytes > pool->peak_bytes) {
+        pool->peak_bytes = pool->live_bytes;
+    }
+}
+
+/** Release the ID of a freed block.
+ *
+ *  @param pool    The IDs.
+ *  @param id      The ID.
+ */
+static void put_id(id_pool_t *pool, unsigned int id) {
+    pool->live_bytes -= pool->sizes[id];
+    pool->free_ids[pool->nfree++] = id;
+}
+
+/** Append an op to a trace being built.
+ *
+ *  @param ops      The ops so far.
+ *  @param num_ops  The number of them, which is incremented.
+ *  @param type     The op's type.
+ *  @param id       Its block ID.
+ *  @param size     Its size.
+ */
+static void add_op(traceop_t *ops, unsigned int *num_ops, traceopcode_t type,
+                   unsigned int id, size_t size) {
+    traceop_t *op = &ops[*num_ops];
+    op->type = type;
+    op->lineno = (*num_ops + 5) & 0xffffff; // Its line in a text trace
+    op->index = id;
+    op->size = size;
+    (*num_ops)++;
+}
+
+/** Give a block returned at an address an ID.  A block still recorded
+ *  there was freed unseen, by a libc function that doesn't go through
+ *  the ones here, so the trace frees it first.
+ *
+ *  @param blocks   The map from addresses to IDs.
+ *  @param pool     The IDs.
+ *  @param ops      The ops so far.
+ *  @param num_ops  The number of them.
+ *  @param ptr      The address.
+ *  @param id       The block's ID.
+ */
+static void place_block(id_map_t *blocks, id_pool_t *pool, traceop_t *ops,
+                        unsigned int *num_ops, uintptr_t ptr,
+                        unsigned int id) {
+    unsigned int stale = map_take(blocks, ptr);
+    if (stale != NO_ID) {
+        put_id(pool, stale);
+        add_op(ops, num_ops, FREE, stale, 0);
+    }
+    map_put(blocks, ptr, id);
+}
+
+/** Collect every record, from the spool file and the thread buffers, in
+ *  the order the calls were made.
+ *
+ *  @param nrecords  Set to the number of records.
+ *  @return          The records, from malloc.
+ */
+static record_t *collect_records(size_t *nrecords) {
+    struct stat st;
+    if (fstat(spool_fd, &st) < 0) {
+        perror("mmtrace: can't read spool file");
+        exit(1);
+    }
+    size_t spooled = (size_t)st.st_size / sizeof(record_t);
+    size_t n = spooled;
+    record_buf_t *bufs = atomic_load_explicit(&all_bufs, memory_order_acquire);
+    for (record_buf_t *buf = bufs; buf; buf = buf->next) {
+        n += atomic_load_explicit(&buf->count, memory_order_acquire);
+    }
+
+    record_t *records = malloc((n ? n : 1) * sizeof(record_t));
+    if (!records) {
+        fputs("mmtrace: out of memory\n", stderr);
+        exit(1);
+    }
+    size_t bytes = spooled * sizeof(record_t);
+    if (pread(spool_fd, records, bytes, 0) != (ssize_t)bytes) {
+        perror("mmtrace: can't read spool file");
+        exit(1);
+    }
+    n = spooled;
+    for (record_buf_t *buf = bufs; buf; buf = buf->next) {
+        size_t count = atomic_load_explicit(&buf->count, memory_order_acquire);
+        memcpy(&records[n], buf->records, count * sizeof(record_t));
+        n += count;
+    }
+    close(spool_fd);
+
+    qsort(records, n, sizeof(record_t), compare_seq);
+    *nrecords = n;
+    return records;
+}
+
+/** Replay the records, giving each block an ID, to make the trace's ops.
+ *  Blocks allocated before recording started, and so never seen, are
+ *  left out of the trace along with their frees.
+ *
+ *  @param trace     Set to the trace, but for its filename.
+ *  @param records   The records, in order.
+ *  @param nrecords  The number of them.
+ */
+static void build_trace(trace_t *trace, const record_t *records,
+                        size_t nrecords) {
+    id_map_t blocks = {0}, releases = {0};
+    id_pool_t pool = {0};
+    map_alloc(&blocks, 1024);
+    map_alloc(&releases, 64);
+
+    // Each record makes at most two ops, and most make one
+    size_t max_ops = 2 * nrecords < UINT_MAX ? 2 * nrecords + 1 : UINT_MAX;
+    traceop_t *ops = malloc(max_ops * sizeof(traceop_t));
+    if (!ops) {
+        fputs("mmtrace: out of memory\n", stderr);
+        exit(1);
+    }
+    unsigned int num_ops = 0;
+
+    for (size_t r = 0; r < nrecords && num_ops + 2 < max_ops; r++) {
+        const record_t *rec = &records[r];
+        unsigned int id;
+
+        switch (rec->type) {
+        case REC_ALLOC:
+            id = take_id(&pool, rec->size);
+            place_block(&blocks, &pool, ops, &num_ops, rec->ptr, id);
+            add_op(ops, &num_ops, ALLOC, id, rec->size);
+            break;
+
+        case REC_FREE:
+            if ((id = map_take(&blocks, rec->ptr)) != NO_ID) {
+                put_id(&pool, id);
+                add_op(ops, &num_ops, FREE, id, 0);
+            }
+            break;
+
+        case REC_RELEASE:
+            // Until realloc returns, the block is the realloc's alone
+            if ((id = map_take(&blocks, rec->ptr)) != NO_ID) {
+                map_put(&releases, rec->seq, id);
+            }
+            break;
+
+        case REC_REALLOC:
+            if ((id = map_take(&releases, rec->pair)) != NO_ID) {
+                if (rec->ptr) {
+                    resize_id(&pool, id, rec->size);
+                    place_block(&blocks, &pool, ops, &num_ops, rec->ptr, id);
+                    add_op(ops, &num_ops, REALLOC, id, rec->size);
+                } else { // realloc(ptr, 0) freed the block
+                    put_id(&pool, id);
+                    add_op(ops, &num_ops, FREE, id, 0);
+                }
+            } else if (rec->ptr) {
+                // Reallocating a block never seen allocates a new one
+                id = take_id(&pool, rec->size);
+                place_block(&blocks, &pool, ops, &num_ops, rec->ptr, id);
+                add_op(ops, &num_ops, ALLOC, id, rec->size);
+            }
+            break;
+
+        case REC_KEPT:
+            if ((id = map_take(&releases, rec->pair)) != NO_ID) {
+                map_put(&blocks, rec->ptr, id);
+            }
+            break;
+        }
+    }
+
+    trace->data_bytes = pool.peak_bytes;
+    trace->num_ids = pool.num_ids > 0 ? pool.num_ids : 1;
+    trace->num_ops = num_ops;
+    trace->weight = WALL;
+    trace->ops = ops;
+
+    free(blocks.keys);
+    free(blocks.ids);
+    free(releases.keys);
+    free(releases.ids);
+    free(pool.free_ids);
+    free(pool.sizes);
+}
+
+__attribute__((destructor)) static void write_recording(void) {
+    if (spool_fd < 0 || getpid() != traced_pid ||
+        !atomic_exchange(&recording, false)) {
+        return;
+    }
+
+    size_t nrecords;
+    record_t *records = collect_records(&nrecords);
+    trace_t trace = {0};
+    build_trace(&trace, records, nrecords);
+    free(records);
+
+    char name[32];
+    const char *fname = getenv("MMTRACE_FILE");
+    if (!fname || !*fname) {
+        snprintf(name, sizeof(name), "mmtrace.%ld.rep", (long)traced_pid);
+        fname = name;
+    }
+    trace.filename = fname;
+
+    const char *format = getenv("MMTRACE_FORMAT");
+    if (format && strcmp(format, "binary") == 0) {
+        write_binary_trace(&trace, fname);
+    } else {
+        write_text_trace(&trace, fname);
+    }
+    free(trace.ops);
+}
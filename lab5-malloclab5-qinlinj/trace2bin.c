@@ -0,0 +1,27 @@
+/*
+ * trace2bin.c - Convert a text trace file for the CS:APP Malloc Lab
+ * Driver into the binary format, which the driver maps rather than
+ * parses.
+ *
+ * Usage: trace2bin <text trace> <binary trace>
+ *
+ * The binary format depends on the machine and compiler it was written
+ * with, so convert traces where they will be run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tracefile.h"
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <text trace> <binary trace>\n", argv[0]);
+        exit(1);
+    }
+
+    trace_t *trace = read_trace(argv[1], 0);
+    write_binary_trace(trace, argv[2]);
+    free_trace(trace);
+    return 0;
+}
@@ -20,6 +20,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 /** Map from trace file weight codes to Wxxx values.
  *  Quoting traces/README:
  *
@@ -37,6 +42,31 @@ static const weight_t weight_codes[N_WEIGHT_CODES] = {
     /* 3 */ WPERF,
 };
 
+/** Header of a binary trace file.
+ *
+ *  A binary trace is this header followed directly by num_ops traceop_t
+ *  records, exactly as they are laid out in memory, so that read_trace
+ *  can map the file and use the records where they lie.  Since that
+ *  layout depends on the machine and compiler, the header records the
+ *  byte order and record size it was written with, and read_trace
+ *  rejects files that don't match its own.
+ */
+typedef struct binary_header_t {
+    char magic[8];       /* binary_magic */
+    uint32_t byte_order; /* binary_byte_order, in the writer's byte order */
+    uint32_t op_size;    /* sizeof(traceop_t) */
+    uint32_t weight;     /* a weight_t */
+    uint32_t num_ids;    /* as in trace_t */
+    uint32_t num_ops;    /* as in trace_t */
+    uint32_t reserved;   /* zero */
+    uint64_t data_bytes; /* as in trace_t */
+} binary_header_t;
+
+/* The first bytes of every binary trace file; no text trace begins so */
+static const char binary_magic[8] = {'M', 'M', 'T', 'R', 'A', 'C', 'E', 0};
+
+static const uint32_t binary_byte_order = 0x01020304;
+
 /* Temporarily duplicated from mdriver.c.  */
 /*
  * app_error - Report an arbitrary application error
@@ -269,9 +299,114 @@ static void read_free_line(traceop_t *op, char *args, const char *fname,
     op->size = 0;
 }
 
+/** Allocate the arrays of a trace_t that the driver fills in as it
+ *  runs the trace, one entry per block ID.
+ *
+ *  @param trace   The trace, with num_ids set.
+ */
+static void alloc_block_arrays(trace_t *trace) {
+    // We'll keep an array of pointers to the allocated blocks here...
+    trace->blocks = calloc(trace->num_ids, sizeof(char *));
+    if (!trace->blocks) {
+        unix_error("read_trace: malloc/3 (%zd) failed",
+                   trace->num_ids * sizeof(char *));
+    }
+
+    // ...along with the corresponding byte sizes of each block...
+    trace->block_sizes = calloc(trace->num_ids, sizeof(size_t));
+    if (!trace->block_sizes) {
+        unix_error("read_trace: malloc/4 (%zd) failed",
+                   trace->num_ids * sizeof(size_t));
+    }
+
+    // ...and, if we're debugging, the offset into the random data.
+    trace->block_rand_base = calloc(trace->num_ids, sizeof(size_t));
+    if (!trace->block_rand_base) {
+        unix_error("read_trace: malloc/5 (%zd) failed",
+                   trace->num_ids * sizeof(size_t));
+    }
+}
+
+/** Read a binary trace file, mapping it rather than copying its
+ *  records.  The mapping is private, so the file is never modified.
+ *
+ *  @param fd       Open descriptor for the trace file.
+ *  @param fname    Name of the trace file (for error reporting).
+ *  @return         a trace_t object.
+ */
+static trace_t *read_binary_trace(int fd, const char *fname) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        unix_error("Could not stat %s in read_trace", fname);
+    }
+    size_t len = (size_t)st.st_size;
+    if (len < sizeof(binary_header_t)) {
+        app_error("%s: error: invalid binary trace: truncated header", fname);
+    }
+
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        unix_error("Could not map %s in read_trace", fname);
+    }
+    close(fd);
+
+    const binary_header_t *header = map;
+    if (header->byte_order != binary_byte_order ||
+        header->op_size != sizeof(traceop_t)) {
+        app_error("%s: error: binary trace written on a different kind of "
+                  "machine; convert the text trace again",
+                  fname);
+    }
+    if (header->weight > WALL || header->num_ids == 0) {
+        app_error("%s: error: invalid binary trace: bad header", fname);
+    }
+    if (len != sizeof(binary_header_t) +
+                   (size_t)header->num_ops * sizeof(traceop_t)) {
+        app_error("%s: error: invalid binary trace: "
+                  "size doesn't match number of ops",
+                  fname);
+    }
+
+    trace_t *trace = malloc(sizeof(trace_t));
+    if (!trace) {
+        unix_error("read_trace: malloc/1 (%zd) failed", sizeof(trace_t));
+    }
+    trace->filename = fname;
+    trace->data_bytes = header->data_bytes;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = (weight_t)header->weight;
+    trace->ops = (traceop_t *)((char *)map + sizeof(binary_header_t));
+    trace->map = map;
+    trace->map_len = len;
+    trace->stream = NULL;
+
+    // The driver indexes its arrays with these without checking
+    unsigned int max_id_used = 0;
+    for (unsigned int op = 0; op < trace->num_ops; op++) {
+        const traceop_t *p = &trace->ops[op];
+        if ((p->type != ALLOC && p->type != FREE && p->type != REALLOC) ||
+            p->index >= trace->num_ids) {
+            app_error("%s: error: invalid binary trace: bad op %u", fname, op);
+        }
+        if (p->index > max_id_used) {
+            max_id_used = p->index;
+        }
+    }
+    if (max_id_used != trace->num_ids - 1) {
+        app_error("%s: error: invalid binary trace: "
+                  "wrong number of block IDs used",
+                  fname);
+    }
+
+    alloc_block_arrays(trace);
+    return trace;
+}
+
 /** Read a trace file into a freshly allocated trace_t object.
  *  Caller is responsible for calling free_trace on the trace
- *  when it's finished with it.
+ *  when it's finished with it.  Binary traces, which begin with
+ *  binary_magic, are mapped; all others are parsed as text.
  *
  *  @param fname    Name of the trace file to be read.
  *  @param verbose     Verbosity level.
@@ -282,7 +417,20 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
     if (verbose > 1)
         fprintf(stderr, "Reading tracefile: %s\n", fname);
 
-    FILE *fp = fopen(fname, "r");
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        unix_error("Could not open %s in read_trace", fname);
+    }
+    char magic[sizeof(binary_magic)];
+    if (read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+        memcmp(magic, binary_magic, sizeof(magic)) == 0) {
+        return read_binary_trace(fd, fname);
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        unix_error("Could not rewind %s in read_trace", fname);
+    }
+
+    FILE *fp = fdopen(fd, "r");
     if (!fp) {
         unix_error("Could not open %s in read_trace", fname);
     }
@@ -318,6 +466,9 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
     trace->num_ids = num_ids;
     trace->num_ops = num_ops;
     trace->weight = weight_codes[iweight];
+    trace->map = NULL;
+    trace->map_len = 0;
+    trace->stream = NULL;
 
     // We'll store each request line in the trace in this array.
     trace->ops = calloc(trace->num_ops, sizeof(traceop_t));
@@ -326,26 +477,7 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
                    trace->num_ops * sizeof(traceop_t));
     }
 
-    // We'll keep an array of pointers to the allocated blocks here...
-    trace->blocks = calloc(trace->num_ids, sizeof(char *));
-    if (!trace->blocks) {
-        unix_error("read_trace: malloc/3 (%zd) failed",
-                   trace->num_ids * sizeof(char *));
-    }
-
-    // ...along with the corresponding byte sizes of each block...
-    trace->block_sizes = calloc(trace->num_ids, sizeof(size_t));
-    if (!trace->block_sizes) {
-        unix_error("read_trace: malloc/4 (%zd) failed",
-                   trace->num_ids * sizeof(size_t));
-    }
-
-    // ...and, if we're debugging, the offset into the random data.
-    trace->block_rand_base = calloc(trace->num_ids, sizeof(size_t));
-    if (!trace->block_rand_base) {
-        unix_error("read_trace: malloc/5 (%zd) failed",
-                   trace->num_ids * sizeof(size_t));
-    }
+    alloc_block_arrays(trace);
 
     // Read every request line in the trace file.
     unsigned int op = 0;
@@ -401,14 +533,476 @@ void reinit_trace(trace_t *trace) {
     /* block_rand_base is unused if size is zero */
 }
 
+static void free_trace_stream(trace_stream_t *stream);
+
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or
+ *              for a binary trace, unmap the ops with the file.
  */
 void free_trace(trace_t *trace) {
-    free(trace->ops); /* free the three arrays... */
-    free(trace->blocks);
+    if (trace->stream) {
+        free_trace_stream(trace->stream);
+    }
+    if (trace->map) { /* free the ops, or unmap them with the header... */
+        munmap(trace->map, trace->map_len);
+    } else {
+        free(trace->ops);
+    }
+    free(trace->blocks); /* ...then the other three arrays... */
     free(trace->block_sizes);
     free(trace->block_rand_base);
     free(trace); /* and the trace record itself... */
 }
+
+/** Write a trace in the binary format that read_trace maps.
+ *
+ *  @param trace    The trace to write.
+ *  @param fname    Name of the file to write it to.
+ */
+void write_binary_trace(const trace_t *trace, const char *fname) {
+    binary_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, binary_magic, sizeof(header.magic));
+    header.byte_order = binary_byte_order;
+    header.op_size = sizeof(traceop_t);
+    header.weight = (uint32_t)trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.data_bytes = trace->data_bytes;
+
+    FILE *fp = fopen(fname, "wb");
+    if (!fp) {
+        unix_error("Could not create %s in write_binary_trace", fname);
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, fp) !=
+            trace->num_ops ||
+        fclose(fp) != 0) {
+        unix_error("%s: write error", fname);
+    }
+}
+
+/** Write a trace in the text format, as described in traces/README.
+ *
+ *  @param trace    The trace to write.
+ *  @param fname    Name of the file to write it to.
+ */
+void write_text_trace(const trace_t *trace, const char *fname) {
+    unsigned int iweight = 0;
+    while (iweight < N_WEIGHT_CODES - 1 &&
+           weight_codes[iweight] != trace->weight) {
+        iweight++;
+    }
+
+    FILE *fp = fopen(fname, "w");
+    if (!fp) {
+        unix_error("Could not create %s in write_text_trace", fname);
+    }
+    fprintf(fp, "%u\n%u\n%u\n%zu\n", iweight, trace->num_ids,
+            trace->num_ops, trace->data_bytes);
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        switch (op->type) {
+        case ALLOC:
+            fprintf(fp, "a %u %zu\n", op->index, op->size);
+            break;
+        case REALLOC:
+            fprintf(fp, "r %u %zu\n", op->index, op->size);
+            break;
+        case FREE:
+            fprintf(fp, "f %u\n", op->index);
+            break;
+        }
+    }
+    if (ferror(fp) || fclose(fp) != 0) {
+        unix_error("%s: write error", fname);
+    }
+}
+
+/** Most blocks a streamed trace may have allocated at once.  */
+#define STREAM_MAX_LIVE (1u << 24)
+
+/** Marks an empty entry in a stream's ID map.  */
+#define NO_SLOT UINT_MAX
+
+/** State of a trace that is read a window of ops at a time.
+ *
+ *  Block IDs in a long trace are unbounded, so each live block is
+ *  given a slot instead, and the ops in trace->ops carry slots as their
+ *  indexes; trace->num_ids is the number of slots.  Slots freed in one
+ *  window are reused only from the next, once the ops that free them
+ *  have run and the driver is done with their entries.
+ */
+struct trace_stream_t {
+    FILE *fp;
+    const char *fname;
+    char *line;            /* Line buffer, for getline */
+    size_t linesz;
+    unsigned int lineno;   /* Line number of the last line read */
+    unsigned int ops_line; /* Line number just before the first op */
+    long ops_offset;       /* Offset of the first op, or -1 for a pipe */
+    bool started;          /* Whether a pass has begun */
+    bool at_eof;           /* Whether this pass has read every op */
+    unsigned int window;   /* Most ops in one window */
+    size_t ops_read;       /* Ops read in this pass so far */
+
+    /* Open-addressed map from live block IDs to their slots */
+    unsigned int *map_ids;
+    unsigned int *map_slots; /* NO_SLOT where the entry is empty */
+    size_t map_mask;         /* Number of entries less one, a power of two */
+
+    unsigned int next_slot;   /* Slots from here up have never been used */
+    unsigned int *free_slots; /* Slots free for reuse... */
+    size_t nfree;
+    unsigned int *freed_slots; /* ...and those freed in this window */
+    size_t nfreed;
+};
+
+/** Find where a block ID is, or would go, in a stream's ID map.
+ *
+ *  @param stream  The stream.
+ *  @param id      The block ID.
+ *  @return        The index of its entry, or of the empty one for it.
+ */
+static size_t stream_map_find(const trace_stream_t *stream, unsigned int id) {
+    size_t i = (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15u) >> 32);
+    for (i &= stream->map_mask; stream->map_slots[i] != NO_SLOT;
+         i = (i + 1) & stream->map_mask) {
+        if (stream->map_ids[i] == id) {
+            break;
+        }
+    }
+    return i;
+}
+
+/** Remove an entry from a stream's ID map, moving back those after it
+ *  that would otherwise no longer be found.
+ *
+ *  @param stream  The stream.
+ *  @param i       The index of the entry.
+ */
+static void stream_map_remove(trace_stream_t *stream, size_t i) {
+    size_t j = i;
+    for (;;) {
+        stream->map_slots[i] = NO_SLOT;
+        do {
+            j = (j + 1) & stream->map_mask;
+            if (stream->map_slots[j] == NO_SLOT) {
+                return;
+            }
+            // Where the entry at j would be found from
+            size_t home = (size_t)(((uint64_t)stream->map_ids[j] *
+                                    0x9E3779B97F4A7C15u) >>
+                                   32) &
+                          stream->map_mask;
+            // It can move to i only if i lies cyclically in [home, j)
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+                break;
+            }
+        } while (true);
+        stream->map_ids[i] = stream->map_ids[j];
+        stream->map_slots[i] = stream->map_slots[j];
+        i = j;
+    }
+}
+
+/** Empty a stream's ID map and make it large enough for num_ids slots.
+ *
+ *  @param stream   The stream.
+ *  @param num_ids  The number of slots.
+ */
+static void stream_map_reset(trace_stream_t *stream, unsigned int num_ids) {
+    size_t entries = 1;
+    while (entries < 2 * (size_t)num_ids) {
+        entries *= 2;
+    }
+    free(stream->map_ids);
+    free(stream->map_slots);
+    stream->map_ids = malloc(entries * sizeof(unsigned int));
+    stream->map_slots = malloc(entries * sizeof(unsigned int));
+    if (!stream->map_ids || !stream->map_slots) {
+        unix_error("%s: malloc failed for block ID map", stream->fname);
+    }
+    memset(stream->map_slots, 0xff, entries * sizeof(unsigned int));
+    stream->map_mask = entries - 1;
+}
+
+/** Give a streamed trace twice as many slots, keeping those in use.
+ *
+ *  @param trace   The trace.
+ */
+static void stream_grow(trace_t *trace) {
+    trace_stream_t *stream = trace->stream;
+    unsigned int old_ids = trace->num_ids;
+    if (old_ids >= STREAM_MAX_LIVE) {
+        app_error("%s:%u: error: more than %u blocks allocated at once",
+                  stream->fname, stream->lineno, STREAM_MAX_LIVE);
+    }
+    unsigned int num_ids = 2 * old_ids;
+    size_t added = num_ids - old_ids;
+
+    trace->blocks = realloc(trace->blocks, num_ids * sizeof(char *));
+    trace->block_sizes = realloc(trace->block_sizes, num_ids * sizeof(size_t));
+    trace->block_rand_base =
+        realloc(trace->block_rand_base, num_ids * sizeof(size_t));
+    stream->free_slots =
+        realloc(stream->free_slots, num_ids * sizeof(unsigned int));
+    stream->freed_slots =
+        realloc(stream->freed_slots, num_ids * sizeof(unsigned int));
+    if (!trace->blocks || !trace->block_sizes || !trace->block_rand_base ||
+        !stream->free_slots || !stream->freed_slots) {
+        unix_error("%s: realloc failed for %u blocks", stream->fname, num_ids);
+    }
+    memset(trace->blocks + old_ids, 0, added * sizeof(char *));
+    memset(trace->block_sizes + old_ids, 0, added * sizeof(size_t));
+    trace->num_ids = num_ids;
+
+    // Rebuild the ID map at its new size
+    unsigned int *ids = stream->map_ids;
+    unsigned int *slots = stream->map_slots;
+    size_t old_entries = stream->map_mask + 1;
+    stream->map_ids = NULL;
+    stream->map_slots = NULL;
+    stream_map_reset(stream, num_ids);
+    for (size_t i = 0; i < old_entries; i++) {
+        if (slots[i] != NO_SLOT) {
+            size_t j = stream_map_find(stream, ids[i]);
+            stream->map_ids[j] = ids[i];
+            stream->map_slots[j] = slots[i];
+        }
+    }
+    free(ids);
+    free(slots);
+}
+
+/** Replace the block ID of an op just read with its slot, giving a new
+ *  block a slot and taking back that of a freed one.
+ *
+ *  @param trace   The trace.
+ *  @param op      The op.
+ */
+static void stream_assign_slot(trace_t *trace, traceop_t *op) {
+    trace_stream_t *stream = trace->stream;
+    size_t i = stream_map_find(stream, op->index);
+    bool live = stream->map_slots[i] != NO_SLOT;
+
+    if (op->type == FREE) {
+        if (!live) {
+            op->index = (unsigned int)-1; // Free of a block never allocated
+            return;
+        }
+        op->index = stream->map_slots[i];
+        stream->freed_slots[stream->nfreed++] = op->index;
+        stream_map_remove(stream, i);
+        return;
+    }
+    if (live) {
+        if (op->type == ALLOC) {
+            app_error("%s:%u: error: invalid trace: "
+                      "block ID %u allocated twice",
+                      stream->fname, stream->lineno, op->index);
+        }
+        op->index = stream->map_slots[i];
+        return;
+    }
+
+    // A new block
+    if (stream->nfree == 0 && stream->next_slot == trace->num_ids) {
+        stream_grow(trace);
+        i = stream_map_find(stream, op->index);
+    }
+    unsigned int slot = stream->nfree > 0 ? stream->free_slots[--stream->nfree]
+                                          : stream->next_slot++;
+    stream->map_ids[i] = op->index;
+    stream->map_slots[i] = slot;
+    op->index = slot;
+}
+
+/** Read the next window of a streamed trace's ops.
+ *
+ *  @param trace   The trace.
+ *  @return        True if any ops were read.
+ */
+static bool stream_read_window(trace_t *trace) {
+    trace_stream_t *stream = trace->stream;
+
+    // The ops of the last window have run, so their freed slots are free
+    for (size_t i = 0; i < stream->nfreed; i++) {
+        unsigned int slot = stream->freed_slots[i];
+        trace->blocks[slot] = NULL;
+        trace->block_sizes[slot] = 0;
+        stream->free_slots[stream->nfree++] = slot;
+    }
+    stream->nfreed = 0;
+
+    unsigned int op = 0;
+    while (op < stream->window &&
+           get_next_line(stream->fp, stream->fname, &stream->line,
+                         &stream->linesz, &stream->lineno)) {
+        traceop_t *p = &trace->ops[op];
+        switch (stream->line[0]) {
+        case 'a':
+            read_alloc_line(p, ALLOC, stream->line + 1, stream->fname,
+                            stream->lineno);
+            break;
+        case 'r':
+            read_alloc_line(p, REALLOC, stream->line + 1, stream->fname,
+                            stream->lineno);
+            break;
+        case 'f':
+            read_free_line(p, stream->line + 1, stream->fname, stream->lineno);
+            break;
+        default:
+            app_error("%s:%d: error: invalid trace: "
+                      "unrecognized trace opcode '%c'",
+                      stream->fname, stream->lineno, stream->line[0]);
+        }
+        stream_assign_slot(trace, p);
+        op++;
+    }
+    if (op < stream->window) {
+        stream->at_eof = true;
+    }
+    trace->num_ops = op;
+    stream->ops_read += op;
+    return op > 0;
+}
+
+/** Start reading a text trace a window of ops at a time.  Only the
+ *  header is read here; the ops are read by first_trace_window and
+ *  next_trace_window, and the counts of IDs and ops in the header are
+ *  not relied on.  Caller is responsible for calling free_trace on the
+ *  trace when it's finished with it.
+ *
+ *  @param fname    Name of the trace file, or "-" for standard input.
+ *  @param window   Most ops to hold at once.
+ *  @param verbose  Verbosity level.
+ *  @return         a trace_t object, with no ops yet.
+ */
+trace_t *open_trace_stream(const char *fname, unsigned int window,
+                           unsigned int verbose) {
+    if (verbose > 1)
+        fprintf(stderr, "Streaming tracefile: %s\n", fname);
+
+    trace_stream_t *stream = calloc(1, sizeof(trace_stream_t));
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    if (!stream || !trace) {
+        unix_error("open_trace_stream: calloc failed");
+    }
+    stream->fname = fname;
+    stream->window = window > 0 ? window : 1;
+    stream->fp = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+    if (!stream->fp) {
+        unix_error("Could not open %s in open_trace_stream", fname);
+    }
+
+    get_header_line(stream->fp, fname, &stream->line, &stream->linesz,
+                    &stream->lineno);
+    unsigned int iweight = (unsigned int)read_single_number(
+        stream->line, N_WEIGHT_CODES - 1, fname, stream->lineno,
+        "trace weight");
+    get_header_line(stream->fp, fname, &stream->line, &stream->linesz,
+                    &stream->lineno); // number of block IDs
+    get_header_line(stream->fp, fname, &stream->line, &stream->linesz,
+                    &stream->lineno); // number of trace operations
+    get_header_line(stream->fp, fname, &stream->line, &stream->linesz,
+                    &stream->lineno);
+    size_t peak_bytes =
+        read_single_number(stream->line, SIZE_MAX, fname, stream->lineno,
+                           "peak allocation in bytes");
+    stream->ops_line = stream->lineno;
+    stream->ops_offset = ftell(stream->fp);
+
+    trace->filename = fname;
+    trace->data_bytes = peak_bytes;
+    trace->weight = weight_codes[iweight];
+    trace->stream = stream;
+    trace->num_ids = 1024;
+    trace->ops = calloc(stream->window, sizeof(traceop_t));
+    stream->free_slots = malloc(trace->num_ids * sizeof(unsigned int));
+    stream->freed_slots = malloc(trace->num_ids * sizeof(unsigned int));
+    if (!trace->ops || !stream->free_slots || !stream->freed_slots) {
+        unix_error("open_trace_stream: malloc failed");
+    }
+    alloc_block_arrays(trace);
+    stream_map_reset(stream, trace->num_ids);
+    return trace;
+}
+
+/** Start a pass over a trace, rewinding a streamed trace that has been
+ *  read before, and load its first window.
+ *
+ *  @param trace   The trace.
+ *  @return        True if the window has any ops.
+ */
+bool first_trace_window(trace_t *trace) {
+    trace_stream_t *stream = trace->stream;
+    if (!stream) {
+        return true;
+    }
+
+    if (stream->started) {
+        if (!trace_can_rewind(trace) ||
+            fseek(stream->fp, stream->ops_offset, SEEK_SET) != 0) {
+            app_error("%s: error: can't read the trace again", stream->fname);
+        }
+        stream->lineno = stream->ops_line;
+        stream_map_reset(stream, trace->num_ids);
+    }
+    stream->started = true;
+    stream->at_eof = false;
+    stream->ops_read = 0;
+    stream->next_slot = 0;
+    stream->nfree = 0;
+    stream->nfreed = 0;
+    return stream_read_window(trace);
+}
+
+/** Load the next window of a pass over a trace.
+ *
+ *  @param trace   The trace.
+ *  @return        True if there is another window, with at least one op.
+ */
+bool next_trace_window(trace_t *trace) {
+    trace_stream_t *stream = trace->stream;
+    if (!stream || stream->at_eof) {
+        return false;
+    }
+    return stream_read_window(trace);
+}
+
+/** Tell whether a trace can be run again once it has been.
+ *
+ *  @param trace   The trace.
+ *  @return        False only for a trace streamed from a pipe.
+ */
+bool trace_can_rewind(const trace_t *trace) {
+    return !trace->stream || trace->stream->ops_offset >= 0;
+}
+
+/** Count the ops of a trace run so far in the current or last pass,
+ *  which once a pass is complete is all of them.
+ *
+ *  @param trace   The trace.
+ *  @return        The number of ops.
+ */
+size_t trace_ops_read(const trace_t *trace) {
+    return trace->stream ? trace->stream->ops_read : trace->num_ops;
+}
+
+/** Close a trace stream and free its state.
+ *
+ *  @param stream  The stream.
+ */
+static void free_trace_stream(trace_stream_t *stream) {
+    if (stream->fp != stdin) {
+        fclose(stream->fp);
+    }
+    free(stream->line);
+    free(stream->map_ids);
+    free(stream->map_slots);
+    free(stream->free_slots);
+    free(stream->freed_slots);
+    free(stream);
+}
@@ -9,6 +9,7 @@
 #ifndef MM_TRACEFILE_H_
 #define MM_TRACEFILE_H_ 1
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /** The 'weight' of a trace file.  Weight is a misnomer; it's actually a
@@ -39,7 +40,11 @@ typedef struct traceop_t {
     size_t size;              /* byte size of alloc/realloc request */
 } traceop_t;
 
-/** Data structure corresponding to a complete trace file.  */
+/** State of a trace that is read a window of ops at a time.  */
+typedef struct trace_stream_t trace_stream_t;
+
+/** Data structure corresponding to a complete trace file, or for a
+ *  streamed trace, to one window of it.  */
 typedef struct trace_t {
     const char *filename;
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
@@ -50,6 +55,9 @@ typedef struct trace_t {
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    void *map;               /* mapping of a binary trace file, or NULL */
+    size_t map_len;          /* length of that mapping */
+    trace_stream_t *stream;  /* source of the ops if streamed, or NULL */
 } trace_t;
 
 /* These functions read, allocate, and free storage for traces */
@@ -57,4 +65,26 @@ extern trace_t *read_trace(const char *filename, unsigned int verbose);
 extern void reinit_trace(trace_t *trace);
 extern void free_trace(trace_t *trace);
 
+/* Write a trace in the text or the binary format, both of which
+ * read_trace reads */
+extern void write_text_trace(const trace_t *trace, const char *filename);
+extern void write_binary_trace(const trace_t *trace, const char *filename);
+
+/* These functions read a text trace a window of ops at a time, from a
+ * file or, given "-", standard input.  A pass over any trace is
+ *
+ *     for (bool more = first_trace_window(trace); more;
+ *          more = next_trace_window(trace)) {
+ *         ... run trace->ops[0] to trace->ops[trace->num_ops - 1] ...
+ *     }
+ *
+ * which for a trace from read_trace is one window of all its ops.
+ */
+extern trace_t *open_trace_stream(const char *filename, unsigned int window,
+                                  unsigned int verbose);
+extern bool first_trace_window(trace_t *trace);
+extern bool next_trace_window(trace_t *trace);
+extern bool trace_can_rewind(const trace_t *trace);
+extern size_t trace_ops_read(const trace_t *trace);
+
 #endif /* tracefile.h */
@@ -6,6 +6,7 @@
 #include "csapp.h"
 
 #include <errno.h>      /* errno */
+#include <limits.h>     /* IOV_MAX */
 #include <netdb.h>      /* freeaddrinfo() */
 #include <semaphore.h>  /* sem_t */
 #include <signal.h>     /* struct sigaction */
@@ -431,18 +432,95 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 }
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_iov_batch - Copy up to IOV_MAX of the iovcnt entries at iov into
+ *    part, leaving out the first skip bytes, and return how many were copied
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-    size_t cnt;
+static size_t rio_iov_batch(struct iovec *part, const struct iovec *iov,
+                            size_t iovcnt, size_t skip) {
+    size_t n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+    memcpy(part, iov, n * sizeof(struct iovec));
+    part[0].iov_base = (char *)part[0].iov_base + skip;
+    part[0].iov_len -= skip;
+    return n;
+}
+
+/*
+ * rio_iov_advance - Step the position (*i, *skip) in an iovec past n more
+ *    bytes, and past any empty entries that follow
+ */
+static void rio_iov_advance(const struct iovec *iov, size_t iovcnt, size_t *i,
+                            size_t *skip, size_t n) {
+    n += *skip;
+    while (*i < iovcnt && n >= iov[*i].iov_len) {
+        n -= iov[*i].iov_len;
+        (*i)++;
+    }
+    *skip = n;
+}
+
+/*
+ * rio_readv - Robustly scatter bytes into a whole iovec (unbuffered). The
+ *    entries themselves are not modified.
+ */
+ssize_t rio_readv(int fd, const struct iovec *iov, size_t iovcnt) {
+    struct iovec part[IOV_MAX];
+    size_t i = 0, skip = 0, total = 0, n;
+    ssize_t nread;
+
+    rio_iov_advance(iov, iovcnt, &i, &skip, 0);
+    while (i < iovcnt) {
+        n = rio_iov_batch(part, iov + i, iovcnt - i, skip);
+        if ((nread = readv(fd, part, (int)n)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by readv() */
+            }
+
+            /* Interrupted by sig handler return, call readv() again */
+            nread = 0;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        total += (size_t)nread;
+        rio_iov_advance(iov, iovcnt, &i, &skip, (size_t)nread);
+    }
+    return (ssize_t)total; /* Return >= 0 */
+}
+
+/*
+ * rio_writev - Robustly gather and write a whole iovec (unbuffered). The
+ *    entries themselves are not modified.
+ */
+ssize_t rio_writev(int fd, const struct iovec *iov, size_t iovcnt) {
+    struct iovec part[IOV_MAX];
+    size_t i = 0, skip = 0, total = 0, n;
+    ssize_t nwritten;
+
+    rio_iov_advance(iov, iovcnt, &i, &skip, 0);
+    while (i < iovcnt) {
+        n = rio_iov_batch(part, iov + i, iovcnt - i, skip);
+        if ((nwritten = writev(fd, part, (int)n)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by writev() */
+            }
+
+            /* Interrupted by sig handler return, call writev() again */
+            nwritten = 0;
+        }
+        total += (size_t)nwritten;
+        rio_iov_advance(iov, iovcnt, &i, &skip, (size_t)nwritten);
+    }
+    return (ssize_t)total;
+}
 
+/*
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the buffer, 0 on EOF, or
+ *    -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp) {
     while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
         if (rp->rio_cnt < 0) {
             if (errno != EINTR) {
                 return -1; /* errno set by read() */
@@ -455,6 +533,24 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
             rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
         }
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+    size_t cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0) {
+        return rc;
+    }
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -471,8 +567,19 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 void rio_readinitb(rio_t *rp, int fd) {
+    rio_readinitb_buf(rp, fd, rp->rio_inline, sizeof(rp->rio_inline));
+}
+
+/*
+ * rio_readinitb_buf - Associate a descriptor with a read buffer that uses
+ *    the caller's size bytes at buf, such as RIO_BIGBUFSIZE of them for bulk
+ *    transfers, rather than its own
+ */
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size) {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
+    rp->rio_buf = buf;
+    rp->rio_bufsize = size;
     rp->rio_bufptr = rp->rio_buf;
 }
 
@@ -485,9 +592,18 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-        if ((nread = rio_read(rp, bufp, nleft)) < 0) {
+        if (rp->rio_cnt <= 0 && nleft >= rp->rio_bufsize) {
+            /* Reads too large to buffer go straight to the user buf */
+            if ((nread = read(rp->rio_fd, bufp, nleft)) < 0) {
+                if (errno != EINTR) {
+                    return -1; /* errno set by read() */
+                }
+                continue;
+            }
+        } else if ((nread = rio_read(rp, bufp, nleft)) < 0) {
             return -1; /* errno set by read() */
-        } else if (nread == 0) {
+        }
+        if (nread == 0) {
             break; /* EOF */
         }
         nleft -= (size_t)nread;
@@ -497,32 +613,42 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 }
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered), finding its end with
+ *    memchr() over the buffered bytes rather than a byte at a time
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    size_t n;
+    size_t n = 0, cnt;
     ssize_t rc;
-    char c, *bufp = usrbuf;
+    char *bufp = usrbuf, *nl;
 
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break; /* EOF, some data was read */
-            }
-        } else {
+    if (maxlen == 0) {
+        return 0;
+    }
+    while (n < maxlen - 1) {
+        if ((rc = rio_fill(rp)) < 0) {
             return -1; /* Error */
+        } else if (rc == 0) {
+            break; /* EOF, with or without some data read */
+        }
+
+        /* Take bytes up to the newline, or as many as fit */
+        cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt) {
+            cnt = (size_t)rp->rio_cnt;
+        }
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL) {
+            cnt = (size_t)(nl - rp->rio_bufptr) + 1;
+        }
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= (ssize_t)cnt;
+        n += cnt;
+        if (nl != NULL) {
+            break;
         }
     }
-    *bufp = 0;
-    return (ssize_t)(n - 1);
+    bufp[n] = 0;
+    return (ssize_t)n;
 }
 
 /********************************
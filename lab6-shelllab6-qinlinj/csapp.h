@@ -6,7 +6,7 @@
  *
  * - The RIO (robust I/O) package, which allows performing reads and writes
  *   robustly by handling short reads and writes. It also provides the rio_t
- *   which allows for buffered reads.
+ *   which allows for buffered reads, and gathering reads and writes.
  *
  * - The SIO (safe I/O) package, which implements an async-signal-safe variant
  *   of printf and related calls. (The Sio_puts and Sio_putl functions in the
@@ -41,18 +41,25 @@
 #include <stdarg.h>    /* va_list */
 #include <stddef.h>    /* size_t */
 #include <sys/types.h> /* ssize_t */
+#include <sys/uio.h>   /* struct iovec */
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 #define DEF_MODE S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH
 #define DEF_UMASK S_IWGRP | S_IWOTH
 
-/* Persistent state for the robust I/O (Rio) package */
+/*
+ * Persistent state for the robust I/O (Rio) package. The internal buffer is
+ * rio_inline, unless rio_readinitb_buf supplies a larger one.
+ */
 #define RIO_BUFSIZE 8192
+#define RIO_BIGBUFSIZE 65536 /* Suggested buffer size for bulk transfers */
 typedef struct {
-    int rio_fd;                /* Descriptor for this internal buf */
-    ssize_t rio_cnt;           /* Unread bytes in internal buf */
-    char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    int rio_fd;                   /* Descriptor for this internal buf */
+    ssize_t rio_cnt;              /* Unread bytes in internal buf */
+    char *rio_bufptr;             /* Next unread byte in internal buf */
+    char *rio_buf;                /* Internal buffer */
+    size_t rio_bufsize;           /* Size of the internal buffer */
+    char rio_inline[RIO_BUFSIZE]; /* Default internal buffer */
 } rio_t;
 
 /* Misc constants */
@@ -82,7 +89,10 @@ void __sio_assert_fail(const char *assertion, const char *file,
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
+ssize_t rio_readv(int fd, const struct iovec *iov, size_t iovcnt);
+ssize_t rio_writev(int fd, const struct iovec *iov, size_t iovcnt);
 void rio_readinitb(rio_t *rp, int fd);
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
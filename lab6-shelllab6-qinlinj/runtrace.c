@@ -3,6 +3,11 @@
  *
  * Runs a tiny shell on a trace file.
  *
+ * Each step of a trace waits on descriptors for the shell's output, the
+ * synchronisation messages, and a pidfd that reports when the shell has
+ * exited, so it moves on as soon as the shell responds. The timeouts only
+ * bound how long a stuck shell is waited for.
+ *
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
@@ -10,6 +15,7 @@
 #include "csapp.h"
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -17,6 +23,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -46,6 +53,9 @@ int datafd[2];
 int syncfd[2];
 int shellsyncfd[2];
 
+/* pidfd of the shell, readable once it has exited, or -1 if unsupported */
+int shellpidfd = -1;
+
 volatile sig_atomic_t cleanup_needed;
 const char *cleanup_args[4] = {"/bin/sh", "-c", NULL, NULL};
 
@@ -55,7 +65,8 @@ int blankline(char *str);
 void print_child_status(void);
 int next_prompt(void);
 void flush_output(void);
-int readable(int fd, int secs);
+int readable(int fd, int secs, bool watch_shell);
+int open_pidfd(pid_t pid);
 void clean(sigset_t prev_all);
 void atexit_clean(void);
 /*
@@ -130,6 +141,7 @@ int main(int argc, char **argv) {
     char *fgets_result;
     pid_t child_pid;
     sigset_t mask_all, prev_all;
+    int n;
 
     /* Install the signal handler */
     Signal(SIGALRM, sigalrm_handler);
@@ -381,10 +393,15 @@ int main(int argc, char **argv) {
     /* Close the descriptor the parent is not using */
     close(datafd[1]);
 
+    /* Learn of the shell exiting, even while its jobs hold the socket */
+    shellpidfd = open_pidfd(child_pid);
+
     /* Read the initial prompt from the shell */
-    if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+    if ((n = readable(datafd[0], DRIVER_TIMEOUT, true)) <= 0) {
         fprintf(stderr,
-                "%s: Runtrace timed out waiting for initial shell prompt\n",
+                n == 0 ? "%s: Runtrace timed out waiting for initial shell "
+                         "prompt\n"
+                       : "%s: Shell exited before its initial prompt\n",
                 tracefile);
         if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0) {
             sio_eprintf("sigprocmask error in main\n");
@@ -426,7 +443,7 @@ int main(int argc, char **argv) {
             printf("%s\n", line);
             /* WAIT command */
         } else if (!strcmp(command, "WAIT")) {
-            if (readable(syncfd[0], DRIVER_TIMEOUT) == 0) {
+            if (readable(syncfd[0], DRIVER_TIMEOUT, false) == 0) {
                 printf("%s: Runtrace timed out waiting for sync from job\n",
                        tracefile);
                 if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0) {
@@ -448,10 +465,12 @@ int main(int argc, char **argv) {
             }
             /* SHELLWAIT command */
         } else if (!strcmp(command, "SHELLWAIT")) {
-            if (readable(shellsyncfd[0], DRIVER_TIMEOUT) == 0) {
-                printf(
-                    "%s: Runtrace timed out waiting for sync from the shell\n",
-                    tracefile);
+            if ((n = readable(shellsyncfd[0], DRIVER_TIMEOUT, true)) <= 0) {
+                printf(n == 0 ? "%s: Runtrace timed out waiting for sync from "
+                                "the shell\n"
+                              : "%s: Shell exited while runtrace waited for "
+                                "sync from it\n",
+                       tracefile);
                 if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0) {
                     sio_eprintf("sigprocmask error in main\n");
                     _exit(1);
@@ -740,29 +759,35 @@ void print_child_status(void) {
 
 /*
  * next_prompt - Print the shell response until the next prompt or EOF
- *               Returns 1 if OK, 0 on EOF or timeout
+ *               The prompt is found at the end of whatever the shell sent,
+ *               even when it came with the rest of the response.
+ *               Returns 1 if OK, 0 on EOF, shell exit or timeout
  */
 int next_prompt(void) {
     int n;
-    struct timeval tv;
-    fd_set rset, readable_set;
+    struct pollfd fds[3];
+    nfds_t nfds = 0;
+    nfds_t syncidx = 0, pididx = 0;
+    size_t promptlen = strlen(PROMPT);
     const char *bufp;
 
     memset(buf, 0, MAXBUF);
-    FD_ZERO(&rset);
 
-    int maxfd = datafd[0];
-    FD_SET(datafd[0], &rset);
+    fds[nfds].fd = datafd[0];
+    fds[nfds++].events = POLLIN;
     if (has_shellsync) {
-        FD_SET(shellsyncfd[0], &rset);
-        maxfd = (maxfd < shellsyncfd[0]) ? shellsyncfd[0] : maxfd;
+        syncidx = nfds;
+        fds[nfds].fd = shellsyncfd[0];
+        fds[nfds++].events = POLLIN;
+    }
+    if (shellpidfd >= 0) {
+        pididx = nfds;
+        fds[nfds].fd = shellpidfd;
+        fds[nfds++].events = POLLIN;
     }
 
-    tv.tv_sec = DRIVER_TIMEOUT;
-    tv.tv_usec = 0;
-    readable_set = rset;
-    while ((n = select(maxfd + 1, &readable_set, NULL, NULL, &tv)) > 0) {
-        if (FD_ISSET(shellsyncfd[0], &readable_set)) {
+    while ((n = poll(fds, nfds, DRIVER_TIMEOUT * 1000)) > 0) {
+        if (syncidx && (fds[syncidx].revents & POLLIN)) {
             if ((recv(shellsyncfd[0], buf, MAXBUF, 0)) < 0) {
                 perror("recv shellsyncfd");
                 exit(1);
@@ -782,24 +807,30 @@ int next_prompt(void) {
             }
             memset(buf, 0, MAXBUF);
         }
-        if (FD_ISSET(datafd[0], &readable_set)) {
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
             ssize_t nread;
-            if ((nread = recv(datafd[0], buf, MAXBUF, 0)) < 0) {
+            if ((nread = recv(datafd[0], buf, MAXBUF - 1, 0)) < 0) {
                 perror("next_prompt:recv1");
                 exit(1);
             } else if (nread == 0) {
                 return 0;
-            } else if (!strcmp(buf, PROMPT)) {
-                return 1;
-            } else {
+            }
+            buf[nread] = '\0';
+            if ((size_t)nread >= promptlen &&
+                !strcmp(buf + nread - promptlen, PROMPT)) {
+                buf[(size_t)nread - promptlen] = '\0';
                 printf("%s", buf);
+                return 1;
             }
+            printf("%s", buf);
             memset(buf, 0, MAXBUF);
+        } else if (pididx && (fds[pididx].revents & POLLIN)) {
+            /* The shell has exited, and all it wrote has been read */
+            return 0;
         }
-        readable_set = rset;
     }
     if (n < 0) {
-        perror("select");
+        perror("poll");
         exit(1);
     } else {
         printf("%s: Runtrace timed out waiting for next shell prompt\n",
@@ -819,7 +850,7 @@ void flush_output(void) {
 
     memset(buf, 0, MAXBUF);
 
-    while (readable(datafd[0], 0)) {
+    while (readable(datafd[0], 0, false) > 0) {
         n = recv(datafd[0], buf, MAXBUF, 0);
         if (n < 0) {
             perror("flush:recv");
@@ -835,25 +866,45 @@ void flush_output(void) {
 }
 
 /*
- * readable - Wait secs seconds for descriptor fd to become readable
- *            Return > 0 if fd is readable, 0 if timeout.
+ * readable - Wait secs seconds for descriptor fd to become readable, or
+ *            with watch_shell, until the shell exits if that comes first
+ *            Return > 0 if fd is readable, 0 if timeout, < 0 if the shell
+ *            exited.
  */
-int readable(int fd, int secs) {
+int readable(int fd, int secs, bool watch_shell) {
     int n;
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
 
-    fd_set rset;
-    struct timeval tv;
-
-    FD_ZERO(&rset);
-    FD_SET(fd, &rset);
-
-    tv.tv_sec = secs;
-    tv.tv_usec = 0;
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    if (watch_shell && shellpidfd >= 0) {
+        fds[1].fd = shellpidfd;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
 
-    if ((n = select(fd + 1, &rset, NULL, NULL, &tv)) < 0) {
-        perror("select");
+    if ((n = poll(fds, nfds, secs * 1000)) < 0) {
+        perror("poll");
         exit(1);
     }
+    if (n > 0 && !(fds[0].revents & (POLLIN | POLLHUP))) {
+        return -1;
+    }
 
     return n;
 }
+
+/*
+ * open_pidfd - Open a descriptor that becomes readable when process pid
+ *              exits. Return -1 if the kernel does not support pidfds
+ */
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
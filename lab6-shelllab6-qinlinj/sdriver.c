@@ -6,16 +6,25 @@
  * Introduces non-determinism in the fork() function call to
  * identify erroneous races in the student code.
  *
+ * Runs several traces at once (-j, by default one per online CPU), each
+ * in its own process group and its own scratch directory, and prints their
+ * results in order. Traces that fail while running alongside others are
+ * rerun on their own, so that the score never depends on -j.
+ *
  * Copyright (c) 2004-2011, R. Bryant and D. O'Hallaron
  */
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,6 +34,12 @@
 /* Prototypes */
 void usage(void);
 int runtrace(const char *tracefile);
+int runtrace_iters(const char *tracefile);
+void run_parallel(const char **tracefiles, int num_traces, int *correct);
+pid_t start_worker(const char *tracefile, const char *dir);
+void link_lab_files(const char *labdir);
+void interrupt_handler(int sig);
+void make_tmpfiles(const char *dir);
 void delete_tmpfiles(void);
 void emit_file(char *filename);
 void error_msg(char *cmd, int status);
@@ -57,6 +72,15 @@ void error_msg(char *cmd, int status);
         }                                                                      \
     } while (0)
 
+/*
+ * The temporary directory runtrace creates in its working directory, which
+ * is not shared with the scratch directories of -j
+ */
+#define RUNTRACE_TMP_FOLDER "runtrace.tmp"
+
+/* The file that collects the output of each trace run with -j */
+#define WORKER_OUTFILE "sdriver.out"
+
 /********************
  * Global variables
  *******************/
@@ -66,6 +90,10 @@ int sandboxing = 0;              /* Enable sandboxing (-x) */
 int autograded = 0;              /* Set only on the Autolab server (-A) */
 int color_output = 0;            /* Flag for printing color output */
 int num_iters = ITERS;           /* How many times to test each trace file */
+int num_jobs = 0;                /* How many traces to run at once (-j) */
+
+/* Set by the SIGINT and SIGTERM handlers while traces run in parallel */
+volatile sig_atomic_t interrupted = 0;
 
 /* Null-terminated list of trace files */
 static const char *default_tracefiles[] = {TRACEFILES, NULL};
@@ -89,8 +117,6 @@ char diff_filtered_outfile[MAXBUF];
 int main(int argc, char **argv) {
     int i, j;
     int c;
-    int pid;
-    int current_time;
 
     int correct[MAXTRACES]; /* True if trace i is correct */
     int num_correct;        /* Number of correct traces */
@@ -102,6 +128,7 @@ int main(int argc, char **argv) {
     int tracenum = -1;             /* Number of trace file to test (-t) */
     int singletrace = 0;           /* Are we testing one trace or all? (-t) */
     int num_iters_specified = 0;   /* True if the user specifed the i flag */
+    int num_jobs_specified = 0;    /* True if the user specifed the j flag */
 
     struct stat statbuf;
 
@@ -117,7 +144,7 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "Ai:t:s:hVxcC")) != EOF) {
+    while ((c = getopt(argc, argv, "Ai:j:t:s:hVxcC")) != EOF) {
         switch (c) {
 
         case 'A': /* hidden Autolab driver argument */
@@ -135,6 +162,16 @@ int main(int argc, char **argv) {
             num_iters_specified = 1;
             break;
 
+        case 'j': /* number of traces to run at once */
+            num_jobs = atoi(optarg);
+            num_jobs = num_jobs < MAXTRACES ? num_jobs : MAXTRACES;
+            if (num_jobs < 1) {
+                printf("Error: Invalid number of jobs (-j)\n");
+                usage();
+            }
+            num_jobs_specified = 1;
+            break;
+
         case 's': /* The name of the test shell (default ./tsh) */
             shellprog = strdup(optarg);
             break;
@@ -188,23 +225,17 @@ int main(int argc, char **argv) {
     if (singletrace && autograded) {
         printf("Warning: -A flag is ignored when testing single traces\n");
     }
+    if (singletrace && num_jobs_specified && num_jobs > 1) {
+        printf("Warning: -j flag is ignored when testing single traces\n");
+    }
 
-    /* Get the current time stamp and PID */
-    current_time = (int)time(NULL);
-    pid = (int)getpid();
-
-    /* Generate some (truly) unique filenames in /usr/tmp */
-    snprintf(test_raw_outfile, sizeof(test_raw_outfile),
-             "/tmp/test_raw_outfile.%d.%d", current_time, pid);
-    snprintf(ref_raw_outfile, sizeof(ref_raw_outfile),
-             "/tmp/ref_raw_outfile.%d.%d", current_time, pid);
+    /* Default to running one trace per online CPU */
+    if (!num_jobs_specified) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_jobs = ncpus < 1 ? 1 : ncpus < MAXTRACES ? (int)ncpus : MAXTRACES;
+    }
 
-    snprintf(test_filtered_outfile, sizeof(test_filtered_outfile),
-             "/tmp/test_filtered_outfile.%d.%d", current_time, pid);
-    snprintf(ref_filtered_outfile, sizeof(ref_filtered_outfile),
-             "/tmp/ref_filtered_outfile.%d.%d", current_time, pid);
-    snprintf(diff_filtered_outfile, sizeof(diff_filtered_outfile),
-             "/tmp/diff_filtered_outfile.%d.%d", current_time, pid);
+    make_tmpfiles("/tmp");
 
     /* Evaluate a single tracefile */
     if (singletrace) {
@@ -229,28 +260,31 @@ int main(int argc, char **argv) {
         /* Evaluate all trace files */
     } else {
         num_correct = 0;
-        for (i = 0; i < num_graded_tracefiles; i++) {
-            if (num_iters > 1) {
-                printf("Running %d iters of %s\n", num_iters, tracefiles[i]);
-            }
-            for (j = 0; j < num_iters; j++) {
-                if (num_iters > 1) {
-                    printf("%d. Running %s...\n", j + 1, tracefiles[i]);
-                } else {
-                    printf("Running %s...\n", tracefiles[i]);
-                }
-                /* Run the trace interpreter on trace i */
-                correct[i] = runtrace(tracefiles[i]);
+        if (num_jobs > 1) {
+            run_parallel(tracefiles, num_graded_tracefiles, correct);
+
+            /*
+             * Traces are timing sensitive, and one sharing the CPUs with
+             * others may fail only because it was slowed down, so rerun
+             * each failed trace on its own before scoring it
+             */
+            for (i = 0; i < num_graded_tracefiles; i++) {
                 if (!correct[i]) {
-                    break;
+                    printf("Rerunning %s serially...\n", tracefiles[i]);
+                    correct[i] = runtrace_iters(tracefiles[i]);
+                    fflush(stdout);
                 }
             }
-
+        } else {
+            for (i = 0; i < num_graded_tracefiles; i++) {
+                correct[i] = runtrace_iters(tracefiles[i]);
+                fflush(stdout);
+            }
+        }
+        for (i = 0; i < num_graded_tracefiles; i++) {
             if (correct[i]) {
                 num_correct += num_iters;
             }
-
-            fflush(stdout);
         }
 
         printf("Score: %d/%d\n", num_correct,
@@ -282,6 +316,231 @@ int main(int argc, char **argv) {
     exit(0);
 }
 
+/*
+ * runtrace_iters - Run trace file num_iters times, stopping at the first
+ *                  failure. Return 1 if every iteration was correct
+ */
+int runtrace_iters(const char *tracefile) {
+    int j;
+
+    if (num_iters > 1) {
+        printf("Running %d iters of %s\n", num_iters, tracefile);
+    }
+    for (j = 0; j < num_iters; j++) {
+        if (num_iters > 1) {
+            printf("%d. Running %s...\n", j + 1, tracefile);
+        } else {
+            printf("Running %s...\n", tracefile);
+        }
+        /* Run the trace interpreter on the trace */
+        if (!runtrace(tracefile)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * run_parallel - Run the trace files with up to num_jobs of them at once,
+ *                setting correct[i] for each trace i. The output of each
+ *                trace is printed, in order, as soon as it and every trace
+ *                before it have finished
+ */
+void run_parallel(const char **tracefiles, int num_traces, int *correct) {
+    pid_t pids[MAXTRACES];
+    char dirs[MAXTRACES][MAXBUF];
+    int done[MAXTRACES];
+    int started = 0, running = 0, printed = 0;
+    char buf[MAXBUF];
+    struct sigaction action, old_int, old_term;
+    int status;
+    pid_t pid;
+    int i, ret;
+
+    /*
+     * Interrupt waitpid on SIGINT and SIGTERM, to stop the traces cleanly,
+     * unless the signals were ignored
+     */
+    action.sa_handler = interrupt_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+    if (old_int.sa_handler == SIG_IGN) {
+        sigaction(SIGINT, &old_int, NULL);
+    }
+    if (old_term.sa_handler == SIG_IGN) {
+        sigaction(SIGTERM, &old_term, NULL);
+    }
+
+    while (printed < num_traces && !interrupted) {
+        /* Start traces while there are free jobs */
+        if (started < num_traces && running < num_jobs) {
+            ret = snprintf(dirs[started], sizeof(dirs[started]),
+                           "/tmp/sdriver.%d.%d.XXXXXX", (int)getpid(),
+                           started);
+            if ((size_t)ret >= sizeof(dirs[started]) ||
+                mkdtemp(dirs[started]) == NULL) {
+                perror("mkdtemp");
+                break;
+            }
+            fflush(stdout);
+            pids[started] = start_worker(tracefiles[started], dirs[started]);
+            if (pids[started] < 0) {
+                perror("fork");
+                break;
+            }
+            done[started] = 0;
+            started++;
+            running++;
+            continue;
+        }
+
+        /* Wait for a trace to finish */
+        if ((pid = waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            break;
+        }
+        for (i = 0; i < started; i++) {
+            if (pids[i] == pid) {
+                correct[i] = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                done[i] = 1;
+                running--;
+            }
+        }
+
+        /* Print the results of the traces finished in order */
+        while (printed < started && done[printed]) {
+            ret = snprintf(buf, sizeof(buf), "%s/%s", dirs[printed],
+                           WORKER_OUTFILE);
+            if ((size_t)ret < sizeof(buf)) {
+                emit_file(buf);
+            }
+            fflush(stdout);
+            printed++;
+        }
+    }
+
+    /* Stop the traces still running, if interrupted or on error */
+    for (i = 0; i < started; i++) {
+        if (!done[i]) {
+            kill(-pids[i], SIGINT);
+            while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR) {
+            }
+            correct[i] = 0;
+        }
+    }
+    for (i = started; i < num_traces; i++) {
+        correct[i] = 0;
+    }
+
+    /* Clean up the scratch directories */
+    for (i = 0; i < started; i++) {
+        ret = snprintf(buf, sizeof(buf), "rm -rf %s", dirs[i]);
+        if ((size_t)ret < sizeof(buf) && (ret = system(buf)) != 0) {
+            error_msg(buf, ret);
+        }
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    if (interrupted) {
+        delete_tmpfiles();
+        raise(interrupted);
+    }
+    if (printed < num_traces) {
+        delete_tmpfiles();
+        exit(1);
+    }
+}
+
+/*
+ * start_worker - Fork a process that runs a trace file in its own process
+ *                group, with dir as its working directory, and its output
+ *                going to WORKER_OUTFILE in dir. The process exits with
+ *                status 0 if the trace was correct. Return its PID
+ */
+pid_t start_worker(const char *tracefile, const char *dir) {
+    char labdir[PATH_MAX];
+    pid_t pid;
+    int fd, correct;
+
+    if (getcwd(labdir, sizeof(labdir)) == NULL) {
+        perror("getcwd");
+        return -1;
+    }
+    if ((pid = fork()) != 0) {
+        if (pid > 0) {
+            setpgid(pid, pid);
+        }
+        return pid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    setpgid(0, 0);
+
+    if (chdir(dir) < 0) {
+        perror("chdir");
+        _exit(1);
+    }
+    if ((fd = open(WORKER_OUTFILE, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        perror("open");
+        _exit(1);
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    link_lab_files(labdir);
+    make_tmpfiles(dir);
+    correct = runtrace_iters(tracefile);
+    fflush(stdout);
+    delete_tmpfiles();
+    exit(correct ? 0 : 1);
+}
+
+/*
+ * link_lab_files - Link every file of the lab directory into the working
+ *                  directory, apart from the temporary directory of
+ *                  runtrace, so that the relative paths of the shells,
+ *                  programs and traces still work
+ */
+void link_lab_files(const char *labdir) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int ret;
+
+    if ((dir = opendir(labdir)) == NULL) {
+        perror("opendir");
+        exit(1);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, RUNTRACE_TMP_FOLDER) == 0) {
+            continue;
+        }
+        ret = snprintf(path, sizeof(path), "%s/%s", labdir, entry->d_name);
+        if ((size_t)ret >= sizeof(path) || symlink(path, entry->d_name) < 0) {
+            perror("symlink");
+            exit(1);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * interrupt_handler - Note that the driver was asked to stop
+ */
+void interrupt_handler(int sig) {
+    interrupted = sig;
+}
+
 /*
  * runtrace - Run trace file on test and reference shells
  *            Return 0 if results are different, 1 if identical
@@ -504,6 +763,27 @@ void emit_file(char *filename) {
     fclose(fp);
 }
 
+/*
+ * make_tmpfiles - Generate some (truly) unique filenames in dir, from the
+ *                 current time stamp and PID
+ */
+void make_tmpfiles(const char *dir) {
+    int current_time = (int)time(NULL);
+    int pid = (int)getpid();
+
+    snprintf(test_raw_outfile, sizeof(test_raw_outfile),
+             "%s/test_raw_outfile.%d.%d", dir, current_time, pid);
+    snprintf(ref_raw_outfile, sizeof(ref_raw_outfile),
+             "%s/ref_raw_outfile.%d.%d", dir, current_time, pid);
+
+    snprintf(test_filtered_outfile, sizeof(test_filtered_outfile),
+             "%s/test_filtered_outfile.%d.%d", dir, current_time, pid);
+    snprintf(ref_filtered_outfile, sizeof(ref_filtered_outfile),
+             "%s/ref_filtered_outfile.%d.%d", dir, current_time, pid);
+    snprintf(diff_filtered_outfile, sizeof(diff_filtered_outfile),
+             "%s/diff_filtered_outfile.%d.%d", dir, current_time, pid);
+}
+
 /*
  * delete_tmpfiles - Clean up the temp files we created during testing
  */
@@ -528,12 +808,15 @@ void delete_tmpfiles(void) {
  * usage - Explain the command line arguments
  */
 void usage(void) {
-    printf("Usage: sdriver [-hV] [-s <shell> -t <tracenum> -i <iters>]\n");
+    printf("Usage: sdriver [-hV] [-s <shell> -t <tracenum> -i <iters> "
+           "-j <jobs>]\n");
     printf("Options\n");
     printf("\t-h           Print this message.\n");
     printf("\t-i <iters>   Run each trace <iters> times "
            "(default %d when running multiple traces, 1 otherwise)\n",
            num_iters);
+    printf("\t-j <jobs>    Run up to <jobs> traces at once "
+           "(default one per online CPU)\n");
     printf("\t-s <shell>   Name of test shell (default ./tsh)\n");
     printf("\t-t <n>       Run trace <n> only (default all)\n");
     printf("\t-V           Be more verbose.\n");
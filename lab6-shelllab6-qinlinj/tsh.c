@@ -7,6 +7,17 @@
  * multiple jobs, and perform basic input/output redirection. The shell supports
  * built-in commands like "jobs," "bg," and "fg" for controlling jobs.
  *
+ * A job is a single command or a pipeline of commands joined by "|", whose
+ * processes share one process group. Commands are launched with posix_spawn
+ * rather than fork, so the shell's memory is not copied for each of them.
+ *
+ * By default, the shell reaps children and forwards signals in signal
+ * handlers. With -e, it instead keeps those signals blocked and reads them
+ * from a signalfd in an event loop, handling them in normal context.
+ *
+ * Command names without a slash are searched for in PATH, and the paths
+ * found are cached, as by the "hash" built-in command.
+ *
  * The shell provides a command-line interface where users can enter commands
  * to be executed. It parses user input, handles job execution, and manages
  * the execution of foreground and background jobs. It also handles signals
@@ -27,10 +38,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -51,6 +68,28 @@
 #define dbg_ensures(...)
 #endif
 
+/* Search path used if PATH is not set, as by execvp */
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/* Entry of the command path cache */
+struct command_path {
+    char *name;    // Command name, or NULL if the entry is empty
+    char *path;    // Path the command was found at, or NULL
+    unsigned hits; // Number of times the path has been used
+};
+
+/* Global variables */
+static int signalFd = -1; // signalfd read by the event loop, or -1 if the
+                          // shell uses signal handlers
+static sigset_t commandMask; // Signal mask that commands are launched with
+static volatile sig_atomic_t batchRunning = false; // parallel is running
+static volatile sig_atomic_t batchInterrupted = false; // SIGINT stopped it
+
+static struct command_path *pathCache = NULL; // The command path cache
+static size_t pathCacheSize = 0;     // Number of entries, 0 or a power of 2
+static size_t pathCacheCount = 0;    // Number of entries used
+static char *pathCacheSource = NULL; // PATH that the paths were found in
+
 /* Function prototypes */
 void eval(const char *cmdline);
 
@@ -60,24 +99,48 @@ void sigint_handler(int sig);
 void sigquit_handler(int sig);
 void cleanup(void);
 
+void reap_children(void);
+void forward_to_foreground(int sig);
+void init_event_loop(void);
+void handle_signal_events(void);
+bool read_command_line(char *cmdline);
+void wait_for_signals(sigset_t *previousMask);
+void wait_for_foreground(sigset_t *previousMask);
+
 void init_signal_sets(sigset_t *mask_all, sigset_t *mask_three);
 void handle_builtin_jobs(const struct cmdline_tokens token,
                          sigset_t *mask_three);
 void handle_builtin_bg_fg(const struct cmdline_tokens token, sigset_t *mask_all,
                           sigset_t *mask_three, parseline_return parse_result);
+void handle_builtin_parallel(const struct cmdline_tokens token,
+                             sigset_t *mask_three);
+jid_t start_batch_job(FILE *commands);
+void handle_builtin_time(const char *cmdline, sigset_t *mask_three);
+void print_time(const struct job_usage *usage);
 void handle_builtin_none(const struct cmdline_tokens token,
                          parseline_return parse_result, const char *cmdline,
                          sigset_t *mask_all, sigset_t *mask_three);
-void redirect_io(const char *filename, int filedes);
 pid_t parse_argument(const struct cmdline_tokens tokens,
                      sigset_t *previousMask);
 void handle_job(pid_t processId, const struct cmdline_tokens tokens,
                 sigset_t *previousMask);
 void print_job(jid_t jobId, pid_t processId);
-void execute_command(const struct cmdline_tokens tokens,
-                     sigset_t *previousMask);
-void handle_parent_process(pid_t processId, parseline_return parseResult,
-                           const char *cmdLine, sigset_t *previousMask);
+int spawn_pipeline(const struct cmdline_tokens *tokens, sigset_t *previousMask,
+                   pid_t *processIds);
+pid_t spawn_command(char **argv, int inputFd, int outputFd, pid_t groupId,
+                    sigset_t *previousMask);
+jid_t add_pipeline_job(const pid_t *processIds, int processCount,
+                       job_state state, const char *cmdLine);
+void handle_parent_process(const pid_t *processIds, int processCount,
+                           parseline_return parseResult, const char *cmdLine,
+                           sigset_t *previousMask);
+
+size_t hash_command(const char *name);
+struct command_path *find_command_path(const char *name, bool add);
+void clear_command_paths(void);
+char *search_path(const char *name, const char *searchPath);
+const char *resolve_command(const char *name, bool refresh);
+void handle_builtin_hash(const struct cmdline_tokens token);
 
 /**
  * @brief Main function of the shell.
@@ -103,7 +166,8 @@ int main(int argc, char **argv) {
     }
 
     // Parse the command line
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    bool event_loop = false; // Use the signalfd event loop
+    while ((c = getopt(argc, argv, "hvpe")) != EOF) {
         switch (c) {
         case 'h': // Prints help message
             usage();
@@ -114,6 +178,9 @@ int main(int argc, char **argv) {
         case 'p': // Disables prompt printing
             emit_prompt = false;
             break;
+        case 'e': // Handles signals in an event loop
+            event_loop = true;
+            break;
         default:
             usage();
         }
@@ -144,6 +211,9 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    // Commands run with the signal mask the shell starts with
+    sigprocmask(SIG_SETMASK, NULL, &commandMask);
+
     // Install the signal handlers
     Signal(SIGINT, sigint_handler);   // Handles Ctrl-C
     Signal(SIGTSTP, sigtstp_handler); // Handles Ctrl-Z
@@ -154,6 +224,10 @@ int main(int argc, char **argv) {
 
     Signal(SIGQUIT, sigquit_handler);
 
+    if (event_loop) {
+        init_event_loop();
+    }
+
     // Execute the shell's read/eval loop
     while (true) {
         if (emit_prompt) {
@@ -163,12 +237,19 @@ int main(int argc, char **argv) {
             fflush(stdout);
         }
 
-        if ((fgets(cmdline, MAXLINE_TSH, stdin) == NULL) && ferror(stdin)) {
+        if (signalFd >= 0) {
+            if (!read_command_line(cmdline)) {
+                // End of file (Ctrl-D)
+                printf("\n");
+                return 0;
+            }
+        } else if ((fgets(cmdline, MAXLINE_TSH, stdin) == NULL) &&
+                   ferror(stdin)) {
             perror("fgets error");
             exit(1);
         }
 
-        if (feof(stdin)) {
+        if (signalFd < 0 && feof(stdin)) {
             // End of file (Ctrl-D)
             printf("\n");
             return 0;
@@ -211,6 +292,13 @@ void eval(const char *cmdLine) {
         return;
     }
 
+    // Built-in commands run in the shell itself, so cannot be piped
+    if (tokens.builtin != BUILTIN_NONE && tokens.nstages > 1) {
+        printf("%s: built-in command cannot be used in a pipeline\n",
+               tokens.argv[0]);
+        return;
+    }
+
     // Handling built-in commands
     switch (tokens.builtin) {
     case BUILTIN_QUIT:
@@ -223,6 +311,15 @@ void eval(const char *cmdLine) {
     case BUILTIN_FG:
         handle_builtin_bg_fg(tokens, &maskAll, &maskSelected, parseResult);
         break;
+    case BUILTIN_PARALLEL:
+        handle_builtin_parallel(tokens, &maskSelected);
+        break;
+    case BUILTIN_HASH:
+        handle_builtin_hash(tokens);
+        break;
+    case BUILTIN_TIME:
+        handle_builtin_time(cmdLine, &maskSelected);
+        break;
     case BUILTIN_NONE:
         handle_builtin_none(tokens, parseResult, cmdLine, &maskAll,
                             &maskSelected);
@@ -240,17 +337,14 @@ void eval(const char *cmdLine) {
  * @brief Handles the SIGCHLD signal.
  *
  * This function is called when a child process stops, terminates due to a
- * signal, or exits normally. It reaps child processes using waitpid, updates
- * job states, and deletes jobs from the job list as appropriate. It also logs
- * which signal caused the child process to change state.
+ * signal, or exits normally. It reaps child processes using wait4, updates
+ * job states, and deletes jobs from the job list once their last process has
+ * ended. It also logs which signal caused the job to change state.
  *
  * @param sig The signal number that caused the handler to be invoked.
  */
 void sigchld_handler(int sig) {
     int savedErrno = errno; // Preserve original errno value
-    int childStatus;
-    pid_t childPid;
-    jid_t jobID;
 
     // Block all signals
     sigset_t allSignalsMask, previousSignalMask;
@@ -258,24 +352,7 @@ void sigchld_handler(int sig) {
     sigprocmask(SIG_BLOCK, &allSignalsMask,
                 &previousSignalMask); // Block all signals
 
-    while ((childPid = waitpid(-1, &childStatus, WNOHANG | WUNTRACED)) > 0) {
-        jobID = job_from_pid(childPid);
-
-        if (WIFSTOPPED(childStatus)) {
-            // Child process was stopped
-            job_set_state(jobID, ST);
-            sio_printf("Job [%d] (%d) stopped by signal %d\n", jobID, childPid,
-                       WSTOPSIG(childStatus));
-        } else if (WIFSIGNALED(childStatus)) {
-            // Child process was terminated by a signal
-            sio_printf("Job [%d] (%d) terminated by signal %d\n", jobID,
-                       childPid, WTERMSIG(childStatus));
-            delete_job(jobID);
-        } else if (WIFEXITED(childStatus)) {
-            // Child process exited normally
-            delete_job(jobID);
-        }
-    }
+    reap_children();
 
     sigprocmask(SIG_SETMASK, &previousSignalMask,
                 NULL);  // Restore previous signal mask
@@ -295,19 +372,11 @@ void sigchld_handler(int sig) {
 void sigint_handler(int sig) {
     int savedErrno = errno; // Preserve original errno value
     sigset_t allSignalsMask, previousMask;
-    pid_t foregroundPid;
-    jid_t foregroundJobId;
 
     sigfillset(&allSignalsMask);
     sigprocmask(SIG_BLOCK, &allSignalsMask, &previousMask); // Block all signals
 
-    foregroundJobId = fg_job(); // Get the foreground job ID
-    if (foregroundJobId > 0) {
-        foregroundPid =
-            job_get_pid(foregroundJobId); // Get the PID of the foreground job
-        kill(-foregroundPid, sig); // Forward the received signal to the entire
-                                   // foreground process group
-    }
+    forward_to_foreground(sig);
 
     sigprocmask(SIG_SETMASK, &previousMask,
                 NULL);  // Restore previous signal mask
@@ -327,19 +396,11 @@ void sigint_handler(int sig) {
 void sigtstp_handler(int sig) {
     int savedErrno = errno; // Preserve original errno value
     sigset_t allSignalsMask, previousMask;
-    pid_t foregroundPid;
-    jid_t foregroundJobId;
 
     sigfillset(&allSignalsMask);
     sigprocmask(SIG_BLOCK, &allSignalsMask, &previousMask); // Block all signals
 
-    foregroundJobId = fg_job(); // Get the foreground job ID
-    if (foregroundJobId > 0) {
-        foregroundPid =
-            job_get_pid(foregroundJobId); // Get the PID of the foreground job
-        kill(-foregroundPid,
-             SIGTSTP); // Send SIGTSTP to the entire foreground process group
-    }
+    forward_to_foreground(SIGTSTP);
 
     sigprocmask(SIG_SETMASK, &previousMask,
                 NULL);  // Restore previous signal mask
@@ -359,6 +420,232 @@ void cleanup(void) {
     Signal(SIGCHLD, SIG_DFL); // Handles terminated or stopped child
 
     destroy_job_list();
+    clear_command_paths();
+}
+
+/**
+ * @brief Reaps every child process that has stopped or ended.
+ *
+ * This updates job states, and deletes jobs from the job list once their
+ * last process has ended, keeping the resources each process used. It also
+ * logs which signal caused the job to change state. It is called from the
+ * SIGCHLD handler, or from the event loop.
+ *
+ * Signals that modify the job list must be blocked.
+ */
+void reap_children(void) {
+    int childStatus;
+    struct rusage childUsage;
+    struct job_usage jobUsage;
+    pid_t childPid;
+    jid_t jobID;
+
+    while ((childPid = wait4(-1, &childStatus, WNOHANG | WUNTRACED,
+                             &childUsage)) > 0) {
+        jobID = job_from_pid(childPid);
+        if (jobID == 0) {
+            continue; // Not a process of any job
+        }
+
+        if (WIFSTOPPED(childStatus)) {
+            // Child process was stopped; a pipeline is reported once
+            if (job_get_state(jobID) != ST) {
+                job_set_state(jobID, ST);
+                sio_printf("Job [%d] (%d) stopped by signal %d\n", jobID,
+                           childPid, WSTOPSIG(childStatus));
+            }
+        } else if (job_end_process(childPid, childStatus, &childUsage) == 0) {
+            // The last process of the job ended; the job ends the way the
+            // last stage of its pipeline did, whichever was reaped last
+            job_get_usage(jobID, &jobUsage);
+            if (WIFSIGNALED(jobUsage.status)) {
+                // Child process was terminated by a signal
+                sio_printf("Job [%d] (%d) terminated by signal %d\n", jobID,
+                           job_get_last_pid(jobID), WTERMSIG(jobUsage.status));
+            }
+            delete_job(jobID);
+        }
+    }
+}
+
+/**
+ * @brief Forwards a signal to the process group of the foreground job, if
+ * there is one. Otherwise, SIGINT stops a running parallel command.
+ *
+ * Signals that modify the job list must be blocked.
+ *
+ * @param sig The signal to forward.
+ */
+void forward_to_foreground(int sig) {
+    pid_t foregroundPid;
+    jid_t foregroundJobId;
+
+    foregroundJobId = fg_job(); // Get the foreground job ID
+    if (foregroundJobId > 0) {
+        foregroundPid =
+            job_get_pid(foregroundJobId); // Get the PID of the foreground job
+        kill(-foregroundPid, sig); // Forward the received signal to the entire
+                                   // foreground process group
+    } else if (sig == SIGINT && batchRunning) {
+        batchInterrupted = true; // Stop the running parallel command
+    }
+}
+
+/*****************
+ * Event loop
+ *****************/
+
+/**
+ * @brief Switches the shell to the signalfd event loop.
+ *
+ * SIGCHLD, SIGINT and SIGTSTP stay blocked from now on, so their handlers
+ * never run, and the job list is always safe to access. Instead, the signals
+ * are read from a signalfd whenever the shell waits, for a command line or
+ * for the foreground job, and handled in normal context. Commands are still
+ * launched with none of them blocked.
+ */
+void init_event_loop(void) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd < 0) {
+        perror("signalfd error");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Handles the signals that are pending on the signalfd.
+ *
+ * SIGINT and SIGTSTP are forwarded to the foreground job in the order they
+ * were read. However many children changed state since the last call, they
+ * are then reaped in one batch.
+ */
+void handle_signal_events(void) {
+    struct signalfd_siginfo events[8];
+    ssize_t size;
+    bool childEvent = false;
+
+    while ((size = read(signalFd, events, sizeof(events))) > 0) {
+        size_t count = (size_t)size / sizeof(events[0]);
+        for (size_t i = 0; i < count; i++) {
+            if (events[i].ssi_signo == SIGCHLD) {
+                childEvent = true;
+            } else {
+                forward_to_foreground((int)events[i].ssi_signo);
+            }
+        }
+    }
+
+    if (childEvent) {
+        reap_children();
+    }
+}
+
+/**
+ * @brief Reads a command line in the event loop.
+ *
+ * This waits on standard input and the signalfd at once, and handles
+ * signals while no command line is complete, so that background jobs are
+ * reaped and reported as they end. Input is read into the shell's own
+ * buffer, since poll cannot see lines that stdio has buffered.
+ *
+ * Lines longer than `MAXLINE_TSH - 1` characters are split, as by fgets.
+ *
+ * @param cmdline Buffer of `MAXLINE_TSH` characters, which receives the
+ * command line without its newline.
+ * @return false at the end of the input.
+ */
+bool read_command_line(char *cmdline) {
+    static char buffer[MAXLINE_TSH]; // Input not yet returned
+    static size_t length = 0;        // Number of characters in buffer
+
+    while (true) {
+        char *newline = memchr(buffer, '\n', length);
+        if (newline != NULL || length == MAXLINE_TSH - 1) {
+            size_t lineLength =
+                newline != NULL ? (size_t)(newline - buffer) : length;
+            size_t used = newline != NULL ? lineLength + 1 : lineLength;
+            memcpy(cmdline, buffer, lineLength);
+            cmdline[lineLength] = '\0';
+            memmove(buffer, buffer + used, length - used);
+            length -= used;
+            return true;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = signalFd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            exit(1);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            handle_signal_events();
+        }
+        if (fds[0].revents != 0) {
+            ssize_t size =
+                read(STDIN_FILENO, buffer + length, MAXLINE_TSH - 1 - length);
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("read error");
+                exit(1);
+            }
+            if (size == 0) {
+                return false;
+            }
+            length += (size_t)size;
+        }
+    }
+}
+
+/**
+ * @brief Waits for signals that may change the job list, and handles them.
+ *
+ * With signal handlers, this suspends the shell until a signal is handled.
+ * In the event loop, it waits on the signalfd, and handles the signals
+ * itself.
+ *
+ * @param previousMask A pointer to the signal mask to suspend with, in
+ * which the signals that modify the job list are not blocked.
+ */
+void wait_for_signals(sigset_t *previousMask) {
+    if (signalFd < 0) {
+        sigsuspend(previousMask);
+        return;
+    }
+
+    struct pollfd fd = {.fd = signalFd, .events = POLLIN};
+    if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+        perror("poll error");
+        exit(1);
+    }
+    handle_signal_events();
+}
+
+/**
+ * @brief Waits until there is no foreground job.
+ *
+ * @param previousMask A pointer to the signal mask to suspend with, in
+ * which the signals that modify the job list are not blocked.
+ */
+void wait_for_foreground(sigset_t *previousMask) {
+    while (fg_job()) {
+        wait_for_signals(previousMask);
+    }
 }
 
 /*****************
@@ -387,8 +674,9 @@ void init_signal_sets(sigset_t *maskAll, sigset_t *maskSelected) {
 /**
  * Handles the built-in 'jobs' command of the shell.
  *
- * Lists all the jobs currently managed by the shell. If an output file is
- * specified, the job list is redirected to the file.
+ * Lists all the jobs currently managed by the shell. With -v, it also lists
+ * the jobs that finished last, and the resources used by each job. If an
+ * output file is specified, the job list is redirected to the file.
  *
  * @param tokens Struct containing parsed command line tokens.
  * @param maskSelected A pointer to the signal set used for blocking specific
@@ -398,13 +686,18 @@ void handle_builtin_jobs(const struct cmdline_tokens tokens,
                          sigset_t *maskSelected) {
     int fileDescriptor;
     sigset_t previousMask;
+    bool (*list)(int) = list_jobs;
+
+    if (tokens.argc > 1 && strcmp(tokens.argv[1], "-v") == 0) {
+        list = list_jobs_usage;
+    }
 
     // Block specific signals during the execution of this command
     sigprocmask(SIG_BLOCK, maskSelected, &previousMask);
 
     if (tokens.outfile == NULL) {
         // If no output file specified, list jobs to standard output
-        list_jobs(STDOUT_FILENO);
+        list(STDOUT_FILENO);
     } else {
         // Open the specified output file with appropriate permissions
         fileDescriptor =
@@ -415,7 +708,7 @@ void handle_builtin_jobs(const struct cmdline_tokens tokens,
             return;
         }
         // Redirect job listing to the file
-        list_jobs(fileDescriptor);
+        list(fileDescriptor);
         close(fileDescriptor); // Close the file after writing
     }
 
@@ -524,9 +817,7 @@ void handle_job(pid_t processId, const struct cmdline_tokens tokens,
 
     if (newState == FG) {
         // If it's a foreground job, wait for it to complete
-        while (fg_job()) {
-            sigsuspend(previousMask);
-        }
+        wait_for_foreground(previousMask);
     } else {
         // If it's a background job, print job information
         print_job(jobId, processId);
@@ -543,11 +834,230 @@ void print_job(jid_t jobId, pid_t processId) {
     printf("[%d] (%d) %s\n", jobId, processId, job_get_cmdline(jobId));
 }
 
+/**
+ * Handles the built-in 'parallel' command of the shell.
+ *
+ * Runs each command line of the input file as a background job, keeping up
+ * to N of them running at once, where N is given with -j, or is the number
+ * of online processors by default. A new job starts as soon as a job of the
+ * batch is reaped, and the command returns once all of them have ended.
+ * Empty lines, and lines that cannot be parsed or are built-in commands, are
+ * skipped.
+ *
+ * SIGINT stops the batch: no more commands start, and the running jobs of
+ * the batch are sent SIGINT.
+ *
+ * @param tokens Struct containing parsed command line tokens.
+ * @param maskSelected A pointer to the signal set used for blocking specific
+ * signals during execution.
+ */
+void handle_builtin_parallel(const struct cmdline_tokens tokens,
+                             sigset_t *maskSelected) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE *commands;
+    jid_t *slots; // Job ID of the job running in each slot, or 0
+    sigset_t previousMask;
+    bool more = true; // Whether commands may be left in the file
+
+    if (tokens.argc == 3 && strcmp(tokens.argv[1], "-j") == 0) {
+        char *end;
+        limit = strtol(tokens.argv[2], &end, 10);
+        if (*end != '\0' || limit < 1 || limit > MAXPARALLEL) {
+            printf("parallel: -j argument must be between 1 and %d\n",
+                   MAXPARALLEL);
+            return;
+        }
+    } else if (tokens.argc != 1) {
+        printf("usage: parallel [-j N] < file\n");
+        return;
+    }
+    if (tokens.infile == NULL || tokens.outfile != NULL) {
+        printf("usage: parallel [-j N] < file\n");
+        return;
+    }
+    if (limit < 1) {
+        limit = 1;
+    } else if (limit > MAXPARALLEL) {
+        limit = MAXPARALLEL;
+    }
+
+    commands = fopen(tokens.infile, "r");
+    if (commands == NULL) {
+        perror(tokens.infile);
+        return;
+    }
+    slots = calloc((size_t)limit, sizeof(jid_t));
+    if (slots == NULL) {
+        perror("calloc error");
+        fclose(commands);
+        return;
+    }
+
+    // Block specific signals, except while waiting for jobs to end
+    sigprocmask(SIG_BLOCK, maskSelected, &previousMask);
+    batchInterrupted = false;
+    batchRunning = true;
+
+    while (true) {
+        long running = 0;
+
+        // Free the slots of the jobs that have been reaped. Only this loop
+        // adds jobs, so a job ID cannot be reused before its slot is freed.
+        for (long i = 0; i < limit; i++) {
+            if (slots[i] != 0 && !job_exists(slots[i])) {
+                slots[i] = 0;
+            }
+        }
+
+        if (batchInterrupted) {
+            batchInterrupted = false;
+            more = false;
+            for (long i = 0; i < limit; i++) {
+                if (slots[i] != 0) {
+                    kill(-job_get_pid(slots[i]), SIGINT);
+                }
+            }
+        }
+
+        for (long i = 0; i < limit; i++) {
+            if (slots[i] == 0 && more) {
+                slots[i] = start_batch_job(commands);
+                more = slots[i] != 0;
+            }
+            if (slots[i] != 0) {
+                running++;
+            }
+        }
+
+        if (running == 0) {
+            break;
+        }
+        wait_for_signals(&previousMask);
+    }
+
+    batchRunning = false;
+    sigprocmask(SIG_SETMASK, &previousMask, NULL);
+    free(slots);
+    fclose(commands);
+}
+
+/**
+ * Starts the next command line of a parallel batch as a background job.
+ *
+ * Signals that modify the job list must be blocked.
+ *
+ * @param commands The file of command lines.
+ * @return The job ID of the new job, or 0 if no command lines are left.
+ */
+jid_t start_batch_job(FILE *commands) {
+    char cmdLine[MAXLINE_TSH];
+    struct cmdline_tokens tokens;
+    pid_t processIds[MAXSTAGES];
+    int processCount;
+
+    while (fgets(cmdLine, MAXLINE_TSH, commands) != NULL) {
+        char *newline = strchr(cmdLine, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        parseline_return parseResult = parseline(cmdLine, &tokens);
+        if (parseResult == PARSELINE_ERROR || parseResult == PARSELINE_EMPTY) {
+            continue;
+        }
+        if (tokens.builtin != BUILTIN_NONE) {
+            printf("%s: built-in command cannot be run by parallel\n",
+                   tokens.argv[0]);
+            continue;
+        }
+
+        processCount = spawn_pipeline(&tokens, &commandMask, processIds);
+        if (processCount > 0) {
+            jid_t jobId = add_pipeline_job(processIds, processCount, BG,
+                                           cmdLine);
+            if (jobId != 0) {
+                return jobId;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Handles the built-in 'time' command of the shell.
+ *
+ * Runs the rest of the command line as a foreground job, and once it has
+ * ended, prints the wall-clock time it took and the resources its processes
+ * used. Nothing is printed if the job is stopped instead.
+ *
+ * @param cmdLine The original command line string, starting with "time".
+ * @param maskSelected A pointer to the signal set used for blocking specific
+ * signals during execution.
+ */
+void handle_builtin_time(const char *cmdLine, sigset_t *maskSelected) {
+    struct cmdline_tokens tokens;
+    parseline_return parseResult;
+    pid_t processIds[MAXSTAGES];
+    int processCount;
+    sigset_t previousMask;
+
+    // Skip the "time" argument
+    const char *timedLine = cmdLine + strspn(cmdLine, " \t");
+    timedLine += strcspn(timedLine, " \t");
+
+    parseResult = parseline(timedLine, &tokens);
+    if (parseResult == PARSELINE_ERROR) {
+        return;
+    }
+    if (parseResult == PARSELINE_EMPTY) {
+        printf("usage: time command [arguments...]\n");
+        return;
+    }
+    if (parseResult == PARSELINE_BG) {
+        printf("time: cannot time a background job\n");
+        return;
+    }
+    if (tokens.builtin != BUILTIN_NONE) {
+        printf("%s: built-in command cannot be timed\n", tokens.argv[0]);
+        return;
+    }
+
+    // Block specific signals during the execution
+    sigprocmask(SIG_BLOCK, maskSelected, &previousMask);
+
+    processCount = spawn_pipeline(&tokens, &commandMask, processIds);
+    if (processCount > 0) {
+        jid_t jobId = add_pipeline_job(processIds, processCount, FG, cmdLine);
+        struct job_usage usage;
+
+        wait_for_foreground(&previousMask);
+        if (jobId != 0 && !job_exists(jobId) && job_get_usage(jobId, &usage)) {
+            print_time(&usage);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &previousMask, NULL);
+}
+
+/**
+ * Prints the resources used by a job, as the 'time' command does.
+ *
+ * @param usage The resource usage of the job.
+ */
+void print_time(const struct job_usage *usage) {
+    printf("real %ld.%03lds  user %ld.%03lds  sys %ld.%03lds  maxrss %ldKB  "
+           "ctxsw %ld/%ld\n",
+           (long)usage->wall.tv_sec, (long)usage->wall.tv_nsec / 1000000,
+           (long)usage->utime.tv_sec, (long)usage->utime.tv_usec / 1000,
+           (long)usage->stime.tv_sec, (long)usage->stime.tv_usec / 1000,
+           usage->maxrss, usage->nvcsw, usage->nivcsw);
+}
+
 /**
  * Handles commands that are not built-in to the shell.
  *
- * Executes external commands by forking a child process. Handles I/O
- * redirection if specified.
+ * Launches the commands of the command line as one job, with I/O redirection
+ * if specified.
  *
  * @param tokens Struct containing parsed command line tokens.
  * @param parseResult The result of the command line parsing, indicating whether
@@ -561,107 +1071,425 @@ void print_job(jid_t jobId, pid_t processId) {
 void handle_builtin_none(const struct cmdline_tokens tokens,
                          parseline_return parseResult, const char *cmdLine,
                          sigset_t *maskAll, sigset_t *maskSelected) {
-    pid_t processId;
+    pid_t processIds[MAXSTAGES];
+    int processCount;
     sigset_t previousMask;
 
     // Block specific signals during the execution
     sigprocmask(SIG_BLOCK, maskSelected, &previousMask);
 
-    // Fork a child process to execute the command
-    if ((processId = fork()) == 0) { // Child process
-        execute_command(tokens, &previousMask);
+    // Launch the commands, and add them to the job list as one job
+    processCount = spawn_pipeline(&tokens, &commandMask, processIds);
+    if (processCount > 0) {
+        handle_parent_process(processIds, processCount, parseResult, cmdLine,
+                              &previousMask);
     }
 
-    // Parent process
-    handle_parent_process(processId, parseResult, cmdLine, &previousMask);
-
     sigprocmask(SIG_SETMASK, &previousMask, NULL);
 }
 
 /**
- * @brief Executes a command in a child process.
+ * @brief Launches the commands of a pipeline.
+ *
+ * Each command reads from the previous one through a pipe, the first from
+ * the input file if one is given, and the last writes to the output file if
+ * one is given. The redirection files are opened before any command starts,
+ * and an error opening either is reported without starting any. A command
+ * that cannot be executed is reported and skipped, and the others still run.
  *
- * This function is responsible for executing an external command in a child
- * process. It handles I/O redirection, sets the child process in a new process
- * group, and executes the command. If the execution fails, it prints an
- * appropriate error message.
+ * The processes are put in one process group, led by the first of them.
  *
  * @param tokens Struct containing parsed command line tokens.
- * @param previousMask A pointer to the signal set used for unblocking signals
- * after fork.
+ * @param previousMask A pointer to the signal mask for the commands to run
+ * with.
+ * @param processIds Array of at least `MAXSTAGES` entries, which receives
+ * the process IDs of the commands started.
+ * @return The number of commands started.
  */
-void execute_command(const struct cmdline_tokens tokens,
-                     sigset_t *previousMask) {
-    setpgid(0, 0); // Put child in a new process group
-    sigprocmask(SIG_SETMASK, previousMask, NULL); // Unblock signals
+int spawn_pipeline(const struct cmdline_tokens *tokens, sigset_t *previousMask,
+                   pid_t *processIds) {
+    int processCount = 0;
+    int inputFd = -1;  // Input of the next command, or -1 for the shell's
+    int outputFd = -1; // Output file of the last command, or -1
+
+    // The descriptors are all close-on-exec, so that only the ones given to
+    // each command as its standard input and output stay open in it
+    if (tokens->infile != NULL) {
+        inputFd = open(tokens->infile, O_RDONLY | O_CLOEXEC);
+        if (inputFd < 0) {
+            perror(tokens->infile);
+            return 0;
+        }
+    }
+    if (tokens->outfile != NULL) {
+        outputFd = open(tokens->outfile,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if (outputFd < 0) {
+            perror(tokens->outfile);
+            if (inputFd >= 0) {
+                close(inputFd);
+            }
+            return 0;
+        }
+    }
 
-    // Handle I/O redirection
-    redirect_io(tokens.infile, STDIN_FILENO);
-    redirect_io(tokens.outfile, STDOUT_FILENO);
+    for (int i = 0; i < tokens->nstages; i++) {
+        int pipeFds[2] = {-1, -1};
+        int commandOutputFd = outputFd;
 
-    if (execve(tokens.argv[0], tokens.argv, environ) < 0) {
-        perror("execve error");
-        exit(1);
+        if (i < tokens->nstages - 1) {
+            if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+                perror("pipe error");
+                break;
+            }
+            commandOutputFd = pipeFds[1];
+        }
+
+        pid_t processId =
+            spawn_command(tokens->stages[i], inputFd, commandOutputFd,
+                          processCount > 0 ? processIds[0] : 0, previousMask);
+        if (processId > 0) {
+            processIds[processCount++] = processId;
+        }
+
+        // Only the commands keep the ends of the pipe they use
+        if (inputFd >= 0) {
+            close(inputFd);
+        }
+        if (pipeFds[1] >= 0) {
+            close(pipeFds[1]);
+        }
+        inputFd = pipeFds[0];
+    }
+
+    if (inputFd >= 0) {
+        close(inputFd);
+    }
+    if (outputFd >= 0) {
+        close(outputFd);
+    }
+    return processCount;
+}
+
+/**
+ * @brief Starts a command in a child process.
+ *
+ * The command is started with posix_spawn, which does not copy the shell's
+ * address space as fork does. The child has the given standard input and
+ * output, joins the given process group, and runs with the signal mask
+ * the shell had before blocking signals. Its path is resolved with
+ * resolve_command, so a cached path costs a single exec. If the command
+ * cannot be executed, an appropriate error message is printed.
+ *
+ * @param argv The arguments of the command, ending with a NULL pointer.
+ * @param inputFd Descriptor to use as standard input, or -1 for the shell's.
+ * @param outputFd Descriptor to use as standard output, or -1 for the
+ * shell's.
+ * @param groupId The process group to join, or 0 for a new one led by the
+ * child.
+ * @param previousMask A pointer to the signal mask for the command to run
+ * with.
+ * @return The process ID of the child, or 0 if the command was not started.
+ */
+pid_t spawn_command(char **argv, int inputFd, int outputFd, pid_t groupId,
+                    sigset_t *previousMask) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    pid_t processId;
+    int error;
+
+    const char *path = resolve_command(argv[0], false);
+    if (path == NULL) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return 0;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (inputFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, inputFd, STDIN_FILENO);
+    }
+    if (outputFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+    }
+
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes,
+                             POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attributes, groupId);
+    posix_spawnattr_setsigmask(&attributes, previousMask);
+
+    error = posix_spawn(&processId, path, &actions, &attributes, argv,
+                        environ);
+    if (error == ENOENT && path != argv[0]) {
+        // The cached path is gone, so search for the command again
+        path = resolve_command(argv[0], true);
+        if (path != NULL) {
+            error = posix_spawn(&processId, path, &actions, &attributes, argv,
+                                environ);
+        }
+    }
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(error));
+        return 0;
+    }
+    return processId;
+}
+
+/**
+ * @brief Adds a job with all of the processes launched for it.
+ *
+ * Signals that modify the job list must be blocked.
+ *
+ * @param processIds The process IDs of the processes, the first of which
+ * leads their process group.
+ * @param processCount The number of processes, at least 1.
+ * @param state The initial state of the job.
+ * @param cmdLine The command line of the job.
+ * @return The job ID of the job, or 0 if it could not be added.
+ */
+jid_t add_pipeline_job(const pid_t *processIds, int processCount,
+                       job_state state, const char *cmdLine) {
+    jid_t jobId = add_job(processIds[0], state, cmdLine);
+    for (int i = 1; jobId != 0 && i < processCount; i++) {
+        job_add_process(jobId, processIds[i]);
     }
+    return jobId;
 }
 
 /**
- * @brief Handles the parent process after forking a child.
+ * @brief Handles the parent process after launching the commands of a job.
  *
- * This function is called in the parent process after forking a child to
- * execute a command. Depending on whether the command is to be run in the
- * foreground or background, it adds the job to the job list and either waits
- * for the foreground job to finish or prints information about the background
- * job.
+ * Depending on whether the command is to be run in the foreground or
+ * background, it adds the job to the job list with all of its processes, and
+ * either waits for the foreground job to finish or prints information about
+ * the background job.
  *
- * @param processId The process ID of the child process.
+ * @param processIds The process IDs of the child processes, the first of
+ * which leads their process group.
+ * @param processCount The number of child processes, at least 1.
  * @param parseResult The result of the command line parsing, indicating
  * foreground or background.
  * @param cmdLine The original command line string.
  * @param previousMask A pointer to the signal set used for unblocking signals
- * after fork.
+ * after launching.
  */
-void handle_parent_process(pid_t processId, parseline_return parseResult,
-                           const char *cmdLine, sigset_t *previousMask) {
+void handle_parent_process(const pid_t *processIds, int processCount,
+                           parseline_return parseResult, const char *cmdLine,
+                           sigset_t *previousMask) {
+    jid_t jobId = add_pipeline_job(processIds, processCount,
+                                   parseResult == PARSELINE_FG ? FG : BG,
+                                   cmdLine);
+
     if (parseResult == PARSELINE_FG) {
-        // Add foreground job
-        add_job(processId, FG, cmdLine);
         // Wait for the foreground job to finish
-        while (fg_job()) {
-            sigsuspend(previousMask);
-        }
+        wait_for_foreground(previousMask);
     } else {
-        // Add background job
-        add_job(processId, BG, cmdLine);
-        jid_t jobId = job_from_pid(processId);
-        printf("[%d] (%d) %s\n", jobId, processId, cmdLine);
+        printf("[%d] (%d) %s\n", jobId, processIds[0], cmdLine);
     }
     sigprocmask(SIG_SETMASK, previousMask, NULL);
 }
 
+/*****************
+ * Command path cache
+ *****************/
+
+/**
+ * @brief Hashes a command name for the command path cache (FNV-1a).
+ *
+ * @param name The command name.
+ * @return The hash of the name.
+ */
+size_t hash_command(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
 /**
- * Handles redirection of input/output for a command.
+ * @brief Finds the entry of the command path cache for a command name.
  *
- * Redirects the standard input or output of a process to/from a file.
+ * The cache is open-addressed with linear probing, and grows to keep it at
+ * most half full.
  *
- * @param fileName The name of the file to redirect input/output to/from. If
- * NULL, no redirection is performed.
- * @param fileDescriptor The file descriptor to be redirected (STDIN_FILENO or
- * STDOUT_FILENO).
+ * @param name The command name.
+ * @param add Whether to add an entry, with no path yet, if there is none.
+ * @return The entry, or NULL if there is none and none could be added.
  */
-void redirect_io(const char *fileName, int fileDescriptor) {
-    if (fileName != NULL) {
-        int fd;
-        if (fileDescriptor == STDIN_FILENO) {
-            fd = open(fileName, O_RDONLY);
-        } else {
-            fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+struct command_path *find_command_path(const char *name, bool add) {
+    if (add && 2 * (pathCacheCount + 1) > pathCacheSize) {
+        size_t size = pathCacheSize != 0 ? 2 * pathCacheSize : 64;
+        struct command_path *cache = calloc(size, sizeof(*cache));
+        if (cache == NULL) {
+            return NULL;
         }
-        if (fd < 0) {
-            perror(fileName);
-            exit(1);
+        for (size_t i = 0; i < pathCacheSize; i++) {
+            if (pathCache[i].name != NULL) {
+                size_t j = hash_command(pathCache[i].name) & (size - 1);
+                while (cache[j].name != NULL) {
+                    j = (j + 1) & (size - 1);
+                }
+                cache[j] = pathCache[i];
+            }
+        }
+        free(pathCache);
+        pathCache = cache;
+        pathCacheSize = size;
+    }
+    if (pathCacheSize == 0) {
+        return NULL;
+    }
+
+    size_t i = hash_command(name) & (pathCacheSize - 1);
+    while (pathCache[i].name != NULL) {
+        if (strcmp(pathCache[i].name, name) == 0) {
+            return &pathCache[i];
+        }
+        i = (i + 1) & (pathCacheSize - 1);
+    }
+    if (!add || (pathCache[i].name = strdup(name)) == NULL) {
+        return NULL;
+    }
+    pathCacheCount++;
+    return &pathCache[i];
+}
+
+/**
+ * @brief Empties the command path cache.
+ */
+void clear_command_paths(void) {
+    for (size_t i = 0; i < pathCacheSize; i++) {
+        free(pathCache[i].name);
+        free(pathCache[i].path);
+    }
+    free(pathCache);
+    free(pathCacheSource);
+    pathCache = NULL;
+    pathCacheSize = 0;
+    pathCacheCount = 0;
+    pathCacheSource = NULL;
+}
+
+/**
+ * @brief Searches the directories of a search path for a command.
+ *
+ * An empty directory in the search path stands for the current directory.
+ *
+ * @param name The command name.
+ * @param searchPath The search path, as directories separated by colons.
+ * @return The path of the first executable regular file named `name`, which
+ * the caller must free, or NULL if there is none.
+ */
+char *search_path(const char *name, const char *searchPath) {
+    size_t nameLength = strlen(name);
+
+    while (true) {
+        size_t dirLength = strcspn(searchPath, ":");
+        const char *dir = dirLength > 0 ? searchPath : ".";
+        size_t length = dirLength > 0 ? dirLength : 1;
+        char *path = malloc(length + nameLength + 2);
+        struct stat status;
+
+        if (path == NULL) {
+            return NULL;
+        }
+        memcpy(path, dir, length);
+        path[length] = '/';
+        memcpy(path + length + 1, name, nameLength + 1);
+        if (stat(path, &status) == 0 && S_ISREG(status.st_mode) &&
+            access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+
+        if (searchPath[dirLength] == '\0') {
+            return NULL;
+        }
+        searchPath += dirLength + 1;
+    }
+}
+
+/**
+ * @brief Resolves the path of a command.
+ *
+ * A name containing a slash is a path already. Other names are searched for
+ * in the directories of PATH, and the result is cached, so that a command
+ * run again is found without searching. The cache is emptied when PATH
+ * changes.
+ *
+ * @param name The command name.
+ * @param refresh Whether to search again even if the path is cached, as
+ * when the cached path no longer exists.
+ * @return The path of the command, valid until the cache next changes, or
+ * NULL if it was not found.
+ */
+const char *resolve_command(const char *name, bool refresh) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    const char *searchPath = getenv("PATH");
+    if (searchPath == NULL) {
+        searchPath = DEFAULT_PATH;
+    }
+    if (pathCacheSource == NULL || strcmp(pathCacheSource, searchPath) != 0) {
+        clear_command_paths();
+        pathCacheSource = strdup(searchPath);
+    }
+
+    struct command_path *entry = find_command_path(name, true);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->path == NULL || refresh) {
+        free(entry->path);
+        entry->path = search_path(name, searchPath);
+    }
+    if (entry->path != NULL && !refresh) {
+        entry->hits++;
+    }
+    return entry->path;
+}
+
+/**
+ * Handles the built-in 'hash' command of the shell.
+ *
+ * With no arguments, lists the command path cache, with the number of times
+ * each path has been used. With -r, empties the cache. Otherwise, looks up
+ * each argument and caches its path.
+ *
+ * @param tokens Struct containing parsed command line tokens.
+ */
+void handle_builtin_hash(const struct cmdline_tokens tokens) {
+    if (tokens.argc == 1) {
+        if (pathCacheCount == 0) {
+            printf("hash: hash table empty\n");
+            return;
+        }
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < pathCacheSize; i++) {
+            if (pathCache[i].path != NULL) {
+                printf("%4u\t%s\n", pathCache[i].hits, pathCache[i].path);
+            }
+        }
+    } else if (tokens.argc == 2 && strcmp(tokens.argv[1], "-r") == 0) {
+        clear_command_paths();
+    } else {
+        for (int i = 1; i < tokens.argc; i++) {
+            struct command_path *entry;
+            if (strchr(tokens.argv[i], '/') != NULL) {
+                continue;
+            }
+            if (resolve_command(tokens.argv[i], true) == NULL) {
+                printf("hash: %s: not found\n", tokens.argv[i]);
+            } else if ((entry = find_command_path(tokens.argv[i], false))) {
+                entry->hits = 0; // Looked up, not used
+            }
         }
-        dup2(fd, fileDescriptor);
-        close(fd);
     }
 }
@@ -6,11 +6,14 @@
  * related to usage, see the corresponding header file at tsh_helper.h.
  */
 
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "csapp.h"
@@ -21,7 +24,25 @@ struct job_t {
     pid_t pid;       // Job PID
     jid_t jid;       // Job ID [1, 2, ...] defined in tsh_helper.c
     job_state state; // UNDEF, BG, FG, or ST
+    int nprocs;      // Number of its processes that have not ended
+    pid_t last_pid;  // PID of the last process of its pipeline
     char *cmdline;   // Command line
+    struct timespec start;  // When the job was added
+    struct job_usage usage; // Usage of its processes that have ended
+};
+
+// A deleted job whose resource usage is kept
+struct finished_job {
+    pid_t pid;                 // Job PID
+    jid_t jid;                 // Job ID, or 0 if the entry is unused
+    struct job_usage usage;    // Resource usage of the job
+    char cmdline[MAXLINE_TSH]; // Command line, possibly truncated
+};
+
+// Entry of the PID index, for one process of a job
+struct pid_entry {
+    pid_t pid; // Process ID
+    jid_t jid; // Job ID of the process, or 0 if the entry is empty
 };
 
 // Parsing states, used internally in parseline
@@ -33,11 +54,33 @@ bool verbose = false;          // If true, prints additional output
 
 /* Static variables */
 static bool check_block = true; // If true, check that signals are blocked
-static struct job_t job_list[MAXJOBS]; // The job list
-static jid_t nextjid = 1;              // Next job ID to allocate
+static struct job_t *job_list = NULL; // The job list, indexed by jid - 1
+static jid_t job_capacity = 0;        // Number of entries in job_list
+static jid_t nextjid = 1; // Next job ID to allocate, above all existing ones
+static jid_t fgjid = 0;   // Job ID of the foreground job, or 0
+
+// Index from the PID of each process of a job to the job ID, open-addressed
+// with linear probing. The number of slots is a power of 2 at least twice
+// the number of entries, and the index only grows when processes are added,
+// so lookups and removals never need to allocate.
+static struct pid_entry *pid_index = NULL;
+static size_t pid_index_size = 0;
+static size_t pid_count = 0; // Number of entries in the PID index
+
+// The last MAXFINISHED jobs deleted, in order of deletion modulo MAXFINISHED
+static struct finished_job finished_jobs[MAXFINISHED];
+static size_t finished_count = 0; // Number of jobs ever deleted
 
 static bool init = false;
 
+/*
+ * last_stage_empty - Returns whether the last command parsed so far has no
+ * arguments. Async-signal-safe
+ */
+static bool last_stage_empty(const struct cmdline_tokens *token) {
+    return token->stages[token->nstages - 1] == &token->argv[token->argc];
+}
+
 /*
  * parseline - Parse the command line and build the argv array.
  * Not async-signal-safe.
@@ -66,6 +109,8 @@ parseline_return parseline(const char *cmdline, struct cmdline_tokens *token) {
 
     // initialize default values
     token->argc = 0;
+    token->nstages = 1;
+    token->stages[0] = token->argv;
     token->infile = NULL;
     token->outfile = NULL;
 
@@ -78,9 +123,38 @@ parseline_return parseline(const char *cmdline, struct cmdline_tokens *token) {
         if (buf >= endbuf)
             break;
 
+        /* Check for the start of the next command of a pipeline */
+        if (*buf == '|' && parsing_state == ST_NORMAL) {
+            if (last_stage_empty(token)) {
+                fprintf(stderr, "Error: missing command in pipeline\n");
+                return PARSELINE_ERROR;
+            }
+            if (token->outfile) { // outfile is not on the last command
+                if (verbose) {
+                    fprintf(stderr, "Error: Ambiguous I/O redirection\n");
+                }
+                return PARSELINE_ERROR;
+            }
+            if (token->nstages >= MAXSTAGES) {
+                fprintf(stderr, "Error: too many commands in pipeline\n");
+                return PARSELINE_ERROR;
+            }
+            token->argv[token->argc] = NULL;
+            token->argc = token->argc + 1;
+            token->stages[token->nstages] = &token->argv[token->argc];
+            token->nstages = token->nstages + 1;
+            buf++;
+
+            /* Check if argv is full */
+            if (token->argc >= MAXARGS - 1)
+                break;
+            continue;
+        }
+
         /* Check for I/O redirection specifiers */
         if (*buf == '<') {
-            if (token->infile) { // infile already exists
+            // infile already exists, or is not on the first command
+            if (token->infile || token->nstages > 1) {
                 if (verbose) {
                     fprintf(stderr, "Error: Ambiguous I/O redirection\n");
                 }
@@ -165,21 +239,32 @@ parseline_return parseline(const char *cmdline, struct cmdline_tokens *token) {
         token->builtin = BUILTIN_BG;
     } else if ((strcmp(token->argv[0], "fg")) == 0) { /* fg command */
         token->builtin = BUILTIN_FG;
+    } else if ((strcmp(token->argv[0], "parallel")) == 0) { /* parallel */
+        token->builtin = BUILTIN_PARALLEL;
+    } else if ((strcmp(token->argv[0], "hash")) == 0) { /* hash command */
+        token->builtin = BUILTIN_HASH;
+    } else if ((strcmp(token->argv[0], "time")) == 0) { /* time command */
+        token->builtin = BUILTIN_TIME;
     } else {
         token->builtin = BUILTIN_NONE;
     }
 
     // Returns 5 if job runs on background; 4 if job runs on foreground
-
-    if (*token->argv[(token->argc) - 1] == '&') {
+    parseline_return result = PARSELINE_FG;
+    if (token->argv[token->argc - 1] != NULL &&
+        *token->argv[(token->argc) - 1] == '&') {
         token->argv[--(token->argc)] = NULL;
         if (token->argc == 0) {
             return PARSELINE_EMPTY;
         }
-        return PARSELINE_BG;
-    } else {
-        return PARSELINE_FG;
+        result = PARSELINE_BG;
+    }
+
+    if (last_stage_empty(token)) {
+        fprintf(stderr, "Error: missing command in pipeline\n");
+        return PARSELINE_ERROR;
     }
+    return result;
 }
 
 /*****************
@@ -234,7 +319,7 @@ static void check_blocked(void) {
  * job struct may not necessarily be valid. Async-signal-safe
  */
 static struct job_t *get_job(jid_t jid) {
-    if (jid < 1 || jid > MAXJOBS) {
+    if (jid < 1 || jid > job_capacity) {
         sio_eprintf("get_job: invalid jid\n");
         abort();
     }
@@ -248,8 +333,139 @@ static struct job_t *get_job(jid_t jid) {
 static void clearjob(struct job_t *job) {
     sio_assert(job != NULL);
     job->pid = 0;
+    job->last_pid = 0;
     job->jid = 0;
     job->state = UNDEF;
+    job->nprocs = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+}
+
+/*
+ * pid_slot - Returns the slot of the PID index at which to start looking
+ * for a PID. Async-signal-safe
+ */
+static size_t pid_slot(pid_t pid) {
+    return ((size_t)pid * 2654435761u) & (pid_index_size - 1);
+}
+
+/*
+ * find_pid - Returns the slot of the PID index holding a PID, or the empty
+ * slot at which it would be inserted. Async-signal-safe
+ */
+static size_t find_pid(pid_t pid) {
+    size_t i = pid_slot(pid);
+    while (pid_index[i].jid != 0 && pid_index[i].pid != pid) {
+        i = (i + 1) & (pid_index_size - 1);
+    }
+    return i;
+}
+
+/*
+ * unindex_pid - Empties a slot of the PID index, moving later entries of
+ * its probe sequence back so that lookups still find them.
+ * Async-signal-safe
+ */
+static void unindex_pid(size_t i) {
+    size_t mask = pid_index_size - 1;
+    pid_count--;
+    for (size_t j = (i + 1) & mask; pid_index[j].jid != 0;
+         j = (j + 1) & mask) {
+        // The entry in slot j must stay unless its home is outside (i, j]
+        size_t home = pid_slot(pid_index[j].pid);
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            pid_index[i] = pid_index[j];
+            i = j;
+        }
+    }
+    pid_index[i].jid = 0;
+}
+
+/*
+ * reserve_pids - Makes the PID index big enough for `count` entries, and
+ * rehashes it if it grows. Returns false if out of memory.
+ * Not async-signal-safe (calloc)
+ */
+static bool reserve_pids(size_t count) {
+    if (2 * count <= pid_index_size) {
+        return true;
+    }
+    size_t index_size = pid_index_size != 0 ? pid_index_size : 1;
+    while (index_size < 2 * count) {
+        index_size <<= 1;
+    }
+    struct pid_entry *index = calloc(index_size, sizeof(struct pid_entry));
+    if (index == NULL) {
+        return false;
+    }
+
+    struct pid_entry *old_index = pid_index;
+    size_t old_size = pid_index_size;
+    pid_index = index;
+    pid_index_size = index_size;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_index[i].jid != 0) {
+            pid_index[find_pid(old_index[i].pid)] = old_index[i];
+        }
+    }
+    free(old_index);
+    return true;
+}
+
+/*
+ * index_pid - Adds a process of a job to the PID index, growing the index
+ * if it would be more than half full. Returns false if out of memory.
+ * Not async-signal-safe (calloc)
+ */
+static bool index_pid(pid_t pid, jid_t jid) {
+    if (!reserve_pids(pid_count + 1)) {
+        return false;
+    }
+
+    size_t i = find_pid(pid);
+    sio_assert(pid_index[i].jid == 0);
+    pid_index[i].pid = pid;
+    pid_index[i].jid = jid;
+    pid_count++;
+    return true;
+}
+
+/*
+ * grow_job_list - Makes the job list hold at least `capacity` jobs. Returns
+ * false if out of memory.
+ * Not async-signal-safe (realloc)
+ */
+static bool grow_job_list(jid_t capacity) {
+    if (capacity <= job_capacity) {
+        return true;
+    }
+
+    struct job_t *list =
+        realloc(job_list, (size_t)capacity * sizeof(struct job_t));
+    if (list == NULL) {
+        return false;
+    }
+    job_list = list;
+    for (jid_t jid = job_capacity + 1; jid <= capacity; jid++) {
+        clearjob(&job_list[jid - 1]);
+        job_list[jid - 1].cmdline = NULL;
+    }
+    job_capacity = capacity;
+    return true;
+}
+
+/*
+ * job_wall_time - Gets the wall-clock time since a job was added
+ * Async-signal-safe
+ */
+static void job_wall_time(const struct job_t *job, struct timespec *wall) {
+    clock_gettime(CLOCK_MONOTONIC, wall);
+    wall->tv_sec -= job->start.tv_sec;
+    wall->tv_nsec -= job->start.tv_nsec;
+    if (wall->tv_nsec < 0) {
+        wall->tv_sec--;
+        wall->tv_nsec += 1000000000L;
+    }
 }
 
 /*
@@ -258,12 +474,15 @@ static void clearjob(struct job_t *job) {
  */
 void init_job_list(void) {
     init = true;
-    for (jid_t jid = 1; jid <= MAXJOBS; jid++) {
-        struct job_t *job = get_job(jid);
-        clearjob(job);
-        job->cmdline = NULL;
+    job_capacity = 0;
+    pid_count = 0;
+    if (!grow_job_list(INITJOBS) || !reserve_pids(INITJOBS)) {
+        sio_eprintf("init_job_list: Out of memory\n");
+        _exit(1);
     }
     nextjid = 1;
+    fgjid = 0;
+    finished_count = 0;
 }
 
 /*
@@ -271,26 +490,18 @@ void init_job_list(void) {
  * Not async-signal-safe (free)
  */
 void destroy_job_list(void) {
-    for (jid_t jid = 1; jid <= MAXJOBS; jid++) {
-        struct job_t *job = get_job(jid);
-        clearjob(job);
-        free(job->cmdline);
-        job->cmdline = NULL;
+    for (jid_t jid = 1; jid <= job_capacity; jid++) {
+        free(get_job(jid)->cmdline);
     }
+    free(job_list);
+    free(pid_index);
+    job_list = NULL;
+    pid_index = NULL;
+    job_capacity = 0;
+    pid_index_size = 0;
+    pid_count = 0;
     nextjid = 1;
-}
-
-/*
- * maxjid - Returns largest allocated job ID
- * Async-signal-safe
- */
-static jid_t maxjid(void) {
-    for (jid_t jid = MAXJOBS; jid >= 1; jid--) {
-        if (job_exists(jid)) {
-            return jid;
-        }
-    }
-    return 0;
+    fgjid = 0;
 }
 
 /*
@@ -300,7 +511,7 @@ static jid_t maxjid(void) {
 bool job_exists(jid_t jid) {
     check_blocked();
 
-    if (jid < 1 || jid > MAXJOBS) {
+    if (jid < 1 || jid > job_capacity) {
         return false;
     }
     struct job_t *job = get_job(jid);
@@ -334,7 +545,7 @@ static void require_valid_state(const char *func, jid_t jid, job_state state) {
 }
 
 /*
- * add_job - Add a job to the job list
+ * add_job - Add a job to the job list, growing it if it is full
  * Not async-signal-safe (realloc)
  */
 jid_t add_job(pid_t pid, job_state state, const char *cmdline) {
@@ -358,7 +569,8 @@ jid_t add_job(pid_t pid, job_state state, const char *cmdline) {
 
     /* Ensure nextjid is available in job list */
     sio_assert(nextjid > 0);
-    if (nextjid > MAXJOBS) {
+    if (nextjid > job_capacity &&
+        (job_capacity > INT_MAX / 2 || !grow_job_list(2 * job_capacity))) {
         if (verbose) {
             fprintf(stderr, "add_job: Tried to create too many jobs\n");
         }
@@ -367,10 +579,19 @@ jid_t add_job(pid_t pid, job_state state, const char *cmdline) {
 
     struct job_t *job = get_job(nextjid);
     sio_assert(job->state == UNDEF);
+    if (!index_pid(pid, nextjid)) {
+        if (verbose) {
+            fprintf(stderr, "add_job: Out of memory\n");
+        }
+        return 0;
+    }
 
     job->jid = nextjid;
     job->pid = pid;
+    job->last_pid = pid;
     job->state = state;
+    job->nprocs = 1;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
 
     /* Realloc new buffer for cmdline */
     job->cmdline = realloc(job->cmdline, strlen(cmdline) + 1);
@@ -379,6 +600,9 @@ jid_t add_job(pid_t pid, job_state state, const char *cmdline) {
         _exit(1);
     }
     strcpy(job->cmdline, cmdline);
+    if (state == FG) {
+        fgjid = job->jid;
+    }
 
     if (verbose) {
         fprintf(stderr, "add_job: Added job [%d] %d %s\n", (int)job->jid,
@@ -406,14 +630,107 @@ bool delete_job(jid_t jid) {
         return false;
     }
 
+    // Remove the processes of the job that have not ended, looking up the
+    // main process first since it is usually the only one
     struct job_t *job = get_job(jid);
+    size_t i = find_pid(job->pid);
+    if (job->nprocs > 0 && pid_index[i].jid == jid) {
+        unindex_pid(i);
+        job->nprocs--;
+    }
+    for (i = 0; job->nprocs > 0 && i < pid_index_size;) {
+        if (pid_index[i].jid == jid) {
+            unindex_pid(i); // May move another entry into slot i
+            job->nprocs--;
+        } else {
+            i++;
+        }
+    }
+    // Keep the usage of the job
+    struct finished_job *record = &finished_jobs[finished_count % MAXFINISHED];
+    record->pid = job->pid;
+    record->jid = jid;
+    record->usage = job->usage;
+    job_wall_time(job, &record->usage.wall);
+    size_t length = strnlen(job->cmdline, MAXLINE_TSH - 1);
+    memcpy(record->cmdline, job->cmdline, length);
+    record->cmdline[length] = '\0';
+    finished_count++;
+
     clearjob(job);
+    if (fgjid == jid) {
+        fgjid = 0;
+    }
 
-    nextjid = maxjid() + 1;
+    // Lower nextjid past the jobs that are gone, which takes O(1) time
+    // amortized over the add_job calls that raised it
+    while (nextjid > 1 && !job_exists(nextjid - 1)) {
+        nextjid--;
+    }
     sio_assert(nextjid > 0);
     return true;
 }
 
+/*
+ * job_add_process - Add another process to a job
+ * Not async-signal-safe (calloc)
+ */
+bool job_add_process(jid_t jid, pid_t pid) {
+    check_blocked();
+    require_job_exists("job_add_process", jid);
+    if (pid <= 0) {
+        sio_eprintf("job_add_process: invalid pid\n");
+        abort();
+    }
+
+    if (!index_pid(pid, jid)) {
+        if (verbose) {
+            fprintf(stderr, "job_add_process: Out of memory\n");
+        }
+        return false;
+    }
+    get_job(jid)->nprocs++;
+    get_job(jid)->last_pid = pid;
+    return true;
+}
+
+/*
+ * job_end_process - Remove a process that has ended from its job, adding its
+ * usage to the job's, and return the number of processes of the job left,
+ * or -1 if it has no job. Only the last process of a pipeline sets the job's
+ * status, whatever order its processes are reaped in.
+ * Async-signal-safe
+ */
+int job_end_process(pid_t pid, int status, const struct rusage *usage) {
+    check_blocked();
+
+    if (pid < 1) {
+        return -1;
+    }
+    size_t i = find_pid(pid);
+    jid_t jid = pid_index[i].jid;
+    if (jid == 0) {
+        return -1;
+    }
+    unindex_pid(i);
+    struct job_t *job = get_job(jid);
+    job->nprocs--;
+
+    if (pid == job->last_pid) {
+        job->usage.status = status;
+    }
+    if (usage != NULL) {
+        timeradd(&job->usage.utime, &usage->ru_utime, &job->usage.utime);
+        timeradd(&job->usage.stime, &usage->ru_stime, &job->usage.stime);
+        if (usage->ru_maxrss > job->usage.maxrss) {
+            job->usage.maxrss = usage->ru_maxrss;
+        }
+        job->usage.nvcsw += usage->ru_nvcsw;
+        job->usage.nivcsw += usage->ru_nivcsw;
+    }
+    return job->nprocs;
+}
+
 /*
  * fg_job - Return JID of current foreground job, or 0 if no such job
  * Async-signal-safe
@@ -421,11 +738,8 @@ bool delete_job(jid_t jid) {
 jid_t fg_job(void) {
     check_blocked();
 
-    for (jid_t jid = 1; jid <= MAXJOBS; jid++) {
-        struct job_t *jobp = get_job(jid);
-        if (jobp->state == FG) {
-            return jid;
-        }
+    if (fgjid != 0) {
+        return fgjid;
     }
 
     if (verbose) {
@@ -448,11 +762,9 @@ jid_t job_from_pid(pid_t pid) {
         return 0;
     }
 
-    for (jid_t jid = 1; jid <= MAXJOBS; jid++) {
-        struct job_t *jobp = get_job(jid);
-        if (jobp->state != UNDEF && jobp->pid == pid) {
-            return jid;
-        }
+    jid_t jid = pid_index[find_pid(pid)].jid;
+    if (jid != 0) {
+        return jid;
     }
 
     if (verbose) {
@@ -484,6 +796,38 @@ void job_set_state(jid_t jid, job_state state) {
 
     struct job_t *jobp = get_job(jid);
     jobp->state = state;
+    if (state == FG) {
+        fgjid = jid;
+    } else if (fgjid == jid) {
+        fgjid = 0;
+    }
+}
+
+/*
+ * job_get_usage - Gets the resources used by a job, or by the last deleted
+ * job with a job ID
+ * Async-signal-safe
+ */
+bool job_get_usage(jid_t jid, struct job_usage *usage) {
+    check_blocked();
+
+    if (job_exists(jid)) {
+        struct job_t *job = get_job(jid);
+        *usage = job->usage;
+        job_wall_time(job, &usage->wall);
+        return true;
+    }
+
+    size_t kept = finished_count < MAXFINISHED ? finished_count : MAXFINISHED;
+    for (size_t i = 1; i <= kept; i++) {
+        struct finished_job *record =
+            &finished_jobs[(finished_count - i) % MAXFINISHED];
+        if (record->jid == jid) {
+            *usage = record->usage;
+            return true;
+        }
+    }
+    return false;
 }
 
 /*
@@ -498,6 +842,19 @@ pid_t job_get_pid(jid_t jid) {
     return jobp->pid;
 }
 
+/*
+ * job_get_last_pid - Gets the process ID of the last process of a job's
+ * pipeline
+ * Async-signal-safe
+ */
+pid_t job_get_last_pid(jid_t jid) {
+    check_blocked();
+    require_job_exists("job_get_last_pid", jid);
+
+    struct job_t *jobp = get_job(jid);
+    return jobp->last_pid;
+}
+
 /*
  * job_get_cmdline - Gets the cmdline of a job
  * Async-signal-safe
@@ -521,7 +878,7 @@ bool list_jobs(int output_fd) {
         abort();
     }
 
-    for (jid_t jid = 1; jid <= MAXJOBS; jid++) {
+    for (jid_t jid = 1; jid < nextjid; jid++) {
         struct job_t *jobp = get_job(jid);
         if (jobp->state == UNDEF) {
             continue;
@@ -554,6 +911,88 @@ bool list_jobs(int output_fd) {
 
     return true;
 }
+/*
+ * print_usage - Print the line of list_jobs_usage for a job's usage, giving
+ * times in seconds with 3 decimals. Returns false on error.
+ * Async-signal-safe
+ */
+static bool print_usage(int output_fd, const struct job_usage *usage) {
+    long ms[3] = {
+        (long)usage->wall.tv_nsec / 1000000,
+        (long)usage->utime.tv_usec / 1000,
+        (long)usage->stime.tv_usec / 1000,
+    };
+    return sio_dprintf(output_fd,
+                       "    real %ld.%ld%ld%lds  user %ld.%ld%ld%lds  "
+                       "sys %ld.%ld%ld%lds  maxrss %ldKB  ctxsw %ld/%ld\n",
+                       (long)usage->wall.tv_sec, ms[0] / 100, ms[0] / 10 % 10,
+                       ms[0] % 10, (long)usage->utime.tv_sec, ms[1] / 100,
+                       ms[1] / 10 % 10, ms[1] % 10, (long)usage->stime.tv_sec,
+                       ms[2] / 100, ms[2] / 10 % 10, ms[2] % 10,
+                       usage->maxrss, usage->nvcsw, usage->nivcsw) >= 0;
+}
+
+/*
+ * list_jobs_usage - Print the job list and the last deleted jobs, with the
+ * resources used by each, to a file descriptor
+ * Async-signal-safe
+ */
+bool list_jobs_usage(int output_fd) {
+    check_blocked();
+    if (output_fd < 0) {
+        sio_eprintf("list_jobs_usage: invalid file descriptor\n");
+        abort();
+    }
+
+    for (jid_t jid = 1; jid < nextjid; jid++) {
+        struct job_t *jobp = get_job(jid);
+        if (jobp->state == UNDEF) {
+            continue;
+        }
+
+        const char *status = jobp->state == BG   ? "Running    "
+                             : jobp->state == FG ? "Foreground "
+                                                 : "Stopped    ";
+        struct job_usage usage;
+        job_get_usage(jid, &usage);
+        if (sio_dprintf(output_fd, "[%d] (%d) %s%s\n", jobp->jid, jobp->pid,
+                        status, jobp->cmdline) < 0 ||
+            !print_usage(output_fd, &usage)) {
+            sio_eprintf("list_jobs_usage: Error writing to output_fd: %d\n",
+                        output_fd);
+            return false;
+        }
+    }
+
+    size_t kept = finished_count < MAXFINISHED ? finished_count : MAXFINISHED;
+    for (size_t i = kept; i > 0; i--) {
+        struct finished_job *record =
+            &finished_jobs[(finished_count - i) % MAXFINISHED];
+        int status = record->usage.status;
+        ssize_t res;
+
+        if (WIFSIGNALED(status)) {
+            res = sio_dprintf(output_fd, "[%d] (%d) Signal %d   %s\n",
+                              record->jid, record->pid, WTERMSIG(status),
+                              record->cmdline);
+        } else if (WEXITSTATUS(status) != 0) {
+            res = sio_dprintf(output_fd, "[%d] (%d) Exit %d     %s\n",
+                              record->jid, record->pid, WEXITSTATUS(status),
+                              record->cmdline);
+        } else {
+            res = sio_dprintf(output_fd, "[%d] (%d) Done       %s\n",
+                              record->jid, record->pid, record->cmdline);
+        }
+        if (res < 0 || !print_usage(output_fd, &record->usage)) {
+            sio_eprintf("list_jobs_usage: Error writing to output_fd: %d\n",
+                        output_fd);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 /******************************
  * end job list helper routines
  ******************************/
@@ -567,9 +1006,10 @@ bool list_jobs(int output_fd) {
  * Not async-signal-safe
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpe]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -e   handle signals in a signalfd event loop\n");
     exit(EXIT_FAILURE);
 }
@@ -8,7 +8,8 @@
  *
  * Many of the helper routines are focused around maintaining a job list,
  * which you can only access through the routines themselves. Each job is
- * represented by a job ID ranging from 1 to `MAXJOBS`.
+ * represented by a job ID of 1 or more. The job list starts with room for
+ * `INITJOBS` jobs, and grows as needed.
  *
  * The signal safety of each helper function is documented in this file. You
  * must ensure that any helper routines that you call within a signal handler
@@ -24,13 +25,19 @@
 #define TSH_HELPER_H
 
 #include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Misc manifest constants */
 #define MAXLINE_TSH 1024 /**< Max line size */
 #define MAXARGS 128      /**< Max args on a command line */
-#define MAXJOBS 64       /**< Max jobs at any point in time */
+#define INITJOBS 64      /**< Initial size of the job list */
+#define MAXSTAGES 32     /**< Max commands in a pipeline */
+#define MAXPARALLEL 1024 /**< Max jobs run at once by `parallel` */
+#define MAXFINISHED 16   /**< Finished jobs whose usage is kept */
 
 /** @brief Integer type used for job IDs */
 typedef int jid_t;
@@ -67,23 +74,43 @@ typedef enum parseline_return {
  * @brief Types of builtins that can be executed by the shell
  */
 typedef enum builtin_state {
-    BUILTIN_NONE = 8,  ///< Not a builtin command
-    BUILTIN_QUIT = 9,  ///< `quit` (exit the shell)
-    BUILTIN_JOBS = 10, ///< `jobs` (list running jobs)
-    BUILTIN_BG = 11,   ///< `bg` (run job in background)
-    BUILTIN_FG = 12    ///< `fg` (run job in foreground)
+    BUILTIN_NONE = 8,      ///< Not a builtin command
+    BUILTIN_QUIT = 9,      ///< `quit` (exit the shell)
+    BUILTIN_JOBS = 10,     ///< `jobs` (list running jobs)
+    BUILTIN_BG = 11,       ///< `bg` (run job in background)
+    BUILTIN_FG = 12,       ///< `fg` (run job in foreground)
+    BUILTIN_PARALLEL = 13, ///< `parallel` (run a file of commands as jobs)
+    BUILTIN_HASH = 14,     ///< `hash` (list or reset cached command paths)
+    BUILTIN_TIME = 15      ///< `time` (run a job and print its resource usage)
 } builtin_state;
 
 /**
  * @brief Result of parsing a command line from parseline
  */
 struct cmdline_tokens {
-    int argc;               ///< Number of arguments passed
-    char *argv[MAXARGS];    ///< The arguments list
-    char *infile;           ///< The filename for input redirection, or NULL
-    char *outfile;          ///< The filename for output redirection, or NULL
-    builtin_state builtin;  ///< Indicates if argv[0] is a builtin command
-    char _buf[MAXLINE_TSH]; ///< Internal backing buffer (do not use)
+    int argc;                 ///< Number of entries used in argv
+    char *argv[MAXARGS];      ///< The arguments list
+    int nstages;              ///< Number of commands in the pipeline
+    char **stages[MAXSTAGES]; ///< The arguments of each command, in argv
+    char *infile;             ///< The filename for input redirection, or NULL
+    char *outfile;            ///< The filename for output redirection, or NULL
+    builtin_state builtin;    ///< Indicates if argv[0] is a builtin command
+    char _buf[MAXLINE_TSH];   ///< Internal backing buffer (do not use)
+};
+
+/**
+ * @brief Resources used by a job, summed over its processes that have ended
+ */
+struct job_usage {
+    struct timespec wall; ///< Wall-clock time from when the job was added
+                          ///< until now, or until it was deleted
+    struct timeval utime; ///< User CPU time
+    struct timeval stime; ///< System CPU time
+    long maxrss;          ///< Largest maximum resident set size, in KB
+    long nvcsw;           ///< Voluntary context switches
+    long nivcsw;          ///< Involuntary context switches
+    int status;           ///< Wait status of the last process of the
+                          ///< pipeline, once it has ended
 };
 
 /* These variables are externally defined in tsh_helper.c. */
@@ -104,7 +131,15 @@ extern bool verbose;        ///< If true, prints additional output
  * Only the first `MAXLINE_TSH - 1` characters of the command line will be
  * parsed. The command line is in the form:
  *
- *     command [arguments...] [< infile] [> oufile] [&]
+ *     command [arguments...] [< infile] [| command [arguments...]]...
+ *             [> oufile] [&]
+ *
+ * Like `<` and `>`, a `|` that starts an argument separates the commands of
+ * a pipeline, of which there may be up to `MAXSTAGES`. Each command's
+ * arguments are stored in argv followed by a NULL pointer, and `stages`
+ * points at the first argument of each; a single command has one stage,
+ * equal to argv. The input file belongs to the first command and the output
+ * file to the last, and only argv[0] is checked for a builtin command.
  *
  * If the function cannot successfully parse the command line, it will return
  * `PARSELINE_ERROR`, and the contents of the token struct may be in an
@@ -157,14 +192,16 @@ void destroy_job_list(void);
  * job, and writing the job to the job list with the given parameters. This
  * allows the job to be tracked by the functions provided in the job list.
  *
+ * The job starts with one process. Further processes, such as the other
+ * commands of a pipeline, can be added to it with `job_add_process`.
+ *
  * @param[in] pid: The process ID of the main process of the job.
  * @param[in] state: The initial state of the job (should not be UNDEF).
  * @param[in] cmdline: The command line used to start the job.
  *
  * @return The JID of the added job, if successful
  * @return `0` if the job could not be added. The function may fail to add a
- *         job if there are no more job IDs available (restricted by the
- *         `MAXJOBS` constant).
+ *         job if the job list is full and cannot be grown.
  *
  * @pre Any signals that could modify the job list must be blocked.
  * @pre `state` must represent a valid job state other than `UNDEF`.
@@ -175,11 +212,57 @@ void destroy_job_list(void);
  */
 jid_t add_job(pid_t pid, job_state state, const char *cmdline);
 
+/**
+ * @brief Adds another process to a job.
+ *
+ * The process can then be found with `job_from_pid`, and the job counts it
+ * as running until `job_end_process` is called for it. The PID of the job
+ * remains that of its main process. Processes must be added in pipeline
+ * order, so that the last one added is the last stage, whose wait status
+ * becomes the job's.
+ *
+ * @param[in] jid The job ID of the job to add the process to.
+ * @param[in] pid The process ID of the process.
+ *
+ * @return true if the process was added
+ * @return false if memory to track the process could not be allocated
+ *
+ * @pre Any signals that could modify the job list must be blocked.
+ * @pre `jid` must be a valid job ID
+ * @pre `pid` must not belong to any job.
+ *
+ * @remark Async-signal-safety: Not async-signal-safe.
+ */
+bool job_add_process(jid_t jid, pid_t pid);
+
+/**
+ * @brief Records that a process of a job has ended.
+ *
+ * The process is no longer found by `job_from_pid`, and its resource usage
+ * is added to the job's. If it is the last stage of the job's pipeline, its
+ * wait status becomes the job's. The shell should call this
+ * function when it reaps a process, and delete the job once none of its
+ * processes are left.
+ *
+ * @param[in] pid The process ID of the process that has ended.
+ * @param[in] status The wait status of the process.
+ * @param[in] usage The resource usage of the process, or NULL if unknown.
+ *
+ * @return The number of processes of its job still running
+ * @return -1 if no job has a process with the given PID
+ *
+ * @pre Any signals that could modify the job list must be blocked.
+ * @remark Async-signal-safety: Async-signal-safe.
+ */
+int job_end_process(pid_t pid, int status, const struct rusage *usage);
+
 /**
  * @brief Deletes a job from the job list.
  *
- * This removes the job's data from the job list, and frees the job ID to
- * allow it to be used by another job.
+ * This removes the job's data from the job list, along with any of its
+ * processes that have not ended, and frees the job ID to allow it to be
+ * used by another job. The job's resource usage is kept among those of the
+ * last `MAXFINISHED` jobs deleted.
  *
  * The shell should call this function when it becomes aware that the job
  * has ended; it does not stop any processes itself. Future calls that
@@ -228,8 +311,8 @@ bool job_exists(jid_t jid);
  * @brief Finds a job corresponding to a process ID.
  *
  * Each job can be identified by the process ID of the initial (root) process
- * in the job. However, there can be multiple processes in a job, which will
- * not be tracked by the job list.
+ * in the job, or of any other process added to it with `job_add_process`
+ * that has not ended.
  *
  * @param[in] pid The process ID to search for
  *
@@ -253,6 +336,19 @@ jid_t job_from_pid(pid_t pid);
  */
 pid_t job_get_pid(jid_t jid);
 
+/**
+ * @brief Gets the process ID of the last process of a job's pipeline
+ *
+ * @param[in] jid The job ID to look up
+ * @return The process ID of the last stage, which is the job's main process
+ *         unless the job is a pipeline
+ *
+ * @pre Any signals that could modify the job list must be blocked.
+ * @pre `jid` must be a valid job ID
+ * @remark Async-signal-safety: Async-signal-safe.
+ */
+pid_t job_get_last_pid(jid_t jid);
+
 /**
  * @brief Gets the command line of a job
  *
@@ -292,6 +388,22 @@ job_state job_get_state(jid_t jid);
  */
 void job_set_state(jid_t jid, job_state state);
 
+/**
+ * @brief Gets the resources used by a job
+ *
+ * For a job in the job list, the usage covers the processes of the job that
+ * have ended so far. Otherwise, the usage is that of the last deleted job
+ * with the job ID, if it is among the last `MAXFINISHED` jobs deleted.
+ *
+ * @param[in]  jid   The job ID to look up
+ * @param[out] usage Receives the resource usage of the job
+ * @return true if the job's usage was found
+ *
+ * @pre Any signals that could modify the job list must be blocked.
+ * @remark Async-signal-safety: Async-signal-safe.
+ */
+bool job_get_usage(jid_t jid, struct job_usage *usage);
+
 /**
  * @brief Writes a representation of the job list to a file descriptor.
  *
@@ -309,6 +421,24 @@ void job_set_state(jid_t jid, job_state state);
  */
 bool list_jobs(int output_fd);
 
+/**
+ * @brief Writes the job list, with the resources used by each job, to a file
+ * descriptor.
+ *
+ * This writes the jobs in the job list as `list_jobs` does, followed by the
+ * last `MAXFINISHED` jobs deleted, oldest first. Each job is followed by a
+ * line giving its resource usage.
+ *
+ * @param[in] output_fd: The file descriptor to write to.
+ * @return true if the function succeeded
+ * @return false if an error occurred while writing to the file descriptor
+ *
+ * @pre Any signals that could modify the job list must be blocked.
+ * @pre `output_fd` must be a valid file descriptor open for writing.
+ * @remark Async-signal-safety: Async-signal-safe.
+ */
+bool list_jobs_usage(int output_fd);
+
 /**
  * @brief Prints usage instructions for the tiny shell.
  * @remark Async-signal-safety: Not async-signal-safe.
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -74,6 +75,7 @@ pid_t __wrap_job_get_pid(jid_t jid);
 pid_t __wrap_job_set_state(jid_t jid, job_state state);
 pid_t __wrap_fork(void);
 pid_t __wrap_waitpid(pid_t pid, int *status, int options);
+pid_t __wrap_wait4(pid_t pid, int *status, int options, struct rusage *usage);
 int __wrap_sigsuspend(const sigset_t *mask);
 int __wrap_sigprocmask(int how, const sigset_t *set, sigset_t *oldset);
 int __wrap_kill(pid_t pid, int sig);
@@ -274,6 +276,25 @@ pid_t __wrap_waitpid(pid_t pid, int *status, int options) {
     return ret;
 }
 
+/*
+ * __wrap_wait4 - Link time wrapper around wait4, with the same
+ * synchronisation points as waitpid
+ */
+pid_t __real_wait4(pid_t pid, int *status, int options, struct rusage *usage);
+
+pid_t __wrap_wait4(pid_t pid, int *status, int options, struct rusage *usage) {
+    if (shellsync_waitpid_before) {
+        shellsync_signal();
+        shellsync_wait();
+    }
+    pid_t ret = __real_wait4(pid, status, options, usage);
+    if (shellsync_waitpid_after && ret > 0) {
+        shellsync_signal();
+        shellsync_wait();
+    }
+    return ret;
+}
+
 /*
  * __wrap_sigsuspend - Link time wrapper for sigsuspend
  * Sleeps before executing the call, increasing the likelihood that a signal
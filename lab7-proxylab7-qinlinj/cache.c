@@ -0,0 +1,627 @@
+/**
+ * @file cache.c
+ * @brief Sharded LRU web object cache for the proxy
+ *
+ * Keys are hashed to one of a fixed number of shards. Each shard has its
+ * own reader-writer lock and doubly-linked list of objects, and its own
+ * counters, padded to a cache line so that shards never share one.
+ *
+ * Recency is tracked with a global logical clock, which ticks once per
+ * insertion. A hit only stamps the object with the current tick, with a
+ * relaxed store that it skips if the object already holds that tick, so
+ * hits take no exclusive lock and write no shared state. Objects last used
+ * between the same two insertions are equally old, so eviction is LRU to
+ * the resolution of one insertion.
+ *
+ * Each shard keeps recency lists, ordered by the stamp each object held
+ * when it took its place there, and all of them are changed only under
+ * cache_update_lock. Looking for a victim, a shard's tail that was hit
+ * since then moves up the list to where its new stamp belongs, until the
+ * tail is the shard's least recently used object. The cache's victim is
+ * the oldest of the shards' tails. The clock stands still while
+ * cache_update_lock is held, so each object moves at most once per search.
+ *
+ * The size limit applies to the cache as a whole, so insertions and
+ * evictions are serialized by cache_update_lock. Every object is added and
+ * removed while holding both that lock and the shard's write lock, so the
+ * victim picked by a thread holding cache_update_lock stays in the cache.
+ * Only the shard that is actually modified is write-locked, which keeps
+ * lookups on other shards running during an insertion.
+ *
+ * With admission enabled, every lookup, hit or miss, is counted in a
+ * count-min sketch of 4-bit counters, packed two to a byte, which estimates
+ * how often each key has been requested recently. Once the sketch has
+ * counted CACHE_SKETCH_SAMPLE requests, every counter is halved, so that
+ * old popularity fades. The counters are updated with relaxed atomics and
+ * no lock. An increment replaces its whole byte with a compare-and-swap, so
+ * it never undoes a change to the other counter in the byte; an increment
+ * lost to a concurrent halving only makes an estimate slightly low. An
+ * object leaving the window competes with the main LRU's victims, the
+ * oldest objects it would have to displace to fit. It is admitted, and
+ * they are all evicted, only if the sketch has seen it more often than
+ * each of them; otherwise it alone is removed.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "cache.h"
+#include "csapp.h"
+#include "disk_cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A recency list, most recently used object first */
+typedef struct {
+    cache_obj_t *head; /* Most recently used object */
+    cache_obj_t *tail; /* Least recently used object */
+} cache_lru_t;
+
+/* One shard of the cache */
+typedef struct {
+    pthread_rwlock_t lock; /* Protects the object list and counters */
+    cache_obj_t *head;     /* The shard's object list */
+    cache_lru_t lru[2];    /* Main LRU and window, by obj->window */
+    size_t size;           /* Bytes cached in this shard */
+    size_t count;          /* Objects cached in this shard */
+    uint64_t hits;         /* Updated atomically under the read lock */
+    uint64_t misses;       /* Updated atomically under the read lock */
+    uint64_t insertions;   /* Objects added to this shard */
+    uint64_t evictions;    /* Objects evicted from this shard */
+    uint64_t rejections;   /* Objects refused entry to the main LRU */
+} __attribute__((aligned(64))) cache_shard_t;
+
+/* Rows and counters per row of the frequency sketch (a power of 2), which
+   take 2 KB at 4 bits per counter */
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 1024
+
+/* Largest value of a sketch counter */
+#define CACHE_SKETCH_MAX 15
+
+/* Requests counted between halvings of the sketch */
+#define CACHE_SKETCH_SAMPLE (10 * CACHE_SKETCH_WIDTH)
+
+static cache_shard_t *cache_shards = NULL;
+static size_t cache_nshard = 0;
+
+/* Bytes cached across all shards, and the part of them in the admission
+   window, protected by cache_update_lock */
+static size_t cache_size = 0;
+static size_t cache_window_size = 0;
+static pthread_mutex_t cache_update_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Logical clock used to order accesses for LRU eviction, which only
+   insertions advance, under cache_update_lock */
+static uint64_t cache_clock = 0;
+
+/* Whether new objects must pass the admission filter */
+static bool cache_admission = false;
+
+/* Victims picked by cache_admit(), protected by cache_update_lock */
+static cache_obj_t **cache_victims = NULL;
+static size_t cache_victims_max = 0;
+
+/* The frequency sketch, two counters per byte, and the requests counted
+   since it was halved */
+static uint8_t cache_sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH / 2];
+static uint64_t cache_sketch_count = 0;
+
+/**
+ * Hashes a key (FNV-1a).
+ *
+ * @param key The normalized request key.
+ * @return The hash.
+ */
+uint32_t cache_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Returns the shard responsible for a hash.
+ *
+ * @param hash The key's hash.
+ * @return The shard.
+ */
+static cache_shard_t *cache_shard(uint32_t hash) {
+    return &cache_shards[hash % cache_nshard];
+}
+
+/**
+ * Finds the object stored under a key. The caller must hold the shard's
+ * lock in either mode, or cache_update_lock.
+ *
+ * @param shard The shard for the key.
+ * @param key The normalized request key.
+ * @param hash The key's hash.
+ * @return The object, or NULL if the key is not cached.
+ */
+static cache_obj_t *cache_find(cache_shard_t *shard, const char *key,
+                               uint32_t hash) {
+    cache_obj_t *obj;
+
+    for (obj = shard->head; obj != NULL; obj = obj->next) {
+        if (obj->hash == hash && strcmp(obj->key, key) == 0) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds the sketch counter for a hash in one row. Each row takes its index
+ * from a different part of a 64-bit mix of the hash.
+ *
+ * @param hash The key's hash.
+ * @param row The row.
+ * @param shift Where to store the position of the counter in its byte.
+ * @return The byte holding the counter.
+ */
+static uint8_t *cache_sketch_counter(uint32_t hash, int row, int *shift) {
+    uint64_t x = hash;
+    size_t i;
+
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    i = (x >> (16 * row)) & (CACHE_SKETCH_WIDTH - 1);
+    *shift = (i & 1) * 4;
+    return &cache_sketch[row][i / 2];
+}
+
+/**
+ * Counts a request for a key in the sketch, halving every counter once
+ * CACHE_SKETCH_SAMPLE requests have been counted.
+ *
+ * @param hash The key's hash.
+ */
+static void cache_sketch_add(uint32_t hash) {
+    uint8_t *counter, value;
+    int shift;
+
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        counter = cache_sketch_counter(hash, row, &shift);
+        value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        while (((value >> shift) & CACHE_SKETCH_MAX) < CACHE_SKETCH_MAX &&
+               !__atomic_compare_exchange_n(counter, &value,
+                                            value + (1 << shift), true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    if (__atomic_add_fetch(&cache_sketch_count, 1, __ATOMIC_RELAXED) ==
+        CACHE_SKETCH_SAMPLE) {
+        // Halve both counters in each byte, dropping the bit that the high
+        // one would shift into the low one
+        for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+            for (size_t i = 0; i < CACHE_SKETCH_WIDTH / 2; i++) {
+                counter = &cache_sketch[row][i];
+                value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+                __atomic_store_n(counter, (value >> 1) & 0x77,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_sub_fetch(&cache_sketch_count, CACHE_SKETCH_SAMPLE / 2,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Estimates how often a key has been requested recently.
+ *
+ * @param hash The key's hash.
+ * @return The smallest of the key's counters.
+ */
+static uint8_t cache_sketch_estimate(uint32_t hash) {
+    uint8_t min = CACHE_SKETCH_MAX, value;
+    int shift;
+
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        value = __atomic_load_n(cache_sketch_counter(hash, row, &shift),
+                                __ATOMIC_RELAXED);
+        value = (value >> shift) & CACHE_SKETCH_MAX;
+        if (value < min) {
+            min = value;
+        }
+    }
+    return min;
+}
+
+/**
+ * Takes an object out of its shard's recency list. The caller must hold
+ * cache_update_lock.
+ *
+ * @param shard The object's shard.
+ * @param obj The object.
+ */
+static void cache_lru_unlink(cache_shard_t *shard, cache_obj_t *obj) {
+    cache_lru_t *lru = &shard->lru[obj->window];
+
+    if (obj->lru_prev) {
+        obj->lru_prev->lru_next = obj->lru_next;
+    } else {
+        lru->head = obj->lru_next;
+    }
+    if (obj->lru_next) {
+        obj->lru_next->lru_prev = obj->lru_prev;
+    } else {
+        lru->tail = obj->lru_prev;
+    }
+}
+
+/**
+ * Places an object in its shard's recency list, in order of the stamp it
+ * holds now, which is most often at the front. The caller must hold
+ * cache_update_lock.
+ *
+ * @param shard The object's shard.
+ * @param obj The object, which must not be in a recency list.
+ */
+static void cache_lru_insert(cache_shard_t *shard, cache_obj_t *obj) {
+    cache_lru_t *lru = &shard->lru[obj->window];
+    cache_obj_t *prev = NULL, *next = lru->head;
+
+    obj->queued = __atomic_load_n(&obj->last_use, __ATOMIC_RELAXED);
+    while (next != NULL && next->queued > obj->queued) {
+        prev = next;
+        next = next->lru_next;
+    }
+    obj->lru_prev = prev;
+    obj->lru_next = next;
+    if (prev) {
+        prev->lru_next = obj;
+    } else {
+        lru->head = obj;
+    }
+    if (next) {
+        next->lru_prev = obj;
+    } else {
+        lru->tail = obj;
+    }
+}
+
+/**
+ * Finds the least recently used object in one of a shard's recency lists
+ * that is not already selected as a victim, first moving tails that were
+ * hit since they were placed to where they now belong. The caller must
+ * hold cache_update_lock.
+ *
+ * @param shard The shard.
+ * @param window Whether to look in the window rather than the main LRU.
+ * @return The object, or NULL if there is none.
+ */
+static cache_obj_t *cache_shard_oldest(cache_shard_t *shard, bool window) {
+    cache_obj_t *obj = shard->lru[window].tail;
+
+    while (obj != NULL) {
+        if (obj->selected) {
+            obj = obj->lru_prev;
+        } else if (__atomic_load_n(&obj->last_use, __ATOMIC_RELAXED) !=
+                   obj->queued) {
+            cache_lru_unlink(shard, obj);
+            cache_lru_insert(shard, obj);
+            obj = shard->lru[window].tail;
+        } else {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds the object with the oldest access stamp in the admission window or
+ * the main LRU, skipping objects already selected as victims, by comparing
+ * the shards' least recently used objects. The caller must hold
+ * cache_update_lock.
+ *
+ * @param window Whether to look in the window rather than the main LRU.
+ * @return The object, or NULL if that part of the cache is empty.
+ */
+static cache_obj_t *cache_oldest(bool window) {
+    cache_obj_t *obj, *oldest = NULL;
+
+    for (size_t i = 0; i < cache_nshard; i++) {
+        obj = cache_shard_oldest(&cache_shards[i], window);
+        if (obj != NULL && (oldest == NULL || obj->queued < oldest->queued)) {
+            oldest = obj;
+        }
+    }
+    return oldest;
+}
+
+/**
+ * Removes an object from its shard and hands the cache's reference to it
+ * to the disk tier. The caller must hold cache_update_lock.
+ *
+ * @param obj The object.
+ * @param rejected Whether the admission filter turned the object away,
+ *                 rather than it being evicted.
+ */
+static void cache_remove(cache_obj_t *obj, bool rejected) {
+    cache_shard_t *shard = cache_shard(obj->hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else {
+        shard->head = obj->next;
+    }
+    if (obj->next) {
+        obj->next->prev = obj->prev;
+    }
+    cache_lru_unlink(shard, obj);
+    shard->size -= obj->size;
+    shard->count--;
+    if (rejected) {
+        shard->rejections++;
+    } else {
+        shard->evictions++;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    cache_size -= obj->size;
+    if (obj->window) {
+        cache_window_size -= obj->size;
+    }
+    disk_cache_store(obj);
+}
+
+/**
+ * Moves objects out of the admission window, oldest first, until it fits
+ * in CACHE_WINDOW_SIZE. For each one, the oldest main LRU objects it would
+ * have to displace are picked first. If it is more popular than every one
+ * of them, they are all evicted and it joins the front of the main LRU;
+ * otherwise it is removed and they all stay. The caller must hold
+ * cache_update_lock.
+ */
+static void cache_admit(void) {
+    cache_obj_t *candidate, *victim;
+    cache_shard_t *shard;
+    size_t main_size, nvictims, i;
+    uint8_t freq;
+    bool admit;
+
+    while (cache_window_size > CACHE_WINDOW_SIZE &&
+           (candidate = cache_oldest(true)) != NULL) {
+        freq = cache_sketch_estimate(candidate->hash);
+        main_size = cache_size - cache_window_size;
+        nvictims = 0;
+        admit = true;
+        while (main_size + candidate->size >
+                   MAX_CACHE_SIZE - CACHE_WINDOW_SIZE &&
+               (victim = cache_oldest(false)) != NULL) {
+            if (cache_sketch_estimate(victim->hash) >= freq) {
+                admit = false;
+                break;
+            }
+            if (nvictims == cache_victims_max) {
+                cache_victims_max = cache_victims_max ? 2 * cache_victims_max
+                                                      : 16;
+                cache_victims =
+                    Realloc(cache_victims,
+                            cache_victims_max * sizeof(cache_obj_t *));
+            }
+            victim->selected = true;
+            cache_victims[nvictims++] = victim;
+            main_size -= victim->size;
+        }
+
+        for (i = 0; i < nvictims; i++) {
+            cache_victims[i]->selected = false;
+            if (admit) {
+                cache_remove(cache_victims[i], false);
+            }
+        }
+        if (admit) {
+            shard = cache_shard(candidate->hash);
+            cache_lru_unlink(shard, candidate);
+            candidate->window = false;
+            __atomic_store_n(&candidate->last_use, cache_clock,
+                             __ATOMIC_RELAXED);
+            cache_lru_insert(shard, candidate);
+            cache_window_size -= candidate->size;
+        } else {
+            cache_remove(candidate, true);
+        }
+    }
+}
+
+/**
+ * Initializes the cache. Must be called once before any worker thread
+ * accesses the cache.
+ *
+ * @param nshards The number of shards, or 0 for CACHE_DEFAULT_SHARDS. It
+ *                is clamped to CACHE_MAX_SHARDS.
+ * @param admission Whether new objects must pass the TinyLFU admission
+ *                  filter, rather than always displacing the LRU object.
+ */
+void cache_init(size_t nshards, bool admission) {
+    if (nshards == 0) {
+        nshards = CACHE_DEFAULT_SHARDS;
+    } else if (nshards > CACHE_MAX_SHARDS) {
+        nshards = CACHE_MAX_SHARDS;
+    }
+
+    if (posix_memalign((void **)&cache_shards, 64,
+                       nshards * sizeof(cache_shard_t)) != 0) {
+        fprintf(stderr, "Error: unable to allocate the cache\n");
+        exit(1);
+    }
+    memset(cache_shards, 0, nshards * sizeof(cache_shard_t));
+    for (size_t i = 0; i < nshards; i++) {
+        pthread_rwlock_init(&cache_shards[i].lock, NULL);
+    }
+    cache_nshard = nshards;
+    cache_size = 0;
+    cache_window_size = 0;
+    cache_clock = 0;
+    cache_admission = admission;
+    memset(cache_sketch, 0, sizeof(cache_sketch));
+    cache_sketch_count = 0;
+}
+
+/**
+ * Looks up an object and marks it as recently used. With admission
+ * enabled, the request is also counted in the frequency sketch, whether or
+ * not it hits.
+ *
+ * @param key The normalized request key.
+ * @return A referenced object that must be passed to cache_release(), or
+ *         NULL on a miss.
+ */
+cache_obj_t *cache_lookup(const char *key) {
+    uint32_t hash = cache_hash(key);
+    cache_shard_t *shard = cache_shard(hash);
+    cache_obj_t *obj;
+    uint64_t now;
+
+    if (cache_admission) {
+        cache_sketch_add(hash);
+    }
+
+    pthread_rwlock_rdlock(&shard->lock);
+    obj = cache_find(shard, key, hash);
+    if (obj) {
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+        now = __atomic_load_n(&cache_clock, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&obj->last_use, __ATOMIC_RELAXED) != now) {
+            __atomic_store_n(&obj->last_use, now, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return obj;
+}
+
+/**
+ * Drops a reference to an object, freeing it once it has been evicted and
+ * no reader is still using it.
+ *
+ * @param obj An object returned by cache_lookup().
+ */
+void cache_release(cache_obj_t *obj) {
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(obj->key);
+        Free(obj->data);
+        Free(obj);
+    }
+}
+
+/**
+ * Inserts an object, evicting least recently used objects to make room.
+ * With admission enabled, the object enters the admission window instead,
+ * and whatever it pushes out of the window is admitted to the main LRU or
+ * turned away.
+ *
+ * Ownership of data passes to the cache whether or not the insertion
+ * succeeds, so the caller must not use or free it afterwards.
+ *
+ * @param key The normalized request key.
+ * @param data Malloc'd buffer holding the complete response.
+ * @param size The number of bytes in data.
+ * @return true if the object was inserted, false if it is too large or
+ *         another thread already cached the same key.
+ */
+bool cache_insert(const char *key, char *data, size_t size) {
+    cache_obj_t *obj, *victim;
+    cache_shard_t *shard;
+
+    if (size > MAX_OBJECT_SIZE) {
+        Free(data);
+        return false;
+    }
+
+    obj = Malloc(sizeof(cache_obj_t));
+    obj->key = Malloc(strlen(key) + 1);
+    strcpy(obj->key, key);
+    obj->hash = cache_hash(key);
+    obj->data = data;
+    obj->size = size;
+    obj->refcnt = 1;
+    obj->prev = NULL;
+    obj->window = cache_admission;
+    obj->selected = false;
+    shard = cache_shard(obj->hash);
+
+    pthread_mutex_lock(&cache_update_lock);
+
+    // Keep at most one copy of each object, and evict nothing for a copy
+    if (cache_find(shard, key, obj->hash) != NULL) {
+        pthread_mutex_unlock(&cache_update_lock);
+        cache_release(obj);
+        return false;
+    }
+
+    while (!cache_admission && cache_size + size > MAX_CACHE_SIZE &&
+           (victim = cache_oldest(false)) != NULL) {
+        cache_remove(victim, false);
+    }
+    cache_size += size;
+    if (obj->window) {
+        cache_window_size += size;
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+    __atomic_store_n(&cache_clock, cache_clock + 1, __ATOMIC_RELAXED);
+    obj->last_use = cache_clock;
+    cache_lru_insert(shard, obj);
+    obj->next = shard->head;
+    if (shard->head) {
+        shard->head->prev = obj;
+    }
+    shard->head = obj;
+    shard->size += size;
+    shard->count++;
+    shard->insertions++;
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (cache_admission) {
+        cache_admit();
+    }
+
+    pthread_mutex_unlock(&cache_update_lock);
+    return true;
+}
+
+/**
+ * Returns the number of shards the cache was initialized with.
+ *
+ * @return The number of shards.
+ */
+size_t cache_nshards(void) {
+    return cache_nshard;
+}
+
+/**
+ * Takes a snapshot of one shard's counters.
+ *
+ * @param shard The shard index, less than cache_nshards().
+ * @param stats Where to store the counters.
+ */
+void cache_get_stats(size_t shard, cache_stats_t *stats) {
+    cache_shard_t *s = &cache_shards[shard];
+
+    pthread_rwlock_rdlock(&s->lock);
+    stats->hits = __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+    stats->insertions = s->insertions;
+    stats->evictions = s->evictions;
+    stats->rejections = s->rejections;
+    stats->objects = s->count;
+    stats->bytes = s->size;
+    pthread_rwlock_unlock(&s->lock);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file cache.h
+ * @brief Interface for the proxy's shared web object cache
+ *
+ * The cache maps a normalized request key ("host:port/path") to the complete
+ * response bytes the origin sent for that request. It is shared by every
+ * worker thread and split into hash shards, each with its own lock and
+ * object list, so that threads working on different keys never contend.
+ * Lookups hold a shard's lock in read mode so that concurrent hits never
+ * serialize, while insertions and evictions take it in write mode.
+ *
+ * Objects handed out by cache_lookup() are reference counted, so a worker can
+ * keep sending an object to a slow client after releasing the lock, even if
+ * the object is evicted in the meantime. Every successful lookup must be
+ * paired with a call to cache_release().
+ *
+ * Evicted objects are passed on to the disk tier (see disk_cache.h), which
+ * frees them if it is off.
+ *
+ * By default the cache is a plain LRU. With admission enabled, it follows
+ * W-TinyLFU instead: new objects enter a small LRU window, and an object
+ * pushed out of the window only enters the main LRU if a frequency sketch
+ * says it has been requested more often than the main cache's victim, so a
+ * scan of one-off objects cannot flush the objects that are in demand.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Max cache and object sizes */
+#define MAX_CACHE_SIZE (1024 * 1024)
+#define MAX_OBJECT_SIZE (100 * 1024)
+
+/* Bytes of the cache set aside for the admission window, which holds at
+   least one object of any size */
+#define CACHE_WINDOW_SIZE (MAX_CACHE_SIZE / 8)
+
+/* Default and largest number of cache shards */
+#define CACHE_DEFAULT_SHARDS 16
+#define CACHE_MAX_SHARDS 1024
+
+/* A cached web object */
+typedef struct cache_obj {
+    struct cache_obj *prev;     /* Previous object in the shard's list */
+    struct cache_obj *next;     /* Next object in the shard's list */
+    struct cache_obj *lru_prev; /* More recently used object in the shard */
+    struct cache_obj *lru_next; /* Less recently used object in the shard */
+    char *key;                  /* Normalized request key */
+    uint32_t hash;              /* Hash of key, which also picks the shard */
+    char *data;                 /* Response bytes, including headers */
+    size_t size;                /* Number of bytes in data */
+    uint64_t last_use;          /* Logical time of the most recent access */
+    uint64_t queued;            /* last_use when placed in the recency list */
+    unsigned int refcnt;        /* Cache reference plus one per active reader */
+    bool window;                /* In the admission window, not the main LRU */
+    bool selected;              /* Picked as a victim by the admission filter */
+} cache_obj_t;
+
+/* Counters for one shard */
+typedef struct {
+    uint64_t hits;       /* Lookups that found an object */
+    uint64_t misses;     /* Lookups that did not */
+    uint64_t insertions; /* Objects added */
+    uint64_t evictions;  /* Objects removed to make room */
+    uint64_t rejections; /* Objects the admission filter turned away */
+    size_t objects;      /* Objects currently cached */
+    size_t bytes;        /* Bytes currently cached */
+} cache_stats_t;
+
+uint32_t cache_hash(const char *key);
+void cache_init(size_t nshards, bool admission);
+cache_obj_t *cache_lookup(const char *key);
+void cache_release(cache_obj_t *obj);
+bool cache_insert(const char *key, char *data, size_t size);
+size_t cache_nshards(void);
+void cache_get_stats(size_t shard, cache_stats_t *stats);
+
+#endif /* CACHE_H */
@@ -3,22 +3,28 @@
  * @brief Functions for the CS:APP3e book
  */
 
+#define _GNU_SOURCE // for SO_REUSEPORT and accept4
+
 #include "csapp.h"
 
-#include <errno.h>      /* errno */
-#include <netdb.h>      /* freeaddrinfo() */
-#include <semaphore.h>  /* sem_t */
-#include <signal.h>     /* struct sigaction */
-#include <stdarg.h>     /* va_list */
-#include <stdbool.h>    /* bool */
-#include <stddef.h>     /* ssize_t */
-#include <stdint.h>     /* intmax_t */
-#include <stdio.h>      /* stderr */
-#include <stdlib.h>     /* abort() */
-#include <string.h>     /* memset() */
-#include <sys/socket.h> /* struct sockaddr */
-#include <sys/types.h>  /* struct sockaddr */
-#include <unistd.h>     /* STDIN_FILENO */
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* fcntl() */
+#include <limits.h>      /* IOV_MAX */
+#include <netdb.h>       /* freeaddrinfo() */
+#include <netinet/in.h>  /* IPPROTO_TCP */
+#include <netinet/tcp.h> /* TCP_DEFER_ACCEPT */
+#include <semaphore.h>   /* sem_t */
+#include <signal.h>      /* struct sigaction */
+#include <stdarg.h>      /* va_list */
+#include <stdbool.h>     /* bool */
+#include <stddef.h>      /* ssize_t */
+#include <stdint.h>      /* intmax_t */
+#include <stdio.h>       /* stderr */
+#include <stdlib.h>      /* abort() */
+#include <string.h>      /* memset() */
+#include <sys/socket.h>  /* struct sockaddr */
+#include <sys/types.h>   /* struct sockaddr */
+#include <unistd.h>      /* STDIN_FILENO */
 
 /************************************
  * Wrappers for Unix signal functions
@@ -472,18 +478,95 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 }
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_iov_batch - Copy up to IOV_MAX of the iovcnt entries at iov into
+ *    part, leaving out the first skip bytes, and return how many were copied
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-    size_t cnt;
+static size_t rio_iov_batch(struct iovec *part, const struct iovec *iov,
+                            size_t iovcnt, size_t skip) {
+    size_t n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+    memcpy(part, iov, n * sizeof(struct iovec));
+    part[0].iov_base = (char *)part[0].iov_base + skip;
+    part[0].iov_len -= skip;
+    return n;
+}
+
+/*
+ * rio_iov_advance - Step the position (*i, *skip) in an iovec past n more
+ *    bytes, and past any empty entries that follow
+ */
+static void rio_iov_advance(const struct iovec *iov, size_t iovcnt, size_t *i,
+                            size_t *skip, size_t n) {
+    n += *skip;
+    while (*i < iovcnt && n >= iov[*i].iov_len) {
+        n -= iov[*i].iov_len;
+        (*i)++;
+    }
+    *skip = n;
+}
+
+/*
+ * rio_readv - Robustly scatter bytes into a whole iovec (unbuffered). The
+ *    entries themselves are not modified.
+ */
+ssize_t rio_readv(int fd, const struct iovec *iov, size_t iovcnt) {
+    struct iovec part[IOV_MAX];
+    size_t i = 0, skip = 0, total = 0, n;
+    ssize_t nread;
+
+    rio_iov_advance(iov, iovcnt, &i, &skip, 0);
+    while (i < iovcnt) {
+        n = rio_iov_batch(part, iov + i, iovcnt - i, skip);
+        if ((nread = readv(fd, part, (int)n)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by readv() */
+            }
 
+            /* Interrupted by sig handler return, call readv() again */
+            nread = 0;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        total += (size_t)nread;
+        rio_iov_advance(iov, iovcnt, &i, &skip, (size_t)nread);
+    }
+    return (ssize_t)total; /* Return >= 0 */
+}
+
+/*
+ * rio_writev - Robustly gather and write a whole iovec (unbuffered). The
+ *    entries themselves are not modified.
+ */
+ssize_t rio_writev(int fd, const struct iovec *iov, size_t iovcnt) {
+    struct iovec part[IOV_MAX];
+    size_t i = 0, skip = 0, total = 0, n;
+    ssize_t nwritten;
+
+    rio_iov_advance(iov, iovcnt, &i, &skip, 0);
+    while (i < iovcnt) {
+        n = rio_iov_batch(part, iov + i, iovcnt - i, skip);
+        if ((nwritten = writev(fd, part, (int)n)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by writev() */
+            }
+
+            /* Interrupted by sig handler return, call writev() again */
+            nwritten = 0;
+        }
+        total += (size_t)nwritten;
+        rio_iov_advance(iov, iovcnt, &i, &skip, (size_t)nwritten);
+    }
+    return (ssize_t)total;
+}
+
+/*
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the buffer, 0 on EOF, or
+ *    -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp) {
     while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
         if (rp->rio_cnt < 0) {
             if (errno != EINTR) {
                 return -1; /* errno set by read() */
@@ -496,6 +579,24 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
             rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
         }
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+    size_t cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0) {
+        return rc;
+    }
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -504,7 +605,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     }
     memcpy(usrbuf, rp->rio_bufptr, cnt);
     rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
+    rp->rio_cnt -= (ssize_t)cnt;
     return (ssize_t)cnt;
 }
 
@@ -512,8 +613,19 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 void rio_readinitb(rio_t *rp, int fd) {
+    rio_readinitb_buf(rp, fd, rp->rio_inline, sizeof(rp->rio_inline));
+}
+
+/*
+ * rio_readinitb_buf - Associate a descriptor with a read buffer that uses
+ *    the caller's size bytes at buf, such as RIO_BIGBUFSIZE of them for bulk
+ *    transfers, rather than its own
+ */
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size) {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
+    rp->rio_buf = buf;
+    rp->rio_bufsize = size;
     rp->rio_bufptr = rp->rio_buf;
 }
 
@@ -526,9 +638,18 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-        if ((nread = rio_read(rp, bufp, nleft)) < 0) {
+        if (rp->rio_cnt <= 0 && nleft >= rp->rio_bufsize) {
+            /* Reads too large to buffer go straight to the user buf */
+            if ((nread = read(rp->rio_fd, bufp, nleft)) < 0) {
+                if (errno != EINTR) {
+                    return -1; /* errno set by read() */
+                }
+                continue;
+            }
+        } else if ((nread = rio_read(rp, bufp, nleft)) < 0) {
             return -1; /* errno set by read() */
-        } else if (nread == 0) {
+        }
+        if (nread == 0) {
             break; /* EOF */
         }
         nleft -= (size_t)nread;
@@ -538,32 +659,99 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 }
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered), finding its end with
+ *    memchr() over the buffered bytes rather than a byte at a time
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    size_t n;
+    size_t n = 0, cnt;
     ssize_t rc;
-    char c, *bufp = usrbuf;
+    char *bufp = usrbuf, *nl;
 
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
+    if (maxlen == 0) {
+        return 0;
+    }
+    while (n < maxlen - 1) {
+        if ((rc = rio_fill(rp)) < 0) {
+            return -1; /* Error */
+        } else if (rc == 0) {
+            break; /* EOF, with or without some data read */
+        }
+
+        /* Take bytes up to the newline, or as many as fit */
+        cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt) {
+            cnt = (size_t)rp->rio_cnt;
+        }
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL) {
+            cnt = (size_t)(nl - rp->rio_bufptr) + 1;
+        }
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= (ssize_t)cnt;
+        n += cnt;
+        if (nl != NULL) {
+            break;
+        }
+    }
+    bufp[n] = 0;
+    return (ssize_t)n;
+}
+
+/*
+ * rio_peeklineb - Find the next text line in the internal buffer, reading
+ *    more as needed, and return its length, with *linep pointing at it
+ *    where it lies. Nothing is copied, and the line is not NUL-terminated;
+ *    it stays valid until the next call on rp. A line longer than the
+ *    buffer comes back a buffer's worth at a time.
+ */
+ssize_t rio_peeklineb(rio_t *rp, char **linep) {
+    size_t scanned = 0, len;
+    ssize_t nread;
+    char *nl, *end;
+
+    if (rp->rio_cnt <= 0) {
+        rp->rio_cnt = 0;
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while (1) {
+        nl = memchr(rp->rio_bufptr + scanned, '\n',
+                    (size_t)rp->rio_cnt - scanned);
+        if (nl != NULL) {
+            len = (size_t)(nl - rp->rio_bufptr) + 1;
+            break;
+        }
+        scanned = (size_t)rp->rio_cnt;
+
+        /* Make room at the end of the buffer for more of the line */
+        end = rp->rio_bufptr + rp->rio_cnt;
+        if (end == rp->rio_buf + rp->rio_bufsize) {
+            if (rp->rio_bufptr == rp->rio_buf) {
+                len = scanned; /* The line fills the buffer */
                 break;
             }
-        } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break; /* EOF, some data was read */
+            memmove(rp->rio_buf, rp->rio_bufptr, scanned);
+            rp->rio_bufptr = rp->rio_buf;
+            end = rp->rio_buf + scanned;
+        }
+
+        nread = read(rp->rio_fd, end,
+                     (size_t)(rp->rio_buf + rp->rio_bufsize - end));
+        if (nread < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by read() */
             }
+        } else if (nread == 0) {
+            len = scanned; /* EOF, with or without some data read */
+            break;
         } else {
-            return -1; /* Error */
+            rp->rio_cnt += nread;
         }
     }
-    *bufp = 0;
-    return (ssize_t)(n - 1);
+
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= (ssize_t)len;
+    return (ssize_t)len;
 }
 
 /********************************
@@ -624,17 +812,24 @@ int open_clientfd(const char *hostname, const char *port) {
 }
 
 /*
- * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ * open_listenfd_opts - Open and return a listening socket on port, set up
+ *     as opts asks, or as open_listenfd does if opts is NULL. The TCP
+ *     options are only set where the system has them, and are otherwise
+ *     ignored, since the socket works without them.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-int open_listenfd(const char *port) {
+int open_listenfd_opts(const char *port, const listen_opts_t *opts) {
+    static const listen_opts_t defaults = { .backlog = LISTENQ };
     struct addrinfo hints, *listp, *p;
     int listenfd = -1, rc, optval = 1;
 
+    if (opts == NULL) {
+        opts = &defaults;
+    }
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
@@ -658,6 +853,14 @@ int open_listenfd(const char *port) {
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                    sizeof(int));
 
+        /* Lets the kernel spread connections over every socket on the port */
+        if (opts->reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
             break; /* Success */
@@ -676,10 +879,87 @@ int open_listenfd(const char *port) {
         return -1;
     }
 
+#ifdef TCP_DEFER_ACCEPT
+    /* Only wake the acceptor once the client has sent its request */
+    if (opts->defer_accept > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   (const void *)&opts->defer_accept, sizeof(int));
+    }
+#endif
+#ifdef TCP_FASTOPEN
+    /* Let returning clients send their request with the SYN */
+    if (opts->fastopen > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+                   (const void *)&opts->fastopen, sizeof(int));
+    }
+#endif
+
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, opts->backlog > 0 ? opts->backlog : LISTENQ) < 0) {
         close(listenfd);
         return -1;
     }
     return listenfd;
 }
+
+/*
+ * accept_conn - Accept a connection, as accept() does, with close-on-exec
+ *     set on the new socket so that programs the server runs don't inherit
+ *     it, and nonblocking mode too if nonblock is set. Where accept4() is
+ *     available, this takes a single system call.
+ */
+int accept_conn(int listenfd, struct sockaddr *addr, socklen_t *addrlen,
+                bool nonblock) {
+    int connfd;
+
+#ifdef SOCK_CLOEXEC
+    connfd = accept4(listenfd, addr, addrlen,
+                     SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0));
+#else
+    connfd = accept(listenfd, addr, addrlen);
+    if (connfd >= 0) {
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);
+        if (nonblock) {
+            fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+#endif
+    return connfd;
+}
+
+/*
+ * set_tcp_nodelay - Turn off Nagle's algorithm on a connected socket, so
+ *     that a small write that ends a message goes out at once instead of
+ *     waiting for the peer to acknowledge earlier data. Returns 0 on
+ *     success, -1 with errno set on error.
+ */
+int set_tcp_nodelay(int fd) {
+    int optval = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&optval,
+                      sizeof(int));
+}
+
+/*
+ * open_listenfd - Open and return a listening socket on port. This
+ *     function is reentrant and protocol-independent.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+int open_listenfd(const char *port) {
+    return open_listenfd_opts(port, NULL);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but the socket shares its
+ *     port with every other socket opened this way, and the kernel balances
+ *     incoming connections across them. Each of several accept threads can
+ *     then have a socket and an accept queue of its own.
+ */
+int open_reuseport_listenfd(const char *port) {
+    listen_opts_t opts = { .backlog = LISTENQ, .reuseport = true };
+
+    return open_listenfd_opts(port, &opts);
+}
@@ -0,0 +1,453 @@
+/**
+ * @file disk_cache.c
+ * @brief Memory-mapped slab file holding objects evicted from the cache
+ *
+ * The slab file is allocated in full when the tier starts and mapped
+ * shared, so the writer stores an object with a memcpy() into the mapping
+ * and the kernel writes the dirty pages back in its own time. Hits are
+ * sent from the same pages with sendfile(), so the body never passes
+ * through a user buffer.
+ *
+ * Stored objects are kept on a list in file order. The writer's position
+ * in the file is disk_pos, and disk_cursor is the first object at or after
+ * it, which is the next one to be reclaimed. To place an object, the
+ * writer reclaims every object from the cursor on that overlaps the space
+ * it needs; if one of them is pinned by a reader, it moves its position
+ * past that object and tries again from there. Everything behind the
+ * position was written more recently than anything ahead of it, so the
+ * objects reclaimed are always the oldest ones.
+ *
+ * One mutex protects the index, the list, the pins, and the counters. The
+ * writer only holds it to find space and to index an object, not while
+ * copying the object into the file, so lookups never wait on the disk.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "disk_cache.h"
+#include "cache.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+/* Smallest number of index buckets */
+#define DISK_CACHE_MIN_BUCKETS 256
+
+/* Expected average object size, which sizes the index */
+#define DISK_CACHE_AVG_OBJECT 4096
+
+/* The slab file and its mapping */
+static int disk_fd = -1;
+static char *disk_map = NULL;
+static size_t disk_capacity = 0;
+
+/* Index from key to object, and the objects in file order */
+static disk_obj_t **disk_index = NULL;
+static size_t disk_nbuckets = 0;
+static disk_obj_t *disk_head = NULL;
+static disk_obj_t *disk_tail = NULL;
+
+/* The writer's position, and the first object at or after it */
+static size_t disk_pos = 0;
+static disk_obj_t *disk_cursor = NULL;
+
+/* Counters, protected by disk_lock */
+static disk_cache_stats_t disk_stats;
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Evicted objects waiting for the writer, protected by disk_queue_lock */
+static cache_obj_t *disk_queue[DISK_CACHE_QUEUE_DEPTH];
+static size_t disk_queue_head = 0;
+static size_t disk_queue_count = 0;
+static pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_queue_ready = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Returns the index bucket for a hash.
+ *
+ * @param hash The key's hash.
+ * @return The head of the bucket's chain.
+ */
+static disk_obj_t **disk_bucket(uint32_t hash) {
+    return &disk_index[hash & (disk_nbuckets - 1)];
+}
+
+/**
+ * Finds the object indexed under a key. The caller must hold disk_lock.
+ *
+ * @param key The normalized request key.
+ * @param hash The key's hash.
+ * @return The object, or NULL if the key is not stored.
+ */
+static disk_obj_t *disk_find(const char *key, uint32_t hash) {
+    disk_obj_t *obj;
+
+    for (obj = *disk_bucket(hash); obj != NULL; obj = obj->hnext) {
+        if (obj->hash == hash && strcmp(obj->key, key) == 0) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Removes an object from the index, so that lookups no longer find it. Its
+ * space stays in use until it is reclaimed. The caller must hold disk_lock.
+ *
+ * @param obj An indexed object.
+ */
+static void disk_unindex(disk_obj_t *obj) {
+    disk_obj_t **p = disk_bucket(obj->hash);
+
+    while (*p != obj) {
+        p = &(*p)->hnext;
+    }
+    *p = obj->hnext;
+    obj->indexed = false;
+    disk_stats.objects--;
+    disk_stats.bytes -= obj->size;
+}
+
+/**
+ * Reclaims an object's space and frees it. The caller must hold disk_lock,
+ * and no reader may have the object pinned.
+ *
+ * @param obj The object.
+ */
+static void disk_reclaim(disk_obj_t *obj) {
+    if (obj->indexed) {
+        disk_unindex(obj);
+        disk_stats.evictions++;
+    }
+    if (disk_cursor == obj) {
+        disk_cursor = obj->next;
+    }
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else {
+        disk_head = obj->next;
+    }
+    if (obj->next) {
+        obj->next->prev = obj->prev;
+    } else {
+        disk_tail = obj->prev;
+    }
+    Free(obj->key);
+    Free(obj);
+}
+
+/**
+ * Finds space for an object at the writer's position, reclaiming the
+ * objects in its way, and links the object into the file order there. The
+ * caller must hold disk_lock.
+ *
+ * @param obj The object, with its size set.
+ * @return false if no space could be found, because every object in the
+ *         way is pinned.
+ */
+static bool disk_place(disk_obj_t *obj) {
+    bool wrapped = false;
+    disk_obj_t *victim;
+
+    while (1) {
+        if (disk_pos + obj->size > disk_capacity) {
+            if (wrapped) {
+                return false;
+            }
+            disk_pos = 0;
+            disk_cursor = disk_head;
+            wrapped = true;
+        }
+
+        while (disk_cursor && disk_cursor->offset < disk_pos + obj->size &&
+               disk_cursor->refcnt == 0) {
+            disk_reclaim(disk_cursor);
+        }
+        if (!disk_cursor || disk_cursor->offset >= disk_pos + obj->size) {
+            break;
+        }
+
+        // Step over an object a reader is still sending
+        victim = disk_cursor;
+        disk_pos = victim->offset + victim->size;
+        disk_cursor = victim->next;
+    }
+
+    obj->offset = disk_pos;
+    disk_pos += obj->size;
+
+    // Link it in just before the cursor, which keeps the list in file order
+    obj->next = disk_cursor;
+    obj->prev = disk_cursor ? disk_cursor->prev : disk_tail;
+    if (obj->prev) {
+        obj->prev->next = obj;
+    } else {
+        disk_head = obj;
+    }
+    if (disk_cursor) {
+        disk_cursor->prev = obj;
+    } else {
+        disk_tail = obj;
+    }
+    return true;
+}
+
+/**
+ * Copies an evicted object into the slab file and indexes it, replacing
+ * any older copy stored under the same key.
+ *
+ * @param cobj The evicted object.
+ */
+static void disk_write(const cache_obj_t *cobj) {
+    disk_obj_t *obj, *old;
+
+    obj = Malloc(sizeof(disk_obj_t));
+    obj->key = Malloc(strlen(cobj->key) + 1);
+    strcpy(obj->key, cobj->key);
+    obj->hash = cobj->hash;
+    obj->size = cobj->size;
+    obj->indexed = false;
+    obj->refcnt = 0;
+    obj->hnext = NULL;
+
+    pthread_mutex_lock(&disk_lock);
+    if (obj->size > disk_capacity || !disk_place(obj)) {
+        disk_stats.drops++;
+        pthread_mutex_unlock(&disk_lock);
+        Free(obj->key);
+        Free(obj);
+        return;
+    }
+    pthread_mutex_unlock(&disk_lock);
+
+    // Only this thread reclaims space, so the object's space stays its own
+    memcpy(disk_map + obj->offset, cobj->data, obj->size);
+
+    pthread_mutex_lock(&disk_lock);
+    if ((old = disk_find(obj->key, obj->hash)) != NULL) {
+        disk_unindex(old);
+        if (old->refcnt == 0) {
+            disk_reclaim(old);
+        }
+    }
+    obj->hnext = *disk_bucket(obj->hash);
+    *disk_bucket(obj->hash) = obj;
+    obj->indexed = true;
+    disk_stats.writes++;
+    disk_stats.objects++;
+    disk_stats.bytes += obj->size;
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/**
+ * Writes evicted objects to the slab file as they are queued.
+ *
+ * @param arg Unused.
+ * @return Never returns.
+ */
+static void *disk_writer(void *arg) {
+    cache_obj_t *obj;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&disk_queue_lock);
+        while (disk_queue_count == 0) {
+            pthread_cond_wait(&disk_queue_ready, &disk_queue_lock);
+        }
+        obj = disk_queue[disk_queue_head];
+        disk_queue_head = (disk_queue_head + 1) % DISK_CACHE_QUEUE_DEPTH;
+        disk_queue_count--;
+        pthread_mutex_unlock(&disk_queue_lock);
+
+        disk_write(obj);
+        cache_release(obj);
+    }
+    return NULL;
+}
+
+/**
+ * Creates the slab file, allocates and maps it, and starts the writer.
+ * Must be called once before any worker thread accesses the cache.
+ *
+ * Anything already in the file is discarded, since the index that
+ * described it did not outlive the process that wrote it.
+ *
+ * @param path The slab file.
+ * @param size The size of the slab file in bytes, or 0 for
+ *             DISK_CACHE_DEFAULT_SIZE.
+ * @return false, with the reason printed, if the file could not be set up.
+ */
+bool disk_cache_init(const char *path, size_t size) {
+    pthread_t tid;
+    int rc;
+
+    if (size == 0) {
+        size = DISK_CACHE_DEFAULT_SIZE;
+    }
+
+    if ((disk_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        fprintf(stderr, "Error: unable to open %s: %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    if ((rc = posix_fallocate(disk_fd, 0, (off_t)size)) != 0) {
+        fprintf(stderr, "Error: unable to allocate %s: %s\n", path,
+                strerror(rc));
+        close(disk_fd);
+        return false;
+    }
+    disk_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                    0);
+    if (disk_map == MAP_FAILED) {
+        fprintf(stderr, "Error: unable to map %s: %s\n", path,
+                strerror(errno));
+        close(disk_fd);
+        return false;
+    }
+
+    disk_nbuckets = DISK_CACHE_MIN_BUCKETS;
+    while (disk_nbuckets < size / DISK_CACHE_AVG_OBJECT) {
+        disk_nbuckets *= 2;
+    }
+    disk_index = Calloc(disk_nbuckets, sizeof(disk_obj_t *));
+    disk_capacity = size;
+    disk_stats.capacity = size;
+
+    if (pthread_create(&tid, NULL, disk_writer, NULL) != 0) {
+        fprintf(stderr, "Error: failed to create disk cache writer\n");
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+/**
+ * Queues an object evicted from the in-memory cache to be written to the
+ * slab file. The cache's reference to the object passes to the tier, which
+ * drops it once the object is written. Never blocks: if the tier is off or
+ * the writer is too far behind, the object is dropped at once.
+ *
+ * @param obj The evicted object.
+ */
+void disk_cache_store(cache_obj_t *obj) {
+    if (disk_capacity == 0) {
+        cache_release(obj);
+        return;
+    }
+
+    pthread_mutex_lock(&disk_queue_lock);
+    if (disk_queue_count == DISK_CACHE_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&disk_queue_lock);
+        pthread_mutex_lock(&disk_lock);
+        disk_stats.drops++;
+        pthread_mutex_unlock(&disk_lock);
+        cache_release(obj);
+        return;
+    }
+    disk_queue[(disk_queue_head + disk_queue_count) %
+               DISK_CACHE_QUEUE_DEPTH] = obj;
+    disk_queue_count++;
+    pthread_cond_signal(&disk_queue_ready);
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+/**
+ * Looks up an object in the slab file and pins it.
+ *
+ * @param key The normalized request key.
+ * @return A pinned object that must be passed to disk_cache_release(), or
+ *         NULL on a miss or if the tier is off.
+ */
+disk_obj_t *disk_cache_lookup(const char *key) {
+    uint32_t hash;
+    disk_obj_t *obj;
+
+    if (disk_capacity == 0) {
+        return NULL;
+    }
+
+    hash = cache_hash(key);
+    pthread_mutex_lock(&disk_lock);
+    obj = disk_find(key, hash);
+    if (obj) {
+        obj->refcnt++;
+        disk_stats.hits++;
+    } else {
+        disk_stats.misses++;
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return obj;
+}
+
+/**
+ * Returns the response bytes of a pinned object, as mapped from the file.
+ *
+ * @param obj An object returned by disk_cache_lookup().
+ * @return The first of obj->size bytes.
+ */
+const char *disk_cache_data(const disk_obj_t *obj) {
+    return disk_map + obj->offset;
+}
+
+/**
+ * Sends part of a pinned object's response straight from the slab file.
+ *
+ * @param fd The descriptor to send to.
+ * @param obj An object returned by disk_cache_lookup().
+ * @param off Where in the response to start.
+ * @param len The number of bytes to send.
+ * @return 0 on success, -1 on write error.
+ */
+int disk_cache_send(int fd, const disk_obj_t *obj, size_t off, size_t len) {
+    off_t pos = (off_t)(obj->offset + off);
+    ssize_t n;
+
+    while (len > 0) {
+        n = sendfile(fd, disk_fd, &pos, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Unpins an object, so that its space can be reclaimed.
+ *
+ * @param obj An object returned by disk_cache_lookup().
+ */
+void disk_cache_release(disk_obj_t *obj) {
+    pthread_mutex_lock(&disk_lock);
+    obj->refcnt--;
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/**
+ * Takes a snapshot of the tier's counters.
+ *
+ * @param stats Where to store the counters.
+ */
+void disk_cache_get_stats(disk_cache_stats_t *stats) {
+    pthread_mutex_lock(&disk_lock);
+    *stats = disk_stats;
+    pthread_mutex_unlock(&disk_lock);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file disk_cache.h
+ * @brief Disk-backed second tier of the proxy's web object cache
+ *
+ * Objects evicted from the in-memory cache are handed to a writer thread,
+ * which copies them into a preallocated slab file mapped into memory. An
+ * in-memory index maps each key to where its response sits in the file, so
+ * a lookup never touches the disk. The file is used as a ring: the writer
+ * places each object after the last one, reclaiming the oldest objects in
+ * its way, and wraps around to the start when it reaches the end.
+ *
+ * Objects handed out by disk_cache_lookup() are pinned, and the writer
+ * steps over pinned objects instead of overwriting them, so a worker can
+ * keep sending one to a slow client with sendfile() while the ring moves
+ * on. Every successful lookup must be paired with a call to
+ * disk_cache_release().
+ *
+ * The tier is off unless disk_cache_init() is called, in which case evicted
+ * objects are simply freed.
+ */
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "cache.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default size of the slab file */
+#define DISK_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/* Most evicted objects waiting for the writer; more are dropped */
+#define DISK_CACHE_QUEUE_DEPTH 64
+
+/* An object stored in the slab file */
+typedef struct disk_obj {
+    struct disk_obj *hnext; /* Next object in the index bucket */
+    struct disk_obj *prev;  /* Previous object in file order */
+    struct disk_obj *next;  /* Next object in file order */
+    char *key;              /* Normalized request key */
+    uint32_t hash;          /* Hash of key */
+    size_t offset;          /* Where the response starts in the file */
+    size_t size;            /* Number of bytes of response */
+    bool indexed;           /* Still reachable from the index */
+    unsigned int refcnt;    /* Number of active readers */
+} disk_obj_t;
+
+/* Counters for the tier */
+typedef struct {
+    uint64_t hits;      /* Lookups that found an object */
+    uint64_t misses;    /* Lookups that did not */
+    uint64_t writes;    /* Objects written to the file */
+    uint64_t drops;     /* Evicted objects that were not written */
+    uint64_t evictions; /* Objects overwritten to make room */
+    size_t objects;     /* Objects currently stored */
+    size_t bytes;       /* Bytes currently stored */
+    size_t capacity;    /* Size of the file, or 0 if the tier is off */
+} disk_cache_stats_t;
+
+bool disk_cache_init(const char *path, size_t size);
+void disk_cache_store(cache_obj_t *obj);
+disk_obj_t *disk_cache_lookup(const char *key);
+const char *disk_cache_data(const disk_obj_t *obj);
+int disk_cache_send(int fd, const disk_obj_t *obj, size_t off, size_t len);
+void disk_cache_release(disk_obj_t *obj);
+void disk_cache_get_stats(disk_cache_stats_t *stats);
+
+#endif /* DISK_CACHE_H */
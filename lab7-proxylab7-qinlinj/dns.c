@@ -0,0 +1,475 @@
+/**
+ * @file dns.c
+ * @brief Process-wide cache of origin name lookups
+ *
+ * Entries live in a hash table under one mutex; lookups themselves run
+ * without it. The first thread to miss on a name inserts an entry marked
+ * as resolving and calls getaddrinfo(). Later threads asking for the same
+ * name find that entry and sleep on a condition variable until it is
+ * filled in. Asynchronous callers instead register an event descriptor on
+ * the entry and are signalled once a resolver thread has filled it in.
+ *
+ * A stale entry is unlinked from the table when it is next looked up and
+ * freed once its last holder releases it, so a refresh never pulls
+ * addresses out from under a connection that is still using them.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "dns.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of hash buckets */
+#define DNS_BUCKETS 256
+
+static dns_entry_t *dns_table[DNS_BUCKETS];
+static size_t dns_count = 0;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Hashes a lookup key (FNV-1a).
+ *
+ * @param key The key.
+ * @return The bucket index.
+ */
+static size_t dns_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h % DNS_BUCKETS;
+}
+
+/**
+ * Frees an entry that is neither in the table nor held by anyone.
+ *
+ * @param e The entry.
+ */
+static void dns_free(dns_entry_t *e) {
+    if (e->addrs) {
+        freeaddrinfo(e->addrs);
+    }
+    Free(e->notify_fds);
+    Free(e->key);
+    Free(e);
+}
+
+/**
+ * Removes an entry from the table, freeing it if nobody holds it. The
+ * caller must hold dns_lock.
+ *
+ * @param prevp The link that points to the entry.
+ */
+static void dns_unlink(dns_entry_t **prevp) {
+    dns_entry_t *e = *prevp;
+
+    *prevp = e->next;
+    e->linked = false;
+    dns_count--;
+    if (e->refcnt == 0) {
+        dns_free(e);
+    }
+}
+
+/**
+ * Drops every expired entry that has finished resolving. The caller must
+ * hold dns_lock.
+ *
+ * @param now The current time.
+ */
+static void dns_sweep(time_t now) {
+    dns_entry_t **prevp;
+
+    for (size_t b = 0; b < DNS_BUCKETS; b++) {
+        prevp = &dns_table[b];
+        while (*prevp) {
+            if (!(*prevp)->resolving && (*prevp)->expires <= now) {
+                dns_unlink(prevp);
+            } else {
+                prevp = &(*prevp)->next;
+            }
+        }
+    }
+}
+
+/**
+ * Finds the current entry for a key, dropping it if it is stale, or
+ * inserts a new one marked as resolving. Either way the caller gets a
+ * reference. The caller must hold dns_lock.
+ *
+ * @param key The "host:port" key.
+ * @param created Set to whether a new entry was inserted, in which case
+ *                the caller must resolve it.
+ * @return The entry.
+ */
+static dns_entry_t *dns_get(const char *key, bool *created) {
+    size_t b = dns_hash(key);
+    time_t now = time(NULL);
+    dns_entry_t **prevp, *e;
+
+    for (prevp = &dns_table[b]; (e = *prevp) != NULL; prevp = &e->next) {
+        if (strcmp(e->key, key) == 0) {
+            if (e->resolving || e->expires > now) {
+                e->refcnt++;
+                *created = false;
+                return e;
+            }
+            dns_unlink(prevp); // Stale
+            break;
+        }
+    }
+
+    if (dns_count >= DNS_CACHE_MAX) {
+        dns_sweep(now);
+    }
+
+    e = Calloc(1, sizeof(dns_entry_t));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->resolving = true;
+    e->linked = true;
+    e->refcnt = 1;
+    e->next = dns_table[b];
+    dns_table[b] = e;
+    dns_count++;
+    *created = true;
+    return e;
+}
+
+/**
+ * Formats the lookup key for a host and port.
+ *
+ * @param key The buffer for the key, MAXLINE bytes long.
+ * @param host The host name.
+ * @param port The port.
+ * @return 0 on success, -1 if the key does not fit.
+ */
+static int dns_key(char *key, const char *host, const char *port) {
+    return snprintf(key, MAXLINE, "%s:%s", host, port) < MAXLINE ? 0 : -1;
+}
+
+/**
+ * Resolves an entry's name and publishes the result, waking every thread
+ * and event loop waiting for it.
+ *
+ * @param e An entry marked as resolving, held by the caller.
+ * @param host The host name.
+ * @param port The port.
+ */
+static void dns_resolve(dns_entry_t *e, const char *host, const char *port) {
+    struct addrinfo hints, *addrs = NULL;
+    uint64_t one = 1;
+    int rc, *fds;
+    size_t nfds;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, port, &hints, &addrs)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        addrs = NULL;
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    e->error = rc;
+    e->addrs = addrs;
+    e->expires = time(NULL) + (rc == 0 ? DNS_CACHE_TTL : DNS_NEGATIVE_TTL);
+    e->resolving = false;
+    fds = e->notify_fds;
+    nfds = e->nnotify;
+    e->notify_fds = NULL;
+    e->nnotify = 0;
+    pthread_cond_broadcast(&dns_done);
+    pthread_mutex_unlock(&dns_lock);
+
+    for (size_t i = 0; i < nfds; i++) {
+        if (write(fds[i], &one, sizeof(one)) < 0) {
+            continue; // Counter full: the waiter is already due to wake
+        }
+    }
+    Free(fds);
+}
+
+/* Work for a background resolver thread */
+typedef struct {
+    dns_entry_t *entry; /* Entry to resolve, held by the thread */
+    char *host;         /* Host name */
+    char *port;         /* Port */
+} dns_job_t;
+
+/**
+ * Background resolver thread routine.
+ *
+ * @param arg The dns_job_t to run.
+ * @return NULL.
+ */
+static void *dns_thread(void *arg) {
+    dns_job_t *job = arg;
+
+    dns_resolve(job->entry, job->host, job->port);
+    dns_release(job->entry);
+    Free(job->host);
+    Free(job->port);
+    Free(job);
+    return NULL;
+}
+
+/**
+ * Looks up a host and port, waiting for the result if it is not cached.
+ *
+ * @param host The host name.
+ * @param port The port.
+ * @return The entry, whose addrs is NULL if the lookup failed, or NULL if
+ *         the name is too long to look up. Release it with dns_release().
+ */
+dns_entry_t *dns_lookup(const char *host, const char *port) {
+    char key[MAXLINE];
+    dns_entry_t *e;
+    bool created;
+
+    if (dns_key(key, host, port) < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    e = dns_get(key, &created);
+    if (!created) {
+        while (e->resolving) {
+            pthread_cond_wait(&dns_done, &dns_lock);
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    if (created) {
+        dns_resolve(e, host, port);
+    }
+    return e;
+}
+
+/**
+ * Looks up a host and port without blocking. If the result is not cached,
+ * a background thread resolves it and then writes to notify_fd, an
+ * eventfd or pipe, after which the caller should ask again.
+ *
+ * @param host The host name.
+ * @param port The port.
+ * @param notify_fd The descriptor to signal once the lookup completes.
+ * @param entry Set to the entry if the result is available. Release it
+ *              with dns_release().
+ * @return 0 if *entry was set, 1 if the lookup is in progress, -1 if the
+ *         name is too long to look up.
+ */
+int dns_lookup_async(const char *host, const char *port, int notify_fd,
+                     dns_entry_t **entry) {
+    char key[MAXLINE];
+    dns_entry_t *e;
+    dns_job_t *job;
+    pthread_t tid;
+    bool created;
+
+    if (dns_key(key, host, port) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    e = dns_get(key, &created);
+    if (!e->resolving) {
+        pthread_mutex_unlock(&dns_lock);
+        *entry = e;
+        return 0;
+    }
+    e->notify_fds =
+        Realloc(e->notify_fds, (e->nnotify + 1) * sizeof(e->notify_fds[0]));
+    e->notify_fds[e->nnotify++] = notify_fd;
+    if (!created) {
+        e->refcnt--; // The caller asks again once notified
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    if (created) {
+        // The new entry's reference passes to the resolver thread
+        job = Malloc(sizeof(dns_job_t));
+        job->entry = e;
+        job->host = Malloc(strlen(host) + 1);
+        strcpy(job->host, host);
+        job->port = Malloc(strlen(port) + 1);
+        strcpy(job->port, port);
+        if (pthread_create(&tid, NULL, dns_thread, job) == 0) {
+            pthread_detach(tid);
+        } else {
+            dns_thread(job);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Releases an entry returned by dns_lookup() or dns_lookup_async().
+ *
+ * @param e The entry, or NULL.
+ */
+void dns_release(dns_entry_t *e) {
+    if (!e) {
+        return;
+    }
+    pthread_mutex_lock(&dns_lock);
+    if (--e->refcnt == 0 && !e->linked) {
+        dns_free(e);
+    }
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/**
+ * Orders addresses so that successive connection attempts alternate
+ * between address families, starting with the resolver's first choice.
+ *
+ * @param addrs The resolved addresses.
+ * @param out The array to store the ordered addresses in.
+ * @return The number of addresses stored, at most DNS_MAX_ADDRS.
+ */
+static size_t dns_interleave(struct addrinfo *addrs, struct addrinfo **out) {
+    struct addrinfo *first[DNS_MAX_ADDRS], *other[DNS_MAX_ADDRS], *p;
+    size_t nfirst = 0, nother = 0, n = 0, i = 0, j = 0;
+
+    for (p = addrs; p != NULL; p = p->ai_next) {
+        if (p->ai_family == addrs->ai_family) {
+            if (nfirst < DNS_MAX_ADDRS) {
+                first[nfirst++] = p;
+            }
+        } else if (nother < DNS_MAX_ADDRS) {
+            other[nother++] = p;
+        }
+    }
+
+    while (n < DNS_MAX_ADDRS && (i < nfirst || j < nother)) {
+        if (i < nfirst) {
+            out[n++] = first[i++];
+        }
+        if (n < DNS_MAX_ADDRS && j < nother) {
+            out[n++] = other[j++];
+        }
+    }
+    return n;
+}
+
+/**
+ * Races connections to a list of addresses. A new attempt is started
+ * whenever the previous ones have failed or have gone DNS_CONNECT_STAGGER_MS
+ * without completing; the first to succeed wins and the rest are closed.
+ *
+ * @param addrs The addresses, in the order to try them.
+ * @param n The number of addresses.
+ * @return A connected, blocking socket, or -1 if every attempt failed.
+ */
+static int dns_connect(struct addrinfo **addrs, size_t n) {
+    struct pollfd pfds[DNS_MAX_ADDRS];
+    size_t started = 0, active = 0, i;
+    int fd = -1, s, flags, err;
+    socklen_t errlen;
+
+    while (fd < 0 && (started < n || active > 0)) {
+        if (started < n) {
+            struct addrinfo *p = addrs[started++];
+
+            s = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (s < 0) {
+                continue;
+            }
+            flags = fcntl(s, F_GETFL);
+            if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+                close(s);
+                continue;
+            }
+            if (connect(s, p->ai_addr, p->ai_addrlen) == 0) {
+                fd = s;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                close(s);
+                continue; // Failed outright; try the next one now
+            }
+            pfds[active].fd = s;
+            pfds[active].events = POLLOUT;
+            active++;
+        }
+
+        for (i = 0; i < active; i++) {
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, active, started < n ? DNS_CONNECT_STAGGER_MS : -1) <
+            0) {
+            continue;
+        }
+
+        // Collect finished attempts
+        for (i = 0; i < active;) {
+            if (pfds[i].revents == 0) {
+                i++;
+                continue;
+            }
+            err = 0;
+            errlen = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) <
+                0) {
+                err = errno;
+            }
+            if (err == 0 && fd < 0) {
+                fd = pfds[i].fd;
+            } else {
+                close(pfds[i].fd);
+            }
+            pfds[i] = pfds[--active];
+        }
+    }
+
+    // Abandon the attempts that lost the race
+    for (i = 0; i < active; i++) {
+        close(pfds[i].fd);
+    }
+
+    if (fd >= 0) {
+        flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    return fd;
+}
+
+/**
+ * Opens a connection to a server, like open_clientfd(), but looks the name
+ * up through the cache and tries the server's addresses in parallel.
+ *
+ * @param host The server's host name.
+ * @param port The server's port.
+ * @return A connected socket, or -1 on error.
+ */
+int dns_open_clientfd(const char *host, const char *port) {
+    struct addrinfo *order[DNS_MAX_ADDRS];
+    dns_entry_t *e;
+    size_t n;
+    int fd = -1;
+
+    e = dns_lookup(host, port);
+    if (e && e->addrs) {
+        n = dns_interleave(e->addrs, order);
+        fd = dns_connect(order, n);
+    }
+    dns_release(e);
+    return fd;
+}
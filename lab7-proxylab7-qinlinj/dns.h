@@ -0,0 +1,60 @@
+/**
+ * @file dns.h
+ * @brief Process-wide cache of origin name lookups
+ *
+ * Each (host, port) maps to the result of a getaddrinfo() call: the list of
+ * addresses, or the error it failed with. Successful lookups are kept for
+ * DNS_CACHE_TTL seconds and failures for DNS_NEGATIVE_TTL, so a mistyped
+ * host does not cost a full lookup on every request. Concurrent lookups of
+ * the same name wait for the one already in flight instead of starting
+ * their own.
+ *
+ * Entries are reference counted like cache objects: every entry handed out
+ * must be paired with a call to dns_release(), and its addresses stay valid
+ * until then even if the entry expires.
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Seconds a successful lookup is cached */
+#define DNS_CACHE_TTL 60
+
+/* Seconds a failed lookup is cached */
+#define DNS_NEGATIVE_TTL 5
+
+/* Number of entries beyond which expired ones are swept out */
+#define DNS_CACHE_MAX 1024
+
+/* Milliseconds to wait on one connect before also trying the next address */
+#define DNS_CONNECT_STAGGER_MS 250
+
+/* Most addresses dns_open_clientfd() will try */
+#define DNS_MAX_ADDRS 16
+
+/* The result of looking up one (host, port) */
+typedef struct dns_entry {
+    struct dns_entry *next; /* Next entry in the hash bucket */
+    char *key;              /* "host:port" */
+    bool resolving;         /* Lookup still in flight */
+    bool linked;            /* Still reachable from the table */
+    time_t expires;         /* When the result goes stale */
+    int error;              /* getaddrinfo() error, 0 on success */
+    struct addrinfo *addrs; /* Resolved addresses, NULL on error */
+    unsigned int refcnt;    /* Number of holders outside the table */
+    int *notify_fds;        /* Event descriptors to signal on completion */
+    size_t nnotify;         /* Number of descriptors in notify_fds */
+} dns_entry_t;
+
+dns_entry_t *dns_lookup(const char *host, const char *port);
+int dns_lookup_async(const char *host, const char *port, int notify_fd,
+                     dns_entry_t **entry);
+void dns_release(dns_entry_t *entry);
+int dns_open_clientfd(const char *host, const char *port);
+
+#endif /* DNS_H */
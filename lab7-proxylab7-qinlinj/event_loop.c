@@ -0,0 +1,845 @@
+/**
+ * @file event_loop.c
+ * @brief Event-driven serving mode for the proxy, built on epoll
+ *
+ * Each loop thread owns an epoll instance and every connection it accepts.
+ * A connection moves through these states:
+ *
+ *   CONN_READ_REQUEST_LINE  reading "GET <url> HTTP/1.x" from the client
+ *   CONN_READ_HEADERS       reading and rewriting the client's headers
+ *   CONN_RESOLVING          waiting for the origin's name to be looked up
+ *   CONN_CONNECTING         waiting for a non-blocking connect to the origin
+ *   CONN_SEND_REQUEST       writing the rewritten request to the origin
+ *   CONN_RELAY_RESPONSE     streaming the origin's response to the client
+ *   CONN_WRITE_REPLY        writing a cached object or error page
+ *
+ * Whenever an operation would block, the connection registers interest in
+ * exactly the descriptor and direction it is waiting on and returns to the
+ * loop. A descriptor the state machine is not waiting on is removed from the
+ * epoll set, so hang-ups on the idle side of a connection cannot spin the
+ * loop. Because connections never migrate between loops, their state needs
+ * no locking; only the object and DNS caches are shared. Names that are not
+ * cached are looked up by a resolver thread, which signals the loop's
+ * eventfd when it is done; the loop then retries every connection waiting
+ * on a lookup.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "event_loop.h"
+#include "cache.h"
+#include "csapp.h"
+#include "disk_cache.h"
+#include "dns.h"
+#include "proxy.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Maximum number of events handled per epoll_wait call */
+#define MAX_EVENTS 256
+
+/* Size of the per-connection response relay buffer */
+#define RELAY_BUFSIZE MAXBUF
+
+typedef enum {
+    CONN_READ_REQUEST_LINE,
+    CONN_READ_HEADERS,
+    CONN_RESOLVING,
+    CONN_CONNECTING,
+    CONN_SEND_REQUEST,
+    CONN_RELAY_RESPONSE,
+    CONN_WRITE_REPLY
+} conn_state;
+
+typedef struct conn conn_t;
+
+/* A descriptor registered with a loop's epoll instance */
+typedef struct {
+    conn_t *conn;    /* Owning connection, or NULL for the loop's own */
+    int fd;          /* The descriptor, or -1 if closed */
+    uint32_t events; /* Events currently registered, 0 if not registered */
+} endpoint_t;
+
+/* Per-loop state */
+typedef struct {
+    int epfd;            /* The loop's epoll instance */
+    endpoint_t listener; /* The shared listening socket */
+    endpoint_t dns_wake; /* Signalled when a name lookup completes */
+    conn_t *resolving;   /* Connections waiting for a name lookup */
+} loop_t;
+
+/* State of one proxied client connection */
+struct conn {
+    conn_state state;
+    loop_t *loop;               /* The owning loop */
+    int epfd;                   /* The owning loop's epoll instance */
+    conn_t *next_resolving;     /* Next connection waiting for a lookup */
+    endpoint_t client;          /* Connection from the client */
+    endpoint_t server;          /* Connection to the origin */
+    char req[MAXBUF];           /* Request bytes read but not yet consumed */
+    size_t req_len;             /* Number of bytes in req */
+    char *servername;           /* Origin host name */
+    char *port;                 /* Origin port */
+    char *key;                  /* Cache key, or NULL if uncacheable */
+    char *fwd;                  /* Rewritten request for the origin */
+    size_t fwd_len;             /* Number of bytes in fwd */
+    size_t fwd_size;            /* Allocated size of fwd */
+    size_t fwd_off;             /* Bytes of fwd already sent */
+    dns_entry_t *dns;           /* Origin addresses, held while connecting */
+    struct addrinfo *next_addr; /* Next address to try connecting to */
+    char *relay;                /* Response bytes read but not yet sent */
+    size_t relay_len;           /* Number of bytes in relay */
+    size_t relay_off;           /* Bytes of relay already sent */
+    char *obj_buf;              /* Copy of the response for the cache */
+    size_t obj_size;            /* Number of bytes in obj_buf */
+    size_t obj_cap;             /* Allocated size of obj_buf */
+    bool cacheable;             /* Response still fits in the cache */
+    cache_obj_t *obj;           /* Cached object being replied with, if any */
+    char *reply;                /* Canned reply (error page or cached object) */
+    size_t reply_len;           /* Number of bytes in reply */
+    size_t reply_off;           /* Bytes of reply already sent */
+    uint64_t start;             /* When the request line arrived, or 0 */
+    uint64_t connect_start;     /* When connecting to the origin began */
+    bool first_byte;            /* Some of the response has been sent */
+};
+
+/**
+ * Puts a descriptor into non-blocking mode.
+ *
+ * @param fd The descriptor.
+ * @return 0 on success, -1 on error.
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Registers interest in exactly the given events on an endpoint, adding,
+ * modifying, or removing it from the epoll set as needed.
+ *
+ * @param epfd The epoll instance.
+ * @param ep The endpoint.
+ * @param events The events to wait for, or 0 to stop waiting.
+ */
+static void endpoint_want(int epfd, endpoint_t *ep, uint32_t events) {
+    struct epoll_event ev;
+    int op;
+
+    if (ep->fd < 0 || ep->events == events) {
+        return;
+    }
+
+    if (events == 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+    } else {
+        op = ep->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        ev.events = events;
+        ev.data.ptr = ep;
+        if (epoll_ctl(epfd, op, ep->fd, &ev) < 0) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        }
+    }
+    ep->events = events;
+}
+
+/**
+ * Closes an endpoint's descriptor, removing it from the epoll set.
+ *
+ * @param epfd The epoll instance.
+ * @param ep The endpoint.
+ */
+static void endpoint_close(int epfd, endpoint_t *ep) {
+    if (ep->fd >= 0) {
+        endpoint_want(epfd, ep, 0);
+        close(ep->fd);
+        ep->fd = -1;
+    }
+}
+
+/**
+ * Makes a heap copy of a string.
+ *
+ * @param s The string to copy.
+ * @return The copy.
+ */
+static char *copy_string(const char *s) {
+    char *copy = Malloc(strlen(s) + 1);
+    strcpy(copy, s);
+    return copy;
+}
+
+/**
+ * Creates a connection record for a newly accepted client.
+ *
+ * @param loop The owning loop.
+ * @param client_fd The client's non-blocking descriptor.
+ * @return The connection.
+ */
+static conn_t *conn_new(loop_t *loop, int client_fd) {
+    conn_t *c = Calloc(1, sizeof(conn_t));
+
+    c->state = CONN_READ_REQUEST_LINE;
+    c->loop = loop;
+    c->epfd = loop->epfd;
+    c->client.conn = c;
+    c->client.fd = client_fd;
+    c->server.conn = c;
+    c->server.fd = -1;
+    c->cacheable = true;
+    return c;
+}
+
+/**
+ * Closes both sides of a connection and frees it.
+ *
+ * @param c The connection.
+ */
+static void conn_free(conn_t *c) {
+    if (c->start) {
+        stats_latency(STATS_TOTAL, c->start);
+    }
+    endpoint_close(c->epfd, &c->client);
+    endpoint_close(c->epfd, &c->server);
+    dns_release(c->dns);
+    if (c->obj) {
+        cache_release(c->obj);
+    } else {
+        Free(c->reply);
+    }
+    Free(c->servername);
+    Free(c->port);
+    Free(c->key);
+    Free(c->fwd);
+    Free(c->relay);
+    Free(c->obj_buf);
+    Free(c);
+}
+
+/**
+ * Switches a connection to sending an error page to the client.
+ *
+ * @param c The connection.
+ * @param cause The cause of the error.
+ * @param errnum The HTTP error number (status code).
+ * @param shortmsg A short description of the error.
+ * @param longmsg A longer explanation of the error.
+ */
+static void conn_error(conn_t *c, const char *cause, const char *errnum,
+                       const char *shortmsg, const char *longmsg) {
+    size_t size = MAXLINE + MAXBUF;
+
+    endpoint_close(c->epfd, &c->server);
+    c->reply = Malloc(size);
+    c->reply_len =
+        build_client_error(c->reply, size, cause, errnum, shortmsg, longmsg);
+    c->reply_off = 0;
+    c->state = CONN_WRITE_REPLY;
+}
+
+/**
+ * Appends bytes to the rewritten request, growing it as needed.
+ *
+ * @param c The connection.
+ * @param data The bytes to append.
+ * @param len The number of bytes.
+ */
+static void conn_append_fwd(conn_t *c, const char *data, size_t len) {
+    if (c->fwd_len + len > c->fwd_size) {
+        while (c->fwd_len + len > c->fwd_size) {
+            c->fwd_size = c->fwd_size ? 2 * c->fwd_size : MAXLINE;
+        }
+        c->fwd = Realloc(c->fwd, c->fwd_size);
+    }
+    memcpy(c->fwd + c->fwd_len, data, len);
+    c->fwd_len += len;
+}
+
+/**
+ * Reads whatever the client has sent into the request buffer.
+ *
+ * @param c The connection.
+ * @return 1 if bytes were read, 0 if the read would block, -1 if the client
+ *         closed the connection, sent an oversized line, or failed.
+ */
+static int conn_fill_request(conn_t *c) {
+    ssize_t n;
+
+    if (c->req_len == sizeof(c->req) - 1) {
+        return -1; // Line too long
+    }
+
+    n = read(c->client.fd, c->req + c->req_len,
+             sizeof(c->req) - 1 - c->req_len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            endpoint_want(c->epfd, &c->client, EPOLLIN);
+            return 0;
+        }
+        return -1;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    c->req_len += (size_t)n;
+    c->req[c->req_len] = '\0';
+    return 1;
+}
+
+/**
+ * Removes the first line, of the given length, from the request buffer.
+ *
+ * @param c The connection.
+ * @param len The length of the line, including its newline.
+ */
+static void conn_consume_request(conn_t *c, size_t len) {
+    memmove(c->req, c->req + len, c->req_len - len);
+    c->req_len -= len;
+    c->req[c->req_len] = '\0';
+}
+
+/**
+ * Parses the request line and starts building the rewritten request.
+ *
+ * @param c The connection.
+ * @param line The NUL-terminated request line.
+ * @return true if the request can be proxied, false if an error page has
+ *         been queued instead.
+ */
+static bool conn_parse_request_line(conn_t *c, char *line) {
+    char method[MAXLINE], url[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], servername[MAXLINE], port[MAXLINE];
+    char head[MAXLINE];
+    char key[MAXLINE];
+    size_t len;
+
+    stats_request();
+    c->start = stats_now();
+
+    if (sscanf(line, "%s %s %s", method, url, version) < 3) {
+        conn_error(c, "Parsing Error", "400", "Bad request",
+                   "Cannot parse the request line");
+        return false;
+    }
+
+    if (strcasecmp(method, "GET") != 0) {
+        conn_error(c, method, "501", "Not implemented",
+                   "This proxy only supports the GET method");
+        return false;
+    }
+
+    if (parse_url(url, port, servername, filename) != 0) {
+        conn_error(c, url, "400", "Bad request", "Cannot parse the URL");
+        return false;
+    }
+
+    // The proxy answers requests for its statistics itself
+    if (stats_is_request(servername, filename)) {
+        endpoint_want(c->epfd, &c->client, 0);
+        c->reply = stats_response(false, &c->reply_len);
+        c->reply_off = 0;
+        c->state = CONN_WRITE_REPLY;
+        return false;
+    }
+
+    len = build_request_head(head, MAXLINE, servername, port, filename, false,
+                             false);
+    if (len == 0) {
+        conn_error(c, url, "400", "Bad request", "Cannot parse the URL");
+        return false;
+    }
+    conn_append_fwd(c, head, len);
+
+    c->servername = copy_string(servername);
+    c->port = copy_string(port);
+    if (snprintf(key, MAXLINE, "%s:%s%s", servername, port,
+                 filename[0] ? filename : "/") < MAXLINE) {
+        c->key = copy_string(key);
+    }
+    return true;
+}
+
+/**
+ * Starts a non-blocking connect to the next candidate origin address.
+ * Advances the connection to CONN_SEND_REQUEST once connected, or to
+ * CONN_CONNECTING while the connect is in progress.
+ *
+ * @param c The connection.
+ * @return true if a connect succeeded or is in progress, false if every
+ *         address has failed.
+ */
+static bool conn_connect_next(conn_t *c) {
+    struct addrinfo *p;
+    int fd;
+
+    while ((p = c->next_addr) != NULL) {
+        c->next_addr = p->ai_next;
+
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (set_nonblocking(fd) < 0) {
+            close(fd);
+            continue;
+        }
+
+        c->server.fd = fd;
+        c->server.events = 0;
+        c->connect_start = stats_now();
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            stats_latency(STATS_CONNECT, c->connect_start);
+            c->state = CONN_SEND_REQUEST;
+            return true;
+        }
+        if (errno == EINPROGRESS) {
+            c->state = CONN_CONNECTING;
+            return true;
+        }
+        endpoint_close(c->epfd, &c->server);
+    }
+    return false;
+}
+
+/**
+ * Looks up the origin's name and starts connecting to it. If the lookup
+ * has to wait, the connection is parked in CONN_RESOLVING on its loop's
+ * waiting list until the resolver signals the loop.
+ *
+ * @param c The connection.
+ */
+static void conn_resolve(conn_t *c) {
+    int rc;
+
+    rc = dns_lookup_async(c->servername, c->port, c->loop->dns_wake.fd,
+                          &c->dns);
+    if (rc > 0) {
+        c->state = CONN_RESOLVING;
+        c->next_resolving = c->loop->resolving;
+        c->loop->resolving = c;
+        return;
+    }
+
+    c->next_addr = rc == 0 ? c->dns->addrs : NULL;
+    if (!conn_connect_next(c)) {
+        fprintf(stderr, "Error connecting to server: %s:%s\n", c->servername,
+                c->port);
+        conn_error(c, c->servername, "500", "Internal server error",
+                   "Error forwarding the request");
+    }
+}
+
+/**
+ * Begins serving a fully read request, either from the cache or by
+ * connecting to the origin.
+ *
+ * @param c The connection.
+ */
+static void conn_start_response(conn_t *c) {
+    disk_obj_t *dobj;
+
+    endpoint_want(c->epfd, &c->client, 0);
+
+    if (c->key && (c->obj = cache_lookup(c->key)) != NULL) {
+        c->reply = c->obj->data;
+        c->reply_len = c->obj->size;
+        c->reply_off = 0;
+        c->state = CONN_WRITE_REPLY;
+        return;
+    }
+
+    // The loop cannot block in sendfile(), so a disk hit is copied out of
+    // the file's mapping and sent like a canned reply
+    if (c->key && (dobj = disk_cache_lookup(c->key)) != NULL) {
+        c->reply = memcpy(Malloc(dobj->size), disk_cache_data(dobj),
+                          dobj->size);
+        c->reply_len = dobj->size;
+        c->reply_off = 0;
+        disk_cache_release(dobj);
+        c->state = CONN_WRITE_REPLY;
+        return;
+    }
+
+    conn_resolve(c);
+}
+
+/**
+ * Copies response bytes into the cache buffer until the object outgrows
+ * MAX_OBJECT_SIZE.
+ *
+ * @param c The connection.
+ * @param data The response bytes.
+ * @param len The number of bytes.
+ */
+static void conn_capture(conn_t *c, const char *data, size_t len) {
+    if (!c->cacheable || !c->key) {
+        return;
+    }
+    if (c->obj_size + len > MAX_OBJECT_SIZE) {
+        c->cacheable = false;
+        Free(c->obj_buf);
+        c->obj_buf = NULL;
+        return;
+    }
+    if (c->obj_size + len > c->obj_cap) {
+        while (c->obj_size + len > c->obj_cap) {
+            c->obj_cap = c->obj_cap ? 2 * c->obj_cap : RELAY_BUFSIZE;
+        }
+        if (c->obj_cap > MAX_OBJECT_SIZE) {
+            c->obj_cap = MAX_OBJECT_SIZE;
+        }
+        c->obj_buf = Realloc(c->obj_buf, c->obj_cap);
+    }
+    memcpy(c->obj_buf + c->obj_size, data, len);
+    c->obj_size += len;
+}
+
+/**
+ * Accounts for response bytes written to the client.
+ *
+ * @param c The connection.
+ * @param len The number of bytes.
+ */
+static void conn_sent(conn_t *c, size_t len) {
+    if (!c->first_byte && len > 0) {
+        c->first_byte = true;
+        stats_latency(STATS_TTFB, c->start);
+    }
+    stats_bytes(0, len);
+}
+
+/**
+ * Advances a connection's state machine as far as it can go without
+ * blocking. Frees the connection once it is finished or has failed.
+ *
+ * @param c The connection.
+ */
+static void conn_drive(conn_t *c) {
+    char *nl, *colon;
+    ssize_t n;
+    int rc, err;
+    socklen_t errlen;
+
+    while (1) {
+        switch (c->state) {
+        case CONN_READ_REQUEST_LINE:
+            nl = memchr(c->req, '\n', c->req_len);
+            if (!nl) {
+                if ((rc = conn_fill_request(c)) == 0) {
+                    return;
+                } else if (rc < 0) {
+                    goto done;
+                }
+                break;
+            }
+            *nl = '\0';
+            if (conn_parse_request_line(c, c->req)) {
+                c->state = CONN_READ_HEADERS;
+            }
+            conn_consume_request(c, (size_t)(nl - c->req) + 1);
+            break;
+
+        case CONN_READ_HEADERS:
+            nl = memchr(c->req, '\n', c->req_len);
+            if (!nl) {
+                if ((rc = conn_fill_request(c)) == 0) {
+                    return;
+                } else if (rc < 0) {
+                    goto done;
+                }
+                break;
+            }
+            n = nl - c->req + 1;
+            if (n == 1 || (n == 2 && c->req[0] == '\r')) {
+                conn_append_fwd(c, "\r\n", 2);
+                conn_consume_request(c, (size_t)n);
+                conn_start_response(c);
+                break;
+            }
+            *nl = '\0';
+            colon = memchr(c->req, ':', (size_t)n);
+            if (!colon ||
+                should_forward_header(c->req, (size_t)(colon - c->req))) {
+                conn_append_fwd(c, c->req, (size_t)n - 1);
+                conn_append_fwd(c, "\n", 1);
+            }
+            conn_consume_request(c, (size_t)n);
+            break;
+
+        case CONN_RESOLVING:
+            return; // Woken by loop_resolved()
+
+        case CONN_CONNECTING:
+            if (c->server.events == 0) {
+                // Connect just started; wait until the socket is writable
+                endpoint_want(c->epfd, &c->server, EPOLLOUT);
+                return;
+            }
+            err = 0;
+            errlen = sizeof(err);
+            if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err,
+                           &errlen) < 0) {
+                err = errno;
+            }
+            if (err != 0) {
+                endpoint_close(c->epfd, &c->server);
+                if (!conn_connect_next(c)) {
+                    conn_error(c, c->servername, "500",
+                               "Internal server error",
+                               "Error forwarding the request");
+                }
+                break;
+            }
+            stats_latency(STATS_CONNECT, c->connect_start);
+            c->state = CONN_SEND_REQUEST;
+            break;
+
+        case CONN_SEND_REQUEST:
+            n = write(c->server.fd, c->fwd + c->fwd_off,
+                      c->fwd_len - c->fwd_off);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    endpoint_want(c->epfd, &c->server, EPOLLOUT);
+                    return;
+                }
+                // Nothing has reached the client yet, so report the error
+                conn_error(c, c->servername, "500", "Internal server error",
+                           "Error forwarding the request");
+                break;
+            }
+            c->fwd_off += (size_t)n;
+            if (c->fwd_off == c->fwd_len) {
+                Free(c->fwd);
+                c->fwd = NULL;
+                c->relay = Malloc(RELAY_BUFSIZE);
+                c->state = CONN_RELAY_RESPONSE;
+            }
+            break;
+
+        case CONN_RELAY_RESPONSE:
+            if (c->relay_off == c->relay_len) {
+                // Relay buffer drained; read more from the origin
+                endpoint_want(c->epfd, &c->client, 0);
+                n = read(c->server.fd, c->relay, RELAY_BUFSIZE);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR) {
+                        endpoint_want(c->epfd, &c->server, EPOLLIN);
+                        return;
+                    }
+                    goto done;
+                }
+                if (n == 0) {
+                    // Origin closed: the response is complete
+                    if (c->cacheable && c->key && c->obj_size > 0) {
+                        cache_insert(c->key, Realloc(c->obj_buf, c->obj_size),
+                                     c->obj_size);
+                        c->obj_buf = NULL;
+                    }
+                    goto done;
+                }
+                c->relay_len = (size_t)n;
+                c->relay_off = 0;
+                stats_bytes((size_t)n, 0);
+                conn_capture(c, c->relay, c->relay_len);
+            }
+
+            // Send buffered bytes to the client
+            endpoint_want(c->epfd, &c->server, 0);
+            n = write(c->client.fd, c->relay + c->relay_off,
+                      c->relay_len - c->relay_off);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    endpoint_want(c->epfd, &c->client, EPOLLOUT);
+                    return;
+                }
+                goto done;
+            }
+            conn_sent(c, (size_t)n);
+            c->relay_off += (size_t)n;
+            break;
+
+        case CONN_WRITE_REPLY:
+            if (c->reply_off == c->reply_len) {
+                goto done;
+            }
+            n = write(c->client.fd, c->reply + c->reply_off,
+                      c->reply_len - c->reply_off);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    endpoint_want(c->epfd, &c->client, EPOLLOUT);
+                    return;
+                }
+                goto done;
+            }
+            conn_sent(c, (size_t)n);
+            c->reply_off += (size_t)n;
+            break;
+        }
+    }
+
+done:
+    conn_free(c);
+}
+
+/**
+ * Accepts every pending connection on the listening socket.
+ *
+ * @param loop The loop that owns the new connections.
+ */
+static void loop_accept(loop_t *loop) {
+    int client_fd;
+    conn_t *c;
+
+    while (1) {
+        client_fd = accept_conn(loop->listener.fd, NULL, NULL, true);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                fprintf(stderr, "Error: failed to accept connection: %s\n",
+                        strerror(errno));
+            }
+            return;
+        }
+        set_tcp_nodelay(client_fd);
+
+        c = conn_new(loop, client_fd);
+        conn_drive(c);
+    }
+}
+
+/**
+ * Retries every connection waiting for a name lookup after the resolver
+ * has signalled the loop. Lookups still in flight park their connections
+ * again.
+ *
+ * @param loop The loop.
+ */
+static void loop_resolved(loop_t *loop) {
+    uint64_t count;
+    conn_t *c, *next;
+
+    if (read(loop->dns_wake.fd, &count, sizeof(count)) < 0) {
+        return; // Spurious wakeup
+    }
+
+    c = loop->resolving;
+    loop->resolving = NULL;
+    for (; c != NULL; c = next) {
+        next = c->next_resolving;
+        c->next_resolving = NULL;
+        conn_resolve(c);
+        if (c->state != CONN_RESOLVING) {
+            conn_drive(c);
+        }
+    }
+}
+
+/**
+ * Runs one event loop forever.
+ *
+ * @param arg The loop_t to run.
+ * @return Never returns.
+ */
+static void *loop_run(void *arg) {
+    loop_t *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    endpoint_t *ep;
+    int n, i;
+
+    while (1) {
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            ep = events[i].data.ptr;
+            if (ep == &loop->dns_wake) {
+                loop_resolved(loop);
+            } else if (ep->conn == NULL) {
+                loop_accept(loop);
+            } else {
+                conn_drive(ep->conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Serves connections from a listening socket with a set of epoll loops.
+ * The calling thread runs the first loop.
+ *
+ * @param listen_fd The listening socket.
+ * @param nloops The number of loops (and threads) to run.
+ */
+void event_loop_run(int listen_fd, long nloops) {
+    loop_t *loops = Calloc((size_t)nloops, sizeof(loop_t));
+    pthread_t tid;
+    uint32_t listen_events = EPOLLIN;
+
+#ifdef EPOLLEXCLUSIVE
+    // Wake only one loop per incoming connection
+    listen_events |= EPOLLEXCLUSIVE;
+#endif
+
+    if (set_nonblocking(listen_fd) < 0) {
+        fprintf(stderr,
+                "Error: unable to make listening socket non-blocking\n");
+        exit(1);
+    }
+
+    for (long i = 0; i < nloops; i++) {
+        loops[i].epfd = epoll_create1(0);
+        if (loops[i].epfd < 0) {
+            fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        loops[i].listener.conn = NULL;
+        loops[i].listener.fd = listen_fd;
+        loops[i].listener.events = 0;
+        endpoint_want(loops[i].epfd, &loops[i].listener, listen_events);
+
+        loops[i].dns_wake.conn = NULL;
+        loops[i].dns_wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loops[i].dns_wake.events = 0;
+        if (loops[i].dns_wake.fd < 0) {
+            fprintf(stderr, "eventfd failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        endpoint_want(loops[i].epfd, &loops[i].dns_wake, EPOLLIN);
+    }
+
+    for (long i = 1; i < nloops; i++) {
+        if (pthread_create(&tid, NULL, loop_run, &loops[i]) != 0) {
+            fprintf(stderr, "Error: failed to create event loop thread\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
+    loop_run(&loops[0]);
+    exit(0);
+}
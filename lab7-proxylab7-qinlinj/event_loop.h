@@ -0,0 +1,17 @@
+/**
+ * @file event_loop.h
+ * @brief Event-driven serving mode for the proxy
+ *
+ * In this mode the proxy runs one epoll loop per thread instead of one
+ * blocking worker per connection. Every loop accepts from the shared
+ * listening socket and drives its own non-blocking client and origin
+ * sockets through a per-connection state machine, so an idle or slow
+ * client costs a small connection record rather than a whole thread.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+void event_loop_run(int listen_fd, long nloops) __attribute__((noreturn));
+
+#endif /* EVENT_LOOP_H */
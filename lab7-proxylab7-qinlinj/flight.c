@@ -0,0 +1,207 @@
+/**
+ * @file flight.c
+ * @brief Coalescing of concurrent cache misses on the same object
+ *
+ * Flights in progress live in a hash table under one mutex, which also
+ * protects every flight's state, buffer and size. The leader copies
+ * response bytes into its buffer without the lock and then publishes the
+ * new size under it. While the flight is pending the leader may still move
+ * the buffer to grow it, but followers do not look at it then; from the
+ * time it starts streaming the buffer is large enough for the whole
+ * response and stays put. Bytes below a published size are never written
+ * again, so followers send them to their clients without holding the lock.
+ *
+ * A flight leaves the table as soon as its leader finishes with it, so
+ * requests arriving later go to the cache, or start a new flight, rather
+ * than joining one that is over.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "flight.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Number of hash buckets */
+#define FLIGHT_BUCKETS 256
+
+static flight_t *flight_table[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Hashes a key (FNV-1a).
+ *
+ * @param key The normalized request key.
+ * @return The bucket index.
+ */
+static size_t flight_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h % FLIGHT_BUCKETS;
+}
+
+/**
+ * Joins the flight for a key, starting one if none is in progress.
+ *
+ * @param key The normalized request key.
+ * @param leader Set to whether a new flight was started, in which case the
+ *               caller must fetch the object and call flight_finish().
+ * @return A referenced flight that must be passed to flight_release().
+ */
+flight_t *flight_join(const char *key, bool *leader) {
+    size_t b = flight_hash(key);
+    flight_t *f;
+
+    pthread_mutex_lock(&flight_lock);
+    for (f = flight_table[b]; f != NULL; f = f->next) {
+        if (strcmp(f->key, key) == 0) {
+            f->refcnt++;
+            pthread_mutex_unlock(&flight_lock);
+            *leader = false;
+            return f;
+        }
+    }
+
+    f = Calloc(1, sizeof(flight_t));
+    f->key = Malloc(strlen(key) + 1);
+    strcpy(f->key, key);
+    f->state = FLIGHT_PENDING;
+    f->linked = true;
+    f->refcnt = 1;
+    pthread_cond_init(&f->changed, NULL);
+    f->next = flight_table[b];
+    flight_table[b] = f;
+    pthread_mutex_unlock(&flight_lock);
+
+    *leader = true;
+    return f;
+}
+
+/**
+ * Makes more of the leader's buffer visible to followers.
+ *
+ * @param f The flight, led by the caller.
+ * @param data The leader's buffer. Once the flight is streaming, it must
+ *             not move again.
+ * @param size The number of bytes of the buffer now filled in.
+ * @param streaming Whether the buffer is now large enough for the whole
+ *                  response, so followers can start sending it.
+ */
+void flight_publish(flight_t *f, char *data, size_t size, bool streaming) {
+    pthread_mutex_lock(&flight_lock);
+    f->data = data;
+    f->size = size;
+    if (streaming && f->state == FLIGHT_PENDING) {
+        f->state = FLIGHT_STREAMING;
+    }
+    pthread_cond_broadcast(&f->changed);
+    pthread_mutex_unlock(&flight_lock);
+}
+
+/**
+ * Ends the leader's part in a flight and removes it from the table. Its
+ * followers are woken to finish sending the buffer, or to fetch the object
+ * themselves if what was buffered is not the whole response.
+ *
+ * @param f The flight, led by the caller.
+ * @param complete Whether the published buffer holds the whole response.
+ * @return true if the flight has taken over the published buffer, because
+ *         followers may still be reading it. Otherwise the buffer is still
+ *         the caller's to free.
+ */
+bool flight_finish(flight_t *f, bool complete) {
+    flight_t **prevp;
+    bool taken = false;
+
+    pthread_mutex_lock(&flight_lock);
+    if (f->linked) {
+        for (prevp = &flight_table[flight_hash(f->key)]; *prevp != f;
+             prevp = &(*prevp)->next)
+            ;
+        *prevp = f->next;
+        f->linked = false;
+        taken = complete || f->state == FLIGHT_STREAMING;
+        f->owns_data = taken;
+        f->state = complete ? FLIGHT_DONE : FLIGHT_FAILED;
+        pthread_cond_broadcast(&f->changed);
+    }
+    pthread_mutex_unlock(&flight_lock);
+
+    return taken;
+}
+
+/**
+ * Waits for a flight to make progress: for the leader to publish more than
+ * a given number of bytes, or to finish.
+ *
+ * @param f The flight, joined by the caller.
+ * @param have The number of bytes the caller has already seen.
+ * @param data Set to the leader's buffer, which only holds the response
+ *             once the flight is streaming or done.
+ * @param size Set to the number of bytes of the buffer filled in.
+ * @param bounded Whether to give up after FLIGHT_WAIT_MS if the response
+ *                still has not started streaming.
+ * @return The flight's state. FLIGHT_PENDING means the wait timed out.
+ */
+flight_state flight_wait(flight_t *f, size_t have, const char **data,
+                         size_t *size, bool bounded) {
+    struct timespec deadline;
+    flight_state state;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_WAIT_MS / 1000;
+    deadline.tv_nsec += (FLIGHT_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&flight_lock);
+    while (f->state == FLIGHT_PENDING ||
+           (f->state == FLIGHT_STREAMING && f->size <= have)) {
+        if (!bounded || f->state != FLIGHT_PENDING) {
+            pthread_cond_wait(&f->changed, &flight_lock);
+        } else if (pthread_cond_timedwait(&f->changed, &flight_lock,
+                                          &deadline) == ETIMEDOUT &&
+                   f->state == FLIGHT_PENDING) {
+            break;
+        }
+    }
+    state = f->state;
+    *data = f->data;
+    *size = f->size;
+    pthread_mutex_unlock(&flight_lock);
+
+    return state;
+}
+
+/**
+ * Drops a reference to a flight, freeing it once nobody holds it.
+ *
+ * @param f A flight returned by flight_join().
+ */
+void flight_release(flight_t *f) {
+    bool last;
+
+    pthread_mutex_lock(&flight_lock);
+    last = --f->refcnt == 0;
+    pthread_mutex_unlock(&flight_lock);
+
+    if (last) {
+        pthread_cond_destroy(&f->changed);
+        if (f->owns_data) {
+            Free(f->data);
+        }
+        Free(f->key);
+        Free(f);
+    }
+}
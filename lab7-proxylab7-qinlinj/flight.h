@@ -0,0 +1,61 @@
+/**
+ * @file flight.h
+ * @brief Coalescing of concurrent cache misses on the same object
+ *
+ * The first worker to miss on a key becomes the leader of a flight for it
+ * and fetches the object from the origin, publishing the buffer it copies
+ * the response into as the response arrives. Workers that miss on the same
+ * key while the fetch is in progress join the flight instead of opening
+ * their own connections to the origin. Once the leader knows the whole
+ * response will fit in its buffer, they stream it to their clients from
+ * the buffer as it fills.
+ *
+ * A follower only waits FLIGHT_WAIT_MS for the response to start. If it
+ * does not, or if it turns out too large to buffer, the follower fetches
+ * the object itself, so a stalled or uncacheable fetch never holds up more
+ * than its own client.
+ *
+ * Flights are reference counted: every flight handed out by flight_join()
+ * must be paired with a call to flight_release(). Once followers may be
+ * reading the leader's buffer, the flight takes it over and frees it along
+ * with itself.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Milliseconds a follower waits for the leader's response to start */
+#define FLIGHT_WAIT_MS 1000
+
+typedef enum {
+    FLIGHT_PENDING,   /* Not yet known whether the response will fit */
+    FLIGHT_STREAMING, /* The head is in and the whole response will fit */
+    FLIGHT_DONE,      /* The whole response is in the buffer */
+    FLIGHT_FAILED     /* The response will not be buffered in full */
+} flight_state;
+
+/* A fetch that other requests for the same object can wait on */
+typedef struct flight {
+    struct flight *next;    /* Next flight in the hash bucket */
+    char *key;              /* Normalized request key */
+    bool linked;            /* Still reachable from the table */
+    flight_state state;     /* How far the leader has got */
+    char *data;             /* The leader's buffer, as last published */
+    size_t size;            /* Number of bytes of data filled in */
+    bool owns_data;         /* data is freed along with the flight */
+    pthread_cond_t changed; /* Signalled when state or size changes */
+    unsigned int refcnt;    /* Number of holders, the leader included */
+} flight_t;
+
+flight_t *flight_join(const char *key, bool *leader);
+void flight_publish(flight_t *f, char *data, size_t size, bool streaming);
+bool flight_finish(flight_t *f, bool complete);
+flight_state flight_wait(flight_t *f, size_t have, const char **data,
+                         size_t *size, bool bounded);
+void flight_release(flight_t *f);
+
+#endif /* FLIGHT_H */
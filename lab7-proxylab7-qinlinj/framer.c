@@ -0,0 +1,318 @@
+/**
+ * @file framer.c
+ * @brief Incremental HTTP response framing
+ *
+ * The framer only looks at the bytes it needs to find the end of a
+ * response: header lines while reading the head, chunk-size lines and
+ * trailers of chunked bodies. Body bytes are skipped by count. Anything it
+ * cannot make sense of (an oversized line, an unparsable length) makes it
+ * fall back to reading until the server closes the connection, which is
+ * always safe because the connection is then never reused.
+ *
+ * Lines that arrive whole are interpreted where they lie in the caller's
+ * buffer; only a line split across reads is assembled in the framer's own.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "framer.h"
+#include "httpscan.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Resets a framer to expect the start of a new response.
+ *
+ * @param f The framer.
+ */
+void framer_init(framer_t *f) {
+    f->state = FRAMER_HEAD;
+    f->status = 0;
+    f->keep_alive = false;
+    f->chunked = false;
+    f->content_length = -1;
+    f->remaining = 0;
+    f->head_complete = false;
+    f->head_len = 0;
+    f->line_len = 0;
+}
+
+/**
+ * Checks whether a framer has seen the whole response.
+ *
+ * @param f The framer.
+ * @return true if the response is complete.
+ */
+bool framer_done(const framer_t *f) {
+    return f->state == FRAMER_DONE;
+}
+
+/**
+ * Accounts for body bytes that were passed on without being fed to the
+ * framer. This is only meaningful while reading a body of known length or
+ * one that ends at EOF.
+ *
+ * @param f The framer.
+ * @param len The number of body bytes.
+ */
+void framer_skip(framer_t *f, size_t len) {
+    if (f->state == FRAMER_BODY) {
+        f->remaining -= len < f->remaining ? len : f->remaining;
+        if (f->remaining == 0) {
+            f->state = FRAMER_DONE;
+        }
+    }
+}
+
+/**
+ * Gives up on framing: the response now ends only when the server closes
+ * the connection, which therefore cannot be reused.
+ *
+ * @param f The framer.
+ */
+static void framer_until_eof(framer_t *f) {
+    f->state = FRAMER_UNTIL_EOF;
+    f->keep_alive = false;
+}
+
+/**
+ * Checks whether a comma-separated header value, such as that of a
+ * Connection header, contains a token, ignoring case.
+ *
+ * @param value The header value.
+ * @param token The token to look for.
+ * @return true if the token is present.
+ */
+bool framer_has_token(const char *value, const char *token) {
+    http_slice_t s = {value, strlen(value)};
+
+    return http_slice_has_token(s, token);
+}
+
+/**
+ * Parses the status line of a response, "HTTP/1.x <status> <reason>".
+ *
+ * @param line The line, without its line ending.
+ * @param len The length of the line.
+ * @param minor Set to the minor HTTP version.
+ * @param status Set to the status code.
+ * @return true on success, false if the line is malformed.
+ */
+static bool parse_status_line(const char *line, size_t len, int *minor,
+                              int *status) {
+    size_t i = sizeof("HTTP/1.") - 1;
+
+    if (len < i + 1 || strncmp(line, "HTTP/1.", i) != 0 ||
+        !isdigit((unsigned char)line[i])) {
+        return false;
+    }
+    *minor = line[i++] - '0';
+
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    if (i + 3 > len || !isdigit((unsigned char)line[i]) ||
+        !isdigit((unsigned char)line[i + 1]) ||
+        !isdigit((unsigned char)line[i + 2]) ||
+        (i + 3 < len && line[i + 3] != ' ' && line[i + 3] != '\t')) {
+        return false;
+    }
+    *status = (line[i] - '0') * 100 + (line[i + 1] - '0') * 10 +
+              (line[i + 2] - '0');
+    return true;
+}
+
+/**
+ * Interprets one line of the response head.
+ *
+ * @param f The framer.
+ * @param line The line, without its line ending. Some byte that is not a
+ *             digit follows it.
+ * @param len The length of the line.
+ */
+static void framer_head_line(framer_t *f, const char *line, size_t len) {
+    http_slice_t name, value;
+    int minor;
+
+    // The status line comes first
+    if (f->status == 0) {
+        if (!parse_status_line(line, len, &minor, &f->status) ||
+            f->status <= 0) {
+            framer_until_eof(f);
+            return;
+        }
+        f->keep_alive = minor >= 1;
+        return;
+    }
+
+    // End of the head: decide how the body is delimited
+    if (len == 0) {
+        f->head_complete = true;
+        if ((f->status >= 100 && f->status < 200) || f->status == 204 ||
+            f->status == 304) {
+            f->state = FRAMER_DONE;
+        } else if (f->chunked) {
+            f->state = FRAMER_CHUNK_SIZE;
+        } else if (f->content_length == 0) {
+            f->state = FRAMER_DONE;
+        } else if (f->content_length > 0) {
+            f->remaining = (size_t)f->content_length;
+            f->state = FRAMER_BODY;
+        } else {
+            framer_until_eof(f);
+        }
+        return;
+    }
+
+    if (!http_split_header(line, len, &name, &value)) {
+        return;
+    }
+
+    if (http_slice_eq(name, "Content-Length")) {
+        // The digits end before the line does, so strtoll stops in time
+        char *end;
+        long long length = strtoll(value.ptr, &end, 10);
+        if (end == value.ptr || length < 0) {
+            framer_until_eof(f);
+            return;
+        }
+        f->content_length = length;
+    } else if (http_slice_eq(name, "Transfer-Encoding")) {
+        f->chunked = http_slice_has_token(value, "chunked");
+    } else if (http_slice_eq(name, "Connection")) {
+        if (http_slice_has_token(value, "close")) {
+            f->keep_alive = false;
+        } else if (http_slice_has_token(value, "keep-alive")) {
+            f->keep_alive = true;
+        }
+    }
+}
+
+/**
+ * Interprets a complete line in whichever state expects one.
+ *
+ * @param f The framer.
+ * @param line The line, without its line ending, which follows it.
+ * @param len The length of the line.
+ */
+static void framer_line(framer_t *f, const char *line, size_t len) {
+    char *end;
+    unsigned long long size;
+
+    switch (f->state) {
+    case FRAMER_HEAD:
+        framer_head_line(f, line, len);
+        break;
+
+    case FRAMER_CHUNK_SIZE:
+        size = strtoull(line, &end, 16);
+        if (end == line || !isxdigit((unsigned char)line[0])) {
+            framer_until_eof(f);
+        } else if (size == 0) {
+            f->state = FRAMER_TRAILER;
+        } else {
+            f->remaining = (size_t)size;
+            f->state = FRAMER_CHUNK_DATA;
+        }
+        break;
+
+    case FRAMER_CHUNK_END:
+        if (len != 0) {
+            framer_until_eof(f);
+        } else {
+            f->state = FRAMER_CHUNK_SIZE;
+        }
+        break;
+
+    case FRAMER_TRAILER:
+        if (len == 0) {
+            f->state = FRAMER_DONE;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * Feeds response bytes to a framer.
+ *
+ * @param f The framer.
+ * @param buf The bytes received from the server.
+ * @param len The number of bytes.
+ * @return The number of leading bytes of buf that belong to the current
+ *         response. This is less than len only once the response is
+ *         complete, in which case the rest is unexpected extra data.
+ */
+size_t framer_feed(framer_t *f, const char *buf, size_t len) {
+    size_t used = 0, n;
+    const char *nl, *line;
+
+    while (used < len) {
+        switch (f->state) {
+        case FRAMER_DONE:
+            return used;
+
+        case FRAMER_UNTIL_EOF:
+            return len;
+
+        case FRAMER_BODY:
+        case FRAMER_CHUNK_DATA:
+            n = len - used < f->remaining ? len - used : f->remaining;
+            used += n;
+            f->remaining -= n;
+            if (f->remaining == 0) {
+                f->state =
+                    f->state == FRAMER_BODY ? FRAMER_DONE : FRAMER_CHUNK_END;
+            }
+            break;
+
+        default:
+            // Line-oriented states: assemble the next line
+            nl = memchr(buf + used, '\n', len - used);
+            n = nl ? (size_t)(nl - (buf + used)) + 1 : len - used;
+            if (nl && f->line_len == 0) {
+                // A whole line: interpret it where it is
+                line = buf + used;
+                used += n;
+                if (f->state == FRAMER_HEAD) {
+                    f->head_len += n;
+                }
+                n--;
+                if (n > 0 && line[n - 1] == '\r') {
+                    n--;
+                }
+                framer_line(f, line, n);
+                break;
+            }
+            if (f->line_len + n >= sizeof(f->line)) {
+                framer_until_eof(f);
+                break;
+            }
+            memcpy(f->line + f->line_len, buf + used, n);
+            f->line_len += n;
+            used += n;
+            if (f->state == FRAMER_HEAD) {
+                f->head_len += n;
+            }
+            if (nl) {
+                // Strip the line ending and interpret the line
+                f->line_len--;
+                if (f->line_len > 0 && f->line[f->line_len - 1] == '\r') {
+                    f->line_len--;
+                }
+                f->line[f->line_len] = '\0';
+                n = f->line_len;
+                f->line_len = 0;
+                framer_line(f, f->line, n);
+            }
+            break;
+        }
+    }
+    return used;
+}
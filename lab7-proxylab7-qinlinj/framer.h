@@ -0,0 +1,51 @@
+/**
+ * @file framer.h
+ * @brief Incremental HTTP response framing
+ *
+ * A framer is fed the bytes of an origin's response as they arrive and
+ * works out where the response ends: after Content-Length body bytes, after
+ * the last chunk of a chunked body, immediately for responses that carry no
+ * body, or only when the server closes the connection. This is what lets
+ * the proxy reuse a persistent connection to the origin for the next
+ * request.
+ */
+
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include "csapp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    FRAMER_HEAD,       /* Reading the status line and headers */
+    FRAMER_BODY,       /* Reading a body of known length */
+    FRAMER_CHUNK_SIZE, /* Reading a chunk-size line */
+    FRAMER_CHUNK_DATA, /* Reading chunk data */
+    FRAMER_CHUNK_END,  /* Reading the CRLF that ends chunk data */
+    FRAMER_TRAILER,    /* Reading trailer lines after the last chunk */
+    FRAMER_UNTIL_EOF,  /* Body ends when the server closes */
+    FRAMER_DONE        /* Response is complete */
+} framer_state;
+
+typedef struct {
+    framer_state state;
+    int status;               /* Response status code */
+    bool keep_alive;          /* Server keeps the connection open afterwards */
+    bool chunked;             /* Body uses chunked transfer coding */
+    long long content_length; /* Content-Length, or -1 if absent */
+    size_t remaining;         /* Bytes left in the body or current chunk */
+    bool head_complete;       /* The blank line ending the head was seen */
+    size_t head_len;          /* Bytes of the head consumed so far */
+    char line[MAXLINE];       /* Partial line being assembled */
+    size_t line_len;          /* Number of bytes in line */
+} framer_t;
+
+void framer_init(framer_t *f);
+size_t framer_feed(framer_t *f, const char *buf, size_t len);
+void framer_skip(framer_t *f, size_t len);
+bool framer_done(const framer_t *f);
+bool framer_has_token(const char *value, const char *token);
+
+#endif /* FRAMER_H */
@@ -0,0 +1,197 @@
+/**
+ * @file httpscan.c
+ * @brief Vectorized scanning of HTTP request and header lines
+ *
+ * The vector loops compare a block of bytes against both delimiters at
+ * once and turn the result into a bit mask, one bit per byte, so the first
+ * match is the mask's lowest set bit. Unaligned loads are used throughout;
+ * a block is only loaded while it lies entirely inside the line, and the
+ * last few bytes are checked one at a time.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "httpscan.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Finds the first occurrence of either of two bytes.
+ *
+ * @param p The first byte to look at.
+ * @param end Just past the last byte to look at.
+ * @param a One byte to look for.
+ * @param b The other, which may be the same as a.
+ * @return The first byte equal to a or b, or end if there is none.
+ */
+const char *http_scan(const char *p, const char *end, char a, char b) {
+#if defined(__AVX2__)
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                     _mm256_cmpeq_epi8(v, vb));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(eq);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i eq =
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(eq);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            break;
+        }
+    }
+    return p;
+}
+
+/**
+ * Returns the length of a line without its line ending.
+ *
+ * @param line The line, which may end with CRLF or a bare LF.
+ * @param len The length of the line.
+ * @return The number of bytes before the first CR or LF.
+ */
+size_t http_line_len(const char *line, size_t len) {
+    return (size_t)(http_scan(line, line + len, '\r', '\n') - line);
+}
+
+/**
+ * Skips spaces and tabs.
+ *
+ * @param p The first byte to look at.
+ * @param end Just past the last byte to look at.
+ * @return The first byte that is neither, or end.
+ */
+static const char *skip_ows(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Splits a request line, such as "GET /index.html HTTP/1.1", into its
+ * three parts, which may be separated by any run of spaces and tabs.
+ *
+ * @param line The line, without its line ending.
+ * @param len The length of the line.
+ * @param method Set to the method.
+ * @param uri Set to the request URI.
+ * @param version Set to the HTTP version, with trailing spaces removed.
+ * @return true on success, false if any part is missing.
+ */
+bool http_split_request_line(const char *line, size_t len,
+                             http_slice_t *method, http_slice_t *uri,
+                             http_slice_t *version) {
+    const char *end = line + len, *p, *q;
+
+    p = skip_ows(line, end);
+    q = http_scan(p, end, ' ', '\t');
+    method->ptr = p;
+    method->len = (size_t)(q - p);
+
+    p = skip_ows(q, end);
+    q = http_scan(p, end, ' ', '\t');
+    uri->ptr = p;
+    uri->len = (size_t)(q - p);
+
+    p = skip_ows(q, end);
+    q = http_scan(p, end, ' ', '\t');
+    version->ptr = p;
+    version->len = (size_t)(q - p);
+
+    return method->len > 0 && uri->len > 0 && version->len > 0 &&
+           skip_ows(q, end) == end;
+}
+
+/**
+ * Splits a header line at its colon, trimming the spaces and tabs around
+ * the value.
+ *
+ * @param line The line, without its line ending.
+ * @param len The length of the line.
+ * @param name Set to the header name.
+ * @param value Set to the header value, which may be empty.
+ * @return true on success, false if there is no colon or no name.
+ */
+bool http_split_header(const char *line, size_t len, http_slice_t *name,
+                       http_slice_t *value) {
+    const char *end = line + len, *colon, *p;
+
+    colon = http_scan(line, end, ':', ':');
+    if (colon == end || colon == line) {
+        return false;
+    }
+    name->ptr = line;
+    name->len = (size_t)(colon - line);
+
+    p = skip_ows(colon + 1, end);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    value->ptr = p;
+    value->len = (size_t)(end - p);
+    return true;
+}
+
+/**
+ * Compares a slice with a string, ignoring case.
+ *
+ * @param s The slice.
+ * @param str The NUL-terminated string.
+ * @return true if they are equal.
+ */
+bool http_slice_eq(http_slice_t s, const char *str) {
+    return strlen(str) == s.len && strncasecmp(s.ptr, str, s.len) == 0;
+}
+
+/**
+ * Checks whether a comma-separated header value, such as that of a
+ * Connection header, contains a token, ignoring case.
+ *
+ * @param s The header value.
+ * @param token The token to look for.
+ * @return true if the token is present.
+ */
+bool http_slice_has_token(http_slice_t s, const char *token) {
+    const char *p = s.ptr, *end = s.ptr + s.len, *comma, *q;
+    size_t len = strlen(token);
+
+    while (p < end) {
+        comma = http_scan(p, end, ',', ',');
+        p = skip_ows(p, comma);
+
+        // The token may be followed by parameters or spaces
+        q = p + len;
+        if ((size_t)(comma - p) >= len && strncasecmp(p, token, len) == 0 &&
+            (q == comma || *q == ';' || *q == ' ' || *q == '\t')) {
+            return true;
+        }
+        p = comma + (comma < end);
+    }
+    return false;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file httpscan.h
+ * @brief Vectorized scanning of HTTP request and header lines
+ *
+ * HTTP lines are split on a handful of delimiter bytes: spaces in the
+ * request and status lines, the colon after a header name, and the CR and
+ * LF that end every line. The scanner looks for them 32 bytes at a time
+ * with AVX2 or 16 at a time with SSE2, whichever the compiler targets, and
+ * a byte at a time elsewhere.
+ *
+ * The splitting functions never copy: they return slices of the line they
+ * were given, which need not be NUL-terminated, so lines can be parsed
+ * where they lie in a read buffer.
+ */
+
+#ifndef HTTPSCAN_H
+#define HTTPSCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A run of bytes within a larger buffer, not NUL-terminated */
+typedef struct {
+    const char *ptr; /* First byte */
+    size_t len;      /* Number of bytes */
+} http_slice_t;
+
+const char *http_scan(const char *p, const char *end, char a, char b);
+size_t http_line_len(const char *line, size_t len);
+bool http_split_request_line(const char *line, size_t len,
+                             http_slice_t *method, http_slice_t *uri,
+                             http_slice_t *version);
+bool http_split_header(const char *line, size_t len, http_slice_t *name,
+                       http_slice_t *value);
+bool http_slice_eq(http_slice_t s, const char *str);
+bool http_slice_has_token(http_slice_t s, const char *token);
+
+#endif /* HTTPSCAN_H */
@@ -0,0 +1,111 @@
+/**
+ * @file logger.c
+ * @brief Buffered asynchronous logging for the proxy's hot paths
+ *
+ * Messages are appended to one of two buffers. The writer thread swaps the
+ * buffers under the lock and writes out the full one without it, so
+ * producers only ever hold the lock for a memcpy.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "logger.h"
+#include "csapp.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Longest single message; longer ones are truncated */
+#define LOGGER_MAXMSG 1024
+
+static char logger_bufs[2][LOGGER_BUFSIZE];
+static char *logger_active = logger_bufs[0]; /* Buffer being appended to */
+static size_t logger_len = 0;                /* Bytes in logger_active */
+static unsigned long logger_dropped = 0;     /* Messages lost since a flush */
+static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_ready = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Writer thread routine: writes out whatever has been logged, forever.
+ *
+ * @param arg Unused.
+ * @return Never returns.
+ */
+static void *logger_thread(void *arg) {
+    char *out;
+    size_t len;
+    unsigned long dropped;
+    char note[64];
+    int n;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&logger_lock);
+        while (logger_len == 0 && logger_dropped == 0) {
+            pthread_cond_wait(&logger_ready, &logger_lock);
+        }
+        out = logger_active;
+        len = logger_len;
+        dropped = logger_dropped;
+        logger_active = out == logger_bufs[0] ? logger_bufs[1] : logger_bufs[0];
+        logger_len = 0;
+        logger_dropped = 0;
+        pthread_mutex_unlock(&logger_lock);
+
+        rio_writen(STDOUT_FILENO, out, len);
+        if (dropped > 0) {
+            n = snprintf(note, sizeof(note), "[%lu log messages dropped]\n",
+                         dropped);
+            rio_writen(STDOUT_FILENO, note, (size_t)n);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the writer thread. Must be called before logger_printf().
+ */
+void logger_init(void) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, logger_thread, NULL) != 0) {
+        fprintf(stderr, "Error: failed to create logger thread\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+/**
+ * Logs a message to standard output without waiting for it to be written.
+ *
+ * @param fmt A printf-style format string.
+ */
+void logger_printf(const char *fmt, ...) {
+    char msg[LOGGER_MAXMSG];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n >= sizeof(msg)) {
+        n = sizeof(msg) - 1;
+    }
+
+    pthread_mutex_lock(&logger_lock);
+    if (logger_len + (size_t)n <= LOGGER_BUFSIZE) {
+        memcpy(logger_active + logger_len, msg, (size_t)n);
+        logger_len += (size_t)n;
+    } else {
+        logger_dropped++;
+    }
+    pthread_cond_signal(&logger_ready);
+    pthread_mutex_unlock(&logger_lock);
+}
@@ -0,0 +1,21 @@
+/**
+ * @file logger.h
+ * @brief Buffered asynchronous logging for the proxy's hot paths
+ *
+ * logger_printf() formats a message on the caller's stack and copies it
+ * into a shared buffer; a background thread writes the buffer to standard
+ * output. Callers never wait on the terminal or a pipe, and if the writer
+ * falls behind far enough for the buffer to fill, messages are dropped and
+ * counted rather than stalling the caller.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/* Bytes of messages that can wait to be written */
+#define LOGGER_BUFSIZE (64 * 1024)
+
+void logger_init(void);
+void logger_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif /* LOGGER_H */
@@ -0,0 +1,369 @@
+/**
+ * @file origin.c
+ * @brief Per-origin concurrency limits and fair sharing of origin fetches
+ *
+ * Origins are kept in a hash table under one mutex, which also protects
+ * every count and queue here. An origin's entry exists while it has fetches
+ * in progress or waiting, or if it was given a weight on the command line.
+ *
+ * Each waiting request sleeps on its own condition variable, so granting a
+ * slot wakes exactly the request it was granted to. Origins with waiting
+ * requests are kept on a ready list; after an origin is granted a slot it
+ * moves to the back of the list, so origins that are tied on fetches per
+ * unit of weight take turns.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "origin.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Number of hash buckets for origins */
+#define ORIGIN_BUCKETS 256
+
+/* A request waiting for a fetch slot */
+typedef struct origin_waiter {
+    struct origin_waiter *next;  /* Next request in the origin's queue */
+    pthread_cond_t granted_cond; /* Signaled when a slot is granted */
+    bool granted;                /* A slot has been granted */
+} origin_waiter_t;
+
+/* Fetches in progress and waiting for one origin */
+struct origin {
+    struct origin *next;       /* Next origin in the hash bucket */
+    struct origin *next_ready; /* Next origin on the ready list */
+    char *key;                 /* "host:port" */
+    size_t weight;             /* Share of slots relative to other origins */
+    bool configured;           /* Weight given on the command line */
+    size_t active;             /* Fetches in progress */
+    size_t nwaiting;           /* Requests in the queue */
+    origin_waiter_t *head;     /* First request in the queue */
+    origin_waiter_t *tail;     /* Last request in the queue */
+};
+
+static origin_t *origin_table[ORIGIN_BUCKETS];
+static pthread_mutex_t origin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Origins with waiting requests, in the order they get their turn */
+static origin_t *ready_head = NULL;
+static origin_t *ready_tail = NULL;
+
+/* Base fetches per origin, or 0 if limits are disabled */
+static size_t origin_limit = 0;
+
+/* Fetches all origins together may have in progress, and do */
+static size_t total_slots, total_active;
+
+/**
+ * Enables the limits.
+ *
+ * @param limit The number of fetches an origin of weight 1 may have in
+ *              progress, or 0 to leave the limits disabled.
+ * @param nworkers The number of worker threads, half of which may be
+ *                 fetching at once.
+ */
+void origin_init(size_t limit, size_t nworkers) {
+    origin_limit = limit;
+    total_slots = nworkers / 2 > 0 ? nworkers / 2 : 1;
+}
+
+/**
+ * Hashes an origin key (FNV-1a).
+ *
+ * @param key The key.
+ * @return The bucket index.
+ */
+static size_t origin_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h % ORIGIN_BUCKETS;
+}
+
+/**
+ * Finds the entry for an origin, creating it if missing. The caller must
+ * hold origin_lock.
+ *
+ * @param key The "host:port" key.
+ * @return The entry.
+ */
+static origin_t *origin_find(const char *key) {
+    size_t b = origin_hash(key);
+    origin_t *o;
+
+    for (o = origin_table[b]; o != NULL; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+
+    o = Calloc(1, sizeof(origin_t));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->weight = 1;
+    o->next = origin_table[b];
+    origin_table[b] = o;
+    return o;
+}
+
+/**
+ * Frees an origin's entry if nothing refers to it any more. The caller must
+ * hold origin_lock.
+ *
+ * @param o The origin.
+ */
+static void origin_put(origin_t *o) {
+    origin_t **prevp;
+
+    if (o->configured || o->active > 0 || o->nwaiting > 0) {
+        return;
+    }
+    for (prevp = &origin_table[origin_hash(o->key)]; *prevp != o;
+         prevp = &(*prevp)->next)
+        ;
+    *prevp = o->next;
+    Free(o->key);
+    Free(o);
+}
+
+/**
+ * Returns the number of fetches an origin may have in progress, which is
+ * also the number of requests its queue may hold.
+ *
+ * @param o The origin.
+ * @return The limit.
+ */
+static size_t origin_cap(const origin_t *o) {
+    return origin_limit * o->weight;
+}
+
+/**
+ * Takes an origin off the ready list. The caller must hold origin_lock.
+ *
+ * @param o The origin.
+ * @param prev The origin before it on the list, or NULL if it is first.
+ */
+static void ready_unlink(origin_t *o, origin_t *prev) {
+    if (prev) {
+        prev->next_ready = o->next_ready;
+    } else {
+        ready_head = o->next_ready;
+    }
+    if (ready_tail == o) {
+        ready_tail = prev;
+    }
+    o->next_ready = NULL;
+}
+
+/**
+ * Puts an origin at the back of the ready list. The caller must hold
+ * origin_lock.
+ *
+ * @param o The origin, which must not be on the list.
+ */
+static void ready_append(origin_t *o) {
+    o->next_ready = NULL;
+    if (ready_tail) {
+        ready_tail->next_ready = o;
+    } else {
+        ready_head = o;
+    }
+    ready_tail = o;
+}
+
+/**
+ * Grants free slots to waiting requests, each time to the first request of
+ * the eligible origin with the fewest fetches in progress per unit of
+ * weight. The caller must hold origin_lock.
+ */
+static void origin_dispatch(void) {
+    origin_t *o, *prev, *best, *best_prev;
+    origin_waiter_t *w;
+
+    while (total_active < total_slots) {
+        best = best_prev = NULL;
+        for (prev = NULL, o = ready_head; o != NULL;
+             prev = o, o = o->next_ready) {
+            if (o->active < origin_cap(o) &&
+                (!best || o->active * best->weight <
+                              best->active * o->weight)) {
+                best = o;
+                best_prev = prev;
+            }
+        }
+        if (!best) {
+            break;
+        }
+
+        w = best->head;
+        best->head = w->next;
+        if (!best->head) {
+            best->tail = NULL;
+        }
+        best->nwaiting--;
+        best->active++;
+        total_active++;
+
+        ready_unlink(best, best_prev);
+        if (best->head) {
+            ready_append(best);
+        }
+
+        w->granted = true;
+        pthread_cond_signal(&w->granted_cond);
+    }
+}
+
+/**
+ * Gives an origin a larger share of the fetch slots.
+ *
+ * @param spec "host:port=weight", with the host in lower case.
+ * @return true on success, false if spec is malformed.
+ */
+bool origin_set_weight(const char *spec) {
+    const char *eq = strrchr(spec, '=');
+    char key[MAXLINE], *end;
+    long weight;
+    origin_t *o;
+
+    if (!eq || eq == spec || (size_t)(eq - spec) >= sizeof(key) ||
+        !strchr(spec, ':')) {
+        return false;
+    }
+    weight = strtol(eq + 1, &end, 10);
+    if (*end != '\0' || weight <= 0 || weight > ORIGIN_MAX_WEIGHT) {
+        return false;
+    }
+    memcpy(key, spec, (size_t)(eq - spec));
+    key[eq - spec] = '\0';
+
+    pthread_mutex_lock(&origin_lock);
+    o = origin_find(key);
+    o->weight = (size_t)weight;
+    o->configured = true;
+    pthread_mutex_unlock(&origin_lock);
+    return true;
+}
+
+/**
+ * Waits for a slot to fetch from an origin.
+ *
+ * @param host The origin's host, in lower case.
+ * @param port The origin's port.
+ * @param origin Set to the slot, which must be passed to origin_release()
+ *               once the fetch is over. NULL if limits are disabled.
+ * @return true if a slot was granted, false if the request was refused
+ *         because too many are waiting already or the wait timed out.
+ */
+bool origin_acquire(const char *host, const char *port, origin_t **origin) {
+    char key[MAXLINE];
+    origin_waiter_t w, *before, **prevp;
+    struct timespec deadline;
+    origin_t *o, *prev, *r;
+
+    *origin = NULL;
+    if (origin_limit == 0) {
+        return true;
+    }
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&origin_lock);
+    o = origin_find(key);
+
+    // Go straight ahead if a slot is free. Any request queued for one
+    // would have been granted it already, so this does not jump the queue.
+    if (o->active < origin_cap(o) && total_active < total_slots) {
+        o->active++;
+        total_active++;
+        pthread_mutex_unlock(&origin_lock);
+        *origin = o;
+        return true;
+    }
+
+    // Refuse the request rather than tie up yet another worker
+    if (o->nwaiting >= origin_cap(o)) {
+        origin_put(o);
+        pthread_mutex_unlock(&origin_lock);
+        return false;
+    }
+
+    // Join the back of the origin's queue
+    w.next = NULL;
+    w.granted = false;
+    pthread_cond_init(&w.granted_cond, NULL);
+    if (o->tail) {
+        o->tail->next = &w;
+    } else {
+        o->head = &w;
+        ready_append(o);
+    }
+    o->tail = &w;
+    o->nwaiting++;
+    origin_dispatch();
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ORIGIN_WAIT_MS / 1000;
+    deadline.tv_nsec += (ORIGIN_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!w.granted && pthread_cond_timedwait(&w.granted_cond, &origin_lock,
+                                                &deadline) != ETIMEDOUT)
+        ;
+
+    // Leave the queue if the wait timed out before a slot came up
+    if (!w.granted) {
+        for (before = NULL, prevp = &o->head; *prevp != &w;
+             before = *prevp, prevp = &(*prevp)->next)
+            ;
+        *prevp = w.next;
+        if (o->tail == &w) {
+            o->tail = before;
+        }
+        if (!o->head) {
+            for (prev = NULL, r = ready_head; r != o;
+                 prev = r, r = r->next_ready)
+                ;
+            ready_unlink(o, prev);
+        }
+        o->nwaiting--;
+        origin_put(o);
+    }
+    pthread_mutex_unlock(&origin_lock);
+    pthread_cond_destroy(&w.granted_cond);
+
+    if (!w.granted) {
+        return false;
+    }
+    *origin = o;
+    return true;
+}
+
+/**
+ * Ends a fetch and hands its slot to the next waiting request.
+ *
+ * @param origin The slot from origin_acquire(), or NULL.
+ */
+void origin_release(origin_t *origin) {
+    if (!origin) {
+        return;
+    }
+    pthread_mutex_lock(&origin_lock);
+    origin->active--;
+    total_active--;
+    origin_dispatch();
+    origin_put(origin);
+    pthread_mutex_unlock(&origin_lock);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file origin.h
+ * @brief Per-origin concurrency limits and fair sharing of origin fetches
+ *
+ * A worker thread that fetches from an origin is tied up for as long as the
+ * origin takes to answer, so without a limit one slow origin can absorb
+ * every worker and starve requests to healthy ones. When limits are enabled,
+ * a worker must hold a fetch slot while it talks to an origin:
+ *
+ *   - each origin may have at most its limit of fetches in progress, the
+ *     base limit times the origin's weight;
+ *   - all origins together may have at most a global number in progress;
+ *   - requests beyond either bound wait in their origin's FIFO queue, which
+ *     holds at most as many requests as the origin's limit.
+ *
+ * So an origin ties up at most twice its limit in workers, however slow it
+ * gets, and the rest stay free for requests to other origins and for
+ * cache hits.
+ *
+ * A freed slot goes to the waiting origin with the fewest fetches in
+ * progress relative to its weight, so origins share the global slots in
+ * proportion to their weights. Requests that find the queue full, or wait
+ * longer than ORIGIN_WAIT_MS, are refused so the client can be told the
+ * origin is busy.
+ *
+ * Only the thread pool uses the limits: the event loops never block on an
+ * origin, so a slow one cannot take them away from other requests.
+ */
+
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Milliseconds a request may wait for a fetch slot before it is refused */
+#define ORIGIN_WAIT_MS 5000
+
+/* Largest weight an origin can be given */
+#define ORIGIN_MAX_WEIGHT 64
+
+typedef struct origin origin_t;
+
+void origin_init(size_t limit, size_t nworkers);
+bool origin_set_weight(const char *spec);
+bool origin_acquire(const char *host, const char *port, origin_t **origin);
+void origin_release(origin_t *origin);
+
+#endif /* ORIGIN_H */
@@ -0,0 +1,171 @@
+/**
+ * @file pool.c
+ * @brief Pool of idle persistent connections to origin servers
+ *
+ * Origins are kept in a small hash table. Each origin holds a stack of idle
+ * sockets, so checkout returns the most recently used connection, which is
+ * the one least likely to have been timed out by the server. Sockets that
+ * outlive POOL_IDLE_TIMEOUT are closed lazily on the next visit, and a
+ * socket is checked for a pending EOF before it is handed out.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "pool.h"
+#include "csapp.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of hash buckets for origins */
+#define POOL_BUCKETS 64
+
+/* An idle connection */
+typedef struct {
+    int fd;            /* Connected socket */
+    time_t idle_since; /* When it was checked in */
+} pool_conn_t;
+
+/* Idle connections to one origin */
+typedef struct pool_origin {
+    struct pool_origin *next;                   /* Next origin in bucket */
+    char *key;                                  /* "host:port" */
+    size_t nidle;                               /* Number of idle sockets */
+    pool_conn_t idle[POOL_MAX_IDLE_PER_ORIGIN]; /* Stack of idle sockets */
+} pool_origin_t;
+
+static pool_origin_t *pool_table[POOL_BUCKETS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Hashes an origin key (FNV-1a).
+ *
+ * @param key The key.
+ * @return The bucket index.
+ */
+static size_t pool_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h % POOL_BUCKETS;
+}
+
+/**
+ * Finds the entry for an origin, optionally creating it. The caller must
+ * hold pool_lock.
+ *
+ * @param key The "host:port" key.
+ * @param create Whether to create a missing entry.
+ * @return The entry, or NULL if it does not exist and create is false.
+ */
+static pool_origin_t *pool_find(const char *key, bool create) {
+    size_t b = pool_hash(key);
+    pool_origin_t *o;
+
+    for (o = pool_table[b]; o != NULL; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    o = Calloc(1, sizeof(pool_origin_t));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->next = pool_table[b];
+    pool_table[b] = o;
+    return o;
+}
+
+/**
+ * Checks whether an idle socket is still usable. A socket that is readable
+ * has either been closed by the server or has unexpected data on it.
+ *
+ * @param fd The socket.
+ * @return true if the socket can carry a new request.
+ */
+static bool pool_conn_alive(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * Takes an idle connection to an origin out of the pool.
+ *
+ * @param host The origin's host name.
+ * @param port The origin's port.
+ * @return A connected socket, or -1 if no usable connection is pooled.
+ */
+int pool_checkout(const char *host, const char *port) {
+    char key[MAXLINE];
+    pool_origin_t *o;
+    time_t now = time(NULL);
+    int fd;
+
+    if (snprintf(key, MAXLINE, "%s:%s", host, port) >= MAXLINE) {
+        return -1;
+    }
+
+    while (1) {
+        fd = -1;
+        pthread_mutex_lock(&pool_lock);
+        o = pool_find(key, false);
+        while (o && o->nidle > 0) {
+            pool_conn_t *pc = &o->idle[--o->nidle];
+            if (now - pc->idle_since < POOL_IDLE_TIMEOUT) {
+                fd = pc->fd;
+                break;
+            }
+            close(pc->fd); // Expired
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        if (fd < 0 || pool_conn_alive(fd)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Returns a connection whose last response was fully read to the pool.
+ * The connection is closed instead if the origin already has
+ * POOL_MAX_IDLE_PER_ORIGIN idle connections.
+ *
+ * @param host The origin's host name.
+ * @param port The origin's port.
+ * @param fd The connected socket.
+ */
+void pool_checkin(const char *host, const char *port, int fd) {
+    char key[MAXLINE];
+    pool_origin_t *o;
+
+    if (snprintf(key, MAXLINE, "%s:%s", host, port) >= MAXLINE) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    o = pool_find(key, true);
+    if (o->nidle < POOL_MAX_IDLE_PER_ORIGIN) {
+        o->idle[o->nidle].fd = fd;
+        o->idle[o->nidle].idle_since = time(NULL);
+        o->nidle++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
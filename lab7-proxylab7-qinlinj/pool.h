@@ -0,0 +1,23 @@
+/**
+ * @file pool.h
+ * @brief Pool of idle persistent connections to origin servers
+ *
+ * After a response has been fully read from a keep-alive connection, the
+ * worker checks the socket back in under its (host, port). The next request
+ * to the same origin checks it out again and skips the DNS lookup and TCP
+ * handshake. The pool is shared by all worker threads.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/* Maximum idle connections kept per origin */
+#define POOL_MAX_IDLE_PER_ORIGIN 8
+
+/* Seconds an idle connection may sit in the pool before it is closed */
+#define POOL_IDLE_TIMEOUT 15
+
+int pool_checkout(const char *host, const char *port);
+void pool_checkin(const char *host, const char *port, int fd);
+
+#endif /* POOL_H */
@@ -4,10 +4,25 @@
  * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
  */
 
+#include "proxy.h"
+#include "cache.h"
 #include "csapp.h"
+#include "disk_cache.h"
+#include "dns.h"
+#include "event_loop.h"
+#include "flight.h"
+#include "framer.h"
+#include "http_parser.h"
+#include "logger.h"
+#include "origin.h"
+#include "pool.h"
+#include "relay.h"
+#include "sbuf.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <ctype.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,7 +37,9 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -50,20 +67,16 @@
 #define dbg_printf(...)
 #endif
 
-/*
- * Max cache and object sizes
- * You might want to move these to the file containing your cache implementation
- */
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
+/* Default number of worker threads and depth of the connection queue */
+#define DEFAULT_NTHREADS 32
+#define DEFAULT_QUEUE_DEPTH 256
+
+/* Seconds a persistent client connection may sit idle between requests */
+#define CLIENT_IDLE_TIMEOUT 5
+
+/* Seconds the kernel holds a connection that has sent no request yet */
+#define DEFER_ACCEPT_TIMEOUT 5
 
-void doit(int fd);
-void client_error(int fd, char *cause, char *errnum, char *shortmsg,
-                  char *longmsg);
-int parse_url(char *url, char *port, char *servername, char *filename);
-int forward_request(rio_t *rio, char *servername, char *port, char *filename);
-int forward_response(int client_fd, int server_fd);
-void *thread(void *arg);
 /*
  * String to use for the User-Agent header.
  * Don't forget to terminate with \r\n
@@ -74,33 +87,189 @@ void *thread(void *arg);
 
 typedef struct sockaddr SA;
 
+/* Connected client descriptors waiting for a worker thread */
+static sbuf_t conn_queue;
+
+/* Whether to keep persistent connections to origin servers */
+static bool upstream_keepalive = false;
+
+static bool serve_request(int client_fd, rio_t *client_rio);
+static bool serve_cached(int client_fd, const cache_obj_t *obj,
+                         bool keep_alive);
+static bool serve_disk(int client_fd, const disk_obj_t *obj, bool keep_alive);
+static bool serve_flight(int client_fd, flight_t *flight, bool *keep_alive);
+static bool client_keep_alive(parser_t *parser, bool persistent);
+
+/**
+ * Prints the usage message and exits.
+ *
+ * @param prog The program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--event-loop] [--upstream-keepalive] [-t <nthreads>] "
+            "[-q <queue depth>] [-s <cache shards>] [--tinylfu]\n"
+            "       [--origin-limit <fetches>] "
+            "[--origin-weight <host:port=weight>]...\n"
+            "       [--backlog <n>] [--defer-accept] "
+            "[--fastopen <queue length>]\n"
+            "       [--disk-cache <file>] [--disk-cache-size <MB>] <port>\n",
+            prog);
+    exit(1);
+}
+
+/* Long command line options */
+static const struct option long_options[] = {
+    {"event-loop", no_argument, NULL, 'e'},
+    {"upstream-keepalive", no_argument, NULL, 'k'},
+    {"cache-shards", required_argument, NULL, 's'},
+    {"origin-limit", required_argument, NULL, 'l'},
+    {"origin-weight", required_argument, NULL, 'w'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"defer-accept", no_argument, NULL, 'd'},
+    {"fastopen", required_argument, NULL, 'f'},
+    {"tinylfu", no_argument, NULL, 'a'},
+    {"disk-cache", required_argument, NULL, 'D'},
+    {"disk-cache-size", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0},
+};
+
 int main(int argc, char **argv) {
-    int listen_fd, client_fd;
+    int listen_fd, client_fd, c;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t client_len;
     struct sockaddr_storage client_addr;
     pthread_t tid;
+    long nthreads = 0, queue_depth = DEFAULT_QUEUE_DEPTH, cache_shards = 0;
+    long origin_limit = 0, disk_cache_mb = 0;
+    const char *disk_cache_path = NULL;
+    bool event_loop = false, tinylfu = false;
+    listen_opts_t listen_opts = {.backlog = LISTENQ};
     // Ignore SIGPIPE to handle write errors on socket
     signal(SIGPIPE, SIG_IGN);
 
+    // Parse command line options
+    while ((c = getopt_long(argc, argv, "t:q:s:", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'e':
+            event_loop = true;
+            break;
+        case 'k':
+            upstream_keepalive = true;
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            queue_depth = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            cache_shards = strtol(optarg, NULL, 10);
+            if (cache_shards <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            origin_limit = strtol(optarg, NULL, 10);
+            if (origin_limit <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            if (!origin_set_weight(optarg)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            listen_opts.backlog = (int)strtol(optarg, NULL, 10);
+            if (listen_opts.backlog <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            listen_opts.defer_accept = DEFER_ACCEPT_TIMEOUT;
+            break;
+        case 'f':
+            listen_opts.fastopen = (int)strtol(optarg, NULL, 10);
+            if (listen_opts.fastopen <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            tinylfu = true;
+            break;
+        case 'D':
+            disk_cache_path = optarg;
+            break;
+        case 'S':
+            disk_cache_mb = strtol(optarg, NULL, 10);
+            if (disk_cache_mb <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
     // Check for correct usage
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    if (optind != argc - 1 || queue_depth <= 0) {
+        usage(argv[0]);
+    }
+
+    // By default, run a worker pool, or one event loop per core
+    if (nthreads == 0) {
+        nthreads =
+            event_loop ? sysconf(_SC_NPROCESSORS_ONLN) : DEFAULT_NTHREADS;
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
     }
 
     // Open a listening socket
-    listen_fd = open_listenfd(argv[1]);
+    listen_fd = open_listenfd_opts(argv[optind], &listen_opts);
     if (listen_fd < 0) {
         fprintf(stderr, "Error: unable to open listening socket on port %s\n",
-                argv[1]);
+                argv[optind]);
         exit(1);
     }
 
+    // Set up the shared object cache before any worker can use it
+    cache_init((size_t)cache_shards, tinylfu);
+    if (disk_cache_path &&
+        !disk_cache_init(disk_cache_path,
+                         (size_t)disk_cache_mb * 1024 * 1024)) {
+        exit(1);
+    }
+    logger_init();
+
+    if (event_loop) {
+        event_loop_run(listen_fd, nthreads);
+    }
+
+    // Keep a slow origin from tying up every worker
+    origin_init((size_t)origin_limit, (size_t)nthreads);
+
+    // Pre-spawn the worker pool
+    sbuf_init(&conn_queue, (size_t)queue_depth);
+    for (long i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, thread, NULL) != 0) {
+            fprintf(stderr, "Error: failed to create worker thread\n");
+            exit(1);
+        }
+    }
+
     // Main loop: accept and handle requests
     while (1) {
+        // Stop accepting while every queue slot is taken
+        sbuf_wait_slot(&conn_queue);
+
         client_len = sizeof(client_addr);
-        client_fd = accept(listen_fd, (SA *)&client_addr, &client_len);
+        client_fd =
+            accept_conn(listen_fd, (SA *)&client_addr, &client_len, false);
 
         // Check for errors in accept
         if (client_fd < 0) {
@@ -108,86 +277,234 @@ int main(int argc, char **argv) {
             continue; // Skip to next iteration
         }
 
-        // Get client information
+        // Log the client's numeric address; a reverse lookup here would
+        // stall every other accept behind it
         if (getnameinfo((SA *)&client_addr, client_len, hostname, MAXLINE, port,
-                        MAXLINE, 0) != 0) {
-            fprintf(stderr, "Error: failed to get client information\n");
-            close(client_fd);
-            continue; // Skip to next iteration
+                        MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            logger_printf("Accepted connection from (%s, %s)\n", hostname,
+                          port);
         }
 
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        // Send the end of each response at once, rather than holding it
+        // until the client acknowledges the write before
+        set_tcp_nodelay(client_fd);
 
-        // // Handle the client's request
-        // doit(client_fd);
-
-        // // Close the client socket
-        // close(client_fd);
-        pthread_create(&tid, NULL, thread, (void *)(intptr_t)client_fd);
+        // Hand the connection to the worker pool
+        sbuf_insert(&conn_queue, client_fd);
     }
 
     return 0;
 }
 
 /**
- * Handles a single client request.
+ * Handles the requests on a client connection.
+ *
+ * Requests are served in order until the client asks to close the
+ * connection, a response cannot be delimited for the client, or an error
+ * occurs. Pipelined requests wait in the read buffer until their turn.
  *
  * @param client_fd File descriptor for the client connection.
  */
 void doit(int client_fd) {
-    char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], servername[MAXLINE], port[6];
     rio_t client_rio;
-    int server_fd, parse_result;
+    struct timeval idle_timeout = {.tv_sec = CLIENT_IDLE_TIMEOUT};
 
     // Initialize the client read buffer
     rio_readinitb(&client_rio, client_fd);
 
-    // Read the request line from the client
-    if (!rio_readlineb(&client_rio, buf, MAXLINE)) {
-        fprintf(stderr, "Error reading request line from client.\n");
+    if (!serve_request(client_fd, &client_rio)) {
         return;
     }
 
+    // Don't let an idle persistent client tie up a worker thread for ever
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout,
+               sizeof(idle_timeout));
+    while (serve_request(client_fd, &client_rio))
+        ;
+}
+
+/**
+ * Handles a single client request.
+ *
+ * @param client_fd File descriptor for the client connection.
+ * @param client_rio The read buffer for the client connection.
+ * @return true if the connection can carry another request.
+ */
+static bool serve_request(int client_fd, rio_t *client_rio) {
+    char buf[MAXLINE], url[MAXLINE];
+    char filename[MAXLINE], servername[MAXLINE], port[6];
+    char key[MAXLINE];
+    const char *method, *uri, *version;
+    parser_t *parser;
+    request_t request;
+    cache_obj_t *obj;
+    disk_obj_t *disk_obj;
+    flight_t *flight = NULL;
+    origin_t *origin;
+    int server_fd, parse_result, rc = -1;
+    bool keep_alive = false, http11, pooled, reusable = false;
+    bool leader, served;
+
+    // Read the request line; the client may close between requests
+    if (rio_readlineb(client_rio, buf, MAXLINE) <= 0) {
+        return false;
+    }
+    stats_begin();
+
     // Parse the request line
-    if (sscanf(buf, "%s %s %s", method, url, version) < 3) {
+    parser = parser_new();
+    if (strlen(buf) > PARSER_MAXLINE ||
+        parser_parse_line(parser, buf) != REQUEST ||
+        parser_retrieve(parser, METHOD, &method) < 0 ||
+        parser_retrieve(parser, URI, &uri) < 0 ||
+        parser_retrieve(parser, HTTP_VERSION, &version) < 0) {
         fprintf(stderr, "Error parsing request line: %s\n", buf);
         client_error(client_fd, "Parsing Error", "400", "Bad request",
                      "Cannot parse the request line");
-        return;
+        goto out;
     }
 
     // Only support the GET method
     if (strcasecmp(method, "GET") != 0) {
-        client_error(client_fd, method, "501", "Not implemented",
+        client_error(client_fd, (char *)method, "501", "Not implemented",
                      "This proxy only supports the GET method");
-        return;
+        goto out;
     }
 
     // Extract hostname, port, and filename from URL
+    if (snprintf(url, MAXLINE, "%s", uri) >= MAXLINE) {
+        url[0] = '\0';
+    }
     parse_result = parse_url(url, port, servername, filename);
     if (parse_result != 0) {
-        fprintf(stderr, "Error parsing URL: %s\n", url);
-        client_error(client_fd, url, "400", "Bad request",
+        fprintf(stderr, "Error parsing URL: %s\n", uri);
+        client_error(client_fd, (char *)uri, "400", "Bad request",
                      "Cannot parse the URL");
-        return;
+        goto out;
     }
 
-    // Attempt to forward the request to the server
-    server_fd = forward_request(&client_rio, servername, port, filename);
-    if (server_fd < 0) {
-        fprintf(stderr, "Error connecting to server: %s:%s\n", servername,
-                port);
-        client_error(client_fd, servername, "500", "Internal server error",
-                     "Error forwarding the request");
-        return;
+    // HTTP/1.1 connections persist unless the client's headers say
+    // otherwise; HTTP/1.0 ones only if they ask to
+    read_request_headers(client_rio, parser);
+    keep_alive = client_keep_alive(parser, strcmp(version, "1.1") == 0);
+
+    // The proxy answers requests for its statistics itself
+    if (stats_is_request(servername, filename)) {
+        size_t len;
+        char *response = stats_response(keep_alive, &len);
+
+        stats_first_byte();
+        if (rio_writen(client_fd, response, len) != (ssize_t)len) {
+            keep_alive = false;
+        }
+        stats_bytes(0, len);
+        Free(response);
+        goto out;
+    }
+
+    // Serve the object from the cache if we have it. Requests whose key
+    // does not fit are never cached, so truncated keys cannot collide.
+    if (snprintf(key, MAXLINE, "%s:%s%s", servername, port,
+                 filename[0] ? filename : "/") >= MAXLINE) {
+        key[0] = '\0';
+    }
+    obj = key[0] ? cache_lookup(key) : NULL;
+    if (obj) {
+        keep_alive = serve_cached(client_fd, obj, keep_alive);
+        cache_release(obj);
+        goto out;
+    }
+    disk_obj = key[0] ? disk_cache_lookup(key) : NULL;
+    if (disk_obj) {
+        keep_alive = serve_disk(client_fd, disk_obj, keep_alive);
+        disk_cache_release(disk_obj);
+        goto out;
+    }
+
+    // Share a fetch of the same object that is already in progress, or
+    // start one that later requests can share
+    if (key[0]) {
+        flight = flight_join(key, &leader);
+        if (!leader) {
+            served = serve_flight(client_fd, flight, &keep_alive);
+            flight_release(flight);
+            flight = NULL;
+            if (served) {
+                goto out;
+            }
+        }
     }
 
-    // Forward the response from the server back to the client
-    forward_response(client_fd, server_fd);
+    // Build the request for the server from the client's headers. Persistent
+    // upstream connections speak the client's HTTP version, so that chunked
+    // responses are only ever relayed to clients that understand them.
+    http11 = upstream_keepalive && strcmp(version, "1.1") == 0;
+    if (!build_request(&request, parser, servername, port, filename,
+                       upstream_keepalive, http11)) {
+        client_error(client_fd, url, "400", "Bad request",
+                     "Cannot build the request");
+        keep_alive = false;
+        goto done;
+    }
 
-    // Clean-up
-    close(server_fd);
+    // Wait for a turn to fetch from the origin, or tell the client it is
+    // busy if too many requests are waiting for it already
+    if (!origin_acquire(servername, port, &origin)) {
+        client_error(client_fd, servername, "503", "Service unavailable",
+                     "Too many requests are waiting for this server");
+        request_free(&request);
+        keep_alive = false;
+        goto done;
+    }
+
+    while (1) {
+        // Attempt to forward the request to the server
+        server_fd = forward_request(servername, port, &request, &pooled);
+        if (server_fd < 0) {
+            fprintf(stderr, "Error connecting to server: %s:%s\n", servername,
+                    port);
+            client_error(client_fd, servername, "500", "Internal server error",
+                         "Error forwarding the request");
+            break;
+        }
+
+        // Forward the response from the server back to the client
+        rc = forward_response(client_fd, server_fd, key, flight,
+                              upstream_keepalive ? &reusable : NULL,
+                              &keep_alive);
+
+        // A pooled connection the server closed while idle: retry the
+        // request, which no byte of the response has reached the client for
+        if (rc == -2 && pooled) {
+            close(server_fd);
+            continue;
+        }
+
+        // Clean-up
+        if (upstream_keepalive && reusable) {
+            pool_checkin(servername, port, server_fd);
+        } else {
+            close(server_fd);
+        }
+        break;
+    }
+
+    origin_release(origin);
+    request_free(&request);
+    keep_alive = rc == 0 && keep_alive;
+
+done:
+    // Send any followers off to fetch the object themselves if the
+    // response never made it into the buffer
+    if (flight) {
+        flight_finish(flight, false);
+        flight_release(flight);
+    }
+
+out:
+    parser_free(parser);
+    stats_end();
+    return keep_alive;
 }
 
 /**
@@ -230,24 +547,31 @@ int parse_url(char *url, char *port, char *servername, char *filename) {
         strcpy(port, host_end + 1); // Copy the port number
     }
 
-    // Copy the hostname to servername
+    // Copy the hostname to servername; host names are case-insensitive
     strcpy(servername, host_start);
+    for (char *c = servername; *c; c++) {
+        *c = (char)tolower((unsigned char)*c);
+    }
 
     return 0;
 }
 
 /**
- * Sends an HTTP error response to the client.
+ * Formats a complete HTTP error response, headers and body, into a buffer.
  *
- * @param fd The file descriptor to write the error message to.
+ * @param buf The buffer to store the response in.
+ * @param size The size of buf.
  * @param cause The cause of the error.
  * @param errnum The HTTP error number (status code).
  * @param shortmsg A short description of the error.
  * @param longmsg A longer explanation of the error.
+ * @return The length of the response, truncated to fit in buf.
  */
-void client_error(int fd, char *cause, char *errnum, char *shortmsg,
-                  char *longmsg) {
-    char buf[MAXLINE], body[MAXBUF];
+size_t build_client_error(char *buf, size_t size, const char *cause,
+                          const char *errnum, const char *shortmsg,
+                          const char *longmsg) {
+    char body[MAXBUF];
+    int len;
 
     // Build the HTTP response body
     snprintf(body, MAXBUF,
@@ -258,107 +582,712 @@ void client_error(int fd, char *cause, char *errnum, char *shortmsg,
              "</body></html>",
              errnum, shortmsg, longmsg, cause);
 
-    // Write the HTTP response headers
-    snprintf(buf, MAXLINE, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen(fd, buf, strlen(buf));
-    snprintf(buf, MAXLINE, "Content-type: text/html\r\n");
-    rio_writen(fd, buf, strlen(buf));
-    snprintf(buf, MAXLINE, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen(fd, buf, strlen(buf));
+    // Prepend the HTTP response headers
+    len = snprintf(buf, size,
+                   "HTTP/1.0 %s %s\r\n"
+                   "Content-type: text/html\r\n"
+                   "Content-length: %d\r\n\r\n"
+                   "%s",
+                   errnum, shortmsg, (int)strlen(body), body);
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+/**
+ * Sends an HTTP error response to the client.
+ *
+ * @param fd The file descriptor to write the error message to.
+ * @param cause The cause of the error.
+ * @param errnum The HTTP error number (status code).
+ * @param shortmsg A short description of the error.
+ * @param longmsg A longer explanation of the error.
+ */
+void client_error(int fd, char *cause, char *errnum, char *shortmsg,
+                  char *longmsg) {
+    char buf[MAXLINE + MAXBUF];
+    size_t len;
+
+    len = build_client_error(buf, sizeof(buf), cause, errnum, shortmsg,
+                             longmsg);
+    stats_first_byte();
+    rio_writen(fd, buf, len);
+}
+
+/**
+ * Decides whether a client request header is passed on to the server.
+ * The proxy supplies its own Host, User-Agent, and connection headers.
+ *
+ * @param name The header's name.
+ * @param len The length of the name.
+ * @return true if the header should be forwarded.
+ */
+bool should_forward_header(const char *name, size_t len) {
+    static const char *own_headers[] = {"Host", "User-Agent", "Connection",
+                                        "Proxy-Connection"};
 
-    // Write the response body
-    rio_writen(fd, body, strlen(body));
+    for (size_t i = 0; i < sizeof(own_headers) / sizeof(own_headers[0]);
+         i++) {
+        if (strlen(own_headers[i]) == len &&
+            strncasecmp(name, own_headers[i], len) == 0) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
- * Forwards the client's request to the server.
+ * Decides whether the client wants its connection kept open. Both
+ * Connection and Proxy-Connection are honored.
  *
- * @param read_rio The read buffer for the client's request.
+ * @param parser The parser holding the client's headers.
+ * @param persistent Whether the connection persists by default, as it
+ *                   does for HTTP/1.1.
+ * @return true if the connection should be kept open.
+ */
+static bool client_keep_alive(parser_t *parser, bool persistent) {
+    static const char *names[] = {"Connection", "Proxy-Connection"};
+    header_t *h;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((h = parser_lookup_header(parser, names[i])) == NULL) {
+            continue;
+        }
+        if (framer_has_token(h->value, "close")) {
+            persistent = false;
+        } else if (framer_has_token(h->value, "keep-alive")) {
+            persistent = true;
+        }
+    }
+    return persistent;
+}
+
+/**
+ * Formats the request line and the headers the proxy always sends.
+ *
+ * @param buf The buffer to store the request head in.
+ * @param size The size of buf.
  * @param servername The server's hostname.
  * @param port The server's port number.
  * @param filename The requested filename/path.
- * @return The server's file descriptor on success, -1 on error.
+ * @param keep_alive Whether to ask the server to keep the connection open.
+ * @param http11 Whether to send an HTTP/1.1 rather than HTTP/1.0 request.
+ * @return The length of the request head, or 0 if it does not fit.
  */
-int forward_request(rio_t *read_rio, char *servername, char *port,
-                    char *filename) {
-    char buf[MAXLINE], request_hdr[MAXLINE], other_hdrs[MAXLINE] = "";
-    int server_fd;
+size_t build_request_head(char *buf, size_t size, const char *servername,
+                          const char *port, const char *filename,
+                          bool keep_alive, bool http11) {
+    int len;
 
-    server_fd = open_clientfd(servername, port);
-    if (server_fd < 0)
-        return -1;
+    len = snprintf(buf, size,
+                   "GET %s HTTP/1.%c\r\n"
+                   "Host: %s:%s\r\n"
+                   "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:3.10.0) "
+                   "Gecko/20220411 Firefox/63.0.1\r\n"
+                   "%s",
+                   filename, http11 ? '1' : '0', servername, port,
+                   keep_alive ? "Connection: keep-alive\r\n"
+                              : "Connection: close\r\n"
+                                "Proxy-Connection: close\r\n");
+    if (len < 0 || (size_t)len >= size) {
+        return 0;
+    }
+    return (size_t)len;
+}
+
+/**
+ * Reads the client's request headers, up to and including the blank line
+ * that ends them, into a parser. Lines the parser cannot make sense of are
+ * dropped.
+ *
+ * @param rio The read buffer for the client's request.
+ * @param parser The parser that has parsed the request line.
+ */
+void read_request_headers(rio_t *rio, parser_t *parser) {
+    char buf[MAXLINE];
 
-    // Construct and send the request line
-    snprintf(request_hdr, MAXLINE, "GET %s HTTP/1.0\r\n", filename);
-    rio_writen(server_fd, request_hdr, strlen(request_hdr));
-
-    // Construct and send the necessary headers
-    snprintf(other_hdrs, MAXLINE,
-             "Host: %s:%s\r\n"
-             "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:3.10.0) "
-             "Gecko/20220411 Firefox/63.0.1\r\n"
-             "Connection: close\r\n"
-             "Proxy-Connection: close\r\n",
-             servername, port);
-    rio_writen(server_fd, other_hdrs, strlen(other_hdrs));
-
-    // Forward other necessary headers from the client
-    while (rio_readlineb(read_rio, buf, MAXLINE) > 0) {
-        if (strcmp(buf, "\r\n") == 0) {
-            rio_writen(server_fd, buf, strlen(buf));
+    while (rio_readlineb(rio, buf, MAXLINE) > 0) {
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
             break; // End of headers
         }
-        if (!strstr(buf, "Host:") && !strstr(buf, "User-Agent:") &&
-            !strstr(buf, "Connection:") && !strstr(buf, "Proxy-Connection:")) {
-            rio_writen(server_fd, buf, strlen(buf));
+        if (strlen(buf) <= PARSER_MAXLINE) {
+            parser_parse_line(parser, buf);
+        }
+    }
+}
+
+/**
+ * Appends one entry to a request's iovec, growing it as needed.
+ *
+ * @param req The request.
+ * @param base The bytes to send.
+ * @param len The number of bytes.
+ */
+static void request_append(request_t *req, const char *base, size_t len) {
+    if (req->iovcnt == req->iovcap) {
+        req->iovcap *= 2;
+        req->iov = Realloc(req->iov, req->iovcap * sizeof(struct iovec));
+    }
+    req->iov[req->iovcnt].iov_base = (void *)base;
+    req->iov[req->iovcnt].iov_len = len;
+    req->iovcnt++;
+    req->len += len;
+}
+
+/**
+ * Builds the complete request for the server: the request line, the
+ * proxy's own headers, and the client's remaining headers. Nothing is
+ * copied but the proxy's own line and headers; the iovec points at the
+ * header names and values held by the parser, so the request is only
+ * valid until the parser is freed.
+ *
+ * @param req The request to build. Free it with request_free().
+ * @param parser The parser holding the client's headers.
+ * @param servername The server's hostname.
+ * @param port The server's port number.
+ * @param filename The requested filename/path.
+ * @param keep_alive Whether to ask the server to keep the connection open.
+ * @param http11 Whether to send an HTTP/1.1 rather than HTTP/1.0 request.
+ * @return true on success, false if the request line does not fit.
+ */
+bool build_request(request_t *req, parser_t *parser, const char *servername,
+                   const char *port, const char *filename, bool keep_alive,
+                   bool http11) {
+    size_t head_len;
+    header_t *h;
+
+    // Construct the request line and the necessary headers
+    head_len = build_request_head(req->head, MAXLINE, servername, port,
+                                  filename, keep_alive, http11);
+    if (head_len == 0) {
+        return false;
+    }
+
+    req->iovcap = 32;
+    req->iov = Malloc(req->iovcap * sizeof(struct iovec));
+    req->iovcnt = 0;
+    req->len = 0;
+    request_append(req, req->head, head_len);
+
+    // Append other necessary headers from the client
+    while ((h = parser_retrieve_next_header(parser)) != NULL) {
+        if (should_forward_header(h->name, strlen(h->name))) {
+            request_append(req, h->name, strlen(h->name));
+            request_append(req, ": ", 2);
+            request_append(req, h->value, strlen(h->value));
+            request_append(req, "\r\n", 2);
+        }
+    }
+    request_append(req, "\r\n", 2);
+    return true;
+}
+
+/**
+ * Frees the iovec of a request built by build_request().
+ *
+ * @param req The request.
+ */
+void request_free(request_t *req) {
+    Free(req->iov);
+    req->iov = NULL;
+}
+
+/**
+ * Forwards a request to the server, over a pooled persistent connection if
+ * one is available. The whole request goes out in one writev() call.
+ *
+ * @param servername The server's hostname.
+ * @param port The server's port number.
+ * @param req The complete request.
+ * @param pooled Set to whether the connection came from the pool.
+ * @return The server's file descriptor on success, -1 on error.
+ */
+int forward_request(char *servername, char *port, const request_t *req,
+                    bool *pooled) {
+    int server_fd = -1;
+    uint64_t start;
+
+    *pooled = false;
+    if (upstream_keepalive) {
+        server_fd = pool_checkout(servername, port);
+        *pooled = server_fd >= 0;
+    }
+    if (server_fd < 0) {
+        start = stats_now();
+        server_fd = dns_open_clientfd(servername, port);
+        if (server_fd < 0)
+            return -1;
+        stats_latency(STATS_CONNECT, start);
+    }
+
+    if (rio_writev(server_fd, req->iov, req->iovcnt) < 0) {
+        if (!*pooled) {
+            close(server_fd);
+            return -1;
         }
+        // A stale pooled connection; the caller sees EOF and retries
     }
 
     return server_fd;
 }
 
+/**
+ * Sends a response head to the client with the server's connection
+ * management headers replaced by the proxy's own, since those describe the
+ * connection to the server rather than the one to the client. The start of
+ * the body goes out in the same writev() call.
+ *
+ * @param client_fd The client's file descriptor.
+ * @param head The response head, ending with its blank line.
+ * @param len The length of the head.
+ * @param body The body bytes that follow the head.
+ * @param body_len The number of body bytes, which may be 0.
+ * @param keep_alive Whether the client connection stays open afterwards.
+ * @return 0 on success, -1 on write error.
+ */
+static int write_response_head(int client_fd, const char *head, size_t len,
+                               const char *body, size_t body_len,
+                               bool keep_alive) {
+    static const char *hop_headers[] = {"Connection:", "Proxy-Connection:",
+                                        "Keep-Alive:"};
+    const char *conn_header =
+        keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    const char *line = head, *end = head + len, *nl;
+    char *out = Malloc(len + strlen(conn_header));
+    size_t out_len = 0, n, i;
+    struct iovec iov[2];
+    ssize_t want;
+    int rc;
+
+    stats_first_byte();
+
+    while (line < end) {
+        nl = memchr(line, '\n', (size_t)(end - line));
+        n = nl ? (size_t)(nl + 1 - line) : (size_t)(end - line);
+
+        // Add our own header just before the blank line ending the head
+        if (line[0] == '\r' || line[0] == '\n') {
+            memcpy(out + out_len, conn_header, strlen(conn_header));
+            out_len += strlen(conn_header);
+        }
+
+        for (i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+            if (strncasecmp(line, hop_headers[i], strlen(hop_headers[i])) ==
+                0) {
+                break;
+            }
+        }
+        if (i == sizeof(hop_headers) / sizeof(hop_headers[0])) {
+            memcpy(out + out_len, line, n);
+            out_len += n;
+        }
+        line += n;
+    }
+
+    iov[0].iov_base = out;
+    iov[0].iov_len = out_len;
+    iov[1].iov_base = (char *)body;
+    iov[1].iov_len = body_len;
+    want = (ssize_t)(out_len + body_len);
+    rc = rio_writev(client_fd, iov, 2) == want ? 0 : -1;
+    Free(out);
+    return rc;
+}
+
+/**
+ * Sends a cached response to the client. The connection can only stay
+ * open if the response's own headers say where it ends.
+ *
+ * @param client_fd The client's file descriptor.
+ * @param obj The cached object.
+ * @param keep_alive Whether the client wants the connection kept open.
+ * @return true if the connection can carry another request.
+ */
+static bool serve_cached(int client_fd, const cache_obj_t *obj,
+                         bool keep_alive) {
+    framer_t framer;
+    size_t len;
+
+    stats_bytes(0, obj->size);
+    framer_init(&framer);
+    len = framer_feed(&framer, obj->data, obj->size);
+    if (!framer.head_complete) {
+        rio_writen(client_fd, obj->data, obj->size);
+        return false;
+    }
+
+    keep_alive = keep_alive && framer_done(&framer);
+    if (write_response_head(client_fd, obj->data, framer.head_len,
+                            obj->data + framer.head_len,
+                            len - framer.head_len, keep_alive) < 0) {
+        return false;
+    }
+    return keep_alive;
+}
+
+/**
+ * Sends a response stored in the disk tier to the client. The head is
+ * rewritten from the file's mapping, and the body sent straight from the
+ * file.
+ *
+ * @param client_fd The client's file descriptor.
+ * @param obj The stored object.
+ * @param keep_alive Whether the client wants the connection kept open.
+ * @return true if the connection can carry another request.
+ */
+static bool serve_disk(int client_fd, const disk_obj_t *obj,
+                       bool keep_alive) {
+    const char *data = disk_cache_data(obj);
+    framer_t framer;
+    size_t len;
+
+    stats_bytes(0, obj->size);
+    framer_init(&framer);
+    len = framer_feed(&framer, data, obj->size);
+    if (!framer.head_complete) {
+        disk_cache_send(client_fd, obj, 0, obj->size);
+        return false;
+    }
+
+    keep_alive = keep_alive && framer_done(&framer);
+    if (write_response_head(client_fd, data, framer.head_len, NULL, 0,
+                            keep_alive) < 0 ||
+        disk_cache_send(client_fd, obj, framer.head_len,
+                        len - framer.head_len) < 0) {
+        return false;
+    }
+    return keep_alive;
+}
+
+/**
+ * Sends the response another worker is fetching to the client, streaming
+ * it from the flight's buffer as the leader fills it in.
+ *
+ * @param client_fd The client's file descriptor.
+ * @param flight The flight for the requested object, joined as a follower.
+ * @param keep_alive On entry, whether the client wants its connection kept
+ *                   open; on return, whether it can be.
+ * @return false if nothing was sent because the response did not start in
+ *         time or will not be buffered, in which case the caller must fetch
+ *         the object itself.
+ */
+static bool serve_flight(int client_fd, flight_t *flight, bool *keep_alive) {
+    framer_t framer;
+    flight_state state;
+    const char *data;
+    size_t size, fed, sent;
+    bool keep;
+
+    state = flight_wait(flight, 0, &data, &size, true);
+    if (state == FLIGHT_PENDING || state == FLIGHT_FAILED) {
+        return false;
+    }
+
+    framer_init(&framer);
+    fed = framer_feed(&framer, data, size);
+    if (!framer.head_complete) {
+        rio_writen(client_fd, data, size);
+        *keep_alive = false;
+        return true;
+    }
+
+    keep = *keep_alive && framer.state != FRAMER_UNTIL_EOF;
+    *keep_alive = false;
+    if (write_response_head(client_fd, data, framer.head_len,
+                            data + framer.head_len, fed - framer.head_len,
+                            keep) < 0) {
+        return true;
+    }
+
+    sent = fed;
+    while (1) {
+        if (fed > sent && rio_writen(client_fd, data + sent, fed - sent) !=
+                              (ssize_t)(fed - sent)) {
+            return true; // Write error
+        }
+        sent = fed;
+        if (framer_done(&framer) || state != FLIGHT_STREAMING) {
+            break;
+        }
+        state = flight_wait(flight, fed, &data, &size, false);
+        fed += framer_feed(&framer, data + fed, size - fed);
+    }
+
+    // A leader that failed part way leaves the response cut short
+    stats_bytes(0, sent);
+    *keep_alive = keep && framer_done(&framer);
+    return true;
+}
+
+/**
+ * Makes room in the copy of a response being kept for the cache. Without a
+ * known length the buffer doubles as the response grows, so each byte is
+ * moved a constant number of times on average. Never grows it beyond
+ * MAX_OBJECT_SIZE, since nothing larger is cached.
+ *
+ * @param obj_buf The buffer, or NULL if nothing has been copied yet.
+ * @param obj_cap The buffer's allocated size, updated.
+ * @param need The number of bytes the buffer must hold.
+ * @param exact Whether need is the whole response, so that the buffer is
+ *              sized to fit it rather than doubled.
+ * @return The buffer, which may have moved.
+ */
+static char *reserve_copy(char *obj_buf, size_t *obj_cap, size_t need,
+                          bool exact) {
+    size_t cap = *obj_cap;
+
+    if (need <= cap) {
+        return obj_buf;
+    }
+    if (exact) {
+        cap = need;
+    } else {
+        while (cap < need) {
+            cap = cap ? 2 * cap : MAXLINE;
+        }
+        if (cap > MAX_OBJECT_SIZE) {
+            cap = MAX_OBJECT_SIZE;
+        }
+    }
+    *obj_cap = cap;
+    return Realloc(obj_buf, cap);
+}
+
+/**
+ * Stops keeping a copy of a response that will not be cached, so that the
+ * rest of it is relayed without copying, and frees what was kept. Followers
+ * of the flight, if any, are sent to fetch the object themselves.
+ *
+ * @param flight The flight led by the request, or NULL.
+ * @param obj_buf The copy, set to NULL.
+ * @param obj_size The number of bytes copied, set to 0.
+ * @param obj_cap The copy's allocated size, set to 0.
+ */
+static void drop_copy(flight_t *flight, char **obj_buf, size_t *obj_size,
+                      size_t *obj_cap) {
+    if (!flight || !flight_finish(flight, false)) {
+        Free(*obj_buf);
+    }
+    *obj_buf = NULL;
+    *obj_size = 0;
+    *obj_cap = 0;
+}
+
 /**
  * Forwards the server's response back to the client.
  *
+ * The response is framed by its headers, so it ends after its body even if
+ * the server keeps the connection open. Its head is held back until it is
+ * complete and then passed on with the proxy's own connection header. The
+ * client connection can only stay open if the response is delimited
+ * without closing it.
+ *
+ * Each piece of the body is written to the client as soon as it arrives,
+ * and also copied into a buffer that grows with the response, or is sized
+ * for it up front when its length is known. If the whole response fits
+ * within MAX_OBJECT_SIZE, it is inserted into the cache under the given key
+ * once it is complete. Chunked responses are not cached, since they could
+ * later be served to an HTTP/1.0 client. As soon as a response is known not
+ * to be cached, the copy is dropped and the rest of the body is handed to
+ * relay_copy(), which moves it without copying it through the proxy where
+ * it can.
+ *
+ * If the request leads a flight, the copy is published to its followers as
+ * it grows. The flight is finished once the response is cached, or as soon
+ * as it is known not to be.
+ *
  * @param client_fd The client's file descriptor.
  * @param server_fd The server's file descriptor.
- * @return 0 on successful forwarding, -1 on error.
+ * @param key The cache key for the request.
+ * @param flight The flight led by this request, or NULL.
+ * @param reusable If not NULL, set to whether the connection can carry
+ *                 another request once this one is done.
+ * @param client_keep_alive On entry, whether the client wants its
+ *                          connection kept open; on return, whether it can.
+ * @return 0 on successful forwarding, -2 if the server closed the
+ *         connection without sending anything, -1 on other errors.
  */
-int forward_response(int client_fd, int server_fd) {
-    char buf[MAXLINE];
-    rio_t server_rio;
-    ssize_t num;
+int forward_response(int client_fd, int server_fd, const char *key,
+                     flight_t *flight, bool *reusable,
+                     bool *client_keep_alive) {
+    char buf[RIO_BIGBUFSIZE];
+    ssize_t num = 0, moved;
+    size_t used = 0, total = 0;
+    framer_t framer;
+    char *obj_buf = NULL;
+    size_t obj_size = 0, obj_cap = 0, need;
+    bool cacheable = true, head_sent = false, complete = false, extra = false;
+    bool keep_alive = *client_keep_alive;
+    int rc = -1;
 
-    // Initialize the read buffer for the server's response
-    rio_readinitb(&server_rio, server_fd);
+    framer_init(&framer);
+    if (reusable) {
+        *reusable = false;
+    }
+    *client_keep_alive = false;
 
     // Read from server and write to client
-    while ((num = rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
-        if (rio_writen(client_fd, buf, num) != num)
-            return -1; // Write error
+    while (!framer_done(&framer)) {
+        // A body that will not be cached goes straight to the client
+        if (!cacheable && (framer.state == FRAMER_BODY ||
+                           framer.state == FRAMER_UNTIL_EOF)) {
+            moved = relay_copy(server_fd, client_fd,
+                               framer.state == FRAMER_BODY ? framer.remaining
+                                                           : RELAY_UNTIL_EOF);
+            if (moved < 0) {
+                goto out;
+            }
+            total += (size_t)moved;
+            framer_skip(&framer, (size_t)moved);
+            num = 0;
+            break;
+        }
+
+        while ((num = read(server_fd, buf, sizeof(buf))) < 0 && errno == EINTR)
+            ;
+        if (num <= 0) {
+            break;
+        }
+        used = framer_feed(&framer, buf, (size_t)num);
+        total += used;
+        extra = used < (size_t)num;
+
+        // Keep a copy of the response while it still fits in the cache.
+        // The head has to fit, as it is only sent once it is complete.
+        if (cacheable && obj_size + used <= MAX_OBJECT_SIZE) {
+            need = obj_size + used;
+            if (framer.state == FRAMER_BODY &&
+                need + framer.remaining <= MAX_OBJECT_SIZE) {
+                obj_buf = reserve_copy(obj_buf, &obj_cap,
+                                       need + framer.remaining, true);
+            } else {
+                obj_buf = reserve_copy(obj_buf, &obj_cap, need, false);
+            }
+            memcpy(obj_buf + obj_size, buf, used);
+            obj_size += used;
+
+            // Let followers see the new bytes, and start streaming them
+            // once the buffer holds room for the whole response
+            if (flight && framer.head_complete) {
+                flight_publish(flight, obj_buf, obj_size,
+                               framer_done(&framer) ||
+                                   (framer.state == FRAMER_BODY &&
+                                    obj_size + framer.remaining <= obj_cap));
+            }
+        } else if (!head_sent) {
+            goto out; // Response head too large
+        } else if (cacheable) {
+            cacheable = false;
+            drop_copy(flight, &obj_buf, &obj_size, &obj_cap);
+        }
+
+        if (!head_sent) {
+            if (framer.state == FRAMER_HEAD) {
+                continue; // Wait for the rest of the head
+            }
+            head_sent = true;
+            if ((framer.state == FRAMER_BODY &&
+                 obj_size + framer.remaining > MAX_OBJECT_SIZE) ||
+                framer.chunked) {
+                cacheable = false; // Known not to be cached
+            }
+            if (framer.head_complete) {
+                keep_alive = keep_alive && framer.state != FRAMER_UNTIL_EOF;
+                if (write_response_head(client_fd, obj_buf, framer.head_len,
+                                        obj_buf + framer.head_len,
+                                        obj_size - framer.head_len,
+                                        keep_alive) < 0) {
+                    goto out; // Write error
+                }
+            } else {
+                // A head we cannot parse is passed on as it is
+                keep_alive = false;
+                if (rio_writen(client_fd, obj_buf, obj_size) < 0) {
+                    goto out;
+                }
+            }
+            if (!cacheable) {
+                drop_copy(flight, &obj_buf, &obj_size, &obj_cap);
+            }
+            continue;
+        }
+
+        if (rio_writen(client_fd, buf, used) != (ssize_t)used) {
+            goto out; // Write error
+        }
     }
 
-    // Check for read error
-    if (num < 0)
-        return -1;
+    if (total == 0) {
+        rc = -2; // Closed before responding
+        goto out;
+    }
+    if (!head_sent) {
+        // The server closed in the middle of the head
+        rio_writen(client_fd, obj_buf, obj_size);
+        goto out;
+    }
+    if (num < 0 && !framer_done(&framer)) {
+        goto out; // Read error
+    }
+
+    if (framer_done(&framer)) {
+        // Extra bytes after the response mean the server is confused
+        complete = true;
+        if (reusable) {
+            *reusable = framer.keep_alive && !extra;
+        }
+    } else if (framer.state == FRAMER_UNTIL_EOF) {
+        complete = true;
+    }
+    if (complete) {
+        rc = 0;
+        *client_keep_alive = keep_alive;
+    }
 
-    return 0; // Success
+    if (complete && cacheable && !framer.chunked && key[0] != '\0') {
+        if (flight) {
+            // Followers may still be reading the buffer, which the flight
+            // takes over
+            cache_insert(key, memcpy(Malloc(obj_size), obj_buf, obj_size),
+                         obj_size);
+            flight_finish(flight, true);
+        } else {
+            cache_insert(key,
+                         obj_size < obj_cap ? Realloc(obj_buf, obj_size)
+                                            : obj_buf,
+                         obj_size);
+        }
+        obj_buf = NULL;
+    }
+
+out:
+    stats_bytes(total, total);
+    // Followers streaming from the copy keep it until they are done
+    if (!flight || !obj_buf || !flight_finish(flight, false)) {
+        Free(obj_buf);
+    }
+    return rc;
 }
 
 /**
- * Handles a client connection in a separate thread.
+ * Worker thread routine.
  *
  * This function detaches the current thread for independent execution,
- * calls a function 'doit' to process the client's request, and then
- * closes the client's file descriptor.
+ * then repeatedly takes a client connection from the connection queue,
+ * calls a function 'doit' to process the client's request, and closes the
+ * client's file descriptor.
  *
- * @param client_fd The client's file descriptor.
- * @return NULL after closing the client's connection.
+ * @param arg Unused.
+ * @return Never returns.
  */
 void *thread(void *arg) {
-    int client_fd = (int)(intptr_t)arg;
+    (void)arg;
     pthread_detach(pthread_self());
-    doit(client_fd);
-    close(client_fd);
+    while (1) {
+        int client_fd = sbuf_remove(&conn_queue);
+        doit(client_fd);
+        close(client_fd);
+    }
     return NULL;
-}
\ No newline at end of file
+}
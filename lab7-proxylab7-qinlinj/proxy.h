@@ -0,0 +1,53 @@
+/**
+ * @file proxy.h
+ * @brief Request handling routines shared by the proxy's serving modes
+ *
+ * The thread pool in proxy.c and the epoll loops in event_loop.c both parse
+ * requests, rewrite headers, and report errors the same way; the helpers
+ * that do so are declared here.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "csapp.h"
+#include "flight.h"
+#include "http_parser.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* A request for the origin, gathered for a single writev() */
+typedef struct {
+    char head[MAXLINE]; /* Request line and the proxy's own headers */
+    struct iovec *iov;  /* head, the client's headers, then the final CRLF */
+    size_t iovcnt;      /* Number of entries in iov */
+    size_t iovcap;      /* Allocated number of entries in iov */
+    size_t len;         /* Total length of the request */
+} request_t;
+
+void doit(int fd);
+void client_error(int fd, char *cause, char *errnum, char *shortmsg,
+                  char *longmsg);
+size_t build_client_error(char *buf, size_t size, const char *cause,
+                          const char *errnum, const char *shortmsg,
+                          const char *longmsg);
+int parse_url(char *url, char *port, char *servername, char *filename);
+bool should_forward_header(const char *name, size_t len);
+size_t build_request_head(char *buf, size_t size, const char *servername,
+                          const char *port, const char *filename,
+                          bool keep_alive, bool http11);
+void read_request_headers(rio_t *rio, parser_t *parser);
+bool build_request(request_t *req, parser_t *parser, const char *servername,
+                   const char *port, const char *filename, bool keep_alive,
+                   bool http11);
+void request_free(request_t *req);
+int forward_request(char *servername, char *port, const request_t *req,
+                    bool *pooled);
+int forward_response(int client_fd, int server_fd, const char *key,
+                     flight_t *flight, bool *reusable,
+                     bool *client_keep_alive);
+void *thread(void *arg);
+
+#endif /* PROXY_H */
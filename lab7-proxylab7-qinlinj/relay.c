@@ -0,0 +1,148 @@
+/**
+ * @file relay.c
+ * @brief Socket-to-socket copying of response bodies
+ *
+ * Each thread keeps one pipe for splice(). Data spliced into the pipe is
+ * always drained to the destination before more is read, so the pipe is
+ * empty between calls; if a write fails part way, the pipe is closed and
+ * a fresh one is made next time.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "relay.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/* Most bytes moved by a single read from the source */
+#define RELAY_CHUNK (1 << 16)
+
+/**
+ * Copies bytes through a user-space buffer.
+ *
+ * @param from_fd The descriptor to read from.
+ * @param to_fd The descriptor to write to.
+ * @param len The number of bytes to copy, or RELAY_UNTIL_EOF.
+ * @return The number of bytes copied, or -1 on error.
+ */
+static ssize_t relay_buffered(int from_fd, int to_fd, size_t len) {
+    char buf[MAXLINE];
+    size_t moved = 0, want;
+    ssize_t n;
+
+    while (moved < len) {
+        want = len - moved < MAXLINE ? len - moved : MAXLINE;
+        while ((n = read(from_fd, buf, want)) < 0 && errno == EINTR)
+            ;
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break; // EOF
+        }
+        if (rio_writen(to_fd, buf, (size_t)n) != n) {
+            return -1;
+        }
+        moved += (size_t)n;
+    }
+    return (ssize_t)moved;
+}
+
+#ifdef __linux__
+
+/* This thread's pipe for splice(), or -1 before it is first needed */
+static __thread int relay_pipe[2] = {-1, -1};
+
+/**
+ * Closes this thread's pipe, discarding anything left in it.
+ */
+static void relay_pipe_drop(void) {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/**
+ * Copies bytes between two descriptors. On Linux, at least one of them
+ * must be a socket or pipe for splice() to be used; otherwise the bytes
+ * are copied through a buffer.
+ *
+ * @param from_fd The descriptor to read from.
+ * @param to_fd The descriptor to write to.
+ * @param len The number of bytes to copy, or RELAY_UNTIL_EOF.
+ * @return The number of bytes copied, which is less than len only if the
+ *         source reached end of file, or -1 on error.
+ */
+ssize_t relay_copy(int from_fd, int to_fd, size_t len) {
+    size_t moved = 0, want;
+    ssize_t in, out;
+
+    if (relay_pipe[0] < 0) {
+        if (pipe(relay_pipe) < 0) {
+            relay_pipe[0] = relay_pipe[1] = -1;
+            return relay_buffered(from_fd, to_fd, len);
+        }
+        // A larger pipe needs fewer splice() calls; the default works too
+        fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_CHUNK);
+    }
+
+    while (moved < len) {
+        want = len - moved < RELAY_CHUNK ? len - moved : RELAY_CHUNK;
+        in = splice(from_fd, NULL, relay_pipe[1], NULL, want,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && moved == 0) {
+                // These descriptors do not support splicing
+                return relay_buffered(from_fd, to_fd, len);
+            }
+            return -1;
+        }
+        if (in == 0) {
+            break; // EOF
+        }
+
+        // Drain the pipe into the destination
+        while (in > 0) {
+            out = splice(relay_pipe[0], NULL, to_fd, NULL, (size_t)in,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                relay_pipe_drop();
+                return -1;
+            }
+            in -= out;
+            moved += (size_t)out;
+        }
+    }
+    return (ssize_t)moved;
+}
+
+#else
+
+/**
+ * Copies bytes between two descriptors.
+ *
+ * @param from_fd The descriptor to read from.
+ * @param to_fd The descriptor to write to.
+ * @param len The number of bytes to copy, or RELAY_UNTIL_EOF.
+ * @return The number of bytes copied, which is less than len only if the
+ *         source reached end of file, or -1 on error.
+ */
+ssize_t relay_copy(int from_fd, int to_fd, size_t len) {
+    return relay_buffered(from_fd, to_fd, len);
+}
+
+#endif /* __linux__ */
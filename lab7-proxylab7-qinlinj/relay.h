@@ -0,0 +1,23 @@
+/**
+ * @file relay.h
+ * @brief Socket-to-socket copying of response bodies
+ *
+ * Once the proxy knows it will not cache a response, the body only needs
+ * to pass from the origin to the client. On Linux it is moved through a
+ * pipe with splice(), so it never enters user space; elsewhere it is
+ * copied through a buffer.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Length meaning "until the source reaches end of file" */
+#define RELAY_UNTIL_EOF SIZE_MAX
+
+ssize_t relay_copy(int from_fd, int to_fd, size_t len);
+
+#endif /* RELAY_H */
@@ -0,0 +1,93 @@
+/**
+ * @file sbuf.c
+ * @brief Bounded producer/consumer queue of connected client descriptors
+ *
+ * This is the sbuf package from the CS:APP text, using a mutex and two
+ * condition variables in place of counting semaphores.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "sbuf.h"
+#include "csapp.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Creates an empty queue with the given number of slots.
+ *
+ * @param sp The queue to initialize.
+ * @param capacity The maximum number of queued descriptors.
+ */
+void sbuf_init(sbuf_t *sp, size_t capacity) {
+    sp->buf = Calloc(capacity, sizeof(int));
+    sp->capacity = capacity;
+    sp->front = 0;
+    sp->rear = 0;
+    pthread_mutex_init(&sp->mutex, NULL);
+    pthread_cond_init(&sp->slots, NULL);
+    pthread_cond_init(&sp->items, NULL);
+}
+
+/**
+ * Frees the storage of a queue.
+ *
+ * @param sp The queue to clean up.
+ */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+    pthread_mutex_destroy(&sp->mutex);
+    pthread_cond_destroy(&sp->slots);
+    pthread_cond_destroy(&sp->items);
+}
+
+/**
+ * Blocks until the queue has at least one free slot. The producer calls
+ * this before accept so that a full queue holds off new connections.
+ *
+ * @param sp The queue.
+ */
+void sbuf_wait_slot(sbuf_t *sp) {
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->rear - sp->front == sp->capacity) {
+        pthread_cond_wait(&sp->slots, &sp->mutex);
+    }
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+/**
+ * Inserts a descriptor at the rear of the queue, blocking while it is full.
+ *
+ * @param sp The queue.
+ * @param item The descriptor to insert.
+ */
+void sbuf_insert(sbuf_t *sp, int item) {
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->rear - sp->front == sp->capacity) {
+        pthread_cond_wait(&sp->slots, &sp->mutex);
+    }
+    sp->buf[sp->rear++ % sp->capacity] = item;
+    pthread_cond_signal(&sp->items);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+/**
+ * Removes the descriptor at the front of the queue, blocking while it is
+ * empty.
+ *
+ * @param sp The queue.
+ * @return The removed descriptor.
+ */
+int sbuf_remove(sbuf_t *sp) {
+    int item;
+
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->rear == sp->front) {
+        pthread_cond_wait(&sp->items, &sp->mutex);
+    }
+    item = sp->buf[sp->front++ % sp->capacity];
+    pthread_cond_signal(&sp->slots);
+    pthread_mutex_unlock(&sp->mutex);
+    return item;
+}
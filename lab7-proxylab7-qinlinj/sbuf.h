@@ -0,0 +1,33 @@
+/**
+ * @file sbuf.h
+ * @brief Bounded producer/consumer queue of connected client descriptors
+ *
+ * The accept thread inserts client file descriptors and the worker threads
+ * remove them. Both operations block: a full queue stalls the producer,
+ * which keeps the proxy from accepting more connections than it can serve,
+ * and an empty queue parks the workers until new work arrives.
+ */
+
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef struct {
+    int *buf;              /* Ring buffer of client descriptors */
+    size_t capacity;       /* Maximum number of slots */
+    size_t front;          /* buf[front % capacity] is the first item */
+    size_t rear;           /* buf[rear % capacity] is the next free slot */
+    pthread_mutex_t mutex; /* Protects the fields above */
+    pthread_cond_t slots;  /* Signaled when a slot is freed */
+    pthread_cond_t items;  /* Signaled when an item is added */
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, size_t capacity);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_wait_slot(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* SBUF_H */
@@ -0,0 +1,373 @@
+/**
+ * @file stats.c
+ * @brief Low-overhead performance counters for the proxy
+ *
+ * Each thread's counters are allocated the first time it records anything
+ * and linked into a global list, which is only locked to add a thread or to
+ * read the counters. A thread is the only writer of its own counters, so it
+ * updates them with plain relaxed loads and stores rather than atomic
+ * read-modify-write instructions; readers load them atomically and may see
+ * a sample in one counter before the matching one in another, which is
+ * fine for statistics.
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include "stats.h"
+#include "cache.h"
+#include "csapp.h"
+#include "disk_cache.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* A latency histogram */
+typedef struct {
+    uint64_t count;                  /* Number of samples */
+    uint64_t sum;                    /* Sum of the samples */
+    uint64_t max;                    /* Largest sample */
+    uint64_t buckets[STATS_BUCKETS]; /* Samples per bucket */
+} stats_histogram_t;
+
+/* One thread's counters */
+typedef struct stats_thread {
+    struct stats_thread *next;           /* Next thread in the list */
+    uint64_t requests;                   /* Requests received */
+    uint64_t bytes_in;                   /* Response bytes from origins */
+    uint64_t bytes_out;                  /* Response bytes to clients */
+    stats_histogram_t hist[STATS_NHIST]; /* Latency histograms */
+    uint64_t request_start;              /* When the current request began */
+    bool first_byte;                     /* Its first byte has been sent */
+} stats_thread_t;
+
+static stats_thread_t *stats_threads = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_thread_t *stats_self = NULL;
+
+/* Names of the histograms in the report */
+static const char *stats_hist_names[STATS_NHIST] = {"connect_us", "ttfb_us",
+                                                    "total_us"};
+
+/**
+ * Returns the calling thread's counters, creating them on first use.
+ *
+ * @return The counters.
+ */
+static stats_thread_t *stats_thread(void) {
+    if (!stats_self) {
+        stats_self = Calloc(1, sizeof(stats_thread_t));
+        pthread_mutex_lock(&stats_lock);
+        stats_self->next = stats_threads;
+        stats_threads = stats_self;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return stats_self;
+}
+
+/**
+ * Adds to a counter that only the calling thread writes.
+ *
+ * @param counter The counter.
+ * @param n The amount to add.
+ */
+static void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the histogram bucket a value falls in. Values below
+ * STATS_SUB_BUCKETS get a bucket each; above that, the bucket is chosen by
+ * the value's highest set bit and the STATS_SUB_BITS bits below it.
+ *
+ * @param value The value.
+ * @return The bucket index.
+ */
+static size_t stats_bucket(uint64_t value) {
+    int msb;
+
+    if (value < STATS_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    return ((size_t)(msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+           (size_t)((value >> (msb - STATS_SUB_BITS)) &
+                    (STATS_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the largest value that falls in a histogram bucket.
+ *
+ * @param bucket The bucket index.
+ * @return The value.
+ */
+static uint64_t stats_bucket_max(size_t bucket) {
+    int shift;
+
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = (int)(bucket >> STATS_SUB_BITS) - 1;
+    return (((uint64_t)STATS_SUB_BUCKETS + (bucket & (STATS_SUB_BUCKETS - 1)))
+            << shift) +
+           (((uint64_t)1 << shift) - 1);
+}
+
+/**
+ * Returns the current time on a clock that never jumps.
+ *
+ * @return The time in microseconds.
+ */
+uint64_t stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Counts a request received from a client.
+ */
+void stats_request(void) {
+    stats_add(&stats_thread()->requests, 1);
+}
+
+/**
+ * Counts response bytes relayed through the proxy.
+ *
+ * @param in The number of bytes received from the origin.
+ * @param out The number of bytes sent to the client.
+ */
+void stats_bytes(size_t in, size_t out) {
+    stats_thread_t *t = stats_thread();
+
+    stats_add(&t->bytes_in, in);
+    stats_add(&t->bytes_out, out);
+}
+
+/**
+ * Records the time elapsed since a starting point in a histogram.
+ *
+ * @param hist The histogram.
+ * @param start The starting point, as returned by stats_now().
+ */
+void stats_latency(stats_hist hist, uint64_t start) {
+    stats_histogram_t *h = &stats_thread()->hist[hist];
+    uint64_t now = stats_now(), value = now > start ? now - start : 0;
+
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, value);
+    stats_add(&h->buckets[stats_bucket(value)], 1);
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Marks the start of a request served by the calling thread, for threads
+ * that serve one request at a time.
+ */
+void stats_begin(void) {
+    stats_thread_t *t = stats_thread();
+
+    stats_add(&t->requests, 1);
+    t->request_start = stats_now();
+    t->first_byte = false;
+}
+
+/**
+ * Records the time to the first byte of the calling thread's current
+ * request, unless it has already been recorded.
+ */
+void stats_first_byte(void) {
+    stats_thread_t *t = stats_thread();
+
+    if (!t->first_byte) {
+        t->first_byte = true;
+        stats_latency(STATS_TTFB, t->request_start);
+    }
+}
+
+/**
+ * Records the total time taken by the calling thread's current request.
+ */
+void stats_end(void) {
+    stats_latency(STATS_TOTAL, stats_thread()->request_start);
+}
+
+/**
+ * Checks whether a request is for the statistics page.
+ *
+ * @param servername The requested host, in lower case.
+ * @param filename The requested path.
+ * @return true if the request should be answered with the statistics.
+ */
+bool stats_is_request(const char *servername, const char *filename) {
+    return strcmp(servername, STATS_HOST) == 0 &&
+           strcmp(filename, STATS_PATH) == 0;
+}
+
+/**
+ * Appends formatted text to a report, dropping whatever does not fit.
+ *
+ * @param buf The report.
+ * @param size The size of buf.
+ * @param len The length of the report so far, updated.
+ * @param fmt The format string.
+ */
+static void stats_printf(char *buf, size_t size, size_t *len, const char *fmt,
+                         ...) {
+    va_list ap;
+    int n;
+
+    if (*len >= size) {
+        return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        *len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+    }
+}
+
+/**
+ * Returns the smallest bucket bound that at least a given fraction of a
+ * histogram's samples fall under.
+ *
+ * @param h The histogram.
+ * @param fraction The fraction, between 0 and 1.
+ * @return The value, no larger than the largest sample.
+ */
+static uint64_t stats_percentile(const stats_histogram_t *h,
+                                 double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)h->count + 0.5), seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t value = stats_bucket_max(b);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Builds the HTTP response for the statistics page: one "name value" line
+ * per counter, then one line per latency histogram.
+ *
+ * @param keep_alive Whether the client connection stays open afterwards.
+ * @param len Set to the length of the response.
+ * @return The Malloc'd response.
+ */
+char *stats_response(bool keep_alive, size_t *len) {
+    static stats_histogram_t hist[STATS_NHIST];
+    static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+    char body[MAXBUF], *response;
+    uint64_t requests = 0, bytes_in = 0, bytes_out = 0;
+    cache_stats_t cs, total;
+    disk_cache_stats_t ds;
+    size_t body_len = 0, size;
+    stats_thread_t *t;
+
+    // The summed histograms are too large for the stack, so reports are
+    // built one at a time
+    pthread_mutex_lock(&report_lock);
+    memset(hist, 0, sizeof(hist));
+
+    pthread_mutex_lock(&stats_lock);
+    for (t = stats_threads; t != NULL; t = t->next) {
+        requests += __atomic_load_n(&t->requests, __ATOMIC_RELAXED);
+        bytes_in += __atomic_load_n(&t->bytes_in, __ATOMIC_RELAXED);
+        bytes_out += __atomic_load_n(&t->bytes_out, __ATOMIC_RELAXED);
+        for (int i = 0; i < STATS_NHIST; i++) {
+            stats_histogram_t *h = &t->hist[i];
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+            hist[i].count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            hist[i].sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            if (max > hist[i].max) {
+                hist[i].max = max;
+            }
+            for (size_t b = 0; b < STATS_BUCKETS; b++) {
+                hist[i].buckets[b] +=
+                    __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < cache_nshards(); i++) {
+        cache_get_stats(i, &cs);
+        total.hits += cs.hits;
+        total.misses += cs.misses;
+        total.insertions += cs.insertions;
+        total.evictions += cs.evictions;
+        total.rejections += cs.rejections;
+        total.objects += cs.objects;
+        total.bytes += cs.bytes;
+    }
+    disk_cache_get_stats(&ds);
+
+    stats_printf(body, sizeof(body), &body_len,
+                 "requests %" PRIu64 "\n"
+                 "bytes_in %" PRIu64 "\n"
+                 "bytes_out %" PRIu64 "\n"
+                 "cache_hits %" PRIu64 "\n"
+                 "cache_misses %" PRIu64 "\n"
+                 "cache_insertions %" PRIu64 "\n"
+                 "cache_evictions %" PRIu64 "\n"
+                 "cache_rejections %" PRIu64 "\n"
+                 "cache_objects %zu\n"
+                 "cache_bytes %zu\n"
+                 "disk_hits %" PRIu64 "\n"
+                 "disk_misses %" PRIu64 "\n"
+                 "disk_writes %" PRIu64 "\n"
+                 "disk_drops %" PRIu64 "\n"
+                 "disk_evictions %" PRIu64 "\n"
+                 "disk_objects %zu\n"
+                 "disk_bytes %zu\n"
+                 "disk_capacity %zu\n",
+                 requests, bytes_in, bytes_out, total.hits, total.misses,
+                 total.insertions, total.evictions, total.rejections,
+                 total.objects,
+                 total.bytes, ds.hits, ds.misses, ds.writes, ds.drops,
+                 ds.evictions, ds.objects, ds.bytes, ds.capacity);
+    for (int i = 0; i < STATS_NHIST; i++) {
+        const stats_histogram_t *h = &hist[i];
+
+        stats_printf(body, sizeof(body), &body_len,
+                     "%s count=%" PRIu64 " mean=%" PRIu64 " p50=%" PRIu64
+                     " p90=%" PRIu64 " p99=%" PRIu64 " p999=%" PRIu64
+                     " max=%" PRIu64 "\n",
+                     stats_hist_names[i], h->count,
+                     h->count ? h->sum / h->count : 0,
+                     stats_percentile(h, 0.5), stats_percentile(h, 0.9),
+                     stats_percentile(h, 0.99), stats_percentile(h, 0.999),
+                     h->max);
+    }
+    pthread_mutex_unlock(&report_lock);
+
+    size = body_len + MAXLINE;
+    response = Malloc(size);
+    *len = (size_t)snprintf(response, size,
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Cache-Control: no-store\r\n"
+                            "Connection: %s\r\n\r\n"
+                            "%.*s",
+                            body_len, keep_alive ? "keep-alive" : "close",
+                            (int)body_len, body);
+    return response;
+}
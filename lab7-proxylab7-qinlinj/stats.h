@@ -0,0 +1,55 @@
+/**
+ * @file stats.h
+ * @brief Low-overhead performance counters for the proxy
+ *
+ * Every thread that serves requests gets its own set of counters and
+ * latency histograms, so recording a sample never touches memory that
+ * another thread writes. Reading the statistics sums every thread's
+ * counters, together with the cache's per-shard counters, at that moment.
+ *
+ * Latencies are kept in microseconds in HDR-style histograms: each power of
+ * two is split into STATS_SUB_BUCKETS linear buckets, so every recorded
+ * value is known to within 1 / STATS_SUB_BUCKETS of itself, from a
+ * microsecond up to hours, in a fixed amount of memory.
+ *
+ * The statistics are served as plain text to any request for
+ * http://STATS_HOST/STATS_PATH, such as http://proxy.local/stats.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The URL that serves the statistics */
+#define STATS_HOST "proxy.local"
+#define STATS_PATH "/stats"
+
+/* Linear buckets per power of two in a latency histogram (a power of 2) */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+/* Number of buckets needed to cover every 64-bit value */
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+/* Latency histograms */
+typedef enum {
+    STATS_CONNECT, /* Connecting to the origin */
+    STATS_TTFB,    /* From reading the request to sending its first byte */
+    STATS_TOTAL,   /* From reading the request to sending its last byte */
+    STATS_NHIST
+} stats_hist;
+
+uint64_t stats_now(void);
+void stats_request(void);
+void stats_bytes(size_t in, size_t out);
+void stats_latency(stats_hist hist, uint64_t start);
+void stats_begin(void);
+void stats_first_byte(void);
+void stats_end(void);
+bool stats_is_request(const char *servername, const char *filename);
+char *stats_response(bool keep_alive, size_t *len);
+
+#endif /* STATS_H */
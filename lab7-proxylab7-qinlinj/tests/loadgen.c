@@ -0,0 +1,741 @@
+/**
+ * @file loadgen.c
+ * @brief Closed-loop HTTP load generator for the proxy and tiny
+ *
+ * Each of -c client threads sends requests back to back, either straight
+ * to the origin or through a proxy, and times every request from the start
+ * of its connect (or, on a persistent connection, from sending it) until
+ * the last byte of the response has arrived. When the run ends the tool
+ * reports throughput and exact latency percentiles over all requests.
+ *
+ * The objects requested are files the tool generates itself with -g, in a
+ * directory the origin serves, with sizes drawn from a distribution:
+ *
+ *   fixed:SIZE          every object is SIZE bytes
+ *   uniform:MIN:MAX     sizes spread evenly between MIN and MAX
+ *   pareto:MIN:ALPHA    heavy-tailed sizes of at least MIN, capped at 8 MiB
+ *
+ * Sizes take k and m suffixes. The same -F, -s and -S arguments always
+ * produce the same set of objects.
+ *
+ * The hit ratio is controlled by splitting the objects into a hot set of
+ * the first -H objects and a cold set of the rest. A request goes to a
+ * random hot object with probability -r; otherwise it goes to the next cold
+ * object in turn. If the cold set is several times larger than the proxy's
+ * cache, every cold request misses, so the hit ratio the proxy sees is -r
+ * once the hot set is cached. When going through the proxy, the tool also
+ * reads the proxy's statistics page before and after the run and reports
+ * the hit ratio the proxy actually saw.
+ *
+ * By default every request uses a new HTTP/1.0 connection; with -k the
+ * tool sends HTTP/1.1 requests and reuses each connection for as long as
+ * the server keeps it open.
+ *
+ * Typical use, from the proxy directory with tiny serving tiny/:
+ *
+ *   tests/loadgen -g tiny/lg -F 1000 -s pareto:2k:1.5
+ *   tests/loadgen -x localhost:15213 -t localhost:15214 -u /lg \
+ *                 -F 1000 -H 20 -r 0.9 -c 32 -d 10
+ *
+ * @author Qinlin Jia <qinlinj@andrew.cmu.edu>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Largest object the pareto distribution produces */
+#define MAX_PARETO_SIZE (8 * 1024 * 1024)
+
+/* Size of a client's receive buffer */
+#define RECV_BUFSIZE 65536
+
+/* Largest request the tool sends */
+#define MAX_REQUEST 1024
+
+/* Shapes of object size distributions */
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_PARETO } dist_kind;
+
+/* An object size distribution */
+typedef struct {
+    dist_kind kind;
+    double a; /* Size, minimum, or pareto minimum */
+    double b; /* Maximum, or pareto alpha */
+} dist_t;
+
+/* Settings shared by every client thread */
+typedef struct {
+    const char *proxy;     /* "host:port" of the proxy, or NULL */
+    const char *target;    /* "host:port" of the origin */
+    const char *prefix;    /* URL path of the object directory */
+    long nfiles;           /* Number of generated objects */
+    long nhot;             /* Number of objects in the hot set */
+    double hit_ratio;      /* Fraction of requests for hot objects */
+    long requests;         /* Requests to send, or 0 to run for duration */
+    double duration;       /* Seconds to run for when requests is 0 */
+    bool keep_alive;       /* Reuse connections with HTTP/1.1 */
+    struct addrinfo *addr; /* Address to connect to */
+    unsigned long seed;    /* Seed for the random choices */
+} config_t;
+
+/* One client thread's state and results */
+typedef struct {
+    uint64_t rng;        /* Random state */
+    uint32_t *latencies; /* Microseconds per completed request */
+    size_t nlatencies;   /* Number of entries in latencies */
+    size_t cap;          /* Allocated size of latencies */
+    uint64_t bytes;      /* Response bytes received */
+    uint64_t errors;     /* Requests that failed */
+    uint64_t non_200;    /* Responses with a status other than 200 */
+} client_t;
+
+static config_t cfg;
+
+/* Shared cursors: requests handed out, and the next cold object */
+static long next_request = 0;
+static long next_cold = 0;
+
+/* When a timed run stops, in microseconds */
+static uint64_t deadline = 0;
+
+/**
+ * Prints the usage message and exits.
+ *
+ * @param prog The program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -g <dir> -F <files> [-s <dist>] [-S <seed>]\n"
+            "       %s -t <host:port> [-x <proxy host:port>] [-u <prefix>]\n"
+            "          [-F <files>] [-H <hot files>] [-r <hit ratio>]\n"
+            "          [-c <clients>] [-n <requests> | -d <seconds>] [-k]\n"
+            "          [-S <seed>]\n",
+            prog, prog);
+    exit(1);
+}
+
+/**
+ * Returns the current time on a clock that never jumps.
+ *
+ * @return The time in microseconds.
+ */
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Returns the next number from a xorshift64* generator.
+ *
+ * @param state The generator's state, which must not be 0.
+ * @return A random 64-bit number.
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/**
+ * Returns a random number in [0, 1).
+ *
+ * @param state The generator's state.
+ * @return The number.
+ */
+static double next_unit(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / 9007199254740992.0;
+}
+
+/**
+ * Parses a size such as "512", "4k", or "2m".
+ *
+ * @param s The string.
+ * @param size Set to the size in bytes.
+ * @return 0 on success, -1 if s is not a size.
+ */
+static int parse_size(const char *s, double *size) {
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        v *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        v *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' && *end != ':') {
+        return -1;
+    }
+    *size = v;
+    return 0;
+}
+
+/**
+ * Parses a size distribution such as "uniform:1k:64k".
+ *
+ * @param s The string.
+ * @param dist Set to the distribution.
+ * @return 0 on success, -1 if s is not a distribution.
+ */
+static int parse_dist(const char *s, dist_t *dist) {
+    const char *arg = strchr(s, ':');
+    const char *arg2 = arg ? strchr(arg + 1, ':') : NULL;
+
+    if (!arg) {
+        return -1;
+    }
+    arg++;
+    if (strncmp(s, "fixed:", 6) == 0) {
+        dist->kind = DIST_FIXED;
+        return parse_size(arg, &dist->a);
+    }
+    if (!arg2) {
+        return -1;
+    }
+    if (strncmp(s, "uniform:", 8) == 0) {
+        dist->kind = DIST_UNIFORM;
+        return parse_size(arg, &dist->a) < 0 ||
+                       parse_size(arg2 + 1, &dist->b) < 0 || dist->b < dist->a
+                   ? -1
+                   : 0;
+    }
+    if (strncmp(s, "pareto:", 7) == 0) {
+        dist->kind = DIST_PARETO;
+        dist->b = strtod(arg2 + 1, NULL);
+        return parse_size(arg, &dist->a) < 0 || dist->a < 1 || dist->b <= 0
+                   ? -1
+                   : 0;
+    }
+    return -1;
+}
+
+/**
+ * Draws an object size from a distribution.
+ *
+ * @param dist The distribution.
+ * @param rng The random state.
+ * @return The size in bytes.
+ */
+static size_t draw_size(const dist_t *dist, uint64_t *rng) {
+    double v;
+
+    switch (dist->kind) {
+    case DIST_UNIFORM:
+        v = dist->a + next_unit(rng) * (dist->b - dist->a + 1);
+        break;
+    case DIST_PARETO:
+        v = dist->a / pow(1.0 - next_unit(rng), 1.0 / dist->b);
+        if (v > MAX_PARETO_SIZE) {
+            v = MAX_PARETO_SIZE;
+        }
+        break;
+    default:
+        v = dist->a;
+        break;
+    }
+    return (size_t)v;
+}
+
+/**
+ * Creates the objects in a directory, each filled with bytes that depend on
+ * its number so that mixed-up responses are easy to spot.
+ *
+ * @param dir The directory, created if missing.
+ * @param nfiles The number of objects.
+ * @param dist The size distribution.
+ * @param seed The random seed.
+ * @return 0 on success, -1 on error.
+ */
+static int generate(const char *dir, long nfiles, const dist_t *dist,
+                    unsigned long seed) {
+    char path[4096], block[4096];
+    uint64_t rng = seed * 2 + 1, total = 0;
+    size_t size, n;
+    FILE *fp;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    for (long i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/lg-%05ld.bin", dir, i);
+        if ((fp = fopen(path, "w")) == NULL) {
+            perror(path);
+            return -1;
+        }
+        memset(block, 'a' + (int)(i % 26), sizeof(block));
+        for (size = draw_size(dist, &rng); size > 0; size -= n) {
+            n = size < sizeof(block) ? size : sizeof(block);
+            fwrite(block, 1, n, fp);
+            total += n;
+        }
+        if (fclose(fp) != 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    printf("generated %ld objects, %" PRIu64 " bytes in total, in %s\n",
+           nfiles, total, dir);
+    return 0;
+}
+
+/**
+ * Splits "host:port" into its parts.
+ *
+ * @param s The string.
+ * @param host The buffer for the host.
+ * @param size The size of host.
+ * @return The port, or NULL if s has no port.
+ */
+static const char *split_host_port(const char *s, char *host, size_t size) {
+    const char *colon = strrchr(s, ':');
+
+    if (!colon || (size_t)(colon - s) >= size) {
+        return NULL;
+    }
+    memcpy(host, s, (size_t)(colon - s));
+    host[colon - s] = '\0';
+    return colon + 1;
+}
+
+/**
+ * Opens a connection to the configured address.
+ *
+ * @return The connected descriptor, or -1 on error.
+ */
+static int connect_target(void) {
+    const struct addrinfo *p = cfg.addr;
+    int fd, one = 1;
+
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        return -1;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * Picks the object for the next request.
+ *
+ * @param c The client.
+ * @return The object's number.
+ */
+static long pick_object(client_t *c) {
+    long ncold = cfg.nfiles - cfg.nhot;
+
+    if (cfg.nhot > 0 && (ncold <= 0 || next_unit(&c->rng) < cfg.hit_ratio)) {
+        return (long)(next_random(&c->rng) % (uint64_t)cfg.nhot);
+    }
+    return cfg.nhot +
+           __atomic_fetch_add(&next_cold, 1, __ATOMIC_RELAXED) % ncold;
+}
+
+/**
+ * Reads one response: up to Content-Length bytes after the head on a
+ * connection the server keeps open, otherwise until the server closes.
+ * Only the head is kept; body bytes are counted and dropped.
+ *
+ * @param fd The connection.
+ * @param c The client, whose byte count is updated.
+ * @param status Set to the response's status code.
+ * @param persist Set to whether the server keeps the connection open.
+ * @return 0 on success, -1 on error.
+ */
+static int read_response(int fd, client_t *c, int *status, bool *persist) {
+    char buf[RECV_BUFSIZE + 1], *end, *line;
+    size_t have = 0;
+    long long length = -1, body = 0;
+    bool head = false;
+    int minor;
+    ssize_t n;
+
+    *status = 0;
+    *persist = false;
+    while (1) {
+        n = read(fd, buf + have, RECV_BUFSIZE - have);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            // End of the response, unless its head promised more
+            return head && (length < 0 || body >= length) ? 0 : -1;
+        }
+        c->bytes += (uint64_t)n;
+
+        if (head) {
+            body += n;
+        } else {
+            have += (size_t)n;
+            buf[have] = '\0';
+            if ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+                if (have == RECV_BUFSIZE) {
+                    return -1; // Head too large
+                }
+                continue;
+            }
+            head = true;
+            body = (long long)(have - (size_t)(end + 4 - buf));
+            have = 0;
+            if (sscanf(buf, "HTTP/1.%d %d", &minor, status) != 2) {
+                return -1;
+            }
+            *persist = cfg.keep_alive && minor >= 1;
+            for (line = buf; (line = strchr(line, '\n')) != NULL &&
+                             line < end;) {
+                line++;
+                if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                    length = strtoll(line + 15, NULL, 10);
+                } else if (strncasecmp(line, "Connection:", 11) == 0) {
+                    line += 11 + strspn(line + 11, " \t");
+                    *persist = cfg.keep_alive &&
+                               strncasecmp(line, "keep-alive", 10) == 0;
+                }
+            }
+            *persist = *persist && length >= 0;
+        }
+
+        if (*persist && body >= length) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Records a completed request's latency.
+ *
+ * @param c The client.
+ * @param us The latency in microseconds.
+ */
+static void record(client_t *c, uint64_t us) {
+    if (c->nlatencies == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 4096;
+        c->latencies = realloc(c->latencies, c->cap * sizeof(uint32_t));
+        if (!c->latencies) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    c->latencies[c->nlatencies++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/**
+ * Client thread: sends requests until the run is over.
+ *
+ * @param arg The client.
+ * @return NULL.
+ */
+static void *client_thread(void *arg) {
+    client_t *c = arg;
+    char request[MAX_REQUEST];
+    int fd = -1, status, len;
+    bool persist;
+    uint64_t start;
+
+    while (1) {
+        if (cfg.requests > 0
+                ? __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED) >=
+                      cfg.requests
+                : now_us() >= deadline) {
+            break;
+        }
+
+        len = snprintf(request, sizeof(request),
+                       "GET %s%s%s/lg-%05ld.bin HTTP/1.%c\r\n"
+                       "Host: %s\r\n"
+                       "Connection: %s\r\n\r\n",
+                       cfg.proxy ? "http://" : "", cfg.proxy ? cfg.target : "",
+                       cfg.prefix, pick_object(c), cfg.keep_alive ? '1' : '0',
+                       cfg.target, cfg.keep_alive ? "keep-alive" : "close");
+
+        start = now_us();
+        if (fd < 0 && (fd = connect_target()) < 0) {
+            c->errors++;
+            continue;
+        }
+        if (write(fd, request, (size_t)len) != len ||
+            read_response(fd, c, &status, &persist) < 0) {
+            c->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        record(c, now_us() - start);
+        if (status != 200) {
+            c->non_200++;
+        }
+        if (!persist) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Reads the proxy's cache counters from its statistics page.
+ *
+ * @param hits Set to the number of cache hits.
+ * @param misses Set to the number of cache misses.
+ * @return 0 on success, -1 if the proxy has no statistics page.
+ */
+static int read_cache_stats(uint64_t *hits, uint64_t *misses) {
+    static const char request[] = "GET http://proxy.local/stats HTTP/1.0\r\n"
+                                  "Host: proxy.local\r\n\r\n";
+    char buf[8192], *p;
+    size_t have = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = connect_target()) < 0) {
+        return -1;
+    }
+    if (write(fd, request, sizeof(request) - 1) !=
+        (ssize_t)(sizeof(request) - 1)) {
+        close(fd);
+        return -1;
+    }
+    while (have < sizeof(buf) - 1 &&
+           (n = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0) {
+        have += (size_t)n;
+    }
+    close(fd);
+    buf[have] = '\0';
+
+    if ((p = strstr(buf, "\ncache_hits ")) == NULL) {
+        return -1;
+    }
+    *hits = strtoull(p + 12, NULL, 10);
+    if ((p = strstr(buf, "\ncache_misses ")) == NULL) {
+        return -1;
+    }
+    *misses = strtoull(p + 14, NULL, 10);
+    return 0;
+}
+
+/**
+ * Orders latencies for qsort().
+ */
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns a percentile of sorted latencies.
+ *
+ * @param v The sorted latencies.
+ * @param n The number of latencies.
+ * @param p The percentile, between 0 and 100.
+ * @return The latency.
+ */
+static uint32_t percentile(const uint32_t *v, size_t n, double p) {
+    size_t i = (size_t)ceil(p / 100.0 * (double)n);
+
+    if (n == 0) {
+        return 0;
+    }
+    return v[i == 0 ? 0 : i - 1];
+}
+
+int main(int argc, char **argv) {
+    const char *gen_dir = NULL;
+    char host[1024];
+    const char *port;
+    struct addrinfo hints;
+    dist_t dist = {DIST_FIXED, 10 * 1024, 0};
+    long nclients = 8;
+    client_t *clients;
+    pthread_t *tids;
+    uint32_t *all;
+    size_t total = 0;
+    uint64_t bytes = 0, errors = 0, non_200 = 0, sum = 0, start, elapsed;
+    uint64_t hits0 = 0, misses0 = 0, hits1, misses1;
+    bool have_stats = false;
+    int c, rc;
+
+    cfg.prefix = "/lg";
+    cfg.nfiles = 100;
+    cfg.nhot = 10;
+    cfg.hit_ratio = 0.9;
+    cfg.duration = 10;
+    cfg.seed = 1;
+
+    while ((c = getopt(argc, argv, "g:s:x:t:u:F:H:r:c:n:d:kS:")) != -1) {
+        switch (c) {
+        case 'g':
+            gen_dir = optarg;
+            break;
+        case 's':
+            if (parse_dist(optarg, &dist) < 0) {
+                fprintf(stderr, "bad size distribution: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'x':
+            cfg.proxy = optarg;
+            break;
+        case 't':
+            cfg.target = optarg;
+            break;
+        case 'u':
+            cfg.prefix = optarg;
+            break;
+        case 'F':
+            cfg.nfiles = strtol(optarg, NULL, 10);
+            break;
+        case 'H':
+            cfg.nhot = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            cfg.hit_ratio = strtod(optarg, NULL);
+            break;
+        case 'c':
+            nclients = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            cfg.requests = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            cfg.duration = strtod(optarg, NULL);
+            break;
+        case 'k':
+            cfg.keep_alive = true;
+            break;
+        case 'S':
+            cfg.seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cfg.nfiles <= 0) {
+        usage(argv[0]);
+    }
+    if (gen_dir) {
+        return generate(gen_dir, cfg.nfiles, &dist, cfg.seed) < 0 ? 1 : 0;
+    }
+    if (!cfg.target || nclients <= 0 || cfg.nhot < 0 ||
+        cfg.nhot > cfg.nfiles) {
+        usage(argv[0]);
+    }
+
+    // Resolve the address to connect to once, up front
+    port = split_host_port(cfg.proxy ? cfg.proxy : cfg.target, host,
+                           sizeof(host));
+    if (!port) {
+        usage(argv[0]);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(host, port, &hints, &cfg.addr)) != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+        return 1;
+    }
+
+    clients = calloc((size_t)nclients, sizeof(client_t));
+    tids = calloc((size_t)nclients, sizeof(pthread_t));
+    if (!clients || !tids) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if (cfg.proxy) {
+        have_stats = read_cache_stats(&hits0, &misses0) == 0;
+    }
+
+    start = now_us();
+    deadline = start + (uint64_t)(cfg.duration * 1e6);
+    for (long i = 0; i < nclients; i++) {
+        clients[i].rng = (cfg.seed + 1) * 0x9E3779B97F4A7C15ULL + (uint64_t)i;
+        pthread_create(&tids[i], NULL, client_thread, &clients[i]);
+    }
+    for (long i = 0; i < nclients; i++) {
+        pthread_join(tids[i], NULL);
+        total += clients[i].nlatencies;
+    }
+    elapsed = now_us() - start;
+    if (have_stats) {
+        have_stats = read_cache_stats(&hits1, &misses1) == 0 &&
+                     hits1 + misses1 > hits0 + misses0;
+    }
+
+    // Merge every client's latencies for exact percentiles
+    all = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!all) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    total = 0;
+    for (long i = 0; i < nclients; i++) {
+        memcpy(all + total, clients[i].latencies,
+               clients[i].nlatencies * sizeof(uint32_t));
+        total += clients[i].nlatencies;
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+        non_200 += clients[i].non_200;
+        free(clients[i].latencies);
+    }
+    qsort(all, total, sizeof(uint32_t), compare_latency);
+    for (size_t i = 0; i < total; i++) {
+        sum += all[i];
+    }
+
+    printf("requests %zu errors %" PRIu64 " non-200 %" PRIu64
+           " in %.3f s\n",
+           total, errors, non_200, (double)elapsed / 1e6);
+    printf("throughput %.1f req/s %.2f MiB/s\n",
+           (double)total * 1e6 / (double)elapsed,
+           (double)bytes * 1e6 / (double)elapsed / (1024 * 1024));
+    printf("latency_us mean %" PRIu64 " p50 %" PRIu32 " p99 %" PRIu32
+           " p999 %" PRIu32 " max %" PRIu32 "\n",
+           total ? sum / total : 0, percentile(all, total, 50),
+           percentile(all, total, 99), percentile(all, total, 99.9),
+           total ? all[total - 1] : 0);
+    if (have_stats) {
+        printf("proxy cache hits %" PRIu64 " misses %" PRIu64
+               " hit ratio %.3f\n",
+               hits1 - hits0, misses1 - misses0,
+               (double)(hits1 - hits0) /
+                   (double)(hits1 + misses1 - hits0 - misses0));
+    }
+
+    free(all);
+    free(clients);
+    free(tids);
+    freeaddrinfo(cfg.addr);
+    return errors > 0 ? 2 : 0;
+}
@@ -3,6 +3,7 @@
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgi.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,33 +12,37 @@
 int main(void) {
     char *buf, *p;
     char content[MAXLINE];
-    int n1=0, n2=0;
 
-    /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-        p = strchr(buf, '&');
-        if (p != NULL) {
-            *p = '\0';
-            n1 = atoi(buf);
-            n2 = atoi(p+1);
+    /* Handle each request tiny sends, or just the one if run as plain CGI */
+    while (cgi_accept() >= 0) {
+        int n1=0, n2=0;
+
+        /* Extract the two arguments */
+        if ((buf = getenv("QUERY_STRING")) != NULL) {
+            p = strchr(buf, '&');
+            if (p != NULL) {
+                *p = '\0';
+                n1 = atoi(buf);
+                n2 = atoi(p+1);
+            }
         }
-    }
 
-    /* Make the response body */
-    snprintf(content, sizeof(content),
-        "Welcome to add.com: "
-        "THE Internet addition portal.\r\n<p>"
-        "The answer is: %d + %d = %d\r\n<p>"
-        "Thanks for visiting!\r\n",
-        n1, n2, n1 + n2);
+        /* Make the response body */
+        snprintf(content, sizeof(content),
+            "Welcome to add.com: "
+            "THE Internet addition portal.\r\n<p>"
+            "The answer is: %d + %d = %d\r\n<p>"
+            "Thanks for visiting!\r\n",
+            n1, n2, n1 + n2);
 
-    /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %zu\r\n", strlen(content));
-    printf("Content-type: text/html\r\n");
-    printf("\r\n");
-    printf("%s", content);
-    fflush(stdout);
+        /* Generate the HTTP response */
+        printf("Connection: close\r\n");
+        printf("Content-length: %zu\r\n", strlen(content));
+        printf("Content-type: text/html\r\n");
+        printf("\r\n");
+        printf("%s", content);
+        fflush(stdout);
+    }
 
     exit(0);
 }
@@ -0,0 +1,128 @@
+/*
+ * cgi.c - the worker side of tiny's persistent CGI workers
+ *
+ * See cgi.h for the protocol.
+ */
+#include "cgi.h"
+#include "csapp.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Where stdout pointed before any request was accepted */
+static int saved_stdout = -1;
+
+/* Whether a request is being handled */
+static bool accepted = false;
+
+/*
+ * finish_request - end the response to the current request and tell tiny
+ * Returns 0 on success, or -1 if tiny has gone away.
+ */
+static int finish_request(void) {
+    char done = 0;
+
+    /* Let go of the client, so tiny's close ends the connection */
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    accepted = false;
+
+    if (send(CGI_WORKER_FD, &done, 1, MSG_NOSIGNAL) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * read_request - wait for tiny's next request, then point stdout at its
+ *     client and QUERY_STRING at its query string
+ * Returns 0 on success, or -1 if tiny has gone away.
+ */
+static int read_request(void) {
+    char query[MAXLINE];
+    size_t len = 0;
+    int clientfd = -1;
+
+    /* The client's socket arrives with the first bytes of the query */
+    do {
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov = { query + len, sizeof(query) - len };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)
+        };
+
+        ssize_t n = recvmsg(CGI_WORKER_FD, &msg, 0);
+        if (n <= 0) {
+            break;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&clientfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        len += n;
+    } while (query[len - 1] != '\0' && len < sizeof(query));
+
+    if (clientfd < 0 || len == 0 || query[len - 1] != '\0') {
+        if (clientfd >= 0) {
+            close(clientfd);
+        }
+        return -1;
+    }
+
+    setenv("QUERY_STRING", query, 1);
+    dup2(clientfd, STDOUT_FILENO);
+    close(clientfd);
+    accepted = true;
+    return 0;
+}
+
+/*
+ * cgi_accept - finish the previous request, if any, and wait for the next
+ *
+ * Run as an ordinary CGI program, the first call returns at once, with the
+ *     request in the environment and stdout as usual.
+ * Returns 0 when there is a request to handle, or -1 when there are no
+ *     more.
+ */
+int cgi_accept(void) {
+    static bool started = false;
+    char ready = 0;
+
+    if (getenv(CGI_WORKER_ENV) == NULL) {
+        if (started) {
+            return -1;
+        }
+        started = true;
+        return 0;
+    }
+
+    if (!started) {
+        started = true;
+
+        /* A client that goes away shouldn't take the worker with it */
+        signal(SIGPIPE, SIG_IGN);
+        saved_stdout = dup(STDOUT_FILENO);
+        if (saved_stdout < 0
+                || send(CGI_WORKER_FD, &ready, 1, MSG_NOSIGNAL) != 1) {
+            return -1;
+        }
+    }
+    else if (accepted && finish_request() < 0) {
+        return -1;
+    }
+    return read_request();
+}
@@ -0,0 +1,33 @@
+/*
+ * cgi.h - support for CGI programs that tiny runs as persistent workers
+ *
+ * With -w, tiny starts each CGI program once per worker rather than once
+ *     per request. The worker finds its connection to tiny on
+ *     CGI_WORKER_FD, and CGI_WORKER_ENV set in its environment. For each
+ *     request, tiny sends the query string, NUL-terminated, together with
+ *     the client's socket. The worker writes the rest of the response to
+ *     that socket, the same as a CGI program writes it to stdout, and
+ *     then sends back one byte to say it is done. The worker sends one byte
+ *     at startup, too, so tiny can tell it understands all this.
+ *
+ * A program written as
+ *
+ *     while (cgi_accept() >= 0) {
+ *         ... handle one request, as a CGI program would ...
+ *     }
+ *
+ *     runs as a worker when tiny asks it to, and as an ordinary CGI
+ *     program otherwise.
+ */
+#ifndef __CGI_H__
+#define __CGI_H__
+
+/* Set in the environment of a program started as a worker */
+#define CGI_WORKER_ENV "TINY_CGI_WORKER"
+
+/* A worker's connection to tiny */
+#define CGI_WORKER_FD 0
+
+int cgi_accept(void);
+
+#endif /* __CGI_H__ */
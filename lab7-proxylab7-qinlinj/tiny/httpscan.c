@@ -0,0 +1 @@
+../httpscan.c
\ No newline at end of file
@@ -2,11 +2,41 @@
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve static and dynamic content.
  *
+ * With -t, tiny instead runs several accept threads, each serving the
+ *     clients it accepts one at a time. Every thread has its own
+ *     SO_REUSEPORT listening socket, so the kernel spreads connections
+ *     across them and the threads never contend for one accept queue.
+ *
+ * Static files are kept open in a small cache together with their stat
+ *     results, which are trusted for FILE_CACHE_VALID seconds before the
+ *     file is looked at again, and are sent with sendfile() where
+ *     available. Each file's response header is built once, when the file
+ *     is opened, and sent along with the start of the body.
+ *
+ * With -w, each CGI program that supports it (see cgi-bin/cgi.h) runs as
+ *     up to that many persistent worker processes, started as requests
+ *     first need them, rather than as a new process for every request.
+ *     Programs that don't, and requests a worker fails to take, still get
+ *     a process of their own.
+ *
+ * Requests and responses are only echoed to stdout with -v.
+ *
+ * With -k, tiny keeps connections open for further requests when the client
+ *     asks it to, as HTTP/1.1 clients do by default. A persistent connection
+ *     holds its accept thread until it is closed or sits idle for
+ *     IDLE_TIMEOUT seconds, so run with enough threads for the clients;
+ *     the threads then share one listening socket, so that any free
+ *     thread can take the next connection.
+ *     Single byte ranges of static files are served with 206 Partial
+ *     Content either way.
+ *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
 
 #include "csapp.h"
+#include "cgi-bin/cgi.h"
+#include "httpscan.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,18 +44,48 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/* Most files kept open in the file cache, and its number of hash buckets */
+#define FILE_CACHE_MAX 256
+#define FILE_CACHE_BUCKETS 64
+
+/* Seconds a cached file's stat results are trusted without checking */
+#define FILE_CACHE_VALID 1
+
+/* Seconds a persistent connection may sit idle between requests */
+#define IDLE_TIMEOUT 5
+
+/* Most workers that may be run for each CGI program */
+#define CGI_WORKERS_MAX 64
+
+/* Seconds a new CGI worker has to say it is ready */
+#define CGI_WORKER_START 1
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
@@ -38,6 +98,68 @@ typedef struct {
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* An open static file in the file cache. */
+typedef struct file_entry {
+    struct file_entry *next;    // Next entry in the hash bucket
+    char *name;                 // File name, as from parse_uri
+    int fd;                     // Open descriptor for the file
+    struct stat st;             // Its stat results when opened
+    char *header[2];            // Its 200 response headers, indexed by
+    size_t header_len[2];       //     whether the connection stays open
+    time_t validated;           // When st was last checked against the file
+    time_t used;                // When the entry was last handed out
+    unsigned int refcnt;        // Holders, counting the cache while linked
+    bool linked;                // Still reachable from the cache
+} file_entry;
+
+/* The file cache, shared by every accept thread */
+static file_entry *file_cache[FILE_CACHE_BUCKETS];
+static size_t file_cache_count = 0;
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A persistent CGI worker process. */
+typedef struct {
+    pid_t pid;                  // The worker's process ID
+    int sock;                   // Our end of its connection
+} cgi_worker;
+
+/* The workers for one CGI program. */
+typedef struct cgi_program {
+    struct cgi_program *next;   // Next program in the list
+    char *name;                 // File name, as from parse_uri
+    bool plain;                 // The program can't run as a worker
+    size_t nworkers;            // Workers running or being started
+    size_t nidle;               // Workers waiting for a request
+    cgi_worker idle[CGI_WORKERS_MAX]; // The waiting workers
+    pthread_cond_t idle_cond;   // Signaled when a worker may be free
+} cgi_program;
+
+/* Every CGI program run so far, shared by every accept thread */
+static cgi_program *cgi_programs = NULL;
+static pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Workers to run for each CGI program, or 0 to fork for every request */
+static size_t cgi_workers = 0;
+
+/* Whether to echo requests and responses to stdout */
+static bool verbose = false;
+
+/* Whether to honor requests for persistent connections */
+static bool keep_alive_enabled = false;
+
+/* What the request headers ask for. */
+typedef struct {
+    bool keep_alive;            // Keep the connection open afterwards
+    char range[MAXLINE];        // Value of the Range header, or empty
+} request_info;
+
+/* Byte range parsing results. */
+typedef enum {
+    RANGE_NONE,                 // Send the whole file
+    RANGE_PARTIAL,              // Send just the requested range
+    RANGE_UNSATISFIABLE         // The range lies beyond the end of the file
+} range_result;
+
 /* URI parsing results. */
 typedef enum {
     PARSE_ERROR,
@@ -113,7 +235,7 @@ parse_result parse_uri(char *uri, char *filename, char *cgiargs) {
  * filetype - The buffer in which the file type will be storaged. Must be at
  * least MAXLINE bytes. Will be a NUL-terminated string.
  */
-void get_filetype(char *filename, char *filetype) {
+void get_filetype(const char *filename, char *filetype) {
     if (strstr(filename, ".html")) {
         strcpy(filetype, "text/html");
     } else if (strstr(filename, ".gif")) {
@@ -129,62 +251,634 @@ void get_filetype(char *filename, char *filetype) {
 
 
 /*
- * serve_static - copy a file back to the client
+ * file_hash - hash a file name (FNV-1a) to a file cache bucket
  */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp;
+static size_t file_hash(const char *name) {
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    return h % FILE_CACHE_BUCKETS;
+}
+
+/*
+ * file_put - drop a reference to a file entry, closing the file once the
+ *     last one is gone
+ */
+void file_put(file_entry *e) {
+    bool last;
+
+    pthread_mutex_lock(&file_cache_lock);
+    last = --e->refcnt == 0;
+    pthread_mutex_unlock(&file_cache_lock);
+
+    if (last) {
+        close(e->fd);
+        free(e->header[0]);
+        free(e->header[1]);
+        free(e->name);
+        free(e);
+    }
+}
+
+/*
+ * file_unlink - take an entry out of the file cache, dropping the cache's
+ *     reference. The caller must hold file_cache_lock and keep a reference
+ *     of its own, so that the entry is not freed under the lock.
+ */
+static void file_unlink(file_entry *e) {
+    file_entry **prevp;
+
+    for (prevp = &file_cache[file_hash(e->name)]; *prevp != e;
+            prevp = &(*prevp)->next)
+        ;
+    *prevp = e->next;
+    e->linked = false;
+    e->refcnt--;
+    file_cache_count--;
+}
+
+/*
+ * same_file - check whether stat results still describe the same, unchanged
+ *     file
+ */
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * file_cache_insert - add a newly opened file to the file cache, replacing
+ *     any stale entry for the same name and, if the cache is full, the
+ *     least recently used entry
+ */
+static void file_cache_insert(file_entry *e) {
+    file_entry *old, *victim = NULL;
+    size_t b = file_hash(e->name);
+
+    pthread_mutex_lock(&file_cache_lock);
+    for (old = file_cache[b]; old != NULL; old = old->next) {
+        if (strcmp(old->name, e->name) == 0) {
+            victim = old;
+            break;
+        }
+    }
+    if (victim == NULL && file_cache_count >= FILE_CACHE_MAX) {
+        for (size_t i = 0; i < FILE_CACHE_BUCKETS; i++) {
+            for (old = file_cache[i]; old != NULL; old = old->next) {
+                if (victim == NULL || old->used < victim->used) {
+                    victim = old;
+                }
+            }
+        }
+    }
+    if (victim != NULL) {
+        victim->refcnt++;
+        file_unlink(victim);
+    }
+
+    e->refcnt++;
+    e->linked = true;
+    e->next = file_cache[b];
+    file_cache[b] = e;
+    file_cache_count++;
+    pthread_mutex_unlock(&file_cache_lock);
+
+    if (victim != NULL) {
+        file_put(victim);
+    }
+}
+
+/*
+ * build_header - build the 200 response header for a static file
+ *
+ * Returns the malloc'd header, with its length in len, or NULL if out of
+ * memory.
+ */
+static char *build_header(const char *filename, size_t filesize,
+                          bool keep_alive, size_t *len) {
     char filetype[MAXLINE];
     char buf[MAXBUF];
     size_t buflen;
+    char *header;
 
     get_filetype(filename, filetype);
-
-    /* Send response headers to client */
     buflen = snprintf(buf, MAXBUF,
             "HTTP/1.0 200 OK\r\n" \
             "Server: Tiny Web Server\r\n" \
-            "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
+            "Connection: %s\r\n" \
+            "Accept-Ranges: bytes\r\n" \
+            "Content-Length: %zu\r\n" \
             "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
-    if (buflen >= MAXBUF) {
-        return; // Overflow!
+            keep_alive ? "keep-alive" : "close", filesize, filetype);
+    if (buflen >= MAXBUF || (header = malloc(buflen)) == NULL) {
+        return NULL;
+    }
+    memcpy(header, buf, buflen);
+    *len = buflen;
+    return header;
+}
+
+/*
+ * file_get - open a static file, or find it already open in the file cache
+ *
+ * filename - The file name, as from parse_uri.
+ * status - Set to the HTTP status code to send if the file can't be served:
+ *     404 if it doesn't exist, 403 if it can't be read, 500 if out of memory.
+ *
+ * Returns a referenced entry that must be passed to file_put, or NULL if
+ * the file doesn't exist or isn't a readable regular file.
+ */
+file_entry *file_get(const char *filename, int *status) {
+    file_entry *e;
+    struct stat st;
+    time_t now = time(NULL);
+    size_t b = file_hash(filename);
+    int fd;
+
+    /* Trust a cached entry that was checked recently enough */
+    pthread_mutex_lock(&file_cache_lock);
+    for (e = file_cache[b]; e != NULL; e = e->next) {
+        if (strcmp(e->name, filename) == 0) {
+            e->refcnt++;
+            e->used = now;
+            break;
+        }
+    }
+    if (e != NULL && now - e->validated < FILE_CACHE_VALID) {
+        pthread_mutex_unlock(&file_cache_lock);
+        return e;
+    }
+    pthread_mutex_unlock(&file_cache_lock);
+
+    /* Otherwise check that the file hasn't changed since it was opened */
+    if (e != NULL) {
+        if (stat(filename, &st) == 0 && same_file(&st, &e->st)) {
+            pthread_mutex_lock(&file_cache_lock);
+            e->validated = now;
+            pthread_mutex_unlock(&file_cache_lock);
+            return e;
+        }
+        pthread_mutex_lock(&file_cache_lock);
+        if (e->linked) {
+            file_unlink(e);
+        }
+        pthread_mutex_unlock(&file_cache_lock);
+        file_put(e);
     }
 
-    printf("Response headers:\n%s", buf);
+    /* Open the file and check that it can be served */
+    fd = open(filename, O_RDONLY, 0);
+    if (fd < 0) {
+        *status = errno == EACCES ? 403 : 404;
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+            || !(S_IRUSR & st.st_mode)) {
+        close(fd);
+        *status = 403;
+        return NULL;
+    }
 
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing static response headers to client\n");
-        return;
+    e = calloc(1, sizeof(file_entry));
+    if (e == NULL || (e->name = strdup(filename)) == NULL
+            || (e->header[0] = build_header(filename, st.st_size, false,
+                                            &e->header_len[0])) == NULL
+            || (e->header[1] = build_header(filename, st.st_size, true,
+                                            &e->header_len[1])) == NULL) {
+        if (e != NULL) {
+            free(e->header[0]);
+            free(e->name);
+        }
+        free(e);
+        close(fd);
+        *status = 500;
+        return NULL;
     }
+    e->fd = fd;
+    e->st = st;
+    e->validated = now;
+    e->used = now;
+    e->refcnt = 1;
+    e->linked = false;
+    file_cache_insert(e);
+    return e;
+}
 
+/*
+ * send_static - send a response header and part of a file to the client
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+static int send_static(int fd, const char *header, size_t header_len,
+                       file_entry *file, off_t offset, size_t len) {
+    if (verbose) {
+        printf("Response headers:\n%.*s", (int) header_len, header);
+    }
 
-    /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);
-    if (srcfd < 0) {
-        perror(filename);
-        return;
+#ifdef __linux__
+    /* MSG_MORE holds the header back until the body follows, so the two
+     * leave in the same packets. The body is copied straight from the page
+     * cache with an offset of our own, so other threads sending the same
+     * descriptor don't interfere. */
+    size_t sent = 0;
+    while (sent < header_len) {
+        ssize_t n = send(fd, header + sent, header_len - sent,
+                         len > 0 ? MSG_MORE : 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
     }
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
-        return;
+    off_t end = offset + len;
+    while (offset < end) {
+        ssize_t n = sendfile(fd, file->fd, &offset, end - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+#else
+    /* Send the header and the mapped body with one writev */
+    struct iovec iov[2];
+    char *srcp = NULL;
+    size_t size = file->st.st_size;
+    int iovcnt = 1, rc = 0;
+
+    iov[0].iov_base = (char *) header;
+    iov[0].iov_len = header_len;
+    if (len > 0) {
+        srcp = mmap(0, size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (srcp == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        iov[1].iov_base = srcp + offset;
+        iov[1].iov_len = len;
+        iovcnt = 2;
     }
-    close(srcfd);
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov + 2 - iovcnt, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        /* Step over whatever was written */
+        while (iovcnt > 0 && (size_t) n >= iov[2 - iovcnt].iov_len) {
+            n -= iov[2 - iovcnt].iov_len;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov[2 - iovcnt].iov_base = (char *) iov[2 - iovcnt].iov_base + n;
+            iov[2 - iovcnt].iov_len -= n;
+        }
+    }
+
+    if (srcp != NULL && munmap(srcp, size) < 0) {
+        perror("munmap");
+    }
+    return rc;
+#endif
+}
+
+/*
+ * parse_range - parse a Range header for a file of the given size
+ *
+ * range - The header's value. Only a single range of bytes is supported;
+ *     anything else is ignored, as HTTP allows.
+ * first, last - Set to the first and last byte to send for RANGE_PARTIAL.
+ */
+range_result parse_range(const char *range, size_t size,
+                         size_t *first, size_t *last) {
+    unsigned long long a, b;
+    char *end;
+
+    if (strncasecmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL) {
+        return RANGE_NONE;
+    }
+    range += 6;
+
+    if (*range == '-') { /* The last b bytes */
+        b = strtoull(range + 1, &end, 10);
+        if (!isdigit((unsigned char) range[1]) || *end != '\0') {
+            return RANGE_NONE;
+        }
+        if (b == 0 || size == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *first = b < size ? size - b : 0;
+        *last = size - 1;
+        return RANGE_PARTIAL;
+    }
+
+    if (!isdigit((unsigned char) *range)) {
+        return RANGE_NONE;
+    }
+    a = strtoull(range, &end, 10);
+    if (*end != '-') {
+        return RANGE_NONE;
+    }
+    range = end + 1;
+    b = ULLONG_MAX;
+    if (*range != '\0') { /* Bytes a to b, rather than a to the end */
+        b = strtoull(range, &end, 10);
+        if (!isdigit((unsigned char) *range) || *end != '\0' || b < a) {
+            return RANGE_NONE;
+        }
+    }
+    if (a >= size) {
+        return RANGE_UNSATISFIABLE;
+    }
+    *first = a;
+    *last = b < size - 1 ? b : size - 1;
+    return RANGE_PARTIAL;
+}
+
+/*
+ * serve_static - copy a file, or the range of it asked for, back to the
+ *     client
+ *
+ * Returns true if the response went out and the connection stays open.
+ */
+bool serve_static(int fd, char *filename, file_entry *file,
+                  const request_info *req) {
+    char buf[MAXBUF];
+    char filetype[MAXLINE];
+    size_t buflen, first = 0, last = 0;
+    size_t size = file->st.st_size;
+    const char *connection = req->keep_alive ? "keep-alive" : "close";
+    range_result range = RANGE_NONE;
+    int rc;
+
+    if (req->range[0] != '\0') {
+        range = parse_range(req->range, size, &first, &last);
+    }
+
+    if (range == RANGE_NONE) { /* The common case: a pre-rendered header */
+        rc = send_static(fd, file->header[req->keep_alive],
+                         file->header_len[req->keep_alive], file, 0, size);
+    } else if (range == RANGE_PARTIAL) {
+        get_filetype(filename, filetype);
+        buflen = snprintf(buf, MAXBUF,
+                "HTTP/1.0 206 Partial Content\r\n" \
+                "Server: Tiny Web Server\r\n" \
+                "Connection: %s\r\n" \
+                "Accept-Ranges: bytes\r\n" \
+                "Content-Range: bytes %zu-%zu/%zu\r\n" \
+                "Content-Length: %zu\r\n" \
+                "Content-Type: %s\r\n\r\n", \
+                connection, first, last, size, last - first + 1, filetype);
+        if (buflen >= MAXBUF) {
+            return false; // Overflow!
+        }
+        rc = send_static(fd, buf, buflen, file, first, last - first + 1);
+    } else {
+        buflen = snprintf(buf, MAXBUF,
+                "HTTP/1.0 416 Range Not Satisfiable\r\n" \
+                "Server: Tiny Web Server\r\n" \
+                "Connection: %s\r\n" \
+                "Content-Range: bytes */%zu\r\n" \
+                "Content-Length: 0\r\n\r\n", \
+                connection, size);
+        if (buflen >= MAXBUF) {
+            return false; // Overflow!
+        }
+        rc = send_static(fd, buf, buflen, file, 0, 0);
+    }
+
+    if (rc < 0) {
         fprintf(stderr, "Error writing static file \"%s\" to client\n",
                 filename);
-        // Fall through to cleanup
+        return false;
     }
+    return req->keep_alive;
+}
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
-        return;
+/*
+ * cgi_program_get - find a CGI program's workers, adding the program if
+ *     this is its first request
+ *
+ * The caller must hold cgi_lock.
+ * Returns NULL if out of memory.
+ */
+static cgi_program *cgi_program_get(const char *filename) {
+    cgi_program *p;
+
+    for (p = cgi_programs; p != NULL; p = p->next) {
+        if (strcmp(p->name, filename) == 0) {
+            return p;
+        }
+    }
+
+    if ((p = calloc(1, sizeof(*p))) == NULL) {
+        return NULL;
+    }
+    if ((p->name = strdup(filename)) == NULL) {
+        free(p);
+        return NULL;
+    }
+    pthread_cond_init(&p->idle_cond, NULL);
+    p->next = cgi_programs;
+    cgi_programs = p;
+    return p;
+}
+
+/*
+ * cgi_spawn - start a worker for a CGI program, and wait for it to say it
+ *     is ready
+ *
+ * Returns 0 on success, or -1 on error, setting plain if the program
+ *     didn't start as a worker.
+ */
+static int cgi_spawn(const char *filename, cgi_worker *w, bool *plain) {
+    char *emptylist[] = { NULL };
+    struct timeval start_timeout = { .tv_sec = CGI_WORKER_START };
+    struct timeval no_timeout = { 0 };
+    int sv[2];
+    char ready;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    /* Workers and CGI programs forked later mustn't inherit either end,
+     * or we would never see this worker's connection close */
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == 0) { /* Child */
+        /* Responses go to clients; stdout is only for stray output */
+        int nullfd = open("/dev/null", O_WRONLY);
+        if (nullfd >= 0) {
+            dup2(nullfd, STDOUT_FILENO);
+        }
+        dup2(sv[1], CGI_WORKER_FD);
+
+        /* Nor should it hold on to other threads' clients, which would
+         * then never see their connections close */
+        long maxfd = sysconf(_SC_OPEN_MAX);
+        for (long i = STDERR_FILENO + 1; i < maxfd; i++) {
+            close(i);
+        }
+        setenv(CGI_WORKER_ENV, "1", 1);
+
+        if (execve(filename, emptylist, environ) < 0) {
+            perror(filename);
+            exit(1);  /* Exit child process */
+        }
     }
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+
+    /* An ordinary CGI program just exits, or may wait for input */
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &start_timeout,
+               sizeof(start_timeout));
+    if (recv(sv[0], &ready, 1, 0) != 1) {
+        kill(pid, SIGKILL);
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+        *plain = true;
+        return -1;
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+               sizeof(no_timeout));
+
+    w->pid = pid;
+    w->sock = sv[0];
+    return 0;
+}
+
+/*
+ * cgi_acquire - take an idle worker for a CGI program, starting one if
+ *     the program has fewer than cgi_workers, or else waiting for one
+ *
+ * Returns true on success, or false if the request should fork a process
+ *     of its own instead.
+ */
+static bool cgi_acquire(const char *filename, cgi_program **program,
+                        cgi_worker *w) {
+    bool plain = false;
+    cgi_program *p;
+
+    pthread_mutex_lock(&cgi_lock);
+    if ((p = cgi_program_get(filename)) == NULL) {
+        pthread_mutex_unlock(&cgi_lock);
+        return false;
+    }
+    while (!p->plain && p->nidle == 0 && p->nworkers >= cgi_workers) {
+        pthread_cond_wait(&p->idle_cond, &cgi_lock);
+    }
+    if (p->plain) {
+        pthread_mutex_unlock(&cgi_lock);
+        return false;
+    }
+    *program = p;
+    if (p->nidle > 0) {
+        *w = p->idle[--p->nidle];
+        pthread_mutex_unlock(&cgi_lock);
+        return true;
+    }
+
+    /* Start a new worker, without holding up requests for other programs */
+    p->nworkers++;
+    pthread_mutex_unlock(&cgi_lock);
+    if (cgi_spawn(filename, w, &plain) == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&cgi_lock);
+    p->nworkers--;
+    if (plain) {
+        p->plain = true;
+        pthread_cond_broadcast(&p->idle_cond);
+    } else {
+        pthread_cond_signal(&p->idle_cond);
+    }
+    pthread_mutex_unlock(&cgi_lock);
+    return false;
+}
+
+/*
+ * cgi_release - give back a worker from cgi_acquire, and stop it instead
+ *     if it failed
+ */
+static void cgi_release(cgi_program *p, cgi_worker *w, bool failed) {
+    if (failed) {
+        kill(w->pid, SIGKILL);
+        close(w->sock);
+        waitpid(w->pid, NULL, 0);
+    }
+
+    pthread_mutex_lock(&cgi_lock);
+    if (failed) {
+        p->nworkers--;
+    } else {
+        p->idle[p->nidle++] = *w;
+    }
+    pthread_cond_signal(&p->idle_cond);
+    pthread_mutex_unlock(&cgi_lock);
+}
+
+/*
+ * cgi_run - pass the client and its query string to a worker, and wait
+ *     while the worker answers
+ *
+ * Returns 0 on success, -1 if the request never reached the worker, or -2
+ *     if the worker failed while answering it.
+ */
+static int cgi_run(cgi_worker *w, int fd, const char *cgiargs) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { (char *) cgiargs, strlen(cgiargs) + 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t n;
+    char done;
+
+    memset(&control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    /* The whole query fits in the socket buffer, so this is all or
+     * nothing */
+    while ((n = sendmsg(w->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n != (ssize_t) iov.iov_len) {
+        return -1;
+    }
+
+    while ((n = recv(w->sock, &done, 1, 0)) < 0 && errno == EINTR)
+        ;
+    return n == 1 ? 0 : -2;
 }
 
 /*
@@ -194,6 +888,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
     char buf[MAXLINE];
     size_t buflen;
     char *emptylist[] = { NULL };
+    cgi_program *program;
+    cgi_worker worker;
 
     /* Format first part of HTTP response */
     buflen = snprintf(buf, MAXLINE,
@@ -209,6 +905,16 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
+    /* Hand the request to one of the program's workers if we can, and
+     * fall back on a process of its own if it never reached one */
+    if (cgi_workers > 0 && cgi_acquire(filename, &program, &worker)) {
+        int rc = cgi_run(&worker, fd, cgiargs);
+        cgi_release(program, &worker, rc < 0);
+        if (rc != -1) {
+            return;
+        }
+    }
+
     pid_t pid = fork();
     if (pid == 0) { /* Child */
         /* Real server would set all CGI vars here */
@@ -229,8 +935,9 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
+    /* Parent waits for and reaps child, and only its own child, since
+     * other threads may be running CGI programs too */
+    if (waitpid(pid, NULL, 0) < 0) {
         perror("wait");
         return;
     }
@@ -285,94 +992,110 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
 }
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers, noting the ones tiny acts on
+ *     in req
  * Returns true if an error occurred, or false otherwise.
  */
-bool read_requesthdrs(client_info *client, rio_t *rp) {
-    char buf[MAXLINE];
-    char name[MAXLINE];
-    char value[MAXLINE];
+bool read_requesthdrs(client_info *client, rio_t *rp, request_info *req) {
+    char *line;
+    ssize_t n;
+    size_t len;
+    http_slice_t name, value;
 
     while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+        /* Parse each line where it lies in the read buffer */
+        if ((n = rio_peeklineb(rp, &line)) <= 0) {
             return true;
         }
+        len = http_line_len(line, n);
 
         /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
+        if (len == 0) {
             return false;
         }
 
         /* Parse header into name and value */
-        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
+        if (!http_split_header(line, len, &name, &value)) {
             /* Error parsing header */
             clienterror(client->connfd, "400", "Bad Request",
                         "Tiny could not parse request headers");
             return true;
         }
 
-        /* Convert name to lowercase */
-        for (size_t i = 0; name[i] != '\0'; i++) {
-            name[i] = tolower(name[i]);
+        if (verbose) {
+            printf("%.*s: %.*s\n", (int) name.len, name.ptr,
+                   (int) value.len, value.ptr);
         }
 
-        printf("%s: %s\n", name, value);
+        if (http_slice_eq(name, "connection")) {
+            if (http_slice_has_token(value, "close")) {
+                req->keep_alive = false;
+            } else if (http_slice_has_token(value, "keep-alive")) {
+                req->keep_alive = keep_alive_enabled;
+            }
+        } else if (http_slice_eq(name, "range")
+                && value.len < sizeof(req->range)) {
+            memcpy(req->range, value.ptr, value.len);
+            req->range[value.len] = '\0';
+        }
     }
 }
 
 /*
  * serve - handle one HTTP request/response transaction
+ *
+ * Returns true if the connection can carry another request.
  */
-void serve(client_info *client) {
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    int res = getnameinfo(
-            (SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
-    }
-    else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+bool serve(client_info *client, rio_t *rp) {
+    /* Read request line; the client may close between requests */
+    char *line;
+    ssize_t n = rio_peeklineb(rp, &line);
+    if (n <= 0) {
+        return false;
     }
 
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
-
-    /* Read request line */
-    char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-        return;
+    if (verbose) {
+        printf("%.*s", (int) n, line);
     }
 
-    printf("%s", buf);
-
     /* Parse the request line and check if it's well-formed */
-    char method[MAXLINE];
+    http_slice_t method, uri_slice, version_slice;
     char uri[MAXLINE];
     char version;
 
-    /* sscanf must parse exactly 3 things for request line to be well-formed */
+    /* The line must have exactly 3 parts to be well-formed */
     /* version must be either HTTP/1.0 or HTTP/1.1 */
-    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3
-            || (version != '0' && version != '1')) {
+    if (!http_split_request_line(line, http_line_len(line, n),
+                                 &method, &uri_slice, &version_slice)
+            || version_slice.len != 8
+            || strncmp(version_slice.ptr, "HTTP/1.", 7) != 0
+            || (version_slice.ptr[7] != '0' && version_slice.ptr[7] != '1')
+            || uri_slice.len >= sizeof(uri)) {
         clienterror(client->connfd, "400", "Bad Request",
                     "Tiny received a malformed request");
-        return;
+        return false;
     }
+    version = version_slice.ptr[7];
+
+    /* The URI has to outlive the line, which reading headers overwrites */
+    memcpy(uri, uri_slice.ptr, uri_slice.len);
+    uri[uri_slice.len] = '\0';
 
     /* Check that the method is GET */
-    if (strcmp(method, "GET") != 0) {
+    if (method.len != 3 || strncmp(method.ptr, "GET", 3) != 0) {
         clienterror(client->connfd, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return false;
     }
 
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    request_info req;
+    req.keep_alive = keep_alive_enabled && version == '1';
+    req.range[0] = '\0';
+
     /* Check if reading request headers caused an error */
-    if (read_requesthdrs(client, &rio)) {
-        return;
+    if (read_requesthdrs(client, rp, &req)) {
+        return false;
     }
 
     /* Parse URI from GET request */
@@ -381,7 +1104,27 @@ void serve(client_info *client) {
     if (result == PARSE_ERROR) {
         clienterror(client->connfd, "400", "Bad Request",
                     "Tiny could not parse the request URI");
-        return;
+        return false;
+    }
+
+    if (result == PARSE_STATIC) { /* Serve static content */
+        int status;
+        bool keep_alive = false;
+        file_entry *file = file_get(filename, &status);
+        if (file == NULL && status == 404) {
+            clienterror(client->connfd, "404", "Not found",
+                        "Tiny couldn't find this file");
+        } else if (file == NULL && status == 403) {
+            clienterror(client->connfd, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+        } else if (file == NULL) {
+            clienterror(client->connfd, "500", "Internal Server Error",
+                        "Tiny ran out of memory");
+        } else {
+            keep_alive = serve_static(client->connfd, filename, file, &req);
+            file_put(file);
+        }
+        return keep_alive;
     }
 
     /* Attempt to stat the file */
@@ -389,41 +1132,71 @@ void serve(client_info *client) {
     if (stat(filename, &sbuf) < 0) {
         clienterror(client->connfd, "404", "Not found",
                     "Tiny couldn't find this file");
-        return;
+        return false;
     }
 
-    if (result == PARSE_STATIC) { /* Serve static content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't read the file");
-            return;
-        }
-        serve_static(client->connfd, filename, sbuf.st_size);
-    } else { /* Serve dynamic content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't run the CGI program");
-            return;
-        }
-        serve_dynamic(client->connfd, filename, cgiargs);
+    /* Serve dynamic content. CGI output runs until the program exits, so
+     * the end of the connection is the end of the response. */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+        clienterror(client->connfd, "403", "Forbidden",
+                    "Tiny couldn't run the CGI program");
+        return false;
     }
+    serve_dynamic(client->connfd, filename, cgiargs);
+    return false;
 }
 
-int main(int argc, char **argv) {
-    int listenfd;
+/*
+ * serve_client - handle every request on a client connection
+ */
+void serve_client(client_info *client) {
+    rio_t rio;
+    struct timeval idle_timeout = { .tv_sec = IDLE_TIMEOUT };
 
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    // Get some extra info about the client (hostname/port)
+    // This is optional, but it's nice to know who's connected. The lookup
+    // can take a round trip to a DNS server, so only do it in verbose mode.
+    if (verbose) {
+        int res = getnameinfo(
+                (SA *) &client->addr, client->addrlen,
+                client->host, sizeof(client->host),
+                client->serv, sizeof(client->serv),
+                0);
+        if (res == 0) {
+            printf("Accepted connection from %s:%s\n",
+                   client->host, client->serv);
+        }
+        else {
+            fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+        }
     }
 
-    listenfd = open_listenfd(argv[1]);
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
-        exit(1);
+    /* A response's last segment would otherwise wait out the client's
+     * delayed ACK whenever an earlier one is unacknowledged, which closing
+     * the connection avoids but keeping it open does not */
+    if (keep_alive_enabled) {
+        int one = 1;
+        setsockopt(client->connfd, IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one));
+    }
+
+    rio_readinitb(&rio, client->connfd);
+    if (!serve(client, &rio)) {
+        return;
     }
 
+    /* Don't let an idle persistent client hold this thread for ever */
+    setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout,
+               sizeof(idle_timeout));
+    while (serve(client, &rio))
+        ;
+}
+
+/*
+ * serve_forever - accept clients on a listening socket and serve each one
+ *     in turn
+ */
+void serve_forever(int listenfd) {
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -432,17 +1205,123 @@ int main(int argc, char **argv) {
         /* Initialize the length of the address */
         client->addrlen = sizeof(client->addr);
 
-        /* accept() will block until a client connects to the port */
-        client->connfd = accept(listenfd,
-                (SA *) &client->addr, &client->addrlen);
+        /* accept_conn() will block until a client connects to the port */
+        client->connfd = accept_conn(listenfd,
+                (SA *) &client->addr, &client->addrlen, false);
         if (client->connfd < 0) {
             perror("accept");
             continue;
         }
 
         /* Connection is established; serve client */
-        serve(client);
+        serve_client(client);
         close(client->connfd);
     }
 }
 
+/*
+ * accept_thread - run serve_forever on the listening socket passed in arg
+ */
+void *accept_thread(void *arg) {
+    serve_forever((int) (intptr_t) arg);
+    return NULL;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-kv] [-t <threads>] [-w <workers>] <port>\n",
+            prog);
+    fprintf(stderr, "  -k            keep connections open when asked to\n");
+    fprintf(stderr, "  -t <threads>  accept threads, or 0 for one per core\n");
+    fprintf(stderr, "  -w <workers>  persistent workers per CGI program\n");
+    fprintf(stderr, "  -v            echo requests and responses\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int listenfd, c;
+    long nthreads = -1, nworkers;
+    char *end;
+    pthread_t tid;
+
+    /* Check command line args */
+    while ((c = getopt(argc, argv, "kt:vw:")) != -1) {
+        switch (c) {
+        case 'k':
+            keep_alive_enabled = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 't':
+            nthreads = strtol(optarg, &end, 10);
+            if (*end != '\0' || nthreads < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            nworkers = strtol(optarg, &end, 10);
+            if (*end != '\0' || nworkers < 0 || nworkers > CGI_WORKERS_MAX) {
+                usage(argv[0]);
+            }
+            cgi_workers = nworkers;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    /* Without -t, serve every client on this thread */
+    if (nthreads < 0) {
+        listenfd = open_listenfd(argv[optind]);
+        if (listenfd < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
+            exit(1);
+        }
+        serve_forever(listenfd);
+    }
+
+    if (nthreads == 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+
+    /* Open every socket before serving on any, so a failure exits early.
+     * The kernel hashes each connection to one SO_REUSEPORT socket, so a
+     * thread held by a persistent client would strand the connections
+     * queued behind it; with -k, the threads share one socket instead and
+     * whichever is free takes the next connection. */
+    int *listenfds = malloc(nthreads * sizeof(int));
+    if (listenfds == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (long i = 0; i < nthreads; i++) {
+        if (!keep_alive_enabled) {
+            listenfds[i] = open_reuseport_listenfd(argv[optind]);
+        } else if (i == 0) {
+            listenfds[i] = open_listenfd(argv[optind]);
+        } else {
+            listenfds[i] = listenfds[0];
+        }
+        if (listenfds[i] < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
+            exit(1);
+        }
+    }
+
+    /* Start an accept thread per socket; this thread takes the last one */
+    for (long i = 0; i < nthreads - 1; i++) {
+        if (pthread_create(&tid, NULL, accept_thread,
+                    (void *) (intptr_t) listenfds[i]) != 0) {
+            fprintf(stderr, "Failed to create accept thread\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    serve_forever(listenfds[nthreads - 1]);
+}